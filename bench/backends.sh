@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# RRQ throughput of the epoll/socket loop against the io_uring one, on loopback
+# usage: bench/backends.sh [workers] [clients] [size_mb]
+# run from the project root after "make all bench"
+#
+
+WORKERS=${1:-1}
+CLIENTS=${2:-32}
+SIZE_MB=${3:-16}
+FILE=bench_${SIZE_MB}m.bin
+PORT=6969
+
+mkdir -p tftp_root
+if [ ! -f "tftp_root/$FILE" ]; then
+    head -c "$((SIZE_MB * 1024 * 1024))" /dev/urandom > "tftp_root/$FILE"
+fi
+
+# small blocks stop-and-wait, an ethernet sized window, big blocks
+echo "backend  blksize  window  result"
+for backend in epoll io_uring; do
+    flag=
+    [ "$backend" = io_uring ] && flag=-u
+    ./tftp_server_r -w "$WORKERS" $flag > /tmp/tftp_backend_$$.log 2>&1 &
+    SERVER=$!
+    sleep 0.5
+
+    for args in "512 1" "1428 16" "65464 8"; do
+        set -- $args
+        printf "%-8s %-8s %-7s %s\n" "$backend" "$1" "$2" \
+            "$(./tftp_bench_r -p $PORT -c "$CLIENTS" -n 2 -b "$1" -W "$2" -f "$FILE")"
+    done
+
+    kill -INT "$SERVER"
+    wait "$SERVER" 2>/dev/null
+    if [ "$backend" = io_uring ] && ! grep "io_uring -" /tmp/tftp_backend_$$.log; then
+        echo "(io_uring not available here, those were epoll too)"
+    fi
+done
+rm -f /tmp/tftp_backend_$$.log
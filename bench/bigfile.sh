@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# files past 4 GB and past 65535 blocks, in constant memory
+# usage: bench/bigfile.sh [sim_size] [live_size]
+# run from the project root after "make all bench"
+#
+# tftp_sim_r -Z streams sim_size (default 33g) of zeros through the client
+# library and the server's sessions, RRQ from a sparse file and WRQ into
+# one, with block numbers wrapping to 0 and with rollover=1.
+# then a live_size (default 256m, past 65535 blocks of 1428) sparse file
+# goes through tftp_client_r and tftp_server_r on loopback both ways and
+# has to come back the same size, with its holes
+#
+
+SIM_SIZE=${1:-33g}
+LIVE_SIZE=${2:-256m}
+PORT=6969
+FAILED=0
+
+for op in rrq wrq; do
+    for w in 0 1; do
+        echo "== sim $op $SIM_SIZE rollover $w"
+        ./tftp_sim_r -Z -S "$SIM_SIZE" -n 1 -t 65464x16 -B 0 -o $op -w $w || FAILED=1
+    done
+done
+
+mkdir -p tftp_root
+DIR=$(mktemp -d)
+truncate -s "$LIVE_SIZE" tftp_root/bigfile_get.bin "$DIR/bigfile_put.bin"
+printf 'head' | dd of=tftp_root/bigfile_get.bin conv=notrunc 2> /dev/null
+printf 'tail' | dd of=tftp_root/bigfile_get.bin bs=1 seek=$(($(stat -c %s tftp_root/bigfile_get.bin) - 4)) conv=notrunc 2> /dev/null
+
+./tftp_server_r -p $PORT > /dev/null 2>&1 &
+SERVER=$!
+sleep 0.5
+
+for r in 0 1; do
+    echo "== live get/put $LIVE_SIZE rollover $r"
+    rm -f "$DIR/bigfile_get.bin" tftp_root/bigfile_put.bin
+    printf 'get bigfile_get.bin\nput bigfile_put.bin\n' |
+        (cd "$DIR" && "$OLDPWD/tftp_client_r" -p $PORT -m octet -r $r -q -f -) || FAILED=1
+    if ! cmp -s tftp_root/bigfile_get.bin "$DIR/bigfile_get.bin" ||
+       [ "$(stat -c %s tftp_root/bigfile_put.bin)" != "$(stat -c %s "$DIR/bigfile_put.bin")" ]; then
+        echo "live transfer differs"
+        FAILED=1
+    fi
+    echo "get: $(du -k "$DIR/bigfile_get.bin" | cut -f1) KB on disk, put: $(du -k tftp_root/bigfile_put.bin | cut -f1) KB on disk"
+done
+
+kill -INT "$SERVER"
+wait "$SERVER" 2>/dev/null
+rm -rf "$DIR" tftp_root/bigfile_get.bin tftp_root/bigfile_put.bin
+exit $FAILED
@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# what compress=deflate buys and costs - the simulator runs plain and
+# deflated transfers of text and of random bytes over links from 10 to
+# 1000 Mbit/s, and prints time, bytes on the wire and CPU per transfer
+# usage: bench/compress.sh [scenarios] [size] [json]
+# run from the project root after "make bench" - built without zlib
+# the compress=1 lines are plain transfers, the server never takes it
+#
+
+SCENARIOS=${1:-100}
+SIZE=${2:-4m}
+JSON=${3:-/dev/null}
+
+echo "payload mbit op   compress p50_ms      wire_bytes   cpu_ms"
+for payload in text random; do
+    for mbit in 10 100 1000; do
+        for op in rrq wrq; do
+            ./tftp_sim_r -n "$SCENARIOS" -S "$SIZE" -P $payload -B $mbit -o $op -L 0.5 -d 5 -j 1 \
+                -t 1428x16,1428x16z -l "$payload-$mbit" -J "$JSON" |
+                sed -n 's/.* compress=\([01]\) .* p50_ms=\([0-9.]*\) .* wire_bytes=\([0-9]*\) .* cpu_ms=\([0-9.]*\)$/\1 \2 \3 \4/p' |
+                while read -r z p50 wire cpu; do
+                    printf "%-7s %-4s %-4s %-8s %-11s %-12s %s\n" $payload $mbit $op $z "$p50" "$wire" "$cpu"
+                done
+        done
+    done
+done
@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# aggregate RRQ throughput of the server with 1..N workers
+# usage: bench/scale.sh [max_workers] [clients] [size_mb]
+# run from the project root after "make all bench"
+#
+
+MAX_WORKERS=${1:-$(nproc)}
+CLIENTS=${2:-32}
+SIZE_MB=${3:-16}
+FILE=bench_${SIZE_MB}m.bin
+PORT=6969
+
+mkdir -p tftp_root
+if [ ! -f "tftp_root/$FILE" ]; then
+    head -c "$((SIZE_MB * 1024 * 1024))" /dev/urandom > "tftp_root/$FILE"
+fi
+
+echo "workers  result"
+w=1
+while [ "$w" -le "$MAX_WORKERS" ]; do
+    ./tftp_server_r -w "$w" > /dev/null 2>&1 &
+    SERVER=$!
+    sleep 0.5
+
+    printf "%-8s %s\n" "$w" "$(./tftp_bench_r -p $PORT -c "$CLIENTS" -n 1 -f "$FILE")"
+
+    kill -INT "$SERVER"
+    wait "$SERVER" 2>/dev/null
+    w=$((w * 2))
+done
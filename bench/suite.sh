@@ -0,0 +1,76 @@
+#!/bin/sh
+#
+# the regression suite - a fixed matrix of RRQs and WRQs (sizes, modes,
+# block and window sizes, loss) against a local server. every result is
+# appended to the history as one JSON line labelled with the commit, and
+# compared with the last run of the same configuration in there
+# usage: bench/suite.sh [history.jsonl] [workers] [clients]
+# run from the project root after "make all bench"
+#
+
+HISTORY=${1:-bench/results.jsonl}
+WORKERS=${2:-2}
+CLIENTS=${3:-16}
+PORT=6969
+LABEL=$(git rev-parse --short HEAD 2>/dev/null || echo local)
+git diff --quiet HEAD 2>/dev/null || LABEL="$LABEL-dirty"
+RUN=/tmp/tftp_suite_$$.jsonl
+
+mkdir -p tftp_root
+./tftp_server_r -w "$WORKERS" > /tmp/tftp_suite_$$.log 2>&1 &
+SERVER=$!
+sleep 0.5
+
+# op size blksize window loss [-a]
+while read -r op size blk win loss ascii; do
+    ./tftp_bench_r -p $PORT -c "$CLIENTS" -n 4 -o "$op" -S "$size" -b "$blk" -W "$win" -L "$loss" $ascii \
+        -l "$LABEL" -j "$RUN" > /dev/null
+done <<EOF
+rrq 64k 512 1 0
+rrq 4m 512 1 0
+rrq 4m 1428 16 0
+rrq 16m 65464 8 0
+rrq 1m 512 1 0 -a
+wrq 64k 512 1 0
+wrq 4m 1428 16 0
+wrq 1m 512 1 0 -a
+mix 1m 1428 16 0
+rrq 1m 1428 16 2
+wrq 1m 1428 16 2
+EOF
+
+kill -INT "$SERVER"
+wait "$SERVER" 2>/dev/null
+rm -f /tmp/tftp_suite_$$.log
+
+# each new line against the last one in the history with the same configuration
+touch "$HISTORY"
+awk '
+function val(line, key,    v) {
+    if (!match(line, "\"" key "\":[^,}]*"))
+        return ""
+    v = substr(line, RSTART + length(key) + 3, RLENGTH - length(key) - 3)
+    gsub(/"/, "", v)
+    return v
+}
+function conf(line) {
+    return val(line, "op") " " val(line, "mode") " " val(line, "size") " " val(line, "blksize") "/" val(line, "windowsize") " loss=" val(line, "loss") * 100 "%"
+}
+FILENAME == ARGV[1] { last[conf($0)] = $0; next }
+FNR == 1 { printf "%-36s %10s %9s %9s %6s %7s  %s\n", "configuration", "MB/s", "p50_ms", "p99_ms", "failed", "resent", "vs last run" }
+{
+    c = conf($0)
+    mb = val($0, "mbps"); p99 = val($0, "p99")
+    cmp = "-"
+    if (c in last) {
+        pmb = val(last[c], "mbps"); pp99 = val(last[c], "p99")
+        cmp = sprintf("%+.1f%% MB/s, %+.1f%% p99 (%s)", pmb > 0 ? (mb - pmb) * 100 / pmb : 0,
+                      pp99 > 0 ? (p99 - pp99) * 100 / pp99 : 0, val(last[c], "label"))
+    }
+    printf "%-36s %10.2f %9.1f %9.1f %6s %7s  %s\n", c, mb, val($0, "p50"), p99, val($0, "failed"),
+           val($0, "retransmits") + val($0, "dup_blocks"), cmp
+}
+' "$HISTORY" "$RUN"
+
+cat "$RUN" >> "$HISTORY"
+rm -f "$RUN"
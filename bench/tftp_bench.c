@@ -0,0 +1,894 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <poll.h>
+
+#include "../utils/tftp_utils.h"
+#include "../utils/tftp_options.h"
+#include "../utils/tftp_rtt.h"
+
+/*
+    load generator - every thread runs its own transfers back to back
+    against the server and the totals are reported at the end, as one
+    line of text and, with -j, as a JSON object appended to a file so
+    runs can be compared (bench/suite.sh keeps the history).
+    RRQs read -f, or a file of -S bytes the bench uploads first and
+    deletes when it's done. WRQs upload -S bytes under a name of their
+    own and delete it again. -L drops that share of the datagrams each
+    client sends and receives, the way a lossy link would.
+    with -M every RRQ asks for RFC 2090 multicast, the threads are the
+    clients of one group and each one counts what reached it
+*/
+
+#define BENCH_TIMEOUT_MS 1000
+#define BENCH_RETRIES 5
+#define BENCH_SIZE (1 << 20) // -S when WRQs need one
+
+typedef enum
+{
+    BENCH_RRQ,
+    BENCH_WRQ,
+    BENCH_MIX // every other transfer
+} bench_op_t;
+
+typedef struct
+{
+    struct sockaddr_in server;
+    const char *filename;
+    int id;
+    int transfers;
+    bench_op_t op;
+    int blksize;    // 0 = don't negotiate
+    int windowsize; // 0 = don't negotiate
+    int multicast;
+    const char *mode;      // "octet", or "netascii" with -a
+    struct in_addr ifaddr; // -M, where the group is joined
+    const char *payload;   // what WRQs send, already in mode
+    size_t size;
+    double loss;           // -L, 0..1
+    unsigned int seed;
+
+    uint64_t bytes;
+    int ok;
+    int failed;
+    uint64_t retransmits; // packets this client sent again
+    uint64_t dups;        // DATA received twice, what the server sent again
+    uint64_t packets;     // DATA received, a multicast client sees resends meant for others too
+    double *lat_ms;       // completion time of each transfer that made it
+} bench_thread_t;
+
+static const char *op_names[] = {"rrq", "wrq", "mix"};
+
+// -L, true for the datagrams the link loses
+static int bench_lost(bench_thread_t *t)
+{
+    return t->loss > 0 && rand_r(&t->seed) < t->loss * RAND_MAX;
+}
+
+static void bench_send(bench_thread_t *t, int fd, const void *buf, size_t len, const struct sockaddr_in *to)
+{
+    if (!bench_lost(t))
+        sendto(fd, buf, len, 0, (const struct sockaddr *)to, sizeof(*to));
+}
+
+// RRQ/WRQ/DEL with the options asked for, returns its length
+static size_t bench_request(bench_thread_t *t, unsigned char *req, size_t size, int opcode, const char *filename)
+{
+    size_t req_len = 2 + snprintf((char *)req + 2, size - 2, "%s", filename) + 1;
+
+    req[0] = 0;
+    req[1] = opcode;
+    req_len += snprintf((char *)req + req_len, size - req_len, "%s", t->mode) + 1;
+    if (opcode == TFTP_OPCODE_DEL)
+        return req_len;
+    if (t->blksize)
+        req_len = tftp_append_option((char *)req, req_len, size, "blksize", t->blksize);
+    if (t->windowsize)
+        req_len = tftp_append_option((char *)req, req_len, size, "windowsize", t->windowsize);
+    if (opcode == TFTP_OPCODE_WRQ)
+        req_len = tftp_append_option((char *)req, req_len, size, "tsize", t->size);
+    return req_len;
+}
+
+// one RRQ, returns the bytes received or -1
+static long long bench_rrq(bench_thread_t *t)
+{
+    unsigned char buf[TFTP_HDR_SIZE + TFTP_BLKSIZE_MAX];
+    unsigned char req[TFTP_BUF_SIZE];
+    struct sockaddr_in peer, from;
+    socklen_t from_len;
+    long long total = 0;
+    uint32_t expected = 1;
+    int blksize = TFTP_DATA_SIZE;
+    int windowsize = 1;
+    int since_ack = 0;
+    int retries = 0;
+    int tid_known = 0;
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    struct timeval tv = {BENCH_TIMEOUT_MS / 1000, (BENCH_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // room for a whole window, so what's measured is the server and not our own drops
+    if (t->blksize && t->windowsize)
+    {
+        int rcvbuf = 2 * t->windowsize * (t->blksize + 512);
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+
+    size_t req_len = bench_request(t, req, sizeof(req), TFTP_OPCODE_RRQ, t->filename);
+
+    peer = t->server;
+    unsigned char *last = req; // what to resend on a timeout
+    size_t last_len = req_len;
+    unsigned char ack[4] = {0, TFTP_OPCODE_ACK, 0, 0};
+
+    bench_send(t, sockfd, req, req_len, &peer);
+
+    for (;;)
+    {
+        from_len = sizeof(from);
+        ssize_t len = recvfrom(sockfd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+        if (len < 0)
+        {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && ++retries <= BENCH_RETRIES)
+            {
+                t->retransmits++;
+                bench_send(t, sockfd, last, last_len, &peer);
+                continue;
+            }
+            total = -1;
+            break;
+        }
+        if (bench_lost(t))
+            continue;
+
+        if (!tid_known)
+        {
+            peer = from;
+            tid_known = 1;
+        }
+        else if (from.sin_port != peer.sin_port)
+        {
+            continue;
+        }
+
+        if (len >= 2 && buf[1] == TFTP_OPCODE_OACK && expected == 1)
+        {
+            tftp_options_t opts = {0};
+            if (tftp_parse_options((char *)buf + 2, len - 2, &opts) == 0)
+            {
+                if (opts.present & TFTP_OPT_BLKSIZE)
+                    blksize = opts.blksize;
+                if (opts.present & TFTP_OPT_WINDOWSIZE)
+                    windowsize = opts.windowsize;
+            }
+            ack[2] = ack[3] = 0;
+            last = ack;
+            last_len = sizeof(ack);
+            bench_send(t, sockfd, ack, sizeof(ack), &peer);
+            continue;
+        }
+
+        if (len < 4 || buf[1] != TFTP_OPCODE_DATA)
+        {
+            total = -1;
+            break;
+        }
+
+        // ACK the last block of every window, or the last in-order one on a gap
+        uint32_t block = tftp_block_seq(expected, (buf[2] << 8) | buf[3], 0);
+        int last_block = 0;
+        if (block < expected)
+            t->dups++;
+        if (block == expected)
+        {
+            total += len - 4;
+            expected++;
+            retries = 0;
+            last_block = len < 4 + blksize;
+            if (!last_block && ++since_ack < windowsize)
+            {
+                continue;
+            }
+        }
+        ack[2] = ((expected - 1) >> 8) & 0xFF;
+        ack[3] = (expected - 1) & 0xFF;
+        since_ack = 0;
+        last = ack;
+        last_len = sizeof(ack);
+        bench_send(t, sockfd, ack, sizeof(ack), &peer);
+
+        if (last_block)
+        {
+            break;
+        }
+    }
+
+    close(sockfd);
+    return total;
+}
+
+/*
+    one WRQ of t->payload as filename - a window of blocks at a time,
+    back to the first one not ACKed when the server ACKs short of the
+    window or goes quiet, on the same RTT based timer the server uses.
+    a lost final ACK is answered again when the last block is resent,
+    the server dallies for that. returns the bytes sent or -1
+*/
+static long long bench_wrq(bench_thread_t *t, const char *filename)
+{
+    unsigned char buf[TFTP_BUF_SIZE];
+    unsigned char pkt[TFTP_HDR_SIZE + TFTP_BLKSIZE_MAX];
+    unsigned char req[TFTP_BUF_SIZE];
+    struct sockaddr_in peer, from;
+    socklen_t from_len;
+    tftp_rtt_t rtt;
+    int blksize = TFTP_DATA_SIZE;
+    int windowsize = 1;
+    int retries = 0;
+    int started = 0; // the server answered the WRQ, peer is its TID
+    uint32_t base = 1, next = 1, high = 0, nblocks = 0;
+    uint32_t probe = 0; // a block sent once whose ACK is timed, 0 for none
+    uint64_t probe_us = 0;
+    long long total = -1;
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    size_t req_len = bench_request(t, req, sizeof(req), TFTP_OPCODE_WRQ, filename);
+    rtt_init(&rtt, 0);
+    peer = t->server;
+    bench_send(t, sockfd, req, req_len, &peer);
+    uint64_t req_us = tftp_now_us();
+
+    for (;;)
+    {
+        // the window out, what was sent before counts as resent
+        while (started && next < base + windowsize && next <= nblocks)
+        {
+            size_t off = (size_t)(next - 1) * blksize;
+            size_t n = t->size - off < (size_t)blksize ? t->size - off : (size_t)blksize;
+            pkt[0] = 0;
+            pkt[1] = TFTP_OPCODE_DATA;
+            pkt[2] = (next >> 8) & 0xFF;
+            pkt[3] = next & 0xFF;
+            memcpy(pkt + 4, t->payload + off, n);
+            if (next <= high)
+            {
+                t->retransmits++;
+            }
+            else
+            {
+                high = next;
+                if (!probe)
+                {
+                    probe = next;
+                    probe_us = tftp_now_us();
+                }
+            }
+            bench_send(t, sockfd, pkt, 4 + n, &peer);
+            next++;
+        }
+
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        int n = poll(&pfd, 1, rtt_timeout_us(&rtt) / 1000 + 1);
+        if (n < 0)
+            break;
+        if (n == 0)
+        {
+            if (++retries > BENCH_RETRIES)
+                break;
+            rtt_backoff(&rtt, tftp_now_us());
+            if (!started)
+            {
+                t->retransmits++;
+                bench_send(t, sockfd, req, req_len, &t->server);
+            }
+            next = base; // the window goes out again
+            probe = 0;   // and nothing in it times a round trip (Karn)
+            continue;
+        }
+
+        from_len = sizeof(from);
+        ssize_t len = recvfrom(sockfd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+        if (len < 4 || bench_lost(t))
+            continue;
+        if (started && from.sin_port != peer.sin_port)
+            continue;
+        if (buf[1] == TFTP_OPCODE_ERROR)
+            break;
+
+        if (!started)
+        {
+            // OACK, or ACK 0 from a server that took none of the options
+            if (buf[1] == TFTP_OPCODE_OACK)
+            {
+                tftp_options_t opts = {0};
+                if (tftp_parse_options((char *)buf + 2, len - 2, &opts) == 0)
+                {
+                    if (opts.present & TFTP_OPT_BLKSIZE)
+                        blksize = opts.blksize;
+                    if (opts.present & TFTP_OPT_WINDOWSIZE)
+                        windowsize = opts.windowsize;
+                }
+            }
+            else if (buf[1] != TFTP_OPCODE_ACK || buf[2] || buf[3])
+            {
+                continue;
+            }
+            if (!retries)
+                rtt_sample(&rtt, tftp_now_us() - req_us);
+            peer = from;
+            started = 1;
+            retries = 0;
+            nblocks = t->size / blksize + 1;
+            continue;
+        }
+
+        if (buf[1] != TFTP_OPCODE_ACK)
+            continue;
+        uint32_t acked = tftp_block_seq(base - 1, (buf[2] << 8) | buf[3], 0);
+        if (acked < base || acked > high)
+            continue; // old, or one we never sent
+
+        if (probe && acked >= probe)
+        {
+            rtt_sample(&rtt, tftp_now_us() - probe_us);
+            probe = 0;
+        }
+        rtt_progress(&rtt);
+        retries = 0;
+        base = acked + 1;
+        if (acked == nblocks)
+        {
+            total = t->size;
+            break;
+        }
+        // short of what's out, the server has a gap there
+        if (next > base && acked < next - 1)
+        {
+            next = base;
+            probe = 0;
+        }
+    }
+
+    close(sockfd);
+    return total;
+}
+
+// drops a file the bench made, best effort - the server ACKs or sends an error
+static void bench_del(bench_thread_t *t, const char *filename)
+{
+    unsigned char req[TFTP_BUF_SIZE];
+    unsigned char buf[TFTP_BUF_SIZE];
+    size_t req_len = bench_request(t, req, sizeof(req), TFTP_OPCODE_DEL, filename);
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+        return;
+    for (int i = 0; i < BENCH_RETRIES; i++)
+    {
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        sendto(sockfd, req, req_len, 0, (struct sockaddr *)&t->server, sizeof(t->server));
+        if (poll(&pfd, 1, BENCH_TIMEOUT_MS) > 0 && recv(sockfd, buf, sizeof(buf), 0) >= 0)
+            break;
+    }
+    close(sockfd);
+}
+
+// "addr,port,mc" of a multicast OACK, -1 if it isn't one
+static int parse_multicast(const char *value, struct sockaddr_in *group, int *master)
+{
+    char buf[TFTP_MULTICAST_LEN];
+    char *port, *mc;
+
+    snprintf(buf, sizeof(buf), "%s", value);
+    if (!(port = strchr(buf, ',')) || !(mc = strchr(port + 1, ',')))
+        return -1;
+    *port++ = '\0';
+    *mc++ = '\0';
+    *master = atoi(mc);
+    // an OACK that only hands over the master role may leave the group out
+    if (!*buf)
+        return 0;
+    group->sin_family = AF_INET;
+    group->sin_port = htons(atoi(port));
+    return inet_pton(AF_INET, buf, &group->sin_addr) == 1 ? 0 : -1;
+}
+
+/*
+    one RFC 2090 octet RRQ - blocks come in on the group socket in
+    whatever order the current master pulls them, a bitmap says which
+    are here. as master it ACKs the block before the first one missing,
+    once it has them all that's the last block and it's done. returns
+    the bytes received or -1
+*/
+static long long bench_mcast(bench_thread_t *t)
+{
+    unsigned char buf[TFTP_HDR_SIZE + TFTP_BLKSIZE_MAX];
+    unsigned char req[TFTP_BUF_SIZE];
+    struct sockaddr_in peer, from, group = {0};
+    socklen_t from_len;
+    unsigned char *have = NULL;
+    uint32_t nblocks = 0, missing = 1, got = 0, last_seq = 0;
+    uint64_t size = 0;
+    int blksize = t->blksize ? t->blksize : TFTP_DATA_SIZE;
+    int master = 0, retries = 0, tid_known = 0;
+    long long total = -1;
+    unsigned char ack[4] = {0, TFTP_OPCODE_ACK, 0, 0};
+
+    int ctl = socket(AF_INET, SOCK_DGRAM, 0);
+    int grp = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ctl < 0 || grp < 0)
+    {
+        perror("socket");
+        goto out;
+    }
+
+    size_t req_len = 2 + snprintf((char *)req + 2, sizeof(req) - 2, "%s", t->filename) + 1;
+    req[0] = 0;
+    req[1] = TFTP_OPCODE_RRQ;
+    memcpy(req + req_len, "octet", 6);
+    req_len += 6;
+    if (t->blksize)
+        req_len = tftp_append_option((char *)req, req_len, sizeof(req), "blksize", t->blksize);
+    req_len = tftp_append_option((char *)req, req_len, sizeof(req), "tsize", 0);
+    req_len = tftp_append_option_str((char *)req, req_len, sizeof(req), "multicast", "");
+
+    peer = t->server;
+    bench_send(t, ctl, req, req_len, &peer);
+
+    for (;;)
+    {
+        struct pollfd pfd[2] = {{ctl, POLLIN, 0}, {grp, POLLIN, 0}};
+        int n = poll(pfd, group.sin_port ? 2 : 1, BENCH_TIMEOUT_MS);
+        if (n < 0)
+            goto out;
+        if (n == 0)
+        {
+            if (++retries > BENCH_RETRIES)
+                goto out;
+            t->retransmits++;
+            // before the group that's the RRQ, the server answers a repeated one with the OACK again
+            if (master)
+                bench_send(t, ctl, ack, sizeof(ack), &peer);
+            else
+                bench_send(t, ctl, req, req_len, &t->server);
+            continue;
+        }
+
+        int fd = (pfd[0].revents & POLLIN) ? ctl : grp;
+        from_len = sizeof(from);
+        ssize_t len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+        if (len < 4 || bench_lost(t))
+            continue;
+
+        if (fd == ctl)
+        {
+            if (!tid_known)
+            {
+                peer = from;
+                tid_known = 1;
+            }
+            else if (from.sin_port != peer.sin_port)
+            {
+                continue;
+            }
+            if (buf[1] == TFTP_OPCODE_ERROR)
+                goto out;
+            if (buf[1] != TFTP_OPCODE_OACK)
+                continue;
+
+            tftp_options_t opts = {0};
+            if (tftp_parse_options((char *)buf + 2, len - 2, &opts) < 0 ||
+                !(opts.present & TFTP_OPT_MULTICAST) || !(opts.present & TFTP_OPT_TSIZE) ||
+                parse_multicast(opts.multicast, &group, &master) < 0)
+            {
+                fprintf(stderr, "the server didn't take the multicast option\n");
+                goto out;
+            }
+            retries = 0;
+            if (opts.present & TFTP_OPT_BLKSIZE)
+                blksize = opts.blksize;
+
+            if (!have)
+            {
+                // several clients on one host, all of them bound to the group's port
+                int one = 1;
+                struct ip_mreq mreq = {group.sin_addr, t->ifaddr};
+                setsockopt(grp, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                int rcvbuf = 4 << 20;
+                setsockopt(grp, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+                if (bind(grp, (struct sockaddr *)&group, sizeof(group)) < 0 ||
+                    setsockopt(grp, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+                {
+                    perror("joining the group");
+                    goto out;
+                }
+                size = opts.tsize;
+                nblocks = size / blksize + 1;
+                have = calloc(nblocks + 1, 1);
+                if (!have)
+                    goto out;
+            }
+        }
+        else
+        {
+            if (buf[1] != TFTP_OPCODE_DATA)
+                continue;
+            uint32_t seq = tftp_block_seq(last_seq, (buf[2] << 8) | buf[3], 0);
+            last_seq = seq;
+            t->packets++;
+            retries = 0;
+            if (seq < 1 || seq > nblocks || have[seq])
+            {
+                if (!master)
+                    continue;
+            }
+            else
+            {
+                have[seq] = 1;
+                got++;
+            }
+            while (missing <= nblocks && have[missing])
+                missing++;
+        }
+
+        if (!master)
+            continue;
+
+        // the block before the first one missing, the server sends the one after
+        ack[2] = ((missing - 1) >> 8) & 0xFF;
+        ack[3] = (missing - 1) & 0xFF;
+        bench_send(t, ctl, ack, sizeof(ack), &peer);
+        if (got == nblocks)
+        {
+            total = size;
+            break;
+        }
+    }
+
+out:
+    free(have);
+    if (ctl >= 0)
+        close(ctl);
+    if (grp >= 0)
+        close(grp);
+    return total;
+}
+
+static void *bench_thread(void *arg)
+{
+    bench_thread_t *t = arg;
+    char name[PATH_LENGTH];
+
+    for (int i = 0; i < t->transfers; i++)
+    {
+        int wrq = t->op == BENCH_WRQ || (t->op == BENCH_MIX && (i + t->id) % 2);
+        uint64_t start = tftp_now_us();
+        long long got;
+
+        if (wrq)
+        {
+            // the server won't overwrite, every upload gets a name of its own
+            snprintf(name, sizeof(name), "bench_up_%d_%d_%d.bin", (int)getpid(), t->id, i);
+            got = bench_wrq(t, name);
+        }
+        else
+        {
+            got = t->multicast ? bench_mcast(t) : bench_rrq(t);
+        }
+        if (got < 0)
+            t->failed++;
+        else
+            t->lat_ms[t->ok++] = (tftp_now_us() - start) / 1000.0;
+        if (got > 0)
+            t->bytes += got;
+        if (wrq)
+            bench_del(t, name); // not timed
+    }
+    return NULL;
+}
+
+/*
+    size bytes for WRQs to send - random for octet, lines of text with
+    CR LF for netascii so it's already what goes on the wire
+*/
+static char *make_payload(size_t size, int netascii)
+{
+    char *p = malloc(size ? size : 1);
+    uint32_t x = 2463534242u;
+
+    if (!p)
+        return NULL;
+    for (size_t i = 0; i < size; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        if (!netascii)
+            p[i] = x;
+        else if (i % 72 == 70)
+            p[i] = '\r';
+        else if (i % 72 == 71)
+            p[i] = '\n';
+        else
+            p[i] = ' ' + x % 95;
+    }
+    // a CR can't end a netascii file without its LF
+    if (netascii && size && p[size - 1] == '\r')
+        p[size - 1] = '.';
+    return p;
+}
+
+// "4m", "64k", plain bytes
+static size_t parse_size(const char *s)
+{
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+
+    if (*end == 'k' || *end == 'K')
+        n <<= 10;
+    else if (*end == 'm' || *end == 'M')
+        n <<= 20;
+    else if (*end == 'g' || *end == 'G')
+        n <<= 30;
+    return n;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// nearest rank, of n sorted values
+static double percentile(const double *v, int n, int p)
+{
+    if (n == 0)
+        return 0;
+    int rank = (p * n + 99) / 100;
+    return v[rank > 0 ? rank - 1 : 0];
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s server_ip] [-p port] [-c clients] [-n transfers] [-o rrq|wrq|mix] [-S size] [-b blksize] [-W windowsize] [-a] [-L loss%%] [-j file] [-l label] [-M [-I ifaddr]] [-f filename]\n", prog);
+    fprintf(stderr, "  -o  what each client runs, mix alternates RRQs and WRQs (default rrq)\n");
+    fprintf(stderr, "  -S  bytes per WRQ, and the file RRQs read when there's no -f - 64k, 4m... (default 1m)\n");
+    fprintf(stderr, "  -a  netascii transfers instead of octet\n");
+    fprintf(stderr, "  -L  percent of the datagrams each client sends and receives that are dropped\n");
+    fprintf(stderr, "  -j  append the results as a JSON object (one line) to file, - for stdout\n");
+    fprintf(stderr, "  -l  label for the JSON, a commit or a build\n");
+    fprintf(stderr, "  -M  RFC 2090 multicast RRQs, the clients share one group (server started with -m)\n");
+    fprintf(stderr, "  -I  interface address the group is joined on (default 127.0.0.1)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *server_ip = "127.0.0.1";
+    const char *filename = NULL;
+    int port = TFTP_PORT;
+    int clients = 8;
+    int transfers = 4;
+    int blksize = 0;
+    int windowsize = 0;
+    int multicast = 0;
+    bench_op_t op = BENCH_RRQ;
+    size_t size = 0;
+    double loss = 0;
+    const char *mode = "octet";
+    const char *ifaddr = "127.0.0.1";
+    const char *json = NULL;
+    const char *label = "";
+    char setup_name[PATH_LENGTH] = "";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:p:c:n:o:S:b:W:aL:j:l:MI:f:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            server_ip = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        case 'n':
+            transfers = atoi(optarg);
+            break;
+        case 'o':
+            for (op = BENCH_RRQ; op <= BENCH_MIX && strcmp(optarg, op_names[op]) != 0; op++)
+                ;
+            if (op > BENCH_MIX)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'S':
+            size = parse_size(optarg);
+            break;
+        case 'b':
+            blksize = atoi(optarg);
+            break;
+        case 'W':
+            windowsize = atoi(optarg);
+            break;
+        case 'a':
+            mode = "netascii";
+            break;
+        case 'L':
+            loss = atof(optarg) / 100;
+            break;
+        case 'j':
+            json = optarg;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'M':
+            multicast = 1;
+            break;
+        case 'I':
+            ifaddr = optarg;
+            break;
+        case 'f':
+            filename = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if ((op == BENCH_RRQ && !filename && !size) || clients < 1 || transfers < 1 || loss < 0 || loss >= 1 ||
+        (multicast && op != BENCH_RRQ))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!size && op != BENCH_RRQ)
+        size = BENCH_SIZE;
+
+    bench_thread_t *threads = calloc(clients, sizeof(*threads));
+    pthread_t *tids = calloc(clients, sizeof(*tids));
+    double *lat = calloc((size_t)clients * transfers, sizeof(*lat));
+    char *payload = size ? make_payload(size, strcmp(mode, "netascii") == 0) : NULL;
+    if (!threads || !tids || !lat || (size && !payload))
+    {
+        perror("calloc");
+        return 1;
+    }
+
+    for (int i = 0; i < clients; i++)
+    {
+        threads[i].server.sin_family = AF_INET;
+        threads[i].server.sin_port = htons(port);
+        inet_pton(AF_INET, server_ip, &threads[i].server.sin_addr);
+        threads[i].filename = filename;
+        threads[i].id = i;
+        threads[i].transfers = transfers;
+        threads[i].op = op;
+        threads[i].blksize = blksize;
+        threads[i].windowsize = windowsize;
+        threads[i].multicast = multicast;
+        threads[i].mode = mode;
+        inet_pton(AF_INET, ifaddr, &threads[i].ifaddr);
+        threads[i].payload = payload;
+        threads[i].size = size;
+        threads[i].loss = loss;
+        threads[i].seed = (unsigned int)time(NULL) ^ (i * 2654435761u);
+        threads[i].lat_ms = lat + (size_t)i * transfers;
+    }
+
+    // no -f: the RRQs read a file of -S bytes, uploaded without loss before the clock starts
+    if (!filename && op != BENCH_WRQ)
+    {
+        bench_thread_t setup = threads[0];
+        setup.loss = 0;
+        snprintf(setup_name, sizeof(setup_name), "bench_%d_%zu.bin", (int)getpid(), size);
+        if (bench_wrq(&setup, setup_name) < 0)
+        {
+            fprintf(stderr, "couldn't upload %s to read it back\n", setup_name);
+            bench_del(&setup, setup_name);
+            return 1;
+        }
+        for (int i = 0; i < clients; i++)
+            threads[i].filename = setup_name;
+    }
+
+    uint64_t start = tftp_now_ms();
+    for (int i = 0; i < clients; i++)
+    {
+        pthread_create(&tids[i], NULL, bench_thread, &threads[i]);
+    }
+
+    uint64_t bytes = 0, retransmits = 0, dups = 0, packets = 0;
+    int ok = 0, failed = 0;
+    for (int i = 0; i < clients; i++)
+    {
+        pthread_join(tids[i], NULL);
+        // completion times packed to the front for the percentiles
+        memmove(lat + ok, threads[i].lat_ms, threads[i].ok * sizeof(*lat));
+        bytes += threads[i].bytes;
+        retransmits += threads[i].retransmits;
+        dups += threads[i].dups;
+        packets += threads[i].packets;
+        ok += threads[i].ok;
+        failed += threads[i].failed;
+    }
+    uint64_t elapsed = tftp_now_ms() - start;
+    if (elapsed == 0)
+        elapsed = 1;
+    if (*setup_name)
+        bench_del(&threads[0], setup_name);
+
+    qsort(lat, ok, sizeof(*lat), cmp_double);
+    double mbps = bytes / 1e6 / (elapsed / 1000.0);
+    double p50 = percentile(lat, ok, 50), p90 = percentile(lat, ok, 90), p99 = percentile(lat, ok, 99);
+    double max = ok ? lat[ok - 1] : 0;
+    blksize = blksize ? blksize : TFTP_DATA_SIZE;
+    windowsize = windowsize ? windowsize : 1;
+
+    printf("op=%s mode=%s clients=%d blksize=%d windowsize=%d loss=%.1f%% transfers=%d failed=%d bytes=%llu time_ms=%llu MB/s=%.2f "
+           "p50_ms=%.1f p90_ms=%.1f p99_ms=%.1f max_ms=%.1f retransmits=%llu dup_blocks=%llu\n",
+           op_names[op], mode, clients, blksize, windowsize, loss * 100, ok, failed, (unsigned long long)bytes,
+           (unsigned long long)elapsed, mbps, p50, p90, p99, max, (unsigned long long)retransmits, (unsigned long long)dups);
+
+    if (multicast && ok)
+    {
+        // every client sees every block on the group, the server sent about packets / clients of them
+        printf("multicast: %.1f DATA received per client, %.1f per transfer\n",
+               (double)packets / clients, (double)packets / ok);
+    }
+
+    if (json)
+    {
+        FILE *out = strcmp(json, "-") == 0 ? stdout : fopen(json, "a");
+        if (!out)
+        {
+            perror(json);
+        }
+        else
+        {
+            fprintf(out, "{\"label\":\"%s\",\"time\":%lld,\"op\":\"%s\",\"mode\":\"%s\",\"multicast\":%d,\"clients\":%d,"
+                         "\"blksize\":%d,\"windowsize\":%d,\"size\":%zu,\"loss\":%.4f,\"transfers\":%d,\"failed\":%d,"
+                         "\"bytes\":%llu,\"time_ms\":%llu,\"mbps\":%.3f,"
+                         "\"latency_ms\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+                         "\"retransmits\":%llu,\"dup_blocks\":%llu}\n",
+                    label, (long long)time(NULL), op_names[op], mode, multicast, clients, blksize, windowsize, size, loss,
+                    ok, failed, (unsigned long long)bytes, (unsigned long long)elapsed, mbps, p50, p90, p99, max,
+                    (unsigned long long)retransmits, (unsigned long long)dups);
+            if (out != stdout)
+                fclose(out);
+        }
+    }
+
+    free(payload);
+    free(lat);
+    free(threads);
+    free(tids);
+    return failed ? 2 : 0;
+}
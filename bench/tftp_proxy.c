@@ -0,0 +1,470 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "../utils/tftp_utils.h"
+
+/*
+    impairment proxy - a UDP relay for loopback that makes the link
+    between client and server misbehave on demand: drops, duplicates,
+    reordering, corruption and delay with jitter, the same decisions
+    for the same traffic under the same seed. no root, no netem.
+    jitter keeps the packets of a flow in order the way a path does,
+    reordering is -R: those are held back and the next ones pass.
+    clients talk to the proxy's port as if it was the server's. each
+    client address gets a socket of its own towards the server, the
+    server's TID is learned from its first answer and the client only
+    ever sees the proxy's port - TFTP takes whatever port answers, so
+    that's transparent to both sides. a new request from the same
+    client starts over at the server's well-known port.
+    everything applies to both directions
+*/
+
+#define PROXY_BUF 65536
+#define PROXY_IDLE_US 60000000 // a client quiet this long is forgotten
+#define PROXY_REORDER_MS 20    // -r, how long a reordered packet is held back
+
+typedef struct
+{
+    double drop, dup, reorder, corrupt; // 0..1 per packet
+    int delay_ms, jitter_ms;            // each packet waits delay +- jitter
+    int reorder_ms;                     // on top of that for a reordered one
+} impair_t;
+
+typedef struct flow
+{
+    struct sockaddr_in client;
+    struct sockaddr_in upstream; // the server's well-known port, its TID once it answered
+    int fd;                      // towards the server
+    uint64_t last_us;
+    uint64_t last_due_us[2];     // jitter doesn't reorder, only -R does
+    int held;                    // its packets in the delay queue
+    struct flow *next;
+} flow_t;
+
+// a packet waiting for its time
+typedef struct
+{
+    uint64_t due_us;
+    uint64_t order; // sent in arrival order when due at the same time
+    flow_t *f;
+    int up;         // towards the server
+    struct sockaddr_in upstream; // the flow's when it arrived, a request after it moves the flow on
+    size_t len;
+    unsigned char data[];
+} held_t;
+
+typedef struct
+{
+    uint64_t packets, dropped, duplicated, reordered, corrupted, delayed;
+} dir_stats_t;
+
+static volatile sig_atomic_t running = 1;
+static uint64_t rng_state;
+static impair_t imp;
+static dir_stats_t stats[2]; // [0] to the client, [1] to the server
+
+static held_t **heap;
+static size_t nheap, heap_cap;
+static uint64_t held_order;
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+// xorshift64*, one stream for the whole run so a seed replays the same decisions
+static double rnd(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int held_before(const held_t *a, const held_t *b)
+{
+    return a->due_us < b->due_us || (a->due_us == b->due_us && a->order < b->order);
+}
+
+static int heap_push(held_t *h)
+{
+    if (nheap == heap_cap)
+    {
+        size_t cap = heap_cap ? heap_cap * 2 : 256;
+        held_t **n = realloc(heap, cap * sizeof(*n));
+        if (!n)
+            return -1;
+        heap = n;
+        heap_cap = cap;
+    }
+    size_t i = nheap++;
+    while (i > 0 && held_before(h, heap[(i - 1) / 2]))
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = h;
+    return 0;
+}
+
+static held_t *heap_pop(void)
+{
+    held_t *top = heap[0];
+    held_t *last = heap[--nheap];
+    size_t i = 0;
+
+    for (;;)
+    {
+        size_t c = 2 * i + 1;
+        if (c >= nheap)
+            break;
+        if (c + 1 < nheap && held_before(heap[c + 1], heap[c]))
+            c++;
+        if (!held_before(heap[c], last))
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    if (nheap)
+        heap[i] = last;
+    return top;
+}
+
+static void deliver(int listen_fd, flow_t *f, int up, const struct sockaddr_in *upstream, const unsigned char *buf, size_t len)
+{
+    if (up)
+        sendto(f->fd, buf, len, 0, (struct sockaddr *)upstream, sizeof(*upstream));
+    else
+        sendto(listen_fd, buf, len, 0, (struct sockaddr *)&f->client, sizeof(f->client));
+}
+
+// one packet through the impairments, now or into the delay queue
+static void relay(int listen_fd, flow_t *f, int up, const unsigned char *buf, size_t len, uint64_t now_us)
+{
+    dir_stats_t *st = &stats[up];
+
+    st->packets++;
+    if (rnd() < imp.drop)
+    {
+        st->dropped++;
+        return;
+    }
+    int copies = 1;
+    if (rnd() < imp.dup)
+    {
+        st->duplicated++;
+        copies = 2;
+    }
+
+    for (int i = 0; i < copies; i++)
+    {
+        int corrupt = len > 0 && rnd() < imp.corrupt;
+        long delay_us = imp.delay_ms * 1000L;
+        if (imp.jitter_ms)
+            delay_us += (long)((rnd() * 2 - 1) * imp.jitter_ms * 1000);
+        if (delay_us < 0)
+            delay_us = 0;
+        uint64_t due_us = now_us + delay_us;
+        if (rnd() < imp.reorder)
+        {
+            st->reordered++;
+            due_us += imp.reorder_ms * 1000L; // the ones after it overtake it
+        }
+        else
+        {
+            // a packet doesn't pass the one before it on the same way
+            if (due_us < f->last_due_us[up])
+                due_us = f->last_due_us[up];
+            f->last_due_us[up] = due_us;
+        }
+
+        held_t *h = malloc(sizeof(*h) + len);
+        if (!h)
+            return;
+        memcpy(h->data, buf, len);
+        h->len = len;
+        if (corrupt)
+        {
+            // TFTP has no checksum of its own, this is what gets past a broken one
+            st->corrupted++;
+            h->data[(size_t)(rnd() * len)] ^= 1 << (int)(rnd() * 8);
+        }
+        if (due_us <= now_us && !f->held)
+        {
+            deliver(listen_fd, f, up, &f->upstream, h->data, h->len);
+            free(h);
+            continue;
+        }
+        st->delayed++;
+        h->due_us = due_us;
+        h->order = held_order++;
+        h->f = f;
+        h->up = up;
+        h->upstream = f->upstream;
+        if (heap_push(h) < 0)
+        {
+            free(h);
+            continue;
+        }
+        f->held++;
+    }
+}
+
+static flow_t *flow_get(flow_t **flows, int epfd, const struct sockaddr_in *client, const struct sockaddr_in *server)
+{
+    for (flow_t *f = *flows; f; f = f->next)
+    {
+        if (f->client.sin_addr.s_addr == client->sin_addr.s_addr && f->client.sin_port == client->sin_port)
+            return f;
+    }
+
+    flow_t *f = calloc(1, sizeof(*f));
+    if (!f)
+        return NULL;
+    f->client = *client;
+    f->upstream = *server;
+    f->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = f};
+    if (f->fd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, f->fd, &ev) < 0)
+    {
+        perror("flow socket");
+        if (f->fd >= 0)
+            close(f->fd);
+        free(f);
+        return NULL;
+    }
+    f->next = *flows;
+    *flows = f;
+    return f;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-l listen_port] [-s server_ip] [-p server_port] [-L loss%%] [-D dup%%] [-R reorder%%] [-r hold_ms] [-C corrupt%%] [-d delay_ms] [-j jitter_ms] [-S seed]\n", prog);
+    fprintf(stderr, "  -l  port the clients send to (default %d)\n", TFTP_PORT);
+    fprintf(stderr, "  -p  port of the server behind it, started with -p (default %d)\n", TFTP_PORT + 1);
+    fprintf(stderr, "  -L/-D/-R/-C  percent of the packets dropped, duplicated, reordered, corrupted\n");
+    fprintf(stderr, "  -r  how far a reordered packet is held back (default %d ms)\n", PROXY_REORDER_MS);
+    fprintf(stderr, "  -d/-j  delay of every packet and its jitter, +- that much\n");
+    fprintf(stderr, "  -S  seed of the decisions, the same seed and traffic give the same run (default 1)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *server_ip = "127.0.0.1";
+    int listen_port = TFTP_PORT;
+    int server_port = TFTP_PORT + 1;
+    unsigned long long seed = 1;
+    int opt;
+
+    imp.reorder_ms = PROXY_REORDER_MS;
+    while ((opt = getopt(argc, argv, "l:s:p:L:D:R:r:C:d:j:S:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            listen_port = atoi(optarg);
+            break;
+        case 's':
+            server_ip = optarg;
+            break;
+        case 'p':
+            server_port = atoi(optarg);
+            break;
+        case 'L':
+            imp.drop = atof(optarg) / 100;
+            break;
+        case 'D':
+            imp.dup = atof(optarg) / 100;
+            break;
+        case 'R':
+            imp.reorder = atof(optarg) / 100;
+            break;
+        case 'r':
+            imp.reorder_ms = atoi(optarg);
+            break;
+        case 'C':
+            imp.corrupt = atof(optarg) / 100;
+            break;
+        case 'd':
+            imp.delay_ms = atoi(optarg);
+            break;
+        case 'j':
+            imp.jitter_ms = atoi(optarg);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    rng_state = seed ? seed : 1; // xorshift never leaves 0
+
+    struct sockaddr_in server = {0}, local = {0};
+    server.sin_family = AF_INET;
+    server.sin_port = htons(server_port);
+    if (inet_pton(AF_INET, server_ip, &server.sin_addr) != 1 || listen_port == server_port)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    local.sin_port = htons(listen_port);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&local, sizeof(local)) < 0)
+    {
+        perror("Error binding socket");
+        return 1;
+    }
+
+    // held packets go out on a timerfd, an epoll timeout would round every delay up to the next ms
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    struct epoll_event tev = {.events = EPOLLIN, .data.ptr = &timer_fd};
+    if (epfd < 0 || timer_fd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0 ||
+        epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &tev) < 0)
+    {
+        perror("epoll");
+        return 1;
+    }
+
+    struct sigaction sa = {0};
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("proxy on port %d for %s:%d - loss %.1f%% dup %.1f%% reorder %.1f%% (%d ms) corrupt %.1f%% delay %d+-%d ms seed %llu\n",
+           listen_port, server_ip, server_port, imp.drop * 100, imp.dup * 100, imp.reorder * 100, imp.reorder_ms,
+           imp.corrupt * 100, imp.delay_ms, imp.jitter_ms, seed);
+    fflush(stdout);
+
+    flow_t *flows = NULL;
+    unsigned char buf[PROXY_BUF];
+    uint64_t last_sweep = tftp_now_us();
+
+    while (running)
+    {
+        uint64_t now;
+        if (nheap)
+        {
+            // tftp_now_us is CLOCK_MONOTONIC too
+            struct itimerspec its = {{0, 0}, {heap[0]->due_us / 1000000, (heap[0]->due_us % 1000000) * 1000}};
+            timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+        }
+
+        struct epoll_event events[64];
+        int n = epoll_wait(epfd, events, 64, 1000);
+        if (n < 0 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            break;
+        }
+        now = tftp_now_us();
+
+        for (int i = 0; i < n; i++)
+        {
+            flow_t *f = events[i].data.ptr;
+            struct sockaddr_in from;
+            uint64_t expirations;
+
+            if (events[i].data.ptr == &timer_fd)
+            {
+                // drained, what's due goes out below
+                while (read(timer_fd, &expirations, sizeof(expirations)) > 0)
+                    ;
+                continue;
+            }
+            socklen_t from_len;
+            ssize_t len;
+
+            for (;;)
+            {
+                from_len = sizeof(from);
+                len = recvfrom(f ? f->fd : listen_fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+                if (len < 0)
+                    break;
+                if (!f)
+                {
+                    // from a client, a request sends its flow back to the well-known port
+                    flow_t *cf = flow_get(&flows, epfd, &from, &server);
+                    if (!cf)
+                        continue;
+                    if (len >= 2 && buf[0] == 0 &&
+                        (buf[1] == TFTP_OPCODE_RRQ || buf[1] == TFTP_OPCODE_WRQ || buf[1] == TFTP_OPCODE_DEL))
+                        cf->upstream = server;
+                    cf->last_us = now;
+                    relay(listen_fd, cf, 1, buf, len, now);
+                }
+                else
+                {
+                    f->upstream = from; // the server's TID
+                    f->last_us = now;
+                    relay(listen_fd, f, 0, buf, len, now);
+                }
+            }
+        }
+
+        while (nheap && heap[0]->due_us <= now)
+        {
+            held_t *h = heap_pop();
+            deliver(listen_fd, h->f, h->up, &h->upstream, h->data, h->len);
+            h->f->held--;
+            free(h);
+        }
+
+        if (now - last_sweep > 1000000)
+        {
+            last_sweep = now;
+            for (flow_t **p = &flows; *p;)
+            {
+                flow_t *f = *p;
+                if (!f->held && now - f->last_us > PROXY_IDLE_US)
+                {
+                    *p = f->next;
+                    close(f->fd);
+                    free(f);
+                    continue;
+                }
+                p = &f->next;
+            }
+        }
+    }
+
+    const char *names[2] = {"to client", "to server"};
+    for (int d = 1; d >= 0; d--)
+    {
+        printf("%s: %llu packets, %llu dropped, %llu duplicated, %llu reordered, %llu corrupted, %llu delayed\n",
+               names[d], (unsigned long long)stats[d].packets, (unsigned long long)stats[d].dropped,
+               (unsigned long long)stats[d].duplicated, (unsigned long long)stats[d].reordered,
+               (unsigned long long)stats[d].corrupted, (unsigned long long)stats[d].delayed);
+    }
+
+    while (nheap)
+        free(heap_pop());
+    free(heap);
+    while (flows)
+    {
+        flow_t *f = flows;
+        flows = f->next;
+        close(f->fd);
+        free(f);
+    }
+    close(timer_fd);
+    close(epfd);
+    close(listen_fd);
+    return 0;
+}
@@ -0,0 +1,1016 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "../utils/tftp_utils.h"
+#include "../utils/tftp_options.h"
+#include "../libtftp/tftp_xfer.h"
+#include "../tftp_server/tftp_server.h"
+#include "../tftp_server/tftp_session.h"
+
+/*
+    protocol simulator - the libtftp client engine and the server's
+    sessions, the same code that runs over sockets, wired to each other
+    through an in-memory network on a virtual clock (tftp_set_clock).
+    nothing waits for real time, a timeout is a jump of the clock, so a
+    lossy 1 MB transfer takes well under a millisecond of CPU.
+    each scenario is one RRQ or WRQ under its own seed: the link drops,
+    duplicates, reorders and delays packets the way tftp_proxy_r does,
+    and can be limited to a rate so a big window costs queueing. the
+    same seed is the same run, a failing one can be replayed with -n 1
+    -x seed -v. for every strategy (blksize x windowsize [x timeout],
+    a z on the end asks for compress=deflate) it prints the completion
+    time percentiles, the timer resends of both sides, the DATA sent
+    again, the bytes on the wire and the CPU time a scenario took -
+    what a z strategy saves of the one and costs of the other. its RRQs
+    after the first go out of the .deflate the first one left, like a
+    hot file's on a server.
+    the server side runs without its worker: no I/O pool (uploads are
+    written synchronously), no cache and no prefetch thread
+*/
+
+#define SIM_CLIENT_PORT 1024
+#define SIM_LISTEN_PORT 69
+#define SIM_MAX_SESSIONS 16  // a request copied often enough gets that many
+#define SIM_LIMIT_US 86400000000ULL // virtual time a scenario may take at most, a day
+#define SIM_WIRE_HDR 28          // IPv4 + UDP
+#define SIM_SHOW_FAILED 5        // seeds printed per strategy
+#define SIM_STRATEGIES 32
+#define SIM_TIMEOUT 0            // seconds, what tftp_client_r asks for without -t: none, the timer adapts
+
+typedef struct
+{
+    double drop, dup, reorder;  // 0..1 per packet
+    int delay_ms, jitter_ms;    // one way, each packet waits delay +- jitter
+    int reorder_ms;             // on top of that for a reordered one
+    double mbit;                // each way, 0 = no limit
+} sim_link_t;
+
+typedef struct
+{
+    int blksize, windowsize, timeout;
+    int compress;
+} sim_strategy_t;
+
+// a packet on its way
+typedef struct
+{
+    uint64_t due_us;
+    uint64_t order; // arrival order when due at the same time
+    int to_server;
+    uint16_t src, dst;
+    size_t len;
+    unsigned char data[];
+} sim_pkt_t;
+
+struct sim;
+
+// a server TID
+typedef struct
+{
+    struct sim *sim;
+    uint16_t port;
+    tftp_session_t *s;
+} sim_tid_t;
+
+typedef struct sim
+{
+    const sim_link_t *link;
+    uint64_t rng;
+    sim_pkt_t **heap;
+    size_t nheap, heap_cap;
+    uint64_t order;
+    uint64_t last_due_us[2]; // jitter doesn't reorder, only -R does
+    uint64_t busy_us[2];     // the link is sending until then
+    sim_tid_t tids[SIM_MAX_SESSIONS];
+    int ntids;
+    tftp_xfer_t *client;
+
+    // what this scenario cost
+    uint64_t wire_bytes;
+    uint64_t packets;
+    uint64_t data_pkts;
+    unsigned server_rtx;
+} sim_t;
+
+typedef struct
+{
+    int ok;
+    uint64_t time_us;
+    unsigned client_rtx, server_rtx;
+    uint64_t wire_bytes, packets, data_pkts;
+    double cpu_ms; // both sides', the simulator's own work included
+    int resumed; // -K: the second attempt went on from what the first left
+    char error[128];
+} sim_result_t;
+
+static uint64_t sim_now_us;
+static int trace; // -T
+static int rollover; // -w, what the client asks for
+static int cut_off; // -K
+static const char *op_names[] = {"rrq", "wrq", "mix"};
+
+static uint64_t sim_clock(void)
+{
+    return sim_now_us;
+}
+
+// xorshift64*, like tftp_proxy_r - the scenario's seed is its whole state
+static double rnd(sim_t *sim)
+{
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+    return ((sim->rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int pkt_before(const sim_pkt_t *a, const sim_pkt_t *b)
+{
+    return a->due_us < b->due_us || (a->due_us == b->due_us && a->order < b->order);
+}
+
+static int heap_push(sim_t *sim, sim_pkt_t *p)
+{
+    if (sim->nheap == sim->heap_cap)
+    {
+        size_t cap = sim->heap_cap ? sim->heap_cap * 2 : 256;
+        sim_pkt_t **n = realloc(sim->heap, cap * sizeof(*n));
+        if (!n)
+            return -1;
+        sim->heap = n;
+        sim->heap_cap = cap;
+    }
+    size_t i = sim->nheap++;
+    while (i > 0 && pkt_before(p, sim->heap[(i - 1) / 2]))
+    {
+        sim->heap[i] = sim->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sim->heap[i] = p;
+    return 0;
+}
+
+static sim_pkt_t *heap_pop(sim_t *sim)
+{
+    sim_pkt_t *top = sim->heap[0];
+    sim_pkt_t *last = sim->heap[--sim->nheap];
+    size_t i = 0;
+
+    for (;;)
+    {
+        size_t c = 2 * i + 1;
+        if (c >= sim->nheap)
+            break;
+        if (c + 1 < sim->nheap && pkt_before(sim->heap[c + 1], sim->heap[c]))
+            c++;
+        if (!pkt_before(sim->heap[c], last))
+            break;
+        sim->heap[i] = sim->heap[c];
+        i = c;
+    }
+    if (sim->nheap)
+        sim->heap[i] = last;
+    return top;
+}
+
+// one datagram onto the link - serialized at the rate, then lost, copied, delayed or held back
+static void sim_send(sim_t *sim, int to_server, uint16_t src, uint16_t dst, const struct iovec *iov, int iovcnt)
+{
+    const sim_link_t *link = sim->link;
+    size_t len = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    sim->packets++;
+    sim->wire_bytes += len + SIM_WIRE_HDR;
+    if (len >= 4 && ((const unsigned char *)iov[0].iov_base)[1] == TFTP_OPCODE_DATA)
+        sim->data_pkts++;
+
+    uint64_t out_us = sim_now_us;
+    if (link->mbit > 0)
+    {
+        if (out_us < sim->busy_us[to_server])
+            out_us = sim->busy_us[to_server];
+        out_us += (uint64_t)((len + SIM_WIRE_HDR) * 8 / link->mbit);
+        sim->busy_us[to_server] = out_us;
+    }
+
+    if (rnd(sim) < link->drop)
+        return;
+    int copies = rnd(sim) < link->dup ? 2 : 1;
+
+    for (int c = 0; c < copies; c++)
+    {
+        long delay_us = link->delay_ms * 1000L;
+        if (link->jitter_ms)
+            delay_us += (long)((rnd(sim) * 2 - 1) * link->jitter_ms * 1000);
+        if (delay_us < 0)
+            delay_us = 0;
+        uint64_t due_us = out_us + delay_us;
+        if (rnd(sim) < link->reorder)
+        {
+            due_us += link->reorder_ms * 1000L; // the ones after it overtake it
+        }
+        else
+        {
+            if (due_us < sim->last_due_us[to_server])
+                due_us = sim->last_due_us[to_server];
+            sim->last_due_us[to_server] = due_us;
+        }
+
+        sim_pkt_t *p = malloc(sizeof(*p) + len + 1); // room to terminate a request
+        if (!p)
+            return;
+        size_t off = 0;
+        for (int i = 0; i < iovcnt; i++)
+        {
+            memcpy(p->data + off, iov[i].iov_base, iov[i].iov_len);
+            off += iov[i].iov_len;
+        }
+        p->len = len;
+        p->due_us = due_us;
+        p->order = sim->order++;
+        p->to_server = to_server;
+        p->src = src;
+        p->dst = dst;
+        if (heap_push(sim, p) < 0)
+            free(p);
+    }
+}
+
+// the sessions' transport, see session_create_detached
+static void sim_xmit(tftp_session_t *s, const struct iovec *iov, int iov_per_pkt, int n)
+{
+    sim_tid_t *t = s->xmit_ctx;
+
+    for (int i = 0; i < n; i++)
+        sim_send(t->sim, 0, t->port, SIM_CLIENT_PORT, iov + i * iov_per_pkt, iov_per_pkt);
+}
+
+// an ERROR from the well-known port, for the refusals that have one
+static void sim_refuse(sim_t *sim, uint16_t code, const char *msg)
+{
+    unsigned char hdr[4] = {0, TFTP_OPCODE_ERROR, code >> 8, code & 0xFF};
+    struct iovec iov[2] = {{hdr, 4}, {(void *)msg, strlen(msg) + 1}};
+
+    sim_send(sim, 0, SIM_LISTEN_PORT, SIM_CLIENT_PORT, iov, 2);
+}
+
+// what the worker and rrq_handler/wrq_handler do with a request, without the listen socket
+static void sim_accept(sim_t *sim, unsigned char *buf, size_t len)
+{
+    struct sockaddr_in client;
+    tftp_options_t opts = {0};
+    tftp_session_t *s;
+
+    if (len < 4 || sim->ntids == SIM_MAX_SESSIONS)
+        return;
+    buf[len] = '\0';
+    int opcode = buf[1];
+    if (buf[0] != 0 || (opcode != TFTP_OPCODE_RRQ && opcode != TFTP_OPCODE_WRQ))
+        return;
+
+    const char *filename = (const char *)buf + 2;
+    const char *mode = strchr(filename, 0) + 1;
+    if (mode >= (const char *)buf + len)
+        return;
+    const char *opt_start = mode + strlen(mode) + 1;
+    if (opt_start < (const char *)buf + len &&
+        tftp_parse_options(opt_start, (const char *)buf + len - opt_start, &opts) < 0)
+    {
+        sim_refuse(sim, TFTP_OPCODE_OPT_ERR, "Option negotiation failed");
+        return;
+    }
+
+    memset(&client, 0, sizeof(client));
+    client.sin_family = AF_INET;
+    client.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    client.sin_port = htons(SIM_CLIENT_PORT);
+
+    sim_tid_t *t = &sim->tids[sim->ntids];
+    s = session_create_detached(opcode, &client, filename, mode, &opts, sim_xmit, t);
+    if (!s)
+        return;
+
+    if (opcode == TFTP_OPCODE_RRQ)
+    {
+        if (source_open(&s->src, s->filepath, 0) < 0)
+        {
+            sim_refuse(sim, TFTP_OPCODE_ACC_ERR, "Access violation");
+            session_destroy(s);
+            return;
+        }
+        if (s->opts.present & TFTP_OPT_TSIZE)
+            s->opts.tsize = s->src.size;
+        session_resume(s);
+        session_compress(s);
+    }
+    else
+    {
+        if (access(s->filepath, F_OK) == 0)
+        {
+            sim_refuse(sim, TFTP_OPCODE_EXISTS, "File already exists");
+            session_destroy(s);
+            return;
+        }
+        // a copy of the WRQ finds the first one's temp file, the server drops it the same way
+        int resume = (opts.present & TFTP_OPT_OFFSET) && str_casecmp(mode, "octet") == 0;
+        if (sink_open(&s->sink, s->filepath, 0, (opts.present & TFTP_OPT_TSIZE) && !resume ? opts.tsize : 0) < 0 ||
+            session_resume(s) < 0)
+        {
+            session_destroy(s);
+            return;
+        }
+        session_compress(s);
+    }
+
+    t->sim = sim;
+    t->port = SIM_LISTEN_PORT + 1000 + sim->ntids;
+    t->s = s;
+    sim->ntids++;
+    if (session_begin(s) < 0)
+        s->state = SESSION_DONE;
+}
+
+static tftp_session_t *sim_session(sim_t *sim, uint16_t port)
+{
+    for (int i = 0; i < sim->ntids; i++)
+    {
+        if (sim->tids[i].port == port)
+            return sim->tids[i].s;
+    }
+    return NULL;
+}
+
+static void sim_deliver(sim_t *sim, sim_pkt_t *p)
+{
+    if (trace)
+    {
+        int opcode = p->len >= 2 ? p->data[1] : 0;
+        printf("%10.3f ms %5u -> %-5u %-5s", (sim_now_us - 1000000) / 1000.0, p->src, p->dst,
+               opcode == TFTP_OPCODE_DATA ? "DATA" : opcode == TFTP_OPCODE_ACK ? "ACK" : opcode == TFTP_OPCODE_OACK ? "OACK" :
+               opcode == TFTP_OPCODE_ERROR ? "ERROR" : "REQ");
+        if ((opcode == TFTP_OPCODE_DATA || opcode == TFTP_OPCODE_ACK) && p->len >= 4)
+            printf(" %u", (p->data[2] << 8) | p->data[3]);
+        printf("\n");
+    }
+    if (!p->to_server)
+    {
+        // once the client is done its port is closed, whatever comes is lost
+        if (sim->client->state == TFTP_XFER_RUNNING)
+            tftp_xfer_feed(sim->client, p->data, p->len, p->src, sim_now_us);
+        return;
+    }
+
+    if (p->dst == SIM_LISTEN_PORT)
+    {
+        sim_accept(sim, p->data, p->len);
+        return;
+    }
+
+    tftp_session_t *s = sim_session(sim, p->dst);
+    if (s && s->state != SESSION_DONE)
+    {
+        session_on_packet(s, p->data, p->len, NULL);
+        session_flush(s);
+    }
+}
+
+// sends whatever the client has queued
+static void sim_client_drain(sim_t *sim)
+{
+    tftp_xfer_t *x = sim->client;
+    const void *pkt;
+    size_t len;
+
+    while ((len = tftp_xfer_next(x, &pkt, sim_now_us)))
+    {
+        struct iovec iov = {(void *)pkt, len};
+        sim_send(sim, 1, SIM_CLIENT_PORT, x->peer_known ? x->peer : SIM_LISTEN_PORT, &iov, 1);
+    }
+}
+
+/*
+    -Z: the payload is zeros that only exist as a count, so a transfer
+    of any size runs in constant memory - the RRQ reads a sparse file
+    and the WRQ leaves one behind
+*/
+typedef struct
+{
+    uint64_t size, off;
+    int bad; // a block that wasn't zeros arrived
+} sim_zero_io_t;
+
+static int zero_write(void *ctx, const char *buf, size_t len)
+{
+    sim_zero_io_t *z = ctx;
+    if (len > z->size - z->off || (len && !tftp_is_zero(buf, len)))
+        z->bad = 1;
+    z->off += len;
+    return 0;
+}
+
+static ssize_t zero_read(void *ctx, char *buf, size_t len)
+{
+    sim_zero_io_t *z = ctx;
+    if (len > z->size - z->off)
+        len = z->size - z->off;
+    memset(buf, 0, len);
+    z->off += len;
+    return len;
+}
+
+// the first and last MB of what the server stored have to be zeros, and its size right
+static int zero_check(const char *path, uint64_t size)
+{
+    static char buf[1 << 20];
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    int ok = fd >= 0 && fstat(fd, &st) == 0 && (uint64_t)st.st_size == size;
+    for (int i = 0; ok && i < 2; i++)
+    {
+        uint64_t len = size < sizeof(buf) ? size : sizeof(buf);
+        ok = pread(fd, buf, len, i ? size - len : 0) == (ssize_t)len && (!len || tftp_is_zero(buf, len));
+    }
+    if (fd >= 0)
+        close(fd);
+    return ok;
+}
+
+/*
+    runs the client and the sessions until the client is done and the
+    sessions have finished or given up - their resends after the client
+    left are on the wire too. with cut the client goes away without a
+    word once it has moved that many bytes of the file, like a killed process
+*/
+static void sim_loop(sim_t *sim, uint64_t cut, sim_result_t *r)
+{
+    tftp_xfer_t *x = sim->client;
+    uint64_t start = sim_now_us;
+
+    int running = 1;
+    while (running && sim_now_us - start < SIM_LIMIT_US)
+    {
+        sim_client_drain(sim);
+        if (cut && x->state == TFTP_XFER_RUNNING && x->file_bytes >= cut)
+        {
+            x->state = TFTP_XFER_FAILED;
+            snprintf(x->error, sizeof(x->error), "cut off");
+        }
+        if (x->state != TFTP_XFER_RUNNING && !r->time_us)
+            r->time_us = sim_now_us - start;
+
+        // the next thing that happens - a packet arriving or a timer going off
+        uint64_t next = UINT64_MAX;
+        running = 0;
+        if (x->state == TFTP_XFER_RUNNING)
+        {
+            next = sim_now_us + tftp_xfer_wait_us(x, sim_now_us);
+            running = 1;
+        }
+        for (int i = 0; i < sim->ntids; i++)
+        {
+            tftp_session_t *s = sim->tids[i].s;
+            if (s->state != SESSION_DONE)
+            {
+                if (s->deadline_us < next)
+                    next = s->deadline_us;
+                running = 1;
+            }
+        }
+        if (sim->nheap)
+        {
+            if (sim->heap[0]->due_us < next)
+                next = sim->heap[0]->due_us;
+            running = 1;
+        }
+        if (!running)
+            break;
+        if (next > sim_now_us)
+            sim_now_us = next;
+
+        while (sim->nheap && sim->heap[0]->due_us <= sim_now_us)
+        {
+            sim_pkt_t *p = heap_pop(sim);
+            sim_deliver(sim, p);
+            free(p);
+            sim_client_drain(sim);
+        }
+
+        if (x->state == TFTP_XFER_RUNNING)
+            tftp_xfer_timer(x, sim_now_us);
+        for (int i = 0; i < sim->ntids; i++)
+        {
+            tftp_session_t *s = sim->tids[i].s;
+            if (s->state != SESSION_DONE && s->deadline_us <= sim_now_us)
+            {
+                session_on_timeout(s, sim_now_us);
+                if (s->state != SESSION_DONE)
+                    sim->server_rtx++;
+            }
+        }
+    }
+}
+
+/*
+    one transfer, with -K one cut off part way and then resumed - the
+    time is the two attempts', without the wait for the server to give
+    up on the first
+*/
+static void sim_run(const sim_link_t *link, const sim_strategy_t *st, int op, const char *name,
+                    char *payload, size_t size, uint64_t seed, sim_result_t *r)
+{
+    sim_t sim;
+    tftp_xfer_t x;
+    // a zero stream leaves tsize out, the server would fallocate what it's meant to keep sparse
+    tftp_xfer_opts_t opts = {st->blksize, st->windowsize, st->timeout,
+                             op == TFTP_OPCODE_WRQ && payload ? (long long)size : -1, 0, rollover, cut_off};
+    tftp_xfer_io_t io;
+    tftp_buf_io_t b;
+    sim_zero_io_t z = {size, 0, 0};
+    void *mem = NULL;
+    size_t mem_len;
+    char *rx = NULL;
+    struct timespec c0, c1;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c0);
+    opts.compress = st->compress;
+
+    memset(&sim, 0, sizeof(sim));
+    memset(r, 0, sizeof(*r));
+    sim.link = link;
+    sim.client = &x;
+    // splitmix64, so seeds next to each other start far apart
+    sim.rng = seed + 0x9e3779b97f4a7c15ULL;
+    sim.rng = (sim.rng ^ (sim.rng >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    sim.rng = (sim.rng ^ (sim.rng >> 27)) * 0x94d049bb133111ebULL;
+    sim.rng ^= sim.rng >> 31;
+    if (!sim.rng)
+        sim.rng = 1;
+
+    sim_now_us = 1000000; // 0 means "not timed" to both engines
+
+    int zeros = !payload;
+    if (zeros)
+    {
+        io = (tftp_xfer_io_t){zero_write, NULL, zero_read, &z};
+    }
+    else if (op == TFTP_OPCODE_RRQ)
+    {
+        rx = malloc(size ? size : 1);
+        tftp_buf_io(&io, &b, rx, size, 0);
+    }
+    else
+    {
+        tftp_buf_io(&io, &b, payload, size, size);
+    }
+    mem_len = tftp_xfer_mem_size(op, &opts);
+    if (mem_len)
+        mem = malloc(mem_len);
+    int no_mem = (op == TFTP_OPCODE_RRQ && !rx && !zeros) || (mem_len && !mem);
+    if (no_mem || tftp_xfer_start(&x, op, name, "octet", &opts, &io, mem, mem_len, sim_now_us) < 0)
+    {
+        snprintf(r->error, sizeof(r->error), "%s", no_mem ? "out of memory" : x.error);
+        free(rx);
+        free(mem);
+        return;
+    }
+
+    unsigned client_rtx = 0;
+    if (cut_off && size > 1)
+    {
+        // somewhere in the middle 80%, then the same transfer again with resume
+        uint64_t cut = size / 10 + (uint64_t)(rnd(&sim) * (size * 8 / 10)) + 1;
+        sim_loop(&sim, cut, r);
+        if (x.state != TFTP_XFER_DONE)
+        {
+            uint64_t first = r->time_us;
+            client_rtx = x.retransmits;
+            for (int i = 0; i < sim.ntids; i++)
+                session_destroy(sim.tids[i].s);
+            sim.ntids = 0;
+            if (op == TFTP_OPCODE_RRQ)
+            {
+                size_t have = b.len, tail = have < TFTP_TAIL_LEN ? have : TFTP_TAIL_LEN;
+                opts.offset = have;
+                opts.tailsum = tftp_crc32(0, rx + have - tail, tail);
+                tftp_buf_io(&io, &b, rx, size, have);
+            }
+            else
+            {
+                tftp_buf_io(&io, &b, payload, size, size);
+            }
+            r->time_us = 0;
+            if (tftp_xfer_start(&x, op, name, "octet", &opts, &io, mem, mem_len, sim_now_us) == 0)
+                sim_loop(&sim, 0, r);
+            r->time_us += first;
+            r->resumed = x.offset > 0;
+        }
+    }
+    else
+    {
+        sim_loop(&sim, 0, r);
+    }
+
+    r->client_rtx = client_rtx + x.retransmits;
+    r->server_rtx = sim.server_rtx;
+    r->wire_bytes = sim.wire_bytes;
+    r->packets = sim.packets;
+    r->data_pkts = sim.data_pkts;
+    if (x.state == TFTP_XFER_RUNNING)
+        snprintf(r->error, sizeof(r->error), "still running after %llu s", SIM_LIMIT_US / 1000000);
+    else if (x.state == TFTP_XFER_FAILED)
+        snprintf(r->error, sizeof(r->error), "%s", x.error);
+    else if (op == TFTP_OPCODE_RRQ && zeros && (z.off != size || z.bad))
+        snprintf(r->error, sizeof(r->error), "received %llu bytes%s", (unsigned long long)z.off, z.bad ? ", not all zeros" : "");
+    else if (op == TFTP_OPCODE_RRQ && !zeros && (b.len != size || memcmp(rx, payload, size) != 0))
+        snprintf(r->error, sizeof(r->error), "received data differs");
+    else
+        r->ok = 1;
+
+    // what arrived on the server has to be what was sent
+    if (op == TFTP_OPCODE_WRQ)
+    {
+        char path[2 * PATH_LENGTH];
+        snprintf(path, sizeof(path), "%s/%s", TFTP_ROOT_DIR, name);
+        if (r->ok && zeros && !zero_check(path, size))
+        {
+            r->ok = 0;
+            snprintf(r->error, sizeof(r->error), "stored file differs");
+        }
+        else if (r->ok && !zeros)
+        {
+            FILE *f = fopen(path, "rb");
+            char *back = malloc(size + 1);
+            if (!f || !back || fread(back, 1, size + 1, f) != size || memcmp(back, payload, size) != 0)
+            {
+                r->ok = 0;
+                snprintf(r->error, sizeof(r->error), "stored file differs");
+            }
+            free(back);
+            if (f)
+                fclose(f);
+        }
+        unlink(path);
+    }
+
+    for (int i = 0; i < sim.ntids; i++)
+        session_destroy(sim.tids[i].s);
+    while (sim.nheap)
+        free(heap_pop(&sim));
+    free(sim.heap);
+    free(rx);
+    free(mem);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c1);
+    r->cpu_ms = (c1.tv_sec - c0.tv_sec) * 1e3 + (c1.tv_nsec - c0.tv_nsec) / 1e6;
+}
+
+// "4m", "64k", plain bytes
+static size_t parse_size(const char *s)
+{
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+
+    if (*end == 'k' || *end == 'K')
+        n <<= 10;
+    else if (*end == 'm' || *end == 'M')
+        n <<= 20;
+    else if (*end == 'g' || *end == 'G')
+        n <<= 30;
+    return n;
+}
+
+// "512x1,1428x16x1,1428x16z" - blksize x windowsize, optionally x timeout, z for compress
+static int parse_strategies(char *list, sim_strategy_t *st, int max)
+{
+    int n = 0;
+
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ","))
+    {
+        if (n == max)
+            return -1;
+        size_t len = strlen(tok);
+        st[n].compress = len > 0 && tok[len - 1] == 'z';
+        if (st[n].compress)
+            tok[len - 1] = '\0';
+        st[n].timeout = SIM_TIMEOUT;
+        int got = sscanf(tok, "%dx%dx%d", &st[n].blksize, &st[n].windowsize, &st[n].timeout);
+        if (got < 2 || st[n].blksize < 8 || st[n].blksize > TFTP_BLKSIZE_MAX ||
+            st[n].windowsize < 1 || st[n].windowsize > TFTP_WINDOWSIZE_MAX || st[n].timeout < 0)
+            return -1;
+        n++;
+    }
+    return n;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// nearest rank, of n sorted values
+static double percentile(const double *v, int n, int p)
+{
+    if (n == 0)
+        return 0;
+    int rank = (p * n + 99) / 100;
+    return v[rank > 0 ? rank - 1 : 0];
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n scenarios] [-o rrq|wrq|mix] [-S size] [-t strategies] [-L loss%%] [-D dup%%] [-R reorder%%] [-r hold_ms] [-d delay_ms] [-j jitter_ms] [-B mbit] [-w 0|1] [-P random|text] [-Z] [-K] [-x seed] [-J file] [-l label] [-T] [-v]\n", prog);
+    fprintf(stderr, "  -n  scenarios per strategy, each with its own seed (default 1000)\n");
+    fprintf(stderr, "  -t  blksize x windowsize [x timeout] [z] list, z asks for compress=deflate\n");
+    fprintf(stderr, "      (default 512x1,1428x1,1428x4,1428x16,1428x64)\n");
+    fprintf(stderr, "  -L/-D/-R/-r/-d/-j  the link each way, as in tftp_proxy_r (default -L 1 -d 10 -j 2)\n");
+    fprintf(stderr, "  -B  link rate each way in Mbit/s, 0 for none (default 100)\n");
+    fprintf(stderr, "  -w  1 asks for rollover=1, 0 lets block numbers wrap to 0 (default: not asked, wraps to 0)\n");
+    fprintf(stderr, "  -P  random bytes, or text that deflates about 5:1 like configs and logs (default random)\n");
+    fprintf(stderr, "  -Z  zeros streamed from/to a sparse file instead of data in memory, for sizes past RAM\n");
+    fprintf(stderr, "  -K  cut the client off somewhere in the middle and run the transfer again resumed (not with -Z)\n");
+    fprintf(stderr, "  -x  seed of the first scenario, the others count up from it (default 1)\n");
+    fprintf(stderr, "  -J  append one JSON object per strategy to file, - for stdout\n");
+    fprintf(stderr, "  -T  print every packet as it arrives, for one scenario (-n 1 -x seed)\n");
+    fprintf(stderr, "  -v  show the sessions' messages and every failed seed\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char default_strategies[] = "512x1,1428x1,1428x4,1428x16,1428x64";
+    sim_link_t link = {0.01, 0, 0, 10, 2, 20, 100};
+    sim_strategy_t st[SIM_STRATEGIES];
+    char *strategies = default_strategies;
+    int scenarios = 1000;
+    int op = 0; // index into op_names
+    size_t size = 1 << 20;
+    unsigned long long seed = 1;
+    const char *json = NULL;
+    const char *label = "";
+    int verbose = 0;
+    int zeros = 0;
+    int text = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:o:S:t:L:D:R:r:d:j:B:w:P:ZKx:J:l:Tvh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            scenarios = atoi(optarg);
+            break;
+        case 'o':
+            for (op = 0; op < 3 && strcmp(optarg, op_names[op]) != 0; op++)
+                ;
+            if (op == 3)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'S':
+            size = parse_size(optarg);
+            break;
+        case 't':
+            strategies = optarg;
+            break;
+        case 'L':
+            link.drop = atof(optarg) / 100;
+            break;
+        case 'D':
+            link.dup = atof(optarg) / 100;
+            break;
+        case 'R':
+            link.reorder = atof(optarg) / 100;
+            break;
+        case 'r':
+            link.reorder_ms = atoi(optarg);
+            break;
+        case 'd':
+            link.delay_ms = atoi(optarg);
+            break;
+        case 'j':
+            link.jitter_ms = atoi(optarg);
+            break;
+        case 'B':
+            link.mbit = atof(optarg);
+            break;
+        case 'w':
+            rollover = atoi(optarg) ? 1 : 0;
+            break;
+        case 'P':
+            if (strcmp(optarg, "text") != 0 && strcmp(optarg, "random") != 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            text = strcmp(optarg, "text") == 0;
+            break;
+        case 'Z':
+            zeros = 1;
+            break;
+        case 'K':
+            cut_off = 1;
+            break;
+        case 'x':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'J':
+            json = optarg;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'T':
+            trace = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    int nst = parse_strategies(strategies, st, SIM_STRATEGIES);
+    if (nst <= 0 || scenarios < 1 || (zeros && cut_off))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // a scratch directory holds the server's root, and its server.log
+    char dir[] = "/tmp/tftp_sim.XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) < 0 || mkdir(TFTP_ROOT_DIR, 0755) < 0)
+    {
+        perror("scratch directory");
+        return 1;
+    }
+
+    char *payload = NULL;
+    if (!zeros && !(payload = malloc(size ? size : 1)))
+    {
+        perror("malloc");
+        return 1;
+    }
+    uint32_t fill = 0x12345678;
+    if (text)
+    {
+        // lines of words picked at random out of a few, about what a config or a log deflates to
+        static const char *words[] = {"option", "value", "interface", "eth0", "address", "10.0.0.1", "enable",
+                                      "timeout", "= 30", "kernel", "initrd", "boot", "console=ttyS0", "#", "root",
+                                      "mount", "/dev/sda1", "[main]", "true", "false", "\n", "\n", "\n", "\n"};
+        size_t i = 0;
+        while (payload && i < size)
+        {
+            fill = fill * 1103515245 + 12345;
+            const char *w = words[(fill >> 16) % (sizeof(words) / sizeof(words[0]))];
+            for (size_t k = 0; w[k] && i < size; k++)
+                payload[i++] = w[k];
+            if (i < size && w[0] != '\n')
+                payload[i++] = ' ';
+        }
+    }
+    for (size_t i = 0; payload && !text && i < size; i++)
+    {
+        fill = fill * 1103515245 + 12345;
+        payload[i] = fill >> 16;
+    }
+
+    // the file RRQs read, all hole with -Z
+    char rrq_path[2 * PATH_LENGTH];
+    snprintf(rrq_path, sizeof(rrq_path), "%s/sim_rrq.bin", TFTP_ROOT_DIR);
+    FILE *f = fopen(rrq_path, "wb");
+    if (!f || (payload ? fwrite(payload, 1, size, f) != size : ftruncate(fileno(f), size) < 0) || fclose(f) != 0)
+    {
+        perror(rrq_path);
+        return 1;
+    }
+
+    // the sessions report every timeout on stderr, thousands of them are noise
+    if (!verbose && !freopen("/dev/null", "w", stderr))
+        return 1;
+
+    tftp_set_clock(sim_clock);
+
+    printf("%d scenarios of %s %zu %sbytes per strategy%s, rollover %s, loss %.1f%% dup %.1f%% reorder %.1f%% (%d ms) delay %d+-%d ms rate %.0f Mbit/s seed %llu\n",
+           scenarios, op_names[op], size, zeros ? "zero " : text ? "text " : "", cut_off ? " cut off and resumed" : "", rollover ? "1" : "0", link.drop * 100, link.dup * 100, link.reorder * 100, link.reorder_ms,
+           link.delay_ms, link.jitter_ms, link.mbit, seed);
+
+    double *lat = malloc(scenarios * sizeof(*lat));
+    if (!lat)
+    {
+        perror("malloc");
+        return 1;
+    }
+    int all_failed = 0;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    for (int k = 0; k < nst; k++)
+    {
+        uint64_t client_rtx = 0, server_rtx = 0, wire = 0, packets = 0, data_pkts = 0;
+        int ok = 0, failed = 0, resumed = 0;
+        double cpu_ms = 0;
+        uint64_t fewest = UINT64_MAX; // DATA of the cleanest scenario
+        uint64_t blocks = size / st[k].blksize + 1; // DATA a transfer can't do without
+
+        for (int i = 0; i < scenarios; i++)
+        {
+            sim_result_t r;
+            int wrq = op == 1 || (op == 2 && (i & 1));
+
+            sim_run(&link, &st[k], wrq ? TFTP_OPCODE_WRQ : TFTP_OPCODE_RRQ, wrq ? "sim_wrq.bin" : "sim_rrq.bin",
+                    payload, size, seed + i, &r);
+            client_rtx += r.client_rtx;
+            server_rtx += r.server_rtx;
+            wire += r.wire_bytes;
+            packets += r.packets;
+            data_pkts += r.data_pkts;
+            resumed += r.resumed;
+            cpu_ms += r.cpu_ms;
+            if (r.ok && r.data_pkts < fewest)
+                fewest = r.data_pkts;
+            if (r.ok)
+            {
+                lat[ok++] = r.time_us / 1000.0;
+            }
+            else
+            {
+                if (verbose || failed < SIM_SHOW_FAILED)
+                    printf("  %dx%d%s seed %llu %s failed: %s\n", st[k].blksize, st[k].windowsize,
+                           st[k].compress ? "z" : "", seed + i, wrq ? "wrq" : "rrq", r.error);
+                failed++;
+            }
+        }
+        all_failed += failed;
+
+        qsort(lat, ok, sizeof(*lat), cmp_double);
+        double p50 = percentile(lat, ok, 50), p90 = percentile(lat, ok, 90), p99 = percentile(lat, ok, 99);
+        double max = ok ? lat[ok - 1] : 0;
+        // a compressed stream's size isn't known up front, the cleanest scenario is what it takes
+        if (st[k].compress && fewest != UINT64_MAX)
+            blocks = fewest;
+        double resent = data_pkts > blocks * scenarios ? (double)(data_pkts - blocks * scenarios) / scenarios : 0;
+        double overhead = size ? (double)wire / scenarios / size * 100 - 100 : 0;
+
+        printf("blksize=%d windowsize=%d timeout=%d compress=%d ok=%d failed=%d p50_ms=%.1f p90_ms=%.1f p99_ms=%.1f max_ms=%.1f "
+               "client_rtx=%.2f server_rtx=%.2f data_resent=%.1f packets=%.0f wire_bytes=%.0f overhead=%.1f%% cpu_ms=%.2f\n",
+               st[k].blksize, st[k].windowsize, st[k].timeout, st[k].compress, ok, failed, p50, p90, p99, max,
+               (double)client_rtx / scenarios, (double)server_rtx / scenarios, resent,
+               (double)packets / scenarios, (double)wire / scenarios, overhead, cpu_ms / scenarios);
+        if (cut_off)
+            printf("  cut off and resumed past byte 0: %d of %d\n", resumed, scenarios);
+
+        if (json)
+        {
+            FILE *out = strcmp(json, "-") == 0 ? stdout : fopen(json, "a");
+            if (!out)
+            {
+                perror(json);
+            }
+            else
+            {
+                fprintf(out, "{\"label\":\"%s\",\"time\":%lld,\"op\":\"%s\",\"size\":%zu,\"payload\":\"%s\",\"blksize\":%d,\"windowsize\":%d,\"timeout\":%d,\"compress\":%d,"
+                             "\"loss\":%.4f,\"dup\":%.4f,\"reorder\":%.4f,\"reorder_ms\":%d,\"delay_ms\":%d,\"jitter_ms\":%d,\"mbit\":%.1f,"
+                             "\"seed\":%llu,\"scenarios\":%d,\"failed\":%d,"
+                             "\"latency_ms\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+                             "\"client_rtx\":%.3f,\"server_rtx\":%.3f,\"data_resent\":%.3f,\"packets\":%.1f,\"wire_bytes\":%.1f,\"cpu_ms\":%.3f}\n",
+                        label, (long long)time(NULL), op_names[op], size, zeros ? "zero" : text ? "text" : "random",
+                        st[k].blksize, st[k].windowsize, st[k].timeout, st[k].compress,
+                        link.drop, link.dup, link.reorder, link.reorder_ms, link.delay_ms, link.jitter_ms, link.mbit,
+                        seed, scenarios, failed, p50, p90, p99, max,
+                        (double)client_rtx / scenarios, (double)server_rtx / scenarios, resent,
+                        (double)packets / scenarios, (double)wire / scenarios, cpu_ms / scenarios);
+                if (out != stdout)
+                    fclose(out);
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%d scenarios in %.2f s, %.0f per second\n", nst * scenarios, wall, nst * scenarios / (wall > 0 ? wall : 1e-9));
+
+    unlink(rrq_path);
+    char artifact[2 * PATH_LENGTH + 16];
+    compress_artifact_name(artifact, sizeof(artifact), rrq_path);
+    unlink(artifact);
+    unlink("server.log");
+    rmdir(TFTP_ROOT_DIR);
+    if (chdir("/") == 0)
+        rmdir(dir);
+    free(lat);
+    free(payload);
+    return all_failed ? 2 : 0;
+}
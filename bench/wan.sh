@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# goodput and completion times through the impairment proxy, one
+# network profile after the other - how recovery holds up off loopback
+# usage: bench/wan.sh [clients] [size] [seed] [json]
+# stop-and-wait at 512 bytes needs a round trip per block, keep size small
+# run from the project root after "make all bench", json collects the
+# results labelled with the profile
+#
+
+CLIENTS=${1:-4}
+SIZE=${2:-128k}
+SEED=${3:-1}
+JSON=${4:-/dev/null}
+PORT=6969
+SERVER_PORT=6970
+
+mkdir -p tftp_root
+./tftp_server_r -p $SERVER_PORT > /tmp/tftp_wan_$$.log 2>&1 &
+SERVER=$!
+sleep 0.5
+
+echo "profile   op   result"
+while read -r name args; do
+    ./tftp_proxy_r -l $PORT -p $SERVER_PORT -S "$SEED" $args > /dev/null &
+    PROXY=$!
+    sleep 0.2
+    for op in rrq wrq; do
+        for flow in "512 1" "1428 8"; do
+            set -- $flow
+            printf "%-9s %-4s %s\n" "$name" "$op" \
+                "$(./tftp_bench_r -p $PORT -c "$CLIENTS" -n 1 -o $op -S "$SIZE" -b "$1" -W "$2" -l "$name" -j "$JSON" |
+                    sed 's/ bytes=[0-9]*//; s/ mode=[a-z]*//; s/ loss=[0-9.]*%//')"
+        done
+    done
+    kill -INT "$PROXY"
+    wait "$PROXY" 2>/dev/null
+done <<EOF
+clean
+lan -d 1
+wan -d 20 -j 5 -L 0.5
+lossy -L 3
+reorder -R 3 -r 10
+dup -D 3
+bad -d 40 -j 10 -L 2 -R 1 -D 1
+EOF
+
+kill -INT "$SERVER"
+wait "$SERVER" 2>/dev/null
+rm -f /tmp/tftp_wan_$$.log
@@ -9,7 +9,7 @@ typedef struct {
 	union {
 		struct {
 			uint16_t block_n;
-			char data[TFTP_DATA_SIZE];
+			// payload follows, up to the negotiated blksize - see tftp_session_t.pkt
 		} data_pkt;
 		
 		struct {
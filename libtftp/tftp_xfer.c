@@ -0,0 +1,892 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#ifdef TFTP_ZLIB
+#include <zlib.h>
+#endif
+
+#include "tftp_xfer.h"
+#include "../utils/tftp_options.h"
+
+#define XFER_MAX_RETRIES 5
+
+//compress, in the caller's memory after the window - zlib's own allocations are bumped out of it
+#define XFER_ZBUF_SIZE (16 * 1024)       // WRQ: file bytes read ahead of deflate, RRQ: inflated bytes for io.write
+#define XFER_DEFLATE_MEM (272 * 1024)    // windowBits 15, memLevel 8: 256 KB and its state
+#define XFER_INFLATE_MEM (48 * 1024)     // a 32 KB window and the state
+#define XFER_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+static void xfer_fail(tftp_xfer_t *x, int code, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(x->error, sizeof(x->error), fmt, ap);
+    va_end(ap);
+    x->error_code = code;
+    x->state = TFTP_XFER_FAILED;
+}
+
+// the timer restarts whenever something goes out or the server answers
+static void xfer_arm(tftp_xfer_t *x, uint64_t now_us)
+{
+    x->deadline_us = now_us + rtt_timeout_us(&x->rtt);
+}
+
+static void xfer_progress(tftp_xfer_t *x, uint64_t now_us)
+{
+    rtt_progress(&x->rtt);
+    x->last_progress_us = now_us;
+}
+
+static void queue_ack(tftp_xfer_t *x, uint32_t block)
+{
+    x->send_ack = 1;
+    x->ack_block = block;
+}
+
+// blocks from..to-1 go out next, the ones from fresh on for the first time
+static void queue_blocks(tftp_xfer_t *x, uint32_t from, uint32_t to, uint32_t fresh)
+{
+    if (x->out_from < x->out_to)
+    {
+        // still sending the last batch, stretch it
+        if (from > x->out_from)
+            from = x->out_from;
+        if (fresh > x->out_fresh)
+            fresh = x->out_fresh;
+        if (to < x->out_to)
+            to = x->out_to;
+    }
+    x->out_from = from;
+    x->out_to = to;
+    x->out_fresh = fresh;
+}
+
+// an ERROR for the server, tftp_xfer_next hands it out once the transfer failed
+static void queue_error(tftp_xfer_t *x, int code, const char *msg)
+{
+    size_t msg_len = strnlen(msg, sizeof(x->err_pkt) - 5);
+
+    x->err_pkt[0] = 0;
+    x->err_pkt[1] = TFTP_OPCODE_ERROR;
+    x->err_pkt[2] = (code >> 8) & 0xFF;
+    x->err_pkt[3] = code & 0xFF;
+    memcpy(x->err_pkt + 4, msg, msg_len);
+    x->err_pkt[4 + msg_len] = '\0';
+    x->err_len = 4 + msg_len + 1;
+}
+
+/*
+    the server's answer to offset (o is NULL when it sent no OACK), the
+    io moves to where DATA 1 goes - returns -1 when the transfer failed
+*/
+static int resume_apply(tftp_xfer_t *x, const tftp_options_t *o)
+{
+    if (!x->asked_offset)
+        return 0;
+    x->asked_offset = 0;
+
+    if (x->op == TFTP_OPCODE_RRQ)
+    {
+        // any other answer is a start from nothing
+        if (o && (o->present & TFTP_OPT_OFFSET) && o->offset == x->want_offset)
+            x->offset = o->offset;
+        if (x->io.seek(x->io.ctx, x->offset, NULL) < 0)
+        {
+            xfer_fail(x, -1, "resuming at byte %llu failed", (unsigned long long)x->offset);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (!o || !(o->present & TFTP_OPT_OFFSET) || o->offset == 0)
+        return 0; // nothing kept, it all goes
+    // what the server kept has to be the start of our data
+    uint32_t sum = o->tailsum;
+    if (!(o->present & TFTP_OPT_TAILSUM) || x->io.seek(x->io.ctx, o->offset, &sum) < 0)
+    {
+        x->resume_failed = 1;
+        queue_error(x, TFTP_OPCODE_OPT_ERR, "resume point differs");
+        xfer_fail(x, -1, "the server's partial upload differs at byte %llu", (unsigned long long)o->offset);
+        return -1;
+    }
+    x->offset = o->offset;
+    return 0;
+}
+
+// an ERROR packet to the caller's error, its message isn't always terminated
+static void server_error(tftp_xfer_t *x, const unsigned char *p, size_t len)
+{
+    size_t msg_len = strnlen((const char *)p + 4, len - 4);
+
+    xfer_fail(x, (p[2] << 8) | p[3], "server responded with ERROR %d: %.*s", (p[2] << 8) | p[3], (int)msg_len,
+              (const char *)p + 4);
+}
+
+#ifdef TFTP_ZLIB
+static voidpf xfer_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    tftp_xfer_t *x = opaque;
+    size_t n = XFER_ALIGN((size_t)items * size);
+
+    if (n > x->zmem_left)
+        return Z_NULL;
+    voidpf p = x->zmem;
+    x->zmem += n;
+    x->zmem_left -= n;
+    return p;
+}
+
+// it all goes with the caller's memory
+static void xfer_zfree(voidpf opaque, voidpf p)
+{
+    (void)opaque, (void)p;
+}
+#endif
+
+// the server's answer to compress, zlib is set up in the caller's memory - -1 when the transfer failed
+static int compress_apply(tftp_xfer_t *x, const tftp_options_t *o)
+{
+    if (!x->asked_compress)
+        return 0;
+    x->asked_compress = 0;
+    if (!(o->present & TFTP_OPT_COMPRESS) || o->compress != TFTP_COMPRESS_DEFLATE)
+        return 0;
+#ifdef TFTP_ZLIB
+    z_stream *z = x->z;
+    memset(z, 0, sizeof(*z));
+    z->zalloc = xfer_zalloc;
+    z->zfree = xfer_zfree;
+    z->opaque = x;
+    if ((x->op == TFTP_OPCODE_RRQ ? inflateInit(z) : deflateInit(z, Z_DEFAULT_COMPRESSION)) != Z_OK)
+    {
+        queue_error(x, TFTP_OPCODE_OPT_ERR, "compress failed");
+        xfer_fail(x, -1, "setting up zlib failed");
+        return -1;
+    }
+    x->compress = 1;
+#endif
+    return 0;
+}
+
+/*
+    what the server agreed to in its OACK, options it left out keep their
+    defaults. returns -1 when the transfer can't go on with them
+*/
+static int oack_apply(tftp_xfer_t *x, const unsigned char *p, size_t len)
+{
+    tftp_options_t opts = {0};
+
+    if (tftp_parse_options((const char *)p + 2, len - 2, &opts) < 0)
+    {
+        return resume_apply(x, NULL);
+    }
+    if ((opts.present & TFTP_OPT_BLKSIZE) && opts.blksize <= x->asked_blksize)
+    {
+        x->blksize = opts.blksize;
+    }
+    if ((opts.present & TFTP_OPT_WINDOWSIZE) && opts.windowsize <= x->asked_windowsize)
+    {
+        x->windowsize = opts.windowsize;
+    }
+    if ((opts.present & TFTP_OPT_ROLLOVER) && x->asked_rollover)
+    {
+        x->rollover = opts.rollover;
+    }
+    if ((opts.present & TFTP_OPT_TIMEOUT) && opts.timeout == x->asked_timeout)
+    {
+        rtt_set_timeout(&x->rtt, (uint32_t)opts.timeout * 1000000); // both sides wait exactly that now
+    }
+    if (resume_apply(x, &opts) < 0)
+        return -1;
+    return compress_apply(x, &opts);
+}
+
+// a WRQ's window, where the zlib part starts
+static size_t window_size(int op, const tftp_xfer_opts_t *opts)
+{
+    size_t blksize = opts->blksize > 0 ? opts->blksize : TFTP_DATA_SIZE;
+    size_t windowsize = opts->windowsize > 0 ? opts->windowsize : 1;
+
+    if (op != TFTP_OPCODE_WRQ)
+        return 0;
+    return XFER_ALIGN(windowsize * (sizeof(uint64_t) + sizeof(uint32_t) + TFTP_HDR_SIZE + blksize));
+}
+
+size_t tftp_xfer_mem_size(int op, const tftp_xfer_opts_t *opts)
+{
+    size_t n = window_size(op, opts);
+
+#ifdef TFTP_ZLIB
+    if (opts->compress && (op == TFTP_OPCODE_RRQ || op == TFTP_OPCODE_WRQ))
+        n += XFER_ALIGN(sizeof(z_stream)) + XFER_ZBUF_SIZE +
+             (op == TFTP_OPCODE_WRQ ? XFER_DEFLATE_MEM : XFER_INFLATE_MEM);
+#endif
+    return n;
+}
+
+int tftp_xfer_start(tftp_xfer_t *x, int op, const char *filename, const char *mode, const tftp_xfer_opts_t *opts,
+                    const tftp_xfer_io_t *io, void *mem, size_t mem_len, uint64_t now_us)
+{
+    tftp_options_t req_opts = {0};
+    size_t off;
+
+    memset(x, 0, sizeof(*x));
+    x->op = op;
+    x->state = TFTP_XFER_RUNNING;
+    x->error_code = -1;
+    x->io = *io;
+    x->mem = mem;
+    x->mem_len = mem_len;
+    x->blksize = TFTP_DATA_SIZE;
+    x->windowsize = 1;
+    x->asked_blksize = opts->blksize > 0 ? opts->blksize : TFTP_DATA_SIZE;
+    x->asked_windowsize = opts->windowsize > 0 ? opts->windowsize : 1;
+    x->asked_rollover = opts->rollover == 1;
+    x->asked_timeout = op != TFTP_OPCODE_DEL ? opts->timeout : 0;
+    x->max_retries = opts->max_retries > 0 ? opts->max_retries : XFER_MAX_RETRIES;
+    x->expected = 1;
+    x->base = x->next = 1;
+
+    if (op != TFTP_OPCODE_RRQ && op != TFTP_OPCODE_WRQ && op != TFTP_OPCODE_DEL)
+    {
+        xfer_fail(x, -1, "unknown opcode %d", op);
+        return -1;
+    }
+    if (mem_len < tftp_xfer_mem_size(op, opts))
+    {
+        xfer_fail(x, -1, "memory too small, %zu bytes needed", tftp_xfer_mem_size(op, opts));
+        return -1;
+    }
+    if (opts->blksize && (opts->blksize < TFTP_BLKSIZE_MIN || opts->blksize > TFTP_BLKSIZE_MAX))
+    {
+        xfer_fail(x, -1, "blksize %d out of range", opts->blksize);
+        return -1;
+    }
+    if (opts->resume && !io->seek)
+    {
+        xfer_fail(x, -1, "resuming needs io.seek");
+        return -1;
+    }
+    // byte offsets only mean something in octet, an RRQ with nothing yet has nothing to resume
+    x->asked_offset = opts->resume && op != TFTP_OPCODE_DEL && str_casecmp(mode, "octet") == 0 &&
+                      (op == TFTP_OPCODE_WRQ || opts->offset > 0);
+#ifdef TFTP_ZLIB
+    // a byte offset into a zlib stream is nothing to go on from, resuming wins
+    x->asked_compress = opts->compress && op != TFTP_OPCODE_DEL && !x->asked_offset && str_casecmp(mode, "octet") == 0;
+    if (x->asked_compress)
+    {
+        char *z = (char *)mem + window_size(op, opts);
+        x->z = z;
+        x->zbuf = z + XFER_ALIGN(sizeof(z_stream));
+        x->zmem = x->zbuf + XFER_ZBUF_SIZE;
+        x->zmem_left = mem_len - (x->zmem - (char *)mem);
+    }
+#endif
+
+    // opcode, filename, mode - a DEL is parsed like an RRQ on the other side, mode and all
+    x->req[0] = 0;
+    x->req[1] = op;
+    off = 2 + strlen(filename) + 1;
+    if (off + strlen(mode) + 1 > sizeof(x->req))
+    {
+        xfer_fail(x, -1, "file name too long");
+        return -1;
+    }
+    memcpy(x->req + 2, filename, off - 2);
+    memcpy(x->req + off, mode, strlen(mode) + 1);
+    off += strlen(mode) + 1;
+
+    if (op != TFTP_OPCODE_DEL)
+    {
+        if (opts->blksize)
+        {
+            req_opts.present |= TFTP_OPT_BLKSIZE;
+            req_opts.blksize = opts->blksize;
+        }
+        if (opts->windowsize)
+        {
+            req_opts.present |= TFTP_OPT_WINDOWSIZE;
+            req_opts.windowsize = opts->windowsize;
+        }
+        if (opts->timeout)
+        {
+            req_opts.present |= TFTP_OPT_TIMEOUT;
+            req_opts.timeout = opts->timeout;
+        }
+        if (x->asked_rollover)
+        {
+            req_opts.present |= TFTP_OPT_ROLLOVER;
+            req_opts.rollover = 1;
+        }
+        if (op == TFTP_OPCODE_WRQ && opts->tsize >= 0)
+        {
+            // an upload's size lets the server reserve the space up front
+            req_opts.present |= TFTP_OPT_TSIZE;
+            req_opts.tsize = opts->tsize;
+        }
+        if (x->asked_compress)
+        {
+            req_opts.present |= TFTP_OPT_COMPRESS;
+            req_opts.compress = TFTP_COMPRESS_DEFLATE;
+        }
+        if (x->asked_offset)
+        {
+            // an RRQ says what it has, a WRQ asks what the server kept (offset 0)
+            req_opts.present |= TFTP_OPT_OFFSET;
+            if (op == TFTP_OPCODE_RRQ)
+            {
+                req_opts.present |= TFTP_OPT_TAILSUM;
+                req_opts.offset = x->want_offset = opts->offset;
+                req_opts.tailsum = opts->tailsum;
+            }
+        }
+        off = tftp_append_options(x->req, off, sizeof(x->req), &req_opts);
+    }
+    x->req_len = off;
+
+    // retransmits wait on the adaptive timer, or the timeout we asked for once the server takes it
+    rtt_init(&x->rtt, 0);
+    x->send_req = 1;
+    x->sent_us = now_us;
+    x->last_progress_us = now_us;
+    xfer_arm(x, now_us);
+    return 0;
+}
+
+// RRQ: a block's payload for the io, inflated when it's compressed - -1 when the io failed, -2 on a bad stream
+static int rrq_write(tftp_xfer_t *x, const char *buf, size_t len)
+{
+#ifdef TFTP_ZLIB
+    if (x->compress)
+    {
+        z_stream *z = x->z;
+
+        if (len && x->z_end)
+            return -2; // something after the end of the stream
+        z->next_in = (Bytef *)buf;
+        z->avail_in = len;
+        // a full out buffer can mean there's more to come out of what went in already
+        do
+        {
+            z->next_out = (Bytef *)x->zbuf;
+            z->avail_out = XFER_ZBUF_SIZE;
+            int ret = inflate(z, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END)
+                x->z_end = 1;
+            else if (ret != Z_OK && ret != Z_BUF_ERROR)
+                return -2;
+            size_t n = XFER_ZBUF_SIZE - z->avail_out;
+            if (n && x->io.write(x->io.ctx, x->zbuf, n) < 0)
+                return -1;
+            x->file_bytes += n;
+            if (ret == Z_BUF_ERROR)
+                break; // nothing more until the next block
+        } while (!x->z_end && (z->avail_in > 0 || z->avail_out == 0));
+        return x->z_end && z->avail_in > 0 ? -2 : 0;
+    }
+#endif
+    if (x->io.write(x->io.ctx, buf, len) < 0)
+        return -1;
+    x->file_bytes += len;
+    return 0;
+}
+
+// WRQ: the next block's payload from the io, deflated when compressing - fewer than len only at the end
+static ssize_t wrq_read(tftp_xfer_t *x, char *buf, size_t len)
+{
+#ifdef TFTP_ZLIB
+    if (x->compress)
+    {
+        z_stream *z = x->z;
+
+        z->next_out = (Bytef *)buf;
+        z->avail_out = len;
+        while (z->avail_out > 0 && !x->z_end)
+        {
+            if (z->avail_in == 0 && !x->z_in_end)
+            {
+                ssize_t n = x->io.read(x->io.ctx, x->zbuf, XFER_ZBUF_SIZE);
+                if (n < 0)
+                    return -1;
+                x->z_in_end = n < XFER_ZBUF_SIZE;
+                x->file_bytes += n;
+                z->next_in = (Bytef *)x->zbuf;
+                z->avail_in = n;
+            }
+            // once the io ran out it only gets finished, no more input
+            int ret = deflate(z, x->z_in_end ? Z_FINISH : Z_NO_FLUSH);
+            if (ret == Z_STREAM_END)
+                x->z_end = 1;
+            else if (ret != Z_OK && ret != Z_BUF_ERROR)
+                return -1;
+        }
+        return len - z->avail_out;
+    }
+#endif
+    ssize_t n = x->io.read(x->io.ctx, buf, len);
+    if (n > 0)
+        x->file_bytes += n;
+    return n;
+}
+
+/*
+    RFC 7440 receiver - only the last block of every window is ACKed,
+    a gap or a timeout re-ACKs the last block we have in order so the
+    server goes back to the one after it
+*/
+static int feed_rrq(tftp_xfer_t *x, const unsigned char *p, size_t len, int opcode, uint64_t now_us)
+{
+    if (opcode == TFTP_OPCODE_OACK)
+    {
+        if (x->expected > 1)
+            return TFTP_FEED_IGNORED; // a copy of the one we already answered
+
+        // options accepted, ACK 0 starts the data
+        if (oack_apply(x, p, len) < 0)
+            return TFTP_FEED_OK;
+        if (x->sent_us)
+            rtt_sample(&x->rtt, now_us - x->sent_us);
+        else
+            rtt_spurious(&x->rtt, now_us);
+        queue_ack(x, 0);
+        x->sent_us = now_us;
+        return TFTP_FEED_OK;
+    }
+    if (opcode != TFTP_OPCODE_DATA)
+    {
+        xfer_fail(x, -1, "unexpected packet opcode %d", opcode);
+        return TFTP_FEED_OK;
+    }
+
+    uint32_t block = tftp_block_seq(x->expected, (p[2] << 8) | p[3], x->rollover);
+    if (block != x->expected)
+    {
+        /*
+            a gap, or the server resent what we have because our ACK
+            got lost - ACK what we have once. old blocks while new ones
+            are still coming are copies (a duplicate, a window it went
+            back for), answering them would send it back again
+        */
+        if (!x->gap_acked && (block > x->expected || now_us - x->last_progress_us >= x->rtt.srtt_us))
+        {
+            x->gap_acked = 1;
+            queue_ack(x, x->expected - 1);
+            x->since_ack = 0;
+            x->sent_us = 0;
+        }
+        return TFTP_FEED_OK;
+    }
+    if (len - TFTP_HDR_SIZE > (size_t)x->blksize)
+    {
+        xfer_fail(x, -1, "block %u is bigger than the blksize", block);
+        return TFTP_FEED_OK;
+    }
+
+    // DATA 1 without an OACK, the server doesn't do options
+    if (resume_apply(x, NULL) < 0)
+        return TFTP_FEED_OK;
+
+    // the first block after our request / ACK times the round trip
+    if (x->sent_us && x->since_ack == 0)
+        rtt_sample(&x->rtt, now_us - x->sent_us);
+    else
+        rtt_spurious(&x->rtt, now_us);
+    x->sent_us = 0;
+    xfer_progress(x, now_us);
+
+    int wret = rrq_write(x, (const char *)p + TFTP_HDR_SIZE, len - TFTP_HDR_SIZE);
+    if (wret < 0)
+    {
+        if (wret == -2)
+            queue_error(x, 0, "bad compressed data"); // not defined, see message
+        xfer_fail(x, -1, wret == -2 ? "block %u isn't a valid zlib stream" : "writing block %u failed", block);
+        return TFTP_FEED_OK;
+    }
+    x->bytes += len - TFTP_HDR_SIZE;
+    x->expected++;
+    x->gap_acked = 0;
+
+    // the last block is the short one
+    int done = len < (size_t)(TFTP_HDR_SIZE + x->blksize);
+    if (done || ++x->since_ack >= x->windowsize)
+    {
+        queue_ack(x, block);
+        x->since_ack = 0;
+        x->sent_us = now_us;
+    }
+    if (done)
+    {
+        if (x->compress && !x->z_end)
+            xfer_fail(x, -1, "the compressed data ended early");
+        else if (x->io.end && x->io.end(x->io.ctx) < 0)
+            xfer_fail(x, -1, "finishing the file failed");
+        else
+            x->state = TFTP_XFER_DONE;
+    }
+    return TFTP_FEED_OK;
+}
+
+// reads blocks into the window until it's full or the data ran out
+static int fill_window(tftp_xfer_t *x)
+{
+    while (x->next < x->base + x->windowsize && !x->eof)
+    {
+        char *pkt = x->win + (x->next % x->windowsize) * x->slot_size;
+        ssize_t n = wrq_read(x, pkt + TFTP_HDR_SIZE, x->blksize);
+
+        if (n < 0)
+        {
+            xfer_fail(x, -1, "reading block %u failed", x->next);
+            return -1;
+        }
+        pkt[0] = 0;
+        pkt[1] = TFTP_OPCODE_DATA;
+        uint16_t wire = tftp_block_wire(x->next, x->rollover);
+        pkt[2] = (wire >> 8) & 0xFF;
+        pkt[3] = wire & 0xFF;
+        x->win_len[x->next % x->windowsize] = n + TFTP_HDR_SIZE;
+        x->bytes += n;
+
+        // Stop when last block is shorter than blksize
+        if (n < x->blksize)
+            x->eof = x->next;
+        x->next++;
+    }
+    return 0;
+}
+
+/*
+    RFC 7440 sender - blocks base..next-1 are in flight, at most
+    windowsize of them. an ACK for n slides the window past n,
+    a repeated ACK for base-1 (the server's last in-order block)
+    or a timeout goes back and resends from base
+*/
+static int feed_wrq(tftp_xfer_t *x, const unsigned char *p, size_t len, int opcode, uint64_t now_us, int first)
+{
+    if (first)
+    {
+        // an OACK instead of ACK 0 means the server took our options
+        if ((opcode == TFTP_OPCODE_OACK ? oack_apply(x, p, len) : resume_apply(x, NULL)) < 0)
+            return TFTP_FEED_OK;
+        if (x->sent_us)
+            rtt_sample(&x->rtt, now_us - x->sent_us);
+        else
+            rtt_spurious(&x->rtt, now_us);
+        xfer_progress(x, now_us);
+        x->base_moved_us = now_us;
+
+        // the window is laid out in the caller's memory for what was agreed
+        x->slot_size = TFTP_HDR_SIZE + x->blksize;
+        x->win_sent_us = x->mem;
+        x->win_len = (uint32_t *)(x->win_sent_us + x->windowsize);
+        x->win = (char *)(x->win_len + x->windowsize);
+        if (fill_window(x) == 0)
+            queue_blocks(x, x->base, x->next, x->base);
+        return TFTP_FEED_OK;
+    }
+
+    if (opcode != TFTP_OPCODE_ACK || len != 4)
+    {
+        return TFTP_FEED_IGNORED;
+    }
+
+    uint32_t acked = tftp_block_seq(x->base - 1, (p[2] << 8) | p[3], x->rollover);
+    if (acked < x->base - 1 || acked >= x->next)
+    {
+        return TFTP_FEED_IGNORED;
+    }
+    if (acked == x->base - 1)
+    {
+        // the server lost something, resend the window once - unless it's about copies of the last one
+        if (x->windowsize > 1 && !x->went_back && now_us - x->base_moved_us >= x->rtt.srtt_us / 2)
+        {
+            x->went_back = 1;
+            queue_blocks(x, x->base, x->next, x->next);
+        }
+        return TFTP_FEED_OK;
+    }
+
+    // time it if the block went out only once, and slide the window
+    if (x->win_sent_us[acked % x->windowsize])
+        rtt_sample(&x->rtt, now_us - x->win_sent_us[acked % x->windowsize]);
+    else
+        rtt_spurious(&x->rtt, now_us);
+    xfer_progress(x, now_us);
+    x->base = acked + 1;
+    x->went_back = 0;
+    x->base_moved_us = now_us;
+    if (x->eof && x->base > x->eof)
+    {
+        x->state = TFTP_XFER_DONE;
+        x->out_from = x->out_to; // nothing left worth sending
+        return TFTP_FEED_OK;
+    }
+
+    // an ACK short of the window's end is the server's last in-order block
+    uint32_t fresh = x->next;
+    if (fill_window(x) == 0)
+        queue_blocks(x, x->base < fresh ? x->base : fresh, x->next, fresh);
+    return TFTP_FEED_OK;
+}
+
+int tftp_xfer_feed(tftp_xfer_t *x, const void *pkt, size_t len, uint32_t peer, uint64_t now_us)
+{
+    const unsigned char *p = pkt;
+    int first = 0;
+    int ret;
+
+    if (x->state != TFTP_XFER_RUNNING || len < TFTP_HDR_SIZE || p[0] != 0)
+    {
+        return TFTP_FEED_IGNORED;
+    }
+    int opcode = p[1];
+
+    if (!x->peer_known)
+    {
+        // a late packet for the last transfer on this port isn't the server answering us
+        int starts = opcode == TFTP_OPCODE_ERROR;
+        if (x->op == TFTP_OPCODE_RRQ)
+            starts |= opcode == TFTP_OPCODE_OACK || (opcode == TFTP_OPCODE_DATA && p[2] == 0 && p[3] == 1);
+        else if (x->op == TFTP_OPCODE_WRQ)
+            starts |= opcode == TFTP_OPCODE_OACK || (opcode == TFTP_OPCODE_ACK && p[2] == 0 && p[3] == 0);
+        else
+            starts |= opcode == TFTP_OPCODE_ACK && p[2] == 0 && p[3] == 0;
+        if (!starts)
+            return TFTP_FEED_IGNORED;
+
+        x->peer = peer; // the server answers from the port of this transfer
+        x->peer_known = 1;
+        x->send_req = 0;
+        first = 1;
+    }
+    else if (peer != x->peer)
+    {
+        return TFTP_FEED_IGNORED;
+    }
+
+    if (opcode == TFTP_OPCODE_ERROR)
+    {
+        server_error(x, p, len);
+        return first ? TFTP_FEED_PEER : TFTP_FEED_OK;
+    }
+
+    if (x->op == TFTP_OPCODE_RRQ)
+    {
+        ret = feed_rrq(x, p, len, opcode, now_us);
+    }
+    else if (x->op == TFTP_OPCODE_WRQ)
+    {
+        ret = feed_wrq(x, p, len, opcode, now_us, first);
+    }
+    else
+    {
+        // only ACK 0 gets this far
+        x->state = TFTP_XFER_DONE;
+        ret = TFTP_FEED_OK;
+    }
+
+    if (ret == TFTP_FEED_OK)
+        xfer_arm(x, now_us);
+    return first ? TFTP_FEED_PEER : ret;
+}
+
+uint64_t tftp_xfer_wait_us(const tftp_xfer_t *x, uint64_t now_us)
+{
+    if (x->state != TFTP_XFER_RUNNING || now_us >= x->deadline_us)
+        return 0;
+    return x->deadline_us - now_us;
+}
+
+void tftp_xfer_timer(tftp_xfer_t *x, uint64_t now_us)
+{
+    if (x->state != TFTP_XFER_RUNNING || now_us < x->deadline_us)
+    {
+        return;
+    }
+    if (now_us - x->last_progress_us >= rtt_give_up_us(&x->rtt, x->max_retries))
+    {
+        if (!x->peer_known)
+            xfer_fail(x, -1, "no answer from the server");
+        else if (x->op == TFTP_OPCODE_RRQ)
+            xfer_fail(x, -1, "transfer stalled at block %u", x->expected);
+        else
+            xfer_fail(x, -1, "transfer stalled at block %u", x->base);
+        return;
+    }
+
+    // go back to what the server is missing, and wait longer next time
+    x->retransmits++;
+    rtt_backoff(&x->rtt, now_us);
+    if (!x->peer_known)
+    {
+        x->send_req = 1;
+        x->sent_us = 0;
+    }
+    else if (x->op == TFTP_OPCODE_RRQ)
+    {
+        queue_ack(x, x->expected - 1);
+        x->sent_us = 0;
+    }
+    else
+    {
+        queue_blocks(x, x->base, x->next, x->next);
+    }
+    xfer_arm(x, now_us);
+}
+
+size_t tftp_xfer_next(tftp_xfer_t *x, const void **pkt, uint64_t now_us)
+{
+    if (x->state == TFTP_XFER_FAILED)
+    {
+        size_t len = x->err_len;
+        x->err_len = 0;
+        *pkt = x->err_pkt;
+        return len;
+    }
+    if (x->send_req)
+    {
+        x->send_req = 0;
+        xfer_arm(x, now_us);
+        *pkt = x->req;
+        return x->req_len;
+    }
+    if (x->send_ack)
+    {
+        // ACK for the block's wire number
+        uint16_t wire = tftp_block_wire(x->ack_block, x->rollover);
+        x->send_ack = 0;
+        x->ack[0] = 0;
+        x->ack[1] = TFTP_OPCODE_ACK;
+        x->ack[2] = (wire >> 8) & 0xFF;
+        x->ack[3] = wire & 0xFF;
+        xfer_arm(x, now_us);
+        *pkt = x->ack;
+        return sizeof(x->ack);
+    }
+    if (x->out_from < x->out_to)
+    {
+        // a resend zeroes the block's time, its ACK can't tell which copy it answers (Karn's rule)
+        uint32_t seq = x->out_from++;
+        x->win_sent_us[seq % x->windowsize] = seq >= x->out_fresh ? now_us : 0;
+        xfer_arm(x, now_us);
+        *pkt = x->win + (seq % x->windowsize) * x->slot_size;
+        return x->win_len[seq % x->windowsize];
+    }
+    return 0;
+}
+
+static int file_write(void *ctx, const char *buf, size_t len)
+{
+    tftp_file_io_t *f = ctx;
+
+    // a block of zeros (a disk image's empty space) is skipped over, the file stays sparse
+    f->hole = !f->netascii && tftp_is_zero(buf, len) && fseeko(f->file, len, SEEK_CUR) == 0;
+    if (f->hole)
+        return 0;
+
+    size_t n = f->netascii ? write_netascii(f->file, &f->dec, buf, len) : fwrite(buf, 1, len, f->file);
+    return n == len ? 0 : -1;
+}
+
+static int file_end(void *ctx)
+{
+    tftp_file_io_t *f = ctx;
+
+    if (f->netascii)
+        return write_netascii_end(f->file, &f->dec);
+    // ending in a hole, the file is only as long as what was written so far
+    if (f->hole && (fflush(f->file) != 0 || ftruncate(fileno(f->file), ftello(f->file)) < 0))
+        return -1;
+    return 0;
+}
+
+// RRQ: the file is cut to where DATA 1 goes, WRQ: its bytes before off have to be the server's
+static int file_seek(void *ctx, uint64_t off, const uint32_t *sum)
+{
+    tftp_file_io_t *f = ctx;
+    uint32_t mine;
+
+    if (fflush(f->file) != 0)
+        return -1;
+    if (sum ? tftp_tail_sum(fileno(f->file), off, &mine) < 0 || mine != *sum : ftruncate(fileno(f->file), off) < 0)
+        return -1;
+    return fseeko(f->file, off, SEEK_SET) == 0 ? 0 : -1;
+}
+
+static ssize_t file_read(void *ctx, char *buf, size_t len)
+{
+    tftp_file_io_t *f = ctx;
+    size_t n = f->netascii ? read_netascii(f->file, &f->enc, buf, len) : fread(buf, 1, len, f->file);
+
+    return n < len && ferror(f->file) ? -1 : (ssize_t)n;
+}
+
+void tftp_file_io(tftp_xfer_io_t *io, tftp_file_io_t *f, FILE *file, int netascii)
+{
+    f->file = file;
+    f->netascii = netascii;
+    f->hole = 0;
+    f->enc = (netascii_enc_t)NETASCII_ENC_INIT; // a CR LF can straddle two blocks
+    f->dec = (netascii_dec_t)NETASCII_DEC_INIT;
+    io->write = file_write;
+    io->end = file_end;
+    io->read = file_read;
+    io->ctx = f;
+    io->seek = file_seek;
+}
+
+static int buf_write(void *ctx, const char *buf, size_t len)
+{
+    tftp_buf_io_t *b = ctx;
+
+    if (len > b->cap - b->len)
+        return -1;
+    memcpy(b->buf + b->len, buf, len);
+    b->len += len;
+    return 0;
+}
+
+static ssize_t buf_read(void *ctx, char *buf, size_t len)
+{
+    tftp_buf_io_t *b = ctx;
+
+    if (len > b->len - b->off)
+        len = b->len - b->off;
+    memcpy(buf, b->buf + b->off, len);
+    b->off += len;
+    return len;
+}
+
+static int buf_seek(void *ctx, uint64_t off, const uint32_t *sum)
+{
+    tftp_buf_io_t *b = ctx;
+
+    if (!sum)
+    {
+        if (off > b->len)
+            return -1;
+        b->len = off; // what the caller had before off stays
+        return 0;
+    }
+    uint64_t from = off > TFTP_TAIL_LEN ? off - TFTP_TAIL_LEN : 0;
+    if (off > b->len || tftp_crc32(0, b->buf + from, off - from) != *sum)
+        return -1;
+    b->off = off;
+    return 0;
+}
+
+void tftp_buf_io(tftp_xfer_io_t *io, tftp_buf_io_t *b, char *buf, size_t cap, size_t len)
+{
+    b->buf = buf;
+    b->cap = cap;
+    b->len = len;
+    b->off = 0;
+    io->write = buf_write;
+    io->end = NULL;
+    io->read = buf_read;
+    io->ctx = b;
+    io->seek = buf_seek;
+}
@@ -0,0 +1,203 @@
+#ifndef TFTP_XFER_H
+#define TFTP_XFER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../utils/tftp_utils.h"
+#include "../utils/tftp_rtt.h"
+
+/*
+    libtftp - the client side of RRQ, WRQ and DEL as a session object
+    that never touches a socket, a clock or the heap. the caller owns
+    the tftp_xfer_t (and the window memory of a WRQ), moves the packets
+    and passes the time in, so any number of transfers can share one
+    event loop:
+
+        tftp_xfer_start(&x, TFTP_OPCODE_RRQ, "cfg/host1", "octet", &opts, &io, NULL, 0, now);
+        while (x.state == TFTP_XFER_RUNNING)
+        {
+            while ((len = tftp_xfer_next(&x, &pkt, now)))
+                send pkt to the server (before TFTP_FEED_PEER) or the peer (after)
+            wait up to tftp_xfer_wait_us(&x, now) for a packet
+            tftp_xfer_feed(&x, buf, n, source port, now) for each one
+            tftp_xfer_timer(&x, now)
+        }
+        drain tftp_xfer_next once more - an RRQ ends with its last ACK queued,
+        a failed transfer may have an ERROR for the server
+
+    the file data goes through tftp_xfer_io_t, there are adapters for a
+    FILE and for a caller buffer below. blocks are RFC 7440 windows over
+    the RFC 2347 options, retransmits follow tftp_rtt.h.
+    built with zlib (TFTP_ZLIB, link -lz) a transfer can ask for
+    compress=deflate: the io still sees the file, the wire carries its
+    zlib stream, and zlib works in the caller's memory like the window
+*/
+
+typedef enum
+{
+    TFTP_XFER_RUNNING,
+    TFTP_XFER_DONE,
+    TFTP_XFER_FAILED
+} tftp_xfer_state_t;
+
+//tftp_xfer_feed results
+#define TFTP_FEED_IGNORED -1 // a stray, a copy or from someone else
+#define TFTP_FEED_OK 0
+#define TFTP_FEED_PEER 1     // the first reply - its source is where everything goes from now on
+
+//where the payload comes from / goes, ctx is passed back as is
+typedef struct
+{
+    //RRQ: the next block's payload in order, returns 0 or -1 to fail the transfer
+    int (*write)(void *ctx, const char *buf, size_t len);
+    //RRQ: after the last block, 0 or -1 - may be NULL
+    int (*end)(void *ctx);
+    //WRQ: fills up to len bytes, fewer only at the end of the data, -1 to fail the transfer
+    ssize_t (*read)(void *ctx, char *buf, size_t len);
+    void *ctx;
+    /*
+        opts.resume, once the server answered and before any read or write -
+        RRQ: the data goes on at off, 0 drops what the caller had. WRQ: the
+        server kept off bytes whose tftp_tail_sum is *sum, 0 if the caller's
+        are the same and its reads go on from off. -1 fails the transfer
+    */
+    int (*seek)(void *ctx, uint64_t off, const uint32_t *sum);
+} tftp_xfer_io_t;
+
+typedef struct
+{
+    int blksize;     // asked for (RFC 2348), 0 stays at 512
+    int windowsize;  // asked for (RFC 7440), 0 stays at 1
+    int timeout;     // seconds asked for (RFC 2349), the retransmit timeout once the server agrees - 0 leaves it out and adapts
+    long long tsize; // WRQ size announced (RFC 2349), -1 leaves it out
+    int max_retries; // timeouts in a row without progress before giving up, 0 means 5
+    int rollover;    // 1 asks for rollover=1 (block 65535 is followed by 1), 0 leaves it out - 0 follows
+    int resume;      // 1 goes on from an earlier transfer's end (octet, the offset option), needs io.seek
+    uint64_t offset; // RRQ resume: bytes the caller has already, 0 asks for nothing
+    uint32_t tailsum; // RRQ resume: tftp_tail_sum of them
+    int compress;    // 1 asks for compress=deflate (octet, not when resuming), 0 leaves it out
+} tftp_xfer_opts_t;
+
+typedef struct
+{
+    //for the caller to read
+    int op;                  // TFTP_OPCODE_RRQ, _WRQ or _DEL
+    tftp_xfer_state_t state;
+    int blksize;             // agreed with the server
+    int windowsize;
+    int rollover;            // the block after 65535 is 0 or 1
+    uint64_t offset;         // where DATA 1 is in the file, 0 unless the server agreed to resume
+    int resume_failed;       // WRQ: what the server kept differs from our data, go again without resume
+    uint64_t bytes;          // payload moved so far, from offset on
+    int compress;            // the server agreed, bytes is the zlib stream's
+    uint64_t file_bytes;     // what bytes are of the file - the same unless compressed
+    unsigned retransmits;    // timer expiries that resent something
+    int error_code;          // TFTP error code of the server's ERROR, -1 for anything else
+    char error[128];         // why it failed
+
+    //the engine's
+    tftp_xfer_io_t io;
+    tftp_rtt_t rtt;
+    int asked_blksize;
+    int asked_windowsize;
+    int asked_rollover;
+    int asked_timeout;
+    int asked_offset;        // resuming, the server's answer hasn't come yet
+    uint64_t want_offset;
+    int max_retries;
+    char req[TFTP_BUF_SIZE]; // the request, kept for resends
+    size_t req_len;
+    int send_req;            // the request is queued
+    int send_ack;            // an ACK for ack_block is queued
+    uint32_t ack_block;
+    unsigned char ack[4];
+    char err_pkt[32];        // an ERROR of ours, sent once after the transfer failed
+    size_t err_len;
+    int asked_compress;      // until the server's answer
+    void *z;                 // compress: the z_stream, in mem after the window
+    char *zbuf;              // ...file data on its way in (WRQ) or out (RRQ)
+    char *zmem;              // ...and what zlib allocates from
+    size_t zmem_left;
+    int z_in_end;            // WRQ: the io has no more
+    int z_end;               // the stream is complete
+    int peer_known;
+    uint32_t peer;
+    uint64_t deadline_us;      // when the timer fires
+    uint64_t last_progress_us;
+    uint64_t sent_us;          // when the request/ACK being waited on went out, 0 once resent
+    uint32_t expected;         // RRQ: next block in order
+    int since_ack;             // RRQ: blocks taken since the last ACK
+    int gap_acked;             // RRQ: this gap was answered already
+    uint32_t base, next, eof;  // WRQ: oldest unACKed block, next unread one, last one (0 = not read yet)
+    int went_back;             // WRQ: the window was resent for this base already
+    uint64_t base_moved_us;    // WRQ: when base last moved, a re-ACK within half an RTT is stale
+    uint32_t out_from, out_to; // WRQ: blocks queued to go out
+    uint32_t out_fresh;        // WRQ: blocks from here on go out for the first time
+    void *mem;                 // caller memory for the window and zlib
+    size_t mem_len;
+    uint64_t *win_sent_us;     // when each block in the window went out, 0 once resent
+    uint32_t *win_len;
+    char *win;                 // windowsize DATA packets of slot_size bytes
+    size_t slot_size;
+} tftp_xfer_t;
+
+/*
+    bytes of memory (uint64_t aligned) an op with opts needs - a WRQ's
+    window, and zlib's state when it asks for compress. 0 for an RRQ
+    that doesn't, and a DEL
+*/
+size_t tftp_xfer_mem_size(int op, const tftp_xfer_opts_t *opts);
+
+/*
+    starts a transfer - the request is the first packet tftp_xfer_next
+    hands out. mode is "octet" or "netascii", the io does any conversion.
+    mem/mem_len is tftp_xfer_mem_size(op, opts), NULL/0 when that's 0.
+    returns 0, or -1 with error set (bad op, name too long, mem too small)
+*/
+int tftp_xfer_start(tftp_xfer_t *x, int op, const char *filename, const char *mode, const tftp_xfer_opts_t *opts,
+                    const tftp_xfer_io_t *io, void *mem, size_t mem_len, uint64_t now_us);
+
+/*
+    one datagram that arrived for this transfer, peer identifies its
+    source (its port is the TID). returns one of TFTP_FEED_*
+*/
+int tftp_xfer_feed(tftp_xfer_t *x, const void *pkt, size_t len, uint32_t peer, uint64_t now_us);
+
+//how long the caller may wait for a packet before calling tftp_xfer_timer
+uint64_t tftp_xfer_wait_us(const tftp_xfer_t *x, uint64_t now_us);
+
+//runs the retransmit timer - queues a resend, or gives up, when it's due
+void tftp_xfer_timer(tftp_xfer_t *x, uint64_t now_us);
+
+//next packet to send, its length or 0 when there's none - *pkt is good until the next call
+size_t tftp_xfer_next(tftp_xfer_t *x, const void **pkt, uint64_t now_us);
+
+//payload to and from a FILE, netascii converted line endings on the way - octet zeros are written as holes
+typedef struct
+{
+    FILE *file;
+    int netascii;
+    netascii_enc_t enc;
+    netascii_dec_t dec;
+    int hole; // the last block was all zeros and skipped
+} tftp_file_io_t;
+
+void tftp_file_io(tftp_xfer_io_t *io, tftp_file_io_t *f, FILE *file, int netascii);
+
+/*
+    payload to and from caller memory as it is on the wire, an RRQ of more
+    than cap bytes fails. a resumed RRQ passes the bytes it has as len
+*/
+typedef struct
+{
+    char *buf;
+    size_t cap;
+    size_t len; // RRQ: received so far, WRQ: what there is to send
+    size_t off; // WRQ: handed out so far
+} tftp_buf_io_t;
+
+void tftp_buf_io(tftp_xfer_io_t *io, tftp_buf_io_t *b, char *buf, size_t cap, size_t len);
+
+#endif
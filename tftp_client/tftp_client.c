@@ -6,6 +6,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <netdb.h>
+#include <pthread.h>
 #include "tftp_client.h"
 
 volatile sig_atomic_t client_running = 1; // control+c handler for client
@@ -42,16 +44,385 @@ int is_text_file(const char *filename)
     return 1;
 }
 
+
+/*
+    command line mode - every get/put/del is a job, the workers take the
+    next one off the list and run it on a socket of its own, so -j jobs
+    transfers are in flight at once
+*/
+typedef enum
+{
+    JOB_GET,
+    JOB_PUT,
+    JOB_DEL
+} client_op_t;
+
+static const char *op_names[] = {"get", "put", "del"};
+
+typedef struct
+{
+    client_op_t op;
+    char remote[PATH_LENGTH];
+    char local[PATH_LENGTH];
+    const char *mode;
+    long long bytes; // -1 failed
+    double ms;
+} client_job_t;
+
+typedef struct
+{
+    struct sockaddr_in server;
+    client_job_t *jobs;
+    int count;
+    int next; // next job to hand out, under lock
+    int quiet;
+    pthread_mutex_t lock;
+} client_batch_t;
+
+static void run_job(client_batch_t *b, client_job_t *job)
+{
+    struct sockaddr_in client_addr;
+    uint64_t start = tftp_now_us();
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    int port = -1;
+
+    job->bytes = -1;
+    memset(&client_addr, 0, sizeof(client_addr));
+    client_addr.sin_family = AF_INET;
+    if (sockfd < 0 || (port = client_bind(sockfd, &client_addr)) < 0)
+    {
+        perror("Client socket");
+    }
+    else if (job->op == JOB_GET)
+    {
+        job->bytes = tftp_get(sockfd, &b->server, job->remote, job->local, job->mode);
+    }
+    else if (job->op == JOB_PUT)
+    {
+        job->bytes = tftp_put(sockfd, &b->server, job->local, job->remote, job->mode);
+    }
+    else
+    {
+        job->bytes = tftp_del(sockfd, &b->server, job->remote);
+    }
+    job->ms = (tftp_now_us() - start) / 1000.0;
+
+    client_release(port);
+    if (sockfd >= 0)
+        close(sockfd);
+
+    if (!b->quiet || job->bytes < 0)
+    {
+        pthread_mutex_lock(&b->lock);
+        printf("%-6s %s %s", job->bytes < 0 ? "FAILED" : "ok", op_names[job->op], job->remote);
+        if (job->bytes >= 0 && job->op != JOB_DEL)
+            printf(" %lld bytes %.1f ms", job->bytes, job->ms);
+        printf("\n");
+        fflush(stdout);
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+static void *batch_worker(void *arg)
+{
+    client_batch_t *b = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&b->lock);
+        int i = client_running && b->next < b->count ? b->next++ : -1;
+        pthread_mutex_unlock(&b->lock);
+        if (i < 0)
+            return NULL;
+        run_job(b, &b->jobs[i]);
+    }
+}
+
+// appends a job, local/remote default to each other's last path component
+static int add_job(client_job_t **jobs, int *count, int *cap, client_op_t op, const char *src, const char *dst, const char *mode)
+{
+    if (*count == *cap)
+    {
+        int n = *cap ? *cap * 2 : 16;
+        client_job_t *p = realloc(*jobs, n * sizeof(*p));
+        if (!p)
+        {
+            perror("realloc");
+            return -1;
+        }
+        *jobs = p;
+        *cap = n;
+    }
+
+    client_job_t *job = &(*jobs)[*count];
+    const char *base = strrchr(src, '/') ? strrchr(src, '/') + 1 : src;
+    const char *remote = op == JOB_PUT ? (dst ? dst : base) : src;
+    const char *local = op == JOB_PUT ? src : (dst ? dst : base);
+
+    if (!*base || strlen(remote) >= sizeof(job->remote) || strlen(local) >= sizeof(job->local))
+    {
+        fprintf(stderr, "Bad file name '%s'\n", src);
+        return -1;
+    }
+    memset(job, 0, sizeof(*job));
+    job->op = op;
+    strcpy(job->remote, remote);
+    strcpy(job->local, local);
+    job->mode = mode ? mode : get_mode(op == JOB_PUT ? local : remote);
+    (*count)++;
+    return 0;
+}
+
+static int parse_op(const char *s, client_op_t *op)
+{
+    for (int i = JOB_GET; i <= JOB_DEL; i++)
+    {
+        if (strcmp(s, op_names[i]) == 0)
+        {
+            *op = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+    a manifest has one job per line - "get REMOTE [LOCAL]", "put LOCAL [REMOTE]"
+    or "del REMOTE", blank lines and # comments are skipped
+*/
+static int read_manifest(const char *path, client_job_t **jobs, int *count, int *cap, const char *mode)
+{
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char line[PATH_LENGTH * 2 + 16];
+    int lineno = 0;
+    int ret = 0;
+
+    if (!f)
+    {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        char *verb, *src, *dst, *extra, *save;
+        client_op_t op;
+
+        lineno++;
+        line[strcspn(line, "#")] = '\0';
+        verb = strtok_r(line, " \t\r\n", &save);
+        if (!verb)
+            continue;
+        src = strtok_r(NULL, " \t\r\n", &save);
+        dst = strtok_r(NULL, " \t\r\n", &save);
+        extra = strtok_r(NULL, " \t\r\n", &save);
+        if (parse_op(verb, &op) < 0 || !src || extra || (op == JOB_DEL && dst))
+        {
+            fprintf(stderr, "%s:%d: expected get REMOTE [LOCAL], put LOCAL [REMOTE] or del REMOTE\n", path, lineno);
+            ret = -1;
+            break;
+        }
+        if (add_job(jobs, count, cap, op, src, dst, mode) < 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+    if (f != stdin)
+        fclose(f);
+    return ret;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s                     interactive menu\n", prog);
+    fprintf(stderr, "       %s [options] get|put|del file...\n", prog);
+    fprintf(stderr, "       %s [options] -f manifest\n", prog);
+    fprintf(stderr, "  -s  server host (default 127.0.0.1)\n");
+    fprintf(stderr, "  -p  server port (default %d)\n", TFTP_PORT);
+    fprintf(stderr, "  -m  octet or netascii for every file (default from the file extension)\n");
+    fprintf(stderr, "  -j  transfers run in parallel, each on its own socket (default 4)\n");
+    fprintf(stderr, "  -f  manifest of get REMOTE [LOCAL] / put LOCAL [REMOTE] / del REMOTE lines, - for stdin\n");
+    fprintf(stderr, "  -r  1 asks for block numbers to go on at 1 after 65535 instead of 0\n");
+    fprintf(stderr, "  -c  octet gets go on from the end of the local file and keep it when they fail,\n");
+    fprintf(stderr, "      puts go on from what the server kept of a failed one\n");
+    fprintf(stderr, "  -z  octet files cross the wire deflated (compress=deflate), if the server does it\n");
+    fprintf(stderr, "  -t  seconds both sides wait before a resend (timeout option, 1-255) - by default it adapts to the RTT\n");
+    fprintf(stderr, "  -q  print failures only\n");
+    fprintf(stderr, "  -v  print the transfers' progress too\n");
+    fprintf(stderr, "gets write to the current directory, a failed get leaves no file behind and an existing one as it was (unless -c)\n");
+}
+
+static int resolve(const char *host, int port, struct sockaddr_in *addr)
+{
+    struct addrinfo hints = {0}, *res;
+
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0)
+    {
+        fprintf(stderr, "Unknown host %s\n", host);
+        return -1;
+    }
+    *addr = *(struct sockaddr_in *)res->ai_addr;
+    addr->sin_port = htons(port);
+    freeaddrinfo(res);
+    return 0;
+}
+
+static int run_batch(int argc, char *argv[])
+{
+    const char *host = "127.0.0.1";
+    const char *manifest = NULL;
+    const char *mode = NULL;
+    int port = TFTP_PORT;
+    int nthreads = 4;
+    int quiet = 0;
+    int opt;
+
+    client_verbose = 0;
+    while ((opt = getopt(argc, argv, "s:p:m:j:f:r:t:czqvh")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'm':
+            mode = optarg;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'f':
+            manifest = optarg;
+            break;
+        case 'r':
+            client_rollover = atoi(optarg) == 1;
+            break;
+        case 'c':
+            client_resume = 1;
+            break;
+        case 'z':
+            client_compress = 1;
+            break;
+        case 't':
+            client_timeout = atoi(optarg);
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'v':
+            client_verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    client_op_t op = JOB_GET;
+    if (nthreads < 1 || port <= 0 || port > 65535 || client_timeout < 0 || client_timeout > 255 ||
+        (mode && strcmp(mode, "octet") != 0 && strcmp(mode, "netascii") != 0) ||
+        (manifest ? optind != argc : (argc - optind < 2 || parse_op(argv[optind], &op) < 0)))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    client_batch_t b = {0};
+    int cap = 0;
+    if (resolve(host, port, &b.server) < 0)
+        return 1;
+    if (manifest)
+    {
+        if (read_manifest(manifest, &b.jobs, &b.count, &cap, mode) < 0)
+        {
+            free(b.jobs);
+            return 1;
+        }
+    }
+    else
+    {
+        for (int i = optind + 1; i < argc; i++)
+        {
+            if (add_job(&b.jobs, &b.count, &cap, op, argv[i], NULL, mode) < 0)
+            {
+                free(b.jobs);
+                return 1;
+            }
+        }
+    }
+    b.quiet = quiet;
+    pthread_mutex_init(&b.lock, NULL);
+
+    setup_signal_handler();
+
+    if (nthreads > b.count)
+        nthreads = b.count;
+    pthread_t *tids = calloc(nthreads ? nthreads : 1, sizeof(*tids));
+    if (!tids)
+    {
+        perror("calloc");
+        free(b.jobs);
+        return 1;
+    }
+
+    uint64_t start = tftp_now_us();
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&tids[i], NULL, batch_worker, &b);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+    double secs = (tftp_now_us() - start) / 1e6;
+
+    int failed = 0, done = 0;
+    long long bytes = 0;
+    for (int i = 0; i < b.count; i++)
+    {
+        if (b.jobs[i].bytes < 0)
+        {
+            failed++;
+        }
+        else if (b.jobs[i].op != JOB_DEL)
+        {
+            bytes += b.jobs[i].bytes;
+        }
+    }
+    done = b.next; // an interrupted run doesn't start what's left
+    failed += b.count - done;
+
+    if (!quiet || failed)
+    {
+        printf("%d of %d transfers ok, %lld bytes in %.2f s", b.count - failed, b.count, bytes, secs);
+        if (secs > 0 && bytes)
+            printf(" (%.2f MB/s)", bytes / 1e6 / secs);
+        printf("\n");
+    }
+
+    pthread_mutex_destroy(&b.lock);
+    free(tids);
+    free(b.jobs);
+    return failed ? 2 : 0;
+}
+
 // Main function for the TFTP client
-int main()
+int main(int argc, char *argv[])
 {
     const char *client_ip = "127.0.0.1"; // loopback, same goes for server
     char ip_add[60];
     char filename[256];
     int sockfd;
+    int port;
     struct sockaddr_in client_addr;
     struct sockaddr_in server_addr;
 
+    // any argument means no menu
+    if (argc > 1)
+    {
+        return run_batch(argc, argv);
+    }
 
     if (!dir_exist(TFTP_CLIENT_DIR))
     {
@@ -72,12 +443,9 @@ int main()
         exit(EXIT_FAILURE);
     }
 
-    srand(time(NULL)); // for randomizing each port
-
     // client address setup
     memset(&client_addr, 0, sizeof(client_addr));
     client_addr.sin_family = AF_INET;
-    set_client_port(&client_addr);
 
     //server address setup manual
     memset(&server_addr, 0, sizeof(server_addr));
@@ -85,15 +453,15 @@ int main()
     server_addr.sin_port = htons(TFTP_PORT);
     inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
 
-    if (bind(sockfd, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0)
+    port = client_bind(sockfd, &client_addr);
+    if (port < 0)
     {
         perror("Client bind failed");
-        release_port(ntohs(client_addr.sin_port)); // if bind fails, just to make sure to release it
         exit(EXIT_FAILURE);
     }
 
     // telling which port are being used
-    printf("Client address set with port %d\n", ntohs(client_addr.sin_port));
+    printf("Client address set with port %d\n", port);
 
     // setting up signal for sigint
     setup_signal_handler();
@@ -127,7 +495,7 @@ int main()
         {
             printf("Invalid choice, try again.\n");
             continue;
-        }        
+        }
 
         switch (choice)
         {
@@ -141,7 +509,7 @@ int main()
             del_h(sockfd, &server_addr);
             break;
         case 4:
-            printf("Exiting and freeing port... %d\n", ntohs(client_addr.sin_port));
+            printf("Exiting and freeing port... %d\n", port);
             client_running = 0; // STOP the loop
             break;
         default:
@@ -150,7 +518,7 @@ int main()
         }
     }
     // Close the socket and release port
-    release_port(ntohs(client_addr.sin_port));
+    client_release(port);
 
     close(sockfd);
     return 0;
@@ -5,7 +5,14 @@
 
 #include "tftp_client_handlers.h"
 
-#define MAX_PORTS 10
+//the client's own port range, the kernel picks one when it's all taken
+#define CLIENT_PORT_FIRST 6970
+#define CLIENT_PORTS 10
 #define MAX_RETRIES 5
 
+//blksize asked for in every RRQ/WRQ, sized for a 1500 byte MTU
+#define TFTP_CLIENT_BLKSIZE 1428
+//windowsize asked for (RFC 7440), blocks in flight per ACK
+#define TFTP_CLIENT_WINDOWSIZE 16
+
 #endif
@@ -7,84 +7,243 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <poll.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "tftp_client_handlers.h"
 #include "tftp_client.h"
+#include "../libtftp/tftp_xfer.h"
 
-// for stabling multi-threading
-int ports[MAX_PORTS] = {6970, 6971, 6972, 6973, 6974, 6975, 6976, 6977, 6978, 6979};
-int used[MAX_PORTS] = {0};
+int client_verbose = 1;
+int client_rollover;
+int client_resume;
+int client_compress;
+int client_timeout;
 
 /*
-    ports functions,
-    one is a randomizer,
-    one is a setter,
-    one is a releaser
+    client ports - a transfer binds one of CLIENT_PORT_FIRST .. +CLIENT_PORTS-1
+    so a firewall only has to open those, the cursor spreads them out.
+    when they're all taken, by us or by something else on the host, the
+    kernel picks an ephemeral port instead. the lock makes it safe from
+    the batch threads
 */
-int get_next_port()
+static pthread_mutex_t ports_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ports_used[CLIENT_PORTS];
+static int ports_next;
+
+int client_bind(int sockfd, struct sockaddr_in *client_addr)
 {
-    int available_ports[MAX_PORTS];
-    int count = 0;
+    socklen_t len = sizeof(*client_addr);
 
-    for (int i = 0; i < MAX_PORTS; i++)
+    pthread_mutex_lock(&ports_lock);
+    for (int i = 0; i < CLIENT_PORTS; i++)
     {
-        if (!used[i])
+        int slot = (ports_next + i) % CLIENT_PORTS;
+        if (ports_used[slot])
+            continue;
+        client_addr->sin_port = htons(CLIENT_PORT_FIRST + slot);
+        if (bind(sockfd, (struct sockaddr *)client_addr, sizeof(*client_addr)) == 0)
         {
-            available_ports[count++] = i;
+            ports_used[slot] = 1;
+            ports_next = slot + 1;
+            pthread_mutex_unlock(&ports_lock);
+            return CLIENT_PORT_FIRST + slot;
         }
+        if (errno != EADDRINUSE)
+            break;
     }
-    if (count == 0)
+    pthread_mutex_unlock(&ports_lock);
+
+    client_addr->sin_port = 0;
+    if (bind(sockfd, (struct sockaddr *)client_addr, sizeof(*client_addr)) < 0 ||
+        getsockname(sockfd, (struct sockaddr *)client_addr, &len) < 0)
     {
-        return -1; // no ports available
+        return -1;
     }
-    // pick random index from available ports
-    int rand_index = available_ports[rand() % count];
-    used[rand_index] = 1;
-    return ports[rand_index];
+    return ntohs(client_addr->sin_port);
+}
+
+void client_release(int port)
+{
+    // the kernel's ports aren't ours to track
+    if (port < CLIENT_PORT_FIRST || port >= CLIENT_PORT_FIRST + CLIENT_PORTS)
+        return;
+    pthread_mutex_lock(&ports_lock);
+    ports_used[port - CLIENT_PORT_FIRST] = 0;
+    pthread_mutex_unlock(&ports_lock);
 }
 
-void set_client_port(struct sockaddr_in *client_addr)
+/*
+    runs x to the end on sockfd, the blocking way - libtftp does the
+    protocol, this only moves its packets and keeps the clock.
+    returns 0 or -1, the reason printed against name
+*/
+static int run_xfer(int sockfd, const struct sockaddr_in *server_addr, tftp_xfer_t *x, const char *name)
 {
-    int port = get_next_port();
-    if (port == -1)
+    struct sockaddr_in peer = *server_addr; // becomes the server's TID after the first reply
+    char buffer[TFTP_HDR_SIZE + TFTP_CLIENT_BLKSIZE]; // the blksize we ask for, the server can only go lower
+    unsigned retransmits = 0;
+    const void *pkt;
+    size_t len;
+
+    for (;;)
+    {
+        while ((len = tftp_xfer_next(x, &pkt, tftp_now_us())) > 0)
+        {
+            if (sendto(sockfd, pkt, len, 0, (struct sockaddr *)&peer, sizeof(peer)) < 0)
+            {
+                perror("sendto failed");
+                return -1;
+            }
+        }
+        if (x->state != TFTP_XFER_RUNNING)
+        {
+            break;
+        }
+        if (client_verbose && x->retransmits != retransmits)
+        {
+            retransmits = x->retransmits;
+            fprintf(stderr, "Timeout, resent (%u, next in %u ms)...\n", retransmits, rtt_timeout_us(&x->rtt) / 1000);
+        }
+
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        int ready = poll(&pfd, 1, (tftp_xfer_wait_us(x, tftp_now_us()) + 999) / 1000);
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("poll failed");
+            return -1;
+        }
+        if (ready > 0)
+        {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            ssize_t n = recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &from_len);
+            if (n < 0)
+            {
+                perror("recvfrom failed");
+                return -1;
+            }
+            if (tftp_xfer_feed(x, buffer, n, ntohs(from.sin_port), tftp_now_us()) == TFTP_FEED_PEER)
+            {
+                peer = from;
+                if (client_verbose && x->op != TFTP_OPCODE_DEL && x->state == TFTP_XFER_RUNNING)
+                    printf("Using block size %d, window %d\n", x->blksize, x->windowsize);
+            }
+        }
+        tftp_xfer_timer(x, tftp_now_us());
+    }
+
+    if (x->state == TFTP_XFER_FAILED)
     {
-        printf("No available ports\n");
-        exit(EXIT_FAILURE);
+        fprintf(stderr, "%s: %s\n", name, x->error);
+        return -1;
     }
-    client_addr->sin_port = htons(port);
-    printf("Client using port %d\n", port);
+    return 0;
+}
+
+// what every RRQ/WRQ asks for
+static void client_opts(tftp_xfer_opts_t *opts, long long tsize)
+{
+    opts->blksize = TFTP_CLIENT_BLKSIZE;
+    opts->windowsize = TFTP_CLIENT_WINDOWSIZE;
+    opts->timeout = client_timeout;
+    opts->tsize = tsize;
+    opts->max_retries = MAX_RETRIES;
+    opts->rollover = client_rollover;
+    opts->resume = 0;
+    opts->offset = 0;
+    opts->tailsum = 0;
+    opts->compress = client_compress;
 }
 
-void release_port(int port)
+static void print_compressed(const tftp_xfer_t *x)
 {
-    for (int i = 0; i < MAX_PORTS; i++)
+    if (client_verbose && x->compress)
+        printf("Compressed: %llu bytes on the wire for %llu of the file\n", (unsigned long long)x->bytes,
+               (unsigned long long)x->file_bytes);
+}
+
+long long tftp_put(int sockfd, const struct sockaddr_in *server_addr, const char *local, const char *remote, const char *mode)
+{
+    tftp_xfer_t x;
+    tftp_xfer_opts_t opts;
+    tftp_xfer_io_t io;
+    tftp_file_io_t fio;
+    void *win; // the window's packets and zlib, sized for what we ask for
+    FILE *file;
+
+    /*
+        read binary either way, for netascii read_netascii does the
+        CRLF conversion itself block by block
+    */
+    file = fopen(local, "rb");
+    if (!file)
     {
-        if (ports[i] == port)
-        {                // find the port in the ports array
-            used[i] = 0; // port available if value = 1 used
-            printf("Port %d released\n", port);
-            return; // return when released the port
+        perror(local);
+        return -1;
+    }
+
+    // Get file size, disk images go past what a long holds on 32 bit
+    struct stat st;
+    if (fstat(fileno(file), &st) < 0)
+    {
+        perror(local);
+        fclose(file);
+        return -1;
+    }
+    long long file_size = st.st_size;
+
+    if (client_verbose)
+        printf("file size is %lld\n", file_size);
+
+    client_opts(&opts, file_size);
+    win = malloc(tftp_xfer_mem_size(TFTP_OPCODE_WRQ, &opts));
+    if (!win)
+    {
+        perror("malloc");
+        fclose(file);
+        return -1;
+    }
+
+    // a put the server turns down to resume (its partial upload differs) goes again in full
+    opts.resume = client_resume && str_casecmp(mode, "octet") == 0;
+    int ret;
+    for (;;)
+    {
+        tftp_file_io(&io, &fio, file, str_casecmp(mode, "netascii") == 0);
+        ret = tftp_xfer_start(&x, TFTP_OPCODE_WRQ, remote, mode, &opts, &io, win, tftp_xfer_mem_size(TFTP_OPCODE_WRQ, &opts), tftp_now_us());
+        if (ret < 0)
+        {
+            fprintf(stderr, "%s: %s\n", remote, x.error);
+            break;
         }
+        if (client_verbose)
+            printf("WRQ attempt for file '%s' in '%s' mode\n", remote, mode);
+        ret = run_xfer(sockfd, server_addr, &x, remote);
+        if (ret == 0 || !x.resume_failed || fseeko(file, 0, SEEK_SET) != 0)
+            break;
+        opts.resume = 0;
     }
-    printf("Port %d not found in used list\n", port);
+    if (ret == 0 && client_verbose && x.offset)
+        printf("Resumed at byte %llu\n", (unsigned long long)x.offset);
+    if (ret == 0)
+        print_compressed(&x);
+
+    free(win);
+    fclose(file);
+    return ret < 0 ? -1 : file_size - (long long)x.offset;
 }
 
 // WRQ client handler
 void wrq_h(int sockfd, struct sockaddr_in *server_addr, char *filename, const char *mode)
 {
-    socklen_t server_len = sizeof(*server_addr);
-    char buffer[TFTP_BUF_SIZE];
     char filepath[PATH_LENGTH];
     int c;
     char answer;
-    uint16_t block_n = 1;
-    ssize_t sent_len;
-    ssize_t recv_len;
-    ssize_t bytes_read = 0;
     FILE *file;
-    unsigned char ack_buf[4]; // Separate buffer for ACKs
 
     printf("Do you want to create a new file (y/n)? ");
     scanf(" %c", &answer);
@@ -113,22 +272,14 @@ void wrq_h(int sockfd, struct sockaddr_in *server_addr, char *filename, const ch
 
         printf("Enter content for the file (Ctrl+D to end input):\n");
         char line[256];
+        netascii_dec_t dec = NETASCII_DEC_INIT;
         while (fgets(line, sizeof(line), stdin))
         {
-            write_netascii(file, line, strlen(line));
+            write_netascii(file, &dec, line, strlen(line));
         }
+        write_netascii_end(file, &dec);
         fclose(file);
 
-        /*in order to open the file again to check if it has been created successfully*/
-        file = NULL;
-
-        file = fopen(filepath, "rb");
-        if (!file)
-        {
-            perror("Error re-opening file for reading");
-            return;
-        }
-
         if (feof(stdin))
         {
             while ((c = getchar()) != '\n' && c != EOF);
@@ -149,20 +300,11 @@ void wrq_h(int sockfd, struct sockaddr_in *server_addr, char *filename, const ch
             To check whether it's an octet or netascii
             via the file extension, automoatic checkup
         */
-
-        file = fopen(filepath, "rb");
-        if (!file)
-        {
-            perror("Error reading file");
-            return;
-        }
-
         mode = get_mode(filename);
 
         if (strcmp(mode, "netascii") && strcmp(mode, "octet") != 0)
         {
             fprintf(stderr, "Unsupported mode %s\n", mode);
-            fclose(file);
             return;
         }
     }
@@ -176,139 +318,133 @@ void wrq_h(int sockfd, struct sockaddr_in *server_addr, char *filename, const ch
         return;
     }
 
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    printf("file size is %ld\n", file_size);
-
-    // wrq packet preperation
-    memset(buffer, 0, sizeof(buffer)); // clearing the buffer
-    uint16_t opcode = htons(TFTP_OPCODE_WRQ);
-    memcpy(buffer, &opcode, sizeof(opcode));
-    strcpy(buffer + 2, filename);
-    strcpy(buffer + 2 + strlen(filename) + 1, mode);
-
-    printf("WRQ attempt for file '%s' in '%s' mode\n", filename, mode);
-
-    // Set socket receive timeout (5 seconds)
-    struct timeval tv = {5, 0};
-    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+    if (tftp_put(sockfd, server_addr, filepath, filename, mode) >= 0)
     {
-        perror("setsockopt failed");
-        // continue anyways, not fatal
+        printf("File %s sent Successfully!\n", filename);
     }
+}
 
-    sent_len = sendto(sockfd, buffer, 2 + strlen(filename) + 1 + strlen(mode) + 1, 0,
-                      (struct sockaddr *)server_addr, server_len);
-    if (sent_len < 0)
-    {
-        perror("Error sending WRQ\n");
-        return;
-    }
+// a get lands next to its target under this name, a rename across directories could cross filesystems
+static void get_tmp_name(char *tmp, size_t size, const char *path)
+{
+    static atomic_uint seq; // the batch threads get names of their own
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? (int)(slash - path + 1) : 0;
+
+    snprintf(tmp, size, "%.*s.%s.%d.%u.part", dir_len, path, path + dir_len, (int)getpid(), atomic_fetch_add(&seq, 1));
+}
 
-    recv_len = recvfrom(sockfd, ack_buf, sizeof(ack_buf), 0,
-                        (struct sockaddr *)server_addr, &server_len);
-    if (recv_len < 0)
+long long tftp_get(int sockfd, const struct sockaddr_in *server_addr, const char *remote, const char *local, const char *mode)
+{
+    tftp_xfer_t x;
+    tftp_xfer_opts_t opts;
+    tftp_xfer_io_t io;
+    tftp_file_io_t fio;
+    long long total = -1;
+    void *mem = NULL; // zlib's, when compressing
+    char tmp[2 * PATH_LENGTH + 32] = ""; // without resume the file arrives here, local is only replaced once it's all there
+    FILE *file;
+
+    if (strcmp(mode, "netascii") != 0 && strcmp(mode, "octet") != 0)
     {
-        perror("Error Receiving ACK\n");
-        return;
+        fprintf(stderr, "Invalid mode :%s\n", mode);
+        return -1;
     }
-
-    do
+    client_opts(&opts, -1);
+    opts.resume = client_resume && strcmp(mode, "octet") == 0;
+    if (opts.resume)
     {
-        // Read the next block of data
-        if (str_casecmp(mode, "netascii") == 0)
-            bytes_read = read_netascii(file, buffer + 4, TFTP_DATA_SIZE);
-        else
-            bytes_read = read_octet(file, buffer + 4, TFTP_DATA_SIZE);
-
-        // Build the DATA packet
-        buffer[0] = 0;
-        buffer[1] = TFTP_OPCODE_DATA;
-        buffer[2] = (block_n >> 8) & 0xFF;
-        buffer[3] = block_n & 0xFF;
-
-        int retries = 0;
-
-        while (retries < MAX_RETRIES)
+        // what's there already is kept until the server says whether it has the same
+        int fd = open(local, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        struct stat st;
+        file = fd >= 0 ? fdopen(fd, "r+b") : NULL;
+        if (file && (fstat(fd, &st) < 0 || tftp_tail_sum(fd, st.st_size, &opts.tailsum) < 0))
         {
-            // Send the DATA packet
-            sent_len = sendto(sockfd, buffer, bytes_read + 4, 0,
-                              (struct sockaddr *)server_addr, server_len);
-            if (sent_len < 0)
-            {
-                perror("sendto failed");
-                fclose(file);
-                return;
-            }
-
-            // Wait for ACK
-            recv_len = recvfrom(sockfd, ack_buf, sizeof(ack_buf), 0,
-                                (struct sockaddr *)server_addr, &server_len);
-
-            if (recv_len < 0)
-            {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                {
-                    // Timeout — retry sending the same data
-                    retries++;
-                    fprintf(stderr, "Timeout waiting for ACK for block %d. Retrying (%d/%d)...\n",
-                            block_n, retries, MAX_RETRIES);
-                    continue;
-                }
-                else
-                {
-                    perror("recvfrom failed");
-                    fclose(file);
-                    return;
-                }
-            }
-
-            // Check if it's a valid ACK
-            if (recv_len == 4 && ack_buf[0] == 0 && ack_buf[1] == TFTP_OPCODE_ACK)
-            {
-                uint16_t ack_block = (ack_buf[2] << 8) | ack_buf[3];
-                if (ack_block == block_n)
-                {
-                    // Valid ACK received
-                    break;
-                }
-                else
-                {
-                    fprintf(stderr, "Received ACK for unexpected block %d (expected %d). Ignoring...\n", ack_block, block_n);
-                }
-            }
-
-            // If we get here, either bad ack or wrong block number
-            retries++;
+            fclose(file);
+            file = NULL;
         }
-
-        if (retries >= MAX_RETRIES)
+        else if (file)
         {
-            fprintf(stderr, "Max retries reached for block %d. Aborting transfer.\n", block_n);
-            fclose(file);
-            return;
+            opts.offset = st.st_size;
+        }
+        else if (fd >= 0)
+        {
+            close(fd);
         }
+    }
+    else
+    {
+        get_tmp_name(tmp, sizeof(tmp), local);
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+        if (!file && fd >= 0)
+            close(fd);
+    }
+    if (!file)
+    {
+        perror(*tmp ? tmp : local);
+        return -1;
+    }
 
-        // Proceed to next block
-        block_n++;
+    size_t mem_len = tftp_xfer_mem_size(TFTP_OPCODE_RRQ, &opts);
+    if (mem_len && !(mem = malloc(mem_len)))
+    {
+        perror("malloc");
+        fclose(file);
+        if (*tmp)
+            unlink(tmp);
+        return -1;
+    }
 
-    } while (bytes_read == TFTP_DATA_SIZE); // Stop when last block is less than 512 bytes
+    tftp_file_io(&io, &fio, file, str_casecmp(mode, "netascii") == 0);
+    int ret = tftp_xfer_start(&x, TFTP_OPCODE_RRQ, remote, mode, &opts, &io, mem, mem_len, tftp_now_us());
+    if (ret == 0)
+    {
+        if (client_verbose)
+            printf("Sent RRQ for file '%s' in '%s' mode\n", remote, mode);
+        ret = run_xfer(sockfd, server_addr, &x, remote);
+    }
+    else
+    {
+        fprintf(stderr, "%s: %s\n", remote, x.error);
+    }
 
-    fclose(file);
-    printf("File %s sent Successfully!\n", filename);
+    if (ret == 0 && client_verbose)
+    {
+        if (x.offset)
+            printf("Resumed at byte %llu\n", (unsigned long long)x.offset);
+        printf("Received all %u blocks\n", x.expected - 1);
+        print_compressed(&x);
+    }
+    if (ret == 0)
+        total = ftello(file) - (long long)x.offset;
+    // a resumable get keeps what it has, unless that's nothing at all
+    struct stat st;
+    int keep = opts.resume && fflush(file) == 0 && fstat(fileno(file), &st) == 0 && st.st_size > 0;
+    free(mem);
+    if (fclose(file) != 0)
+        ret = -1;
+    if (ret == 0 && *tmp && rename(tmp, local) < 0)
+    {
+        perror(local);
+        ret = -1;
+    }
+    if (ret < 0)
+    {
+        // half a file is worse than none for whoever runs us from a script, what was at local stays
+        if (*tmp)
+            unlink(tmp);
+        else if (!keep)
+            unlink(local);
+        return -1;
+    }
+    return total;
 }
 
 // Function to handle RRQ (Read Request)
 void rrq_h(int sockfd, struct sockaddr_in *server_addr, char *filename, const char *mode)
 {
-    socklen_t src_len = sizeof(*server_addr);
-    char buffer[TFTP_BUF_SIZE];
-    FILE *file;
     char filepath[PATH_LENGTH];
-    ssize_t bytes_sent;
     int ch; // buffer-cleaner helper var
 
     printf("Enter the filename to download (netascii/octet): ");
@@ -328,196 +464,49 @@ void rrq_h(int sockfd, struct sockaddr_in *server_addr, char *filename, const ch
 
     snprintf(filepath, sizeof(filepath), "%s/%s", TFTP_CLIENT_DIR, filename);
 
-    if (strcmp(mode, "netascii") == 0 || strcmp(mode, "octet") == 0)
-    {
-        file = fopen(filepath, "wb");
-        {
-            if (!file)
-            {
-                perror("Error opening file to write");
-                return;
-            }
-        }
-    }
-    else
-    {
-        fprintf(stderr, "Invalid mode :%s\n", mode);
-        return;
-    }
-
     // Clear stdin buffer
     while ((ch = getchar()) != '\n' && ch != EOF)
         ;
 
-    // Prepare RRQ packet
-    memset(buffer, 0, sizeof(buffer)); // clearing the buffer
-    uint16_t opcode = htons(TFTP_OPCODE_RRQ);
-    memcpy(buffer, &opcode, sizeof(opcode));
-    strcpy(buffer + 2, filename);
-    strcpy(buffer + 2 + strlen(filename) + 1, mode);
-
-    bytes_sent = sendto(sockfd, buffer, 2 + strlen(filename) + 1 + strlen(mode) + 1, 0,
-                        (struct sockaddr *)server_addr, src_len);
-    if (bytes_sent < 0)
+    if (tftp_get(sockfd, server_addr, filename, filepath, mode) < 0)
     {
-        perror("Error sending RRQ");
         return;
     }
+    printf("File %s has been downloaded successfully!\n", filename);
 
-    printf("Sent RRQ for file '%s' in '%s' mode\n", filename, mode);
-
-    // Set socket receive timeout (5 seconds)
-    struct timeval tv = {5, 0};
-    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
-    {
-        perror("setsockopt failed");
-        // continue anyways, not fatal
-    }
-
-    uint16_t expected_block = 1;
-    uint16_t last_ack_block = 0;
+    // print or execute
+    handle_user_action(filename, mode, TFTP_CLIENT_DIR);
+}
 
-    while (1)
+int tftp_del(int sockfd, const struct sockaddr_in *server_addr, const char *remote)
+{
+    tftp_xfer_t x;
+    tftp_xfer_opts_t opts = {0};
+    tftp_xfer_io_t io = {0};
+
+    // resent on a timeout like the rest - a lost ACK turns into a "doesn't exist" then
+    opts.timeout = client_timeout;
+    opts.max_retries = MAX_RETRIES;
+    if (tftp_xfer_start(&x, TFTP_OPCODE_DEL, remote, "octet", &opts, &io, NULL, 0, tftp_now_us()) < 0)
     {
-        ssize_t recv_len = recvfrom(sockfd, buffer, sizeof(buffer), 0,
-                                    (struct sockaddr *)server_addr, &src_len);
-        if (recv_len < 0)
-        {
-            perror("recvfrom failed or timed out");
-            break;
-        }
-        if (recv_len < 4)
-        {
-            fprintf(stderr, "Invalid packet received\n");
-            continue;
-        }
-
-        uint16_t recv_opcode = (buffer[0] << 8) | buffer[1];
-        if (recv_opcode != TFTP_OPCODE_DATA)
-        {
-            fprintf(stderr, "Unexpected packet opcode: %d\n", recv_opcode);
-            break;
-        }
-
-        uint16_t block_num = ((uint16_t)(uint8_t)buffer[2] << 8) | (uint16_t)(uint8_t)buffer[3];
-        printf("Received DATA block %d, %zd bytes\n", block_num, recv_len - 4);
-
-        if (block_num == expected_block)
-        {
-            printf("MATCHING BLOCK NUM\n");
-            // Open file on first data block received
-
-            // Write data payload
-            fwrite(buffer + 4, 1, recv_len - 4, file);
-
-            // Send ACK
-            unsigned char ack_pkt[4] = {0, TFTP_OPCODE_ACK,
-                                        (block_num >> 8) & 0xFF,
-                                        block_num & 0xFF};
-            ssize_t sent = sendto(sockfd, ack_pkt, sizeof(ack_pkt), 0, (struct sockaddr *)server_addr, src_len);
-
-            if (sent < 0)
-            {
-                perror("Failed to send ACK");
-                break;
-            }
-            printf("Sent ACK for block %d\n", block_num);
-
-            expected_block = block_num + 1;
-            last_ack_block = block_num;
-        }
-
-        else if (block_num == ((expected_block - 1) & 0xFFFF)) // Duplicate of last block and resend ack if needed
-        {
-            printf("Duplicate block %u received — resending ACK\n", block_num);
-            unsigned char ack_pkt[4] = {0, TFTP_OPCODE_ACK,
-                                        (block_num >> 8) & 0xFF,
-                                        block_num & 0xFF};
-            ssize_t sent = sendto(sockfd, ack_pkt, 4, 0, (struct sockaddr *)server_addr, src_len);
-            if (sent < 0)
-            {
-                perror("Failed to resend ACK");
-                break;
-            }
-        }
-
-        // check if last block of data
-        if (recv_len < 4 + TFTP_DATA_SIZE)
-        {
-            printf("Sent all blocks %d\n", last_ack_block);
-            printf("File %s has been downloaded successfully!\n", filename);
-            break;
-        }
-
-        else
-        {
-            fprintf(stderr, "Received unexpected block %d, no ACK resent\n", block_num);
-        }
+        fprintf(stderr, "%s: %s\n", remote, x.error);
+        return -1;
     }
-
-    if (file)
-        fclose(file);
-
-    // print or execute
-    handle_user_action(filename, mode, TFTP_CLIENT_DIR);
+    if (client_verbose)
+        printf("Sent DEL request for file '%s'\n", remote);
+    return run_xfer(sockfd, server_addr, &x, remote);
 }
 
 // Function to handle DEL (Delete Request)
 void del_h(int sockfd, struct sockaddr_in *server_addr)
 {
     char filename[PATH_LENGTH];
-    char buffer[TFTP_BUF_SIZE];
 
     printf("Enter the filename you want to delete: ");
     scanf("%s", filename);
 
-    socklen_t addr_len = sizeof(*server_addr);
-
-    // Build DELETE request
-    memset(buffer, 0, sizeof(buffer));
-
-    buffer[0] = 0;
-    buffer[1] = TFTP_OPCODE_DEL; // Use raw opcode byte
-    strcpy(buffer + 2, filename);
-
-    // Send the DEL packet
-    ssize_t bytes_sent = sendto(sockfd, buffer, 2 + strlen(filename) + 1, 0, (struct sockaddr *)server_addr, sizeof(*server_addr));
-    if (bytes_sent < 0)
-    {
-        perror("Error sending DEL request");
-        return;
-    }
-
-    printf("Sent DEL request for file '%s'\n", filename);
-
-    // Wait for server's ACK or ERROR
-    ssize_t recv_len = recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&server_addr, &addr_len);
-
-    if (recv_len < 0)
-    {
-        perror("Failed to receive response from server");
-        return;
-    }
-
-    if (buffer[0] == 0 && buffer[1] == TFTP_OPCODE_ACK)
-    {
-        uint16_t block_n = (buffer[2] << 8) | buffer[3];
-        if (block_n == 0)
-        {
-            printf("Server confirmed file '%s' deleted successfully.\n", filename);
-        }
-        else
-        {
-            printf("Unexpected ACK block number: %d\n", block_n);
-        }
-    }
-    else if (buffer[0] == 0 && buffer[1] == TFTP_OPCODE_ERROR)
-    {
-        uint16_t error_code = (buffer[2] << 8) | buffer[3];
-        printf("Server responded with ERROR %d: %s\n", error_code, buffer + 4);
-    }
-    else
+    if (tftp_del(sockfd, server_addr, filename) == 0)
     {
-        printf("Unexpected response from server.\n");
+        printf("Server confirmed file '%s' deleted successfully.\n", filename);
     }
 }
@@ -8,19 +8,38 @@
 
 
 
+//progress and negotiation chatter on stdout, errors go to stderr regardless
+extern int client_verbose;
+//asks for rollover=1, block 65535 is followed by 1 instead of 0 (some servers only do that)
+extern int client_rollover;
+//octet transfers resume (the offset option): gets from the local file's end, puts from what the server kept
+extern int client_resume;
+//asks for compress=deflate on octet transfers, a resume goes without it
+extern int client_compress;
+//seconds asked for as the timeout (RFC 2349) and waited before each resend once the server agrees, 0 adapts
+extern int client_timeout;
+
 /*
     ports functions,
-    one is a getter of available ports,
-    one is a setter for client port,
+    one binds sockfd to a free client port (or an ephemeral one) and returns it, -1 on failure,
     one is a releaser
 */
-int get_next_port();
-
+int client_bind(int sockfd, struct sockaddr_in *client_addr);
 
-void set_client_port(struct sockaddr_in *client_addr);
 
+void client_release(int port);
 
-void release_port(int port);
+/*
+    transfers without prompts, one per socket at a time.
+    get/put return the bytes of file data moved or -1. a get goes to
+    a temp file next to local and is renamed over it at the end, so a
+    failed one leaves local as it was - with client_resume it goes on
+    in local itself and what it got stays for the next try. del
+    returns 0 or -1
+*/
+long long tftp_get(int sockfd, const struct sockaddr_in *server_addr, const char *remote, const char *local, const char *mode);
+long long tftp_put(int sockfd, const struct sockaddr_in *server_addr, const char *local, const char *remote, const char *mode);
+int tftp_del(int sockfd, const struct sockaddr_in *server_addr, const char *remote);
 
 //oper handlers
 void rrq_h(int sockfd, struct sockaddr_in *server_addr, char *filename, const char *mode);
@@ -0,0 +1,90 @@
+#define _GNU_SOURCE // for recvmmsg/sendmmsg
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "tftp_batch.h"
+
+int batch_recv(int fd, void *bufs, size_t slot_size, int n, size_t *lens, struct sockaddr_in *addrs, tftp_batch_stats_t *st)
+{
+    struct mmsghdr msgs[TFTP_BATCH_MAX];
+    struct iovec iov[TFTP_BATCH_MAX];
+    int got;
+
+    if (n > TFTP_BATCH_MAX)
+        n = TFTP_BATCH_MAX;
+
+    memset(msgs, 0, n * sizeof(msgs[0]));
+    for (int i = 0; i < n; i++)
+    {
+        iov[i].iov_base = (char *)bufs + i * slot_size;
+        iov[i].iov_len = slot_size;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (addrs)
+        {
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+    }
+
+    do
+    {
+        got = recvmmsg(fd, msgs, n, 0, NULL);
+    } while (got < 0 && errno == EINTR);
+
+    if (got <= 0)
+        return got;
+
+    for (int i = 0; i < got; i++)
+    {
+        lens[i] = msgs[i].msg_len;
+    }
+    st->calls++;
+    st->packets += got;
+    return got;
+}
+
+int batch_send(int fd, struct iovec *iov, int iov_per_pkt, int n, tftp_batch_stats_t *st)
+{
+    struct mmsghdr msgs[TFTP_BATCH_MAX];
+    int sent = 0;
+
+    if (n > TFTP_BATCH_MAX)
+        n = TFTP_BATCH_MAX;
+
+    memset(msgs, 0, n * sizeof(msgs[0]));
+    for (int i = 0; i < n; i++)
+    {
+        msgs[i].msg_hdr.msg_iov = &iov[i * iov_per_pkt];
+        msgs[i].msg_hdr.msg_iovlen = iov_per_pkt;
+    }
+
+    // sendmmsg can stop short, e.g. a full socket buffer - carry on from there
+    while (sent < n)
+    {
+        int ret = sendmmsg(fd, msgs + sent, n - sent, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return sent ? sent : -1;
+        }
+        st->calls++;
+        st->packets += ret;
+        sent += ret;
+    }
+    return sent;
+}
+
+void batch_stats_add(tftp_batch_stats_t *to, const tftp_batch_stats_t *from)
+{
+    to->calls += from->calls;
+    to->packets += from->packets;
+}
+
+double batch_stats_avg(const tftp_batch_stats_t *st)
+{
+    return st->calls ? (double)st->packets / st->calls : 0.0;
+}
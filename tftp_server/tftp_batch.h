@@ -0,0 +1,45 @@
+#ifndef TFTP_BATCH_H
+#define TFTP_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+/*
+    batched datagram I/O - recvmmsg drains up to n datagrams and
+    sendmmsg pushes a whole window in one syscall, the stats count
+    syscalls against packets so calls/packets is the batch size
+*/
+
+//most datagrams moved by one syscall, also the biggest window (TFTP_WINDOWSIZE_MAX)
+#define TFTP_BATCH_MAX 64
+
+typedef struct
+{
+    uint64_t calls;   // syscalls that moved at least one packet
+    uint64_t packets; // packets they moved
+} tftp_batch_stats_t;
+
+/*
+    receives up to n datagrams into n slots of slot_size bytes at bufs,
+    lens gets their lengths and addrs (may be NULL) the senders
+    returns how many arrived, or -1 with errno set (EAGAIN when there was nothing)
+*/
+int batch_recv(int fd, void *bufs, size_t slot_size, int n, size_t *lens, struct sockaddr_in *addrs, tftp_batch_stats_t *st);
+
+/*
+    sends n packets on a connected socket, packet i gathered from
+    iov[i * iov_per_pkt] on (e.g. a header and a payload somewhere else)
+    returns how many went out or -1 if the first one failed - EAGAIN
+    leaves the rest to the retransmit timer
+*/
+int batch_send(int fd, struct iovec *iov, int iov_per_pkt, int n, tftp_batch_stats_t *st);
+
+//adds one stats to another
+void batch_stats_add(tftp_batch_stats_t *to, const tftp_batch_stats_t *from);
+
+//average packets per syscall, 0 if nothing moved
+double batch_stats_avg(const tftp_batch_stats_t *st);
+
+#endif
@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "tftp_cache.h"
+#include "../utils/tftp_netascii.h"
+
+struct tftp_cache_entry
+{
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;   // of the file
+    int netascii; // data is the wire representation
+    char *data;
+    off_t len;    // of data, what the budget is charged
+
+    int refs;
+    int loading; // being read by the thread that missed, the others wait for it
+    int stale;   // out of the table, freed with its last reference
+
+    tftp_cache_entry_t *hnext;             // bucket chain
+    tftp_cache_entry_t *lru_prev, *lru_next; // head is the most recently used
+};
+
+/*
+    one lock for everything, it's taken once per RRQ and not per
+    block, and loading a file happens outside of it
+*/
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loaded = PTHREAD_COND_INITIALIZER;
+static tftp_cache_entry_t *buckets[CACHE_BUCKETS];
+static tftp_cache_entry_t *lru_head, *lru_tail;
+static uint64_t budget;
+static tftp_cache_stats_t stats;
+
+static unsigned path_hash(const char *s)
+{
+    unsigned h = 5381;
+    while (*s)
+        h = h * 33 + (unsigned char)*s++;
+    return h % CACHE_BUCKETS;
+}
+
+static void lru_unlink(tftp_cache_entry_t *e)
+{
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push(tftp_cache_entry_t *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = e;
+    lru_head = e;
+    if (!lru_tail)
+        lru_tail = e;
+}
+
+static void entry_free(tftp_cache_entry_t *e)
+{
+    free(e->data);
+    free(e->path);
+    free(e);
+}
+
+// takes e out of the table and the LRU, it's freed now or by its last cache_release
+static void entry_remove(tftp_cache_entry_t *e)
+{
+    tftp_cache_entry_t **pp = &buckets[path_hash(e->path)];
+    while (*pp && *pp != e)
+        pp = &(*pp)->hnext;
+    if (*pp)
+        *pp = e->hnext;
+
+    lru_unlink(e);
+    stats.bytes -= e->len;
+    stats.entries--;
+    e->stale = 1;
+    if (e->refs == 0)
+        entry_free(e);
+}
+
+// evicts unreferenced entries from the cold end until need more bytes fit
+static int make_room(uint64_t need)
+{
+    tftp_cache_entry_t *e = lru_tail;
+
+    while (stats.bytes + need > budget && e)
+    {
+        tftp_cache_entry_t *prev = e->lru_prev;
+        if (e->refs == 0 && !e->loading)
+        {
+            entry_remove(e);
+            stats.evictions++;
+        }
+        e = prev;
+    }
+    return stats.bytes + need <= budget ? 0 : -1;
+}
+
+static int same_file(const tftp_cache_entry_t *e, const struct stat *st)
+{
+    // a file only changes by being written, so all of these agree or it's another file
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static int read_all(int fd, char *buf, off_t size)
+{
+    off_t off = 0;
+
+    while (off < size)
+    {
+        ssize_t got = pread(fd, buf + off, size - off, off);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1; // error, or the file shrank under us
+        off += got;
+    }
+    return 0;
+}
+
+// reads the file into data, netascii encodes it in place from the back, returns the data length or -1
+static off_t load_file(int fd, char *data, off_t size, int netascii)
+{
+    off_t raw_off = netascii ? size : 0; // raw bytes go in the upper half, the image grows in front of them
+    char *raw = data + raw_off;
+
+    if (read_all(fd, raw, size) < 0)
+        return -1;
+    if (!netascii)
+        return size;
+
+    netascii_enc_t enc = NETASCII_ENC_INIT;
+    size_t consumed;
+    // the image never overtakes the raw bytes it's made from, a byte turns into at most two
+    return netascii_encode(&enc, raw, size, &consumed, data, 2 * size);
+}
+
+void cache_init(uint64_t budget_bytes)
+{
+    budget = budget_bytes;
+}
+
+void cache_destroy(void)
+{
+    pthread_mutex_lock(&lock);
+    while (lru_head)
+        entry_remove(lru_head);
+    pthread_mutex_unlock(&lock);
+}
+
+tftp_cache_entry_t *cache_acquire(const char *path, int fd, const struct stat *st, int netascii)
+{
+    tftp_cache_entry_t *e;
+    // a netascii image is charged the worst case, every byte doubled, until it's built
+    off_t reserve = netascii ? 2 * st->st_size : st->st_size;
+
+    // one file may take at most half the budget, so the cache can't be flushed by a single request
+    if (budget == 0 || !S_ISREG(st->st_mode) || st->st_size == 0 || (uint64_t)reserve > budget / 2)
+        return NULL;
+
+    pthread_mutex_lock(&lock);
+again:
+    for (e = buckets[path_hash(path)]; e; e = e->hnext)
+    {
+        if (e->netascii == netascii && strcmp(e->path, path) == 0)
+            break;
+    }
+
+    if (e && same_file(e, st))
+    {
+        if (e->loading)
+        {
+            // somebody else missed on it first, wait for their copy
+            pthread_cond_wait(&loaded, &lock);
+            goto again;
+        }
+        e->refs++;
+        lru_unlink(e);
+        lru_push(e);
+        stats.hits++;
+        pthread_mutex_unlock(&lock);
+        return e;
+    }
+
+    if (e && !e->loading)
+        entry_remove(e); // the file changed on disk
+    else if (e)
+    {
+        pthread_cond_wait(&loaded, &lock);
+        goto again;
+    }
+
+    stats.misses++;
+    if (make_room(reserve) < 0)
+    {
+        pthread_mutex_unlock(&lock); // everything is in use, serve this one from disk
+        return NULL;
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (!e || !(e->path = strdup(path)) || !(e->data = malloc(reserve)))
+    {
+        if (e)
+        {
+            free(e->path);
+            free(e);
+        }
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime = st->st_mtim;
+    e->size = st->st_size;
+    e->netascii = netascii;
+    e->len = reserve;
+    e->refs = 1;
+    e->loading = 1;
+
+    // in the table right away so the others wait instead of reading it too
+    unsigned h = path_hash(path);
+    e->hnext = buckets[h];
+    buckets[h] = e;
+    lru_push(e);
+    stats.bytes += e->len;
+    stats.entries++;
+    pthread_mutex_unlock(&lock);
+
+    off_t len = load_file(fd, e->data, e->size, netascii);
+
+    pthread_mutex_lock(&lock);
+    e->loading = 0;
+    if (len >= 0)
+    {
+        // give back what the netascii reserve didn't need
+        char *shrunk = len < e->len ? realloc(e->data, len) : NULL;
+        if (shrunk)
+            e->data = shrunk;
+        stats.bytes -= e->len - len;
+        e->len = len;
+    }
+    else
+    {
+        e->refs--;
+        entry_remove(e);
+        e = NULL;
+    }
+    pthread_cond_broadcast(&loaded);
+    pthread_mutex_unlock(&lock);
+    return e;
+}
+
+void cache_release(tftp_cache_entry_t *e)
+{
+    pthread_mutex_lock(&lock);
+    if (--e->refs == 0 && e->stale)
+        entry_free(e);
+    pthread_mutex_unlock(&lock);
+}
+
+const char *cache_data(const tftp_cache_entry_t *e)
+{
+    return e->data;
+}
+
+uint64_t cache_len(const tftp_cache_entry_t *e)
+{
+    return e->len;
+}
+
+void cache_stats(tftp_cache_stats_t *out)
+{
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+}
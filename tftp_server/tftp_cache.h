@@ -0,0 +1,52 @@
+#ifndef TFTP_CACHE_H
+#define TFTP_CACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+    hot file cache - whole files held in memory, shared by every
+    worker. entries are keyed by path and representation and checked
+    against the inode, mtime and size, so a replaced file is a miss.
+    the netascii representation is the file already converted for
+    the wire, so its blocks are at (seq - 1) * blksize too. sessions
+    hold a reference while they send out of an entry, only
+    unreferenced ones are evicted (least recently used first)
+    when the budget runs out
+*/
+
+#define CACHE_BUDGET_MB 256 // default, -c on the command line
+#define CACHE_BUCKETS 256
+
+typedef struct tftp_cache_entry tftp_cache_entry_t;
+
+typedef struct
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t bytes; // currently held
+    uint64_t entries;
+} tftp_cache_stats_t;
+
+//sets the memory budget, 0 turns the cache off
+void cache_init(uint64_t budget_bytes);
+//frees every entry, none may be referenced anymore
+void cache_destroy(void);
+
+/*
+    returns a referenced entry with the contents of path (fd open on it,
+    st its fstat), netascii encoded or as is, loading it on a miss - NULL
+    if the cache is off, the file doesn't fit or can't be read, then the
+    caller reads it itself
+*/
+tftp_cache_entry_t *cache_acquire(const char *path, int fd, const struct stat *st, int netascii);
+void cache_release(tftp_cache_entry_t *e);
+
+const char *cache_data(const tftp_cache_entry_t *e);
+//length of the data, the netascii image is longer than the file
+uint64_t cache_len(const tftp_cache_entry_t *e);
+
+void cache_stats(tftp_cache_stats_t *out);
+
+#endif
@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#ifdef TFTP_ZLIB
+#include <zlib.h>
+#endif
+
+#include "tftp_compress.h"
+#include "tftp_iopool.h"
+#include "../utils/tftp_utils.h"
+#include "../utils/tftp_options.h"
+
+#define ORIGIN_XATTR "user.tftp.source"
+#define ORIGIN_LENGTH 128
+
+static int level = COMPRESS_LEVEL;
+
+static _Atomic uint64_t st_deflated, st_kept, st_reused, st_inflated, st_raw, st_zip, st_cpu_us;
+
+void compress_set_level(int l)
+{
+    level = l < 0 ? 0 : l > 9 ? 9 : l;
+}
+
+int compress_supported(int method)
+{
+#ifdef TFTP_ZLIB
+    return method == TFTP_COMPRESS_DEFLATE && level > 0;
+#else
+    (void)method;
+    return 0;
+#endif
+}
+
+void compress_artifact_name(char *out, size_t size, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? (int)(slash - path + 1) : 0;
+
+    snprintf(out, size, "%.*s.%s.deflate", dir_len, path, path + dir_len);
+}
+
+// what goes into the xattr, text so getfattr shows it
+static int origin_format(char *out, const compress_origin_t *of)
+{
+    return snprintf(out, ORIGIN_LENGTH, "%llu %llu %llu %lld.%09ld %lld.%09ld", (unsigned long long)of->dev,
+                    (unsigned long long)of->ino, (unsigned long long)of->size, (long long)of->mtime.tv_sec,
+                    of->mtime.tv_nsec, (long long)of->ctime.tv_sec, of->ctime.tv_nsec);
+}
+
+int compress_artifact_current(int fd, const compress_origin_t *of)
+{
+    char want[ORIGIN_LENGTH], got[ORIGIN_LENGTH];
+    int len = origin_format(want, of);
+
+    return fgetxattr(fd, ORIGIN_XATTR, got, sizeof(got)) == len && memcmp(got, want, len) == 0;
+}
+
+void compress_count_reused(void)
+{
+    atomic_fetch_add_explicit(&st_reused, 1, memory_order_relaxed);
+}
+
+void compress_stats(tftp_compress_stats_t *out)
+{
+    out->deflated = atomic_load(&st_deflated);
+    out->kept = atomic_load(&st_kept);
+    out->reused = atomic_load(&st_reused);
+    out->inflated = atomic_load(&st_inflated);
+    out->raw_bytes = atomic_load(&st_raw);
+    out->zip_bytes = atomic_load(&st_zip);
+    out->cpu_us = atomic_load(&st_cpu_us);
+}
+
+#ifdef TFTP_ZLIB
+
+static atomic_uint tmp_seq;
+
+// not tftp_now_us, the simulator runs that on a virtual clock
+static uint64_t cpu_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct tftp_deflate
+{
+    z_stream z;
+    const char *map; // the file, or NULL and it's pread from fd
+    int fd;
+    uint64_t size;
+    uint64_t in_off; // file bytes handed to zlib so far
+    char *in;        // COMPRESS_CHUNK, what was read from fd
+    int end;         // the stream is complete
+    int out_fd;      // the temp file, -1 if there is none
+    int out_ok;      // every byte of the stream so far made it into it, and it's still shorter than the file
+    char origin[ORIGIN_LENGTH];
+    char artifact[2 * PATH_LENGTH + 16];
+    char tmp[2 * PATH_LENGTH + 48];
+};
+
+// the temp file on its way to being the artifact, or out
+typedef struct
+{
+    tftp_io_job_t io;
+    int fd;
+    int keep;
+    char origin[ORIGIN_LENGTH];
+    char artifact[2 * PATH_LENGTH + 16];
+    char tmp[2 * PATH_LENGTH + 48];
+} artifact_job_t;
+
+static void artifact_run(tftp_io_job_t *io)
+{
+    artifact_job_t *job = (artifact_job_t *)io;
+
+    // the artifact carries what it was made of, that's how the next RRQ knows it's of this version of the file
+    if (job->keep && fsetxattr(job->fd, ORIGIN_XATTR, job->origin, strlen(job->origin), 0) == 0 &&
+        rename(job->tmp, job->artifact) == 0)
+        atomic_fetch_add_explicit(&st_kept, 1, memory_order_relaxed);
+    else
+        unlink(job->tmp);
+    close(job->fd);
+}
+
+static void artifact_free(tftp_io_job_t *io)
+{
+    free(io);
+}
+
+tftp_deflate_t *deflate_open(const char *map, int fd, const char *artifact, const compress_origin_t *of)
+{
+    tftp_deflate_t *d = calloc(1, sizeof(*d));
+
+    if (!d)
+        return NULL;
+    if ((!map && !(d->in = malloc(COMPRESS_CHUNK))) || deflateInit(&d->z, level) != Z_OK)
+    {
+        free(d->in);
+        free(d);
+        return NULL;
+    }
+    d->map = map;
+    d->fd = fd;
+    d->size = of->size;
+    origin_format(d->origin, of);
+    snprintf(d->artifact, sizeof(d->artifact), "%s", artifact);
+    snprintf(d->tmp, sizeof(d->tmp), "%s.%d.%u.part", artifact, (int)getpid(), atomic_fetch_add(&tmp_seq, 1));
+
+    // without the temp file the stream still goes out, nothing is kept of it
+    d->out_fd = open(d->tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    d->out_ok = d->out_fd >= 0;
+    atomic_fetch_add_explicit(&st_deflated, 1, memory_order_relaxed);
+    return d;
+}
+
+// the next piece of the file for zlib, 0 or -1 on a read error
+static int deflate_feed(tftp_deflate_t *d)
+{
+    size_t n = d->size - d->in_off < COMPRESS_CHUNK ? d->size - d->in_off : COMPRESS_CHUNK;
+
+    if (d->map)
+    {
+        d->z.next_in = (Bytef *)d->map + d->in_off;
+        d->z.avail_in = n;
+        d->in_off += n;
+        return 0;
+    }
+    ssize_t got;
+    do
+        got = pread(d->fd, d->in, n, d->in_off);
+    while (got < 0 && errno == EINTR);
+    if (got < 0)
+        return -1;
+    if (got == 0)
+        d->size = d->in_off; // it got shorter under us, the stream ends where it does
+    d->z.next_in = (Bytef *)d->in;
+    d->z.avail_in = got;
+    d->in_off += got;
+    return 0;
+}
+
+ssize_t deflate_read(tftp_deflate_t *d, char *buf, size_t len)
+{
+    uint64_t t0 = cpu_now_us();
+
+    d->z.next_out = (Bytef *)buf;
+    d->z.avail_out = len;
+    while (d->z.avail_out > 0 && !d->end)
+    {
+        if (d->z.avail_in == 0 && d->in_off < d->size && deflate_feed(d) < 0)
+            return -1;
+        // once the whole file was handed over it only gets finished, no more input
+        int ret = deflate(&d->z, d->in_off == d->size ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_END)
+            d->end = 1;
+        else if (ret != Z_OK && ret != Z_BUF_ERROR)
+            return -1;
+    }
+    size_t n = len - d->z.avail_out;
+    atomic_fetch_add_explicit(&st_cpu_us, cpu_now_us() - t0, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st_zip, n, memory_order_relaxed);
+
+    // random bytes don't get any shorter, a stream as long as the file isn't worth keeping
+    if (d->z.total_out >= d->size)
+        d->out_ok = 0;
+    for (size_t done = 0; d->out_ok && done < n;)
+    {
+        ssize_t w = write(d->out_fd, buf + done, n - done);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            d->out_ok = 0;
+        else
+            done += w;
+    }
+    return n;
+}
+
+void deflate_close(tftp_deflate_t *d)
+{
+    atomic_fetch_add_explicit(&st_raw, d->z.total_in, memory_order_relaxed);
+    if (d->out_fd >= 0)
+    {
+        artifact_job_t *job = calloc(1, sizeof(*job));
+        if (job)
+        {
+            job->io.run = artifact_run;
+            job->io.done = artifact_free;
+            job->fd = d->out_fd;
+            job->keep = d->end && d->out_ok;
+            memcpy(job->origin, d->origin, sizeof(job->origin));
+            memcpy(job->artifact, d->artifact, sizeof(job->artifact));
+            memcpy(job->tmp, d->tmp, sizeof(job->tmp));
+            iopool_submit(&job->io, NULL);
+        }
+        else
+        {
+            // no memory for the job, drop it here
+            unlink(d->tmp);
+            close(d->out_fd);
+        }
+    }
+    deflateEnd(&d->z);
+    free(d->in);
+    free(d);
+}
+
+struct tftp_inflate
+{
+    z_stream z;
+    int end;
+    char out[COMPRESS_CHUNK];
+};
+
+tftp_inflate_t *inflate_open(void)
+{
+    tftp_inflate_t *z = calloc(1, sizeof(*z));
+
+    if (z && inflateInit(&z->z) != Z_OK)
+    {
+        free(z);
+        return NULL;
+    }
+    if (z)
+        atomic_fetch_add_explicit(&st_inflated, 1, memory_order_relaxed);
+    return z;
+}
+
+int inflate_write(tftp_inflate_t *z, const char *data, size_t len, int (*out)(void *ctx, const char *buf, size_t len),
+                  void *ctx)
+{
+    if (len && z->end)
+    {
+        errno = EILSEQ; // something after the end of the stream
+        return -1;
+    }
+    atomic_fetch_add_explicit(&st_zip, len, memory_order_relaxed);
+    z->z.next_in = (Bytef *)data;
+    z->z.avail_in = len;
+
+    // a full out buffer can mean there's more to come out of what went in already
+    do
+    {
+        uint64_t t0 = cpu_now_us();
+        z->z.next_out = (Bytef *)z->out;
+        z->z.avail_out = sizeof(z->out);
+        int ret = inflate(&z->z, Z_NO_FLUSH);
+        atomic_fetch_add_explicit(&st_cpu_us, cpu_now_us() - t0, memory_order_relaxed);
+        if (ret == Z_STREAM_END)
+        {
+            z->end = 1;
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            errno = EILSEQ;
+            return -1;
+        }
+        size_t n = sizeof(z->out) - z->z.avail_out;
+        atomic_fetch_add_explicit(&st_raw, n, memory_order_relaxed);
+        if (n && out(ctx, z->out, n) < 0)
+            return -1;
+        if (ret == Z_BUF_ERROR)
+            break; // nothing more until the next block
+    } while (!z->end && (z->z.avail_in > 0 || z->z.avail_out == 0));
+
+    if (z->end && z->z.avail_in > 0)
+    {
+        errno = EILSEQ;
+        return -1;
+    }
+    return 0;
+}
+
+int inflate_done(const tftp_inflate_t *z)
+{
+    return z->end;
+}
+
+void inflate_close(tftp_inflate_t *z)
+{
+    inflateEnd(&z->z);
+    free(z);
+}
+
+#else
+
+tftp_deflate_t *deflate_open(const char *map, int fd, const char *artifact, const compress_origin_t *of)
+{
+    (void)map, (void)fd, (void)artifact, (void)of;
+    return NULL;
+}
+
+ssize_t deflate_read(tftp_deflate_t *d, char *buf, size_t len)
+{
+    (void)d, (void)buf, (void)len;
+    return -1;
+}
+
+void deflate_close(tftp_deflate_t *d)
+{
+    (void)d;
+}
+
+tftp_inflate_t *inflate_open(void)
+{
+    return NULL;
+}
+
+int inflate_write(tftp_inflate_t *z, const char *data, size_t len, int (*out)(void *ctx, const char *buf, size_t len),
+                  void *ctx)
+{
+    (void)z, (void)data, (void)len, (void)out, (void)ctx;
+    errno = EILSEQ;
+    return -1;
+}
+
+int inflate_done(const tftp_inflate_t *z)
+{
+    (void)z;
+    return 0;
+}
+
+void inflate_close(tftp_inflate_t *z)
+{
+    (void)z;
+}
+
+#endif
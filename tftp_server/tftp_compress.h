@@ -0,0 +1,98 @@
+#ifndef TFTP_COMPRESS_H
+#define TFTP_COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+/*
+    the server's side of compress=deflate (see tftp_options.h). an RRQ
+    gets the zlib stream of its file: a .name.deflate next to the file
+    is that stream already when the file is still what it was made of,
+    and goes out like any other file (cache, mmap, prefetch). without one
+    the blocks are deflated on their way out, in order like a netascii
+    stream, and written to a temp file that becomes .name.deflate once
+    the stream got to its end smaller than the file - so a hot file is
+    compressed once, not per request. what it was made of (device,
+    inode, size, mtime and ctime - touch -r can put an mtime back, not
+    a ctime) is in the artifact's user.tftp.source xattr, a filesystem
+    without user xattrs keeps no artifacts.
+    a WRQ's blocks are inflated on their way into the sink.
+    built without zlib nothing is supported and the option never makes
+    it into an OACK
+*/
+
+#define COMPRESS_LEVEL 6             // zlib's default, -z on the command line
+#define COMPRESS_CHUNK (64 * 1024)   // file bytes deflated at a time, inflated bytes handed on at a time
+
+typedef struct tftp_deflate tftp_deflate_t;
+typedef struct tftp_inflate tftp_inflate_t;
+
+typedef struct
+{
+    uint64_t deflated;  // RRQs compressed on the way out
+    uint64_t kept;      // ...that got to the end and left a .name.deflate
+    uint64_t reused;    // RRQs sent from a .name.deflate that was there
+    uint64_t inflated;  // WRQs
+    uint64_t raw_bytes; // file bytes into deflate and out of inflate
+    uint64_t zip_bytes; // stream bytes out of deflate and into inflate
+    uint64_t cpu_us;    // time spent in zlib
+} tftp_compress_stats_t;
+
+//1..9 is zlib's level, 0 doesn't take the option at all
+void compress_set_level(int level);
+//compress=method (TFTP_COMPRESS_*) can be answered
+int compress_supported(int method);
+
+// the file an artifact is made of, as fstat saw it
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    uint64_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+} compress_origin_t;
+
+//.name.deflate next to path
+void compress_artifact_name(char *out, size_t size, const char *path);
+//the artifact open at fd was made of exactly of, not an earlier version or another file
+int compress_artifact_current(int fd, const compress_origin_t *of);
+void compress_count_reused(void);
+
+/*
+    the zlib stream of the of->size bytes at map - or read from fd when
+    map is NULL - and a temp file next to artifact to keep it in.
+    blocking, for the RRQ handler. NULL if zlib or the memory isn't there
+*/
+tftp_deflate_t *deflate_open(const char *map, int fd, const char *artifact, const compress_origin_t *of);
+
+/*
+    the next len bytes of the stream, fewer only at its end - -1 when the
+    file can't be read. what comes out is written to the temp file too,
+    through the page cache (a failed write only costs the artifact), and
+    no more of it once the stream is as long as the file
+*/
+ssize_t deflate_read(tftp_deflate_t *d, char *buf, size_t len);
+
+//a stream that got to its end and shrank the file is renamed to the artifact, else dropped - on the I/O pool
+void deflate_close(tftp_deflate_t *d);
+
+tftp_inflate_t *inflate_open(void);
+
+/*
+    len more bytes of the stream, out(ctx) gets what they inflate to in
+    pieces of up to COMPRESS_CHUNK. -1 with errno EILSEQ when it's no
+    zlib stream or goes on past its end, or -1 from out
+*/
+int inflate_write(tftp_inflate_t *z, const char *data, size_t len, int (*out)(void *ctx, const char *buf, size_t len),
+                  void *ctx);
+
+//the stream got to its end, nothing's missing
+int inflate_done(const tftp_inflate_t *z);
+void inflate_close(tftp_inflate_t *z);
+
+void compress_stats(tftp_compress_stats_t *out);
+
+#endif
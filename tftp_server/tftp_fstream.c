@@ -0,0 +1,575 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "tftp_fstream.h"
+#include "../utils/tftp_netascii.h"
+#include "../utils/tftp_utils.h"
+
+typedef struct
+{
+    char *mem; // FSTREAM_CHUNK_BLOCKS blocks of blksize
+    uint32_t len[FSTREAM_CHUNK_BLOCKS];
+} fstream_chunk_t;
+
+typedef struct tftp_fstream
+{
+    tftp_io_job_t job; // first, the producer job is the stream
+
+    // what it is the stream of
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    int netascii;
+    int blksize;
+
+    pthread_mutex_t lock; // the rest, readers on different workers share it
+    pthread_cond_t cond;  // a producer got blocks in, for readers that have no worker to hear it on
+    int fd;               // its own open file, the sessions' offsets are theirs
+    FILE *file;           // netascii, on fd - these two only the one producing touches, outside the lock
+    netascii_enc_t enc;
+    uint32_t produced;    // blocks 1..produced have been read
+    uint32_t handed;      // the furthest block a reader was given
+    uint32_t want;        // the furthest block a reader asked for, and a chunk past it
+    uint32_t eof;         // the short block, 0 until it's read
+    int failed;
+    int producing;        // a producer is reading into the chunk after produced, without the lock
+    int job_out;          // the producer job is on the pool, it holds a ref
+
+    fstream_chunk_t **ring; // chunk c at ring[c % nring], first..the one holding produced are there
+    uint32_t nring;
+    uint32_t first;
+
+    tftp_fstream_reader_t *readers; // the ones whose base holds chunks
+    int refs;                       // attached readers
+    struct tftp_fstream *next;      // registry
+} tftp_fstream_t;
+
+struct tftp_fstream_reader
+{
+    tftp_io_job_t wake; // first, posted to the reader's worker once what it waits for is there
+    tftp_fstream_t *fs;
+    uint32_t base;
+    int alone;      // cut loose, reads on by itself
+    uint32_t until; // ...from this block, the ones below can still be in its window
+    int listed;
+    tftp_fstream_reader_t *prev, *next;
+
+    // from fstream_bind, unset the reader waits for its blocks right where it asks
+    tftp_io_done_t *ioq;
+    void (*notify)(void *arg);
+    void *notify_arg;
+    uint32_t waiting; // the block it was told to wait for, 0 = none
+    int wake_out;     // the wake is posted and hasn't run yet
+};
+
+// lock order: registry, then a stream
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static tftp_fstream_t *streams;
+
+static _Atomic uint64_t st_streams, st_readers, st_produced, st_shared, st_alone;
+
+static void fstream_run(tftp_io_job_t *job);
+static void fstream_job_done(tftp_io_job_t *job);
+static void reader_wake(tftp_io_job_t *job);
+
+static void reader_unlist(tftp_fstream_t *fs, tftp_fstream_reader_t *r)
+{
+    if (!r->listed)
+        return;
+    if (r->prev)
+        r->prev->next = r->next;
+    else
+        fs->readers = r->next;
+    if (r->next)
+        r->next->prev = r->prev;
+    r->prev = r->next = NULL;
+    r->listed = 0;
+}
+
+// under fs->lock, chunks every listed reader is past are freed
+static void release_chunks(tftp_fstream_t *fs)
+{
+    uint32_t min = UINT32_MAX;
+
+    for (tftp_fstream_reader_t *r = fs->readers; r; r = r->next)
+    {
+        if (r->base < min)
+            min = r->base;
+    }
+    if (min == UINT32_MAX)
+        return; // nobody holds anything, detach frees the lot
+
+    // chunk c is blocks c * CHUNK + 1 .. (c + 1) * CHUNK - and the one a producer reads into stays
+    while (fs->first < (min - 1) / FSTREAM_CHUNK_BLOCKS && fs->first < fs->produced / FSTREAM_CHUNK_BLOCKS &&
+           fs->ring[fs->first % fs->nring])
+    {
+        fstream_chunk_t *c = fs->ring[fs->first % fs->nring];
+        free(c->mem);
+        free(c);
+        fs->ring[fs->first % fs->nring] = NULL;
+        fs->first++;
+    }
+}
+
+static void fstream_free(tftp_fstream_t *fs)
+{
+    for (uint32_t i = 0; i < fs->nring; i++)
+    {
+        if (fs->ring[i])
+        {
+            free(fs->ring[i]->mem);
+            free(fs->ring[i]);
+        }
+    }
+    free(fs->ring);
+    if (fs->file)
+        fclose(fs->file); // closes fd too
+    else if (fs->fd >= 0)
+        close(fs->fd);
+    pthread_cond_destroy(&fs->cond);
+    pthread_mutex_destroy(&fs->lock);
+    free(fs);
+}
+
+// drops a reference, the last one takes the stream out of the registry and frees it
+static void fstream_unref(tftp_fstream_t *fs)
+{
+    int last;
+
+    pthread_mutex_lock(&lock);
+    pthread_mutex_lock(&fs->lock);
+    last = --fs->refs == 0;
+    if (last)
+    {
+        for (tftp_fstream_t **p = &streams; *p; p = &(*p)->next)
+        {
+            if (*p == fs)
+            {
+                *p = fs->next;
+                break;
+            }
+        }
+    }
+    else
+    {
+        release_chunks(fs);
+    }
+    pthread_mutex_unlock(&fs->lock);
+    pthread_mutex_unlock(&lock);
+
+    if (last)
+        fstream_free(fs);
+}
+
+// under the registry lock, a stream of its own for the file at path - NULL if it isn't the file st describes
+static tftp_fstream_t *fstream_create(const char *path, const struct stat *st, int netascii, int blksize)
+{
+    struct stat own;
+    tftp_fstream_t *fs = calloc(1, sizeof(*fs));
+
+    if (!fs)
+        return NULL;
+    fs->dev = st->st_dev;
+    fs->ino = st->st_ino;
+    fs->mtime = st->st_mtim;
+    fs->size = st->st_size;
+    fs->netascii = netascii;
+    fs->blksize = blksize;
+    fs->enc = (netascii_enc_t)NETASCII_ENC_INIT;
+    fs->fd = -1;
+    fs->job.run = fstream_run;
+    fs->job.done = fstream_job_done;
+    pthread_mutex_init(&fs->lock, NULL);
+    pthread_cond_init(&fs->cond, NULL);
+
+    fs->nring = FSTREAM_MAX_BYTES / ((uint64_t)FSTREAM_CHUNK_BLOCKS * blksize);
+    if (fs->nring < 2)
+        fs->nring = 2;
+    fs->ring = calloc(fs->nring, sizeof(*fs->ring));
+    // opened again, a dup would share the file offset with the first reader's stream
+    fs->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (!fs->ring || fs->fd < 0 || fstat(fs->fd, &own) < 0 || own.st_ino != st->st_ino || own.st_dev != st->st_dev)
+    {
+        fstream_free(fs);
+        return NULL;
+    }
+    posix_fadvise(fs->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (netascii && !(fs->file = fdopen(fs->fd, "r")))
+    {
+        fstream_free(fs);
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&st_streams, 1, memory_order_relaxed);
+    return fs;
+}
+
+tftp_fstream_reader_t *fstream_attach(const char *path, int fd, int netascii, int blksize)
+{
+    struct stat st;
+    tftp_fstream_t *fs;
+    tftp_fstream_reader_t *r;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !(r = calloc(1, sizeof(*r))))
+        return NULL;
+
+    pthread_mutex_lock(&lock);
+    for (fs = streams; fs; fs = fs->next)
+    {
+        if (fs->ino != st.st_ino || fs->dev != st.st_dev || fs->size != st.st_size ||
+            fs->mtime.tv_sec != st.st_mtim.tv_sec || fs->mtime.tv_nsec != st.st_mtim.tv_nsec ||
+            fs->netascii != netascii || fs->blksize != blksize)
+            continue;
+        pthread_mutex_lock(&fs->lock);
+        if (fs->first == 0 && !fs->failed)
+            break; // block 1 is still there, locked
+        pthread_mutex_unlock(&fs->lock);
+    }
+    if (!fs)
+    {
+        fs = fstream_create(path, &st, netascii, blksize);
+        if (!fs)
+        {
+            pthread_mutex_unlock(&lock);
+            free(r);
+            return NULL;
+        }
+        pthread_mutex_lock(&fs->lock);
+        fs->next = streams;
+        streams = fs;
+    }
+    pthread_mutex_unlock(&lock);
+
+    r->wake.done = reader_wake;
+    r->fs = fs;
+    r->base = 1;
+    r->listed = 1;
+    r->next = fs->readers;
+    if (fs->readers)
+        fs->readers->prev = r;
+    fs->readers = r;
+    fs->refs++;
+    pthread_mutex_unlock(&fs->lock);
+    atomic_fetch_add_explicit(&st_readers, 1, memory_order_relaxed);
+    return r;
+}
+
+// block seq into chunk c, by the one producing and without the lock - -1 on a read error
+static ssize_t produce(tftp_fstream_t *fs, fstream_chunk_t *c, uint32_t seq)
+{
+    char *buf = c->mem + (size_t)((seq - 1) % FSTREAM_CHUNK_BLOCKS) * fs->blksize;
+    size_t len = 0;
+
+    if (fs->file)
+    {
+        len = read_netascii(fs->file, &fs->enc, buf, fs->blksize);
+        return ferror(fs->file) ? -1 : (ssize_t)len;
+    }
+
+    uint64_t off = (uint64_t)(seq - 1) * fs->blksize;
+    while (len < (size_t)fs->blksize)
+    {
+        ssize_t got = pread(fs->fd, buf + len, fs->blksize - len, off + len);
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (got == 0)
+            break;
+        len += got;
+    }
+    return len;
+}
+
+// under fs->lock, the readers told to wait that can go on get their wake posted
+static void wake_readers(tftp_fstream_t *fs)
+{
+    for (tftp_fstream_reader_t *r = fs->readers; r; r = r->next)
+    {
+        if (!r->waiting || r->wake_out || (r->waiting > fs->produced && !fs->eof && !fs->failed && !r->alone))
+            continue;
+        r->waiting = 0;
+        r->wake_out = 1;
+        io_done_post(r->ioq, &r->wake);
+    }
+    pthread_cond_broadcast(&fs->cond);
+}
+
+/*
+    under fs->lock, reads blocks until produced reaches to - a chunk at a
+    time, and the lock is let go while reading. -1 when there's no chunk
+    to read into, the readers waiting beyond produced were cut loose
+*/
+static int fill(tftp_fstream_t *fs, uint32_t to)
+{
+    while (!fs->producing && fs->produced < to && !fs->eof && !fs->failed)
+    {
+        uint32_t c = fs->produced / FSTREAM_CHUNK_BLOCKS;
+        fstream_chunk_t **slot = &fs->ring[c % fs->nring];
+
+        if (c - fs->first >= fs->nring)
+            goto stuck; // the ones behind hold the ring, nobody asks this far ahead
+        if (!*slot)
+        {
+            fstream_chunk_t *chunk = calloc(1, sizeof(*chunk));
+            if (chunk)
+                chunk->mem = malloc((size_t)FSTREAM_CHUNK_BLOCKS * fs->blksize);
+            if (!chunk || !chunk->mem)
+            {
+                free(chunk);
+                goto stuck;
+            }
+            *slot = chunk;
+        }
+
+        fstream_chunk_t *chunk = *slot;
+        uint32_t from = fs->produced + 1;
+        uint32_t until = (c + 1) * FSTREAM_CHUNK_BLOCKS < to ? (c + 1) * FSTREAM_CHUNK_BLOCKS : to;
+        uint32_t seq = from;
+        int failed = 0, eof = 0;
+
+        fs->producing = 1;
+        pthread_mutex_unlock(&fs->lock);
+        for (; seq <= until; seq++)
+        {
+            ssize_t n = produce(fs, chunk, seq);
+            if (n < 0)
+            {
+                failed = 1;
+                break;
+            }
+            chunk->len[(seq - 1) % FSTREAM_CHUNK_BLOCKS] = n;
+            if (n < fs->blksize)
+            {
+                eof = 1;
+                seq++;
+                break;
+            }
+        }
+        pthread_mutex_lock(&fs->lock);
+        fs->producing = 0;
+        fs->produced = seq - 1;
+        if (eof)
+            fs->eof = fs->produced;
+        fs->failed = failed;
+        atomic_fetch_add_explicit(&st_produced, seq - from, memory_order_relaxed);
+        wake_readers(fs);
+    }
+    return 0;
+
+stuck:
+    // no room for what they asked for, they go on by themselves
+    for (tftp_fstream_reader_t *r = fs->readers; r; r = r->next)
+    {
+        if (r->waiting && !r->alone)
+        {
+            r->alone = 1;
+            r->until = r->waiting;
+            atomic_fetch_add_explicit(&st_alone, 1, memory_order_relaxed);
+        }
+    }
+    wake_readers(fs);
+    return -1;
+}
+
+// under fs->lock, queues the producer if there's something to read and nobody at it - submit it once unlocked
+static int fstream_kick(tftp_fstream_t *fs)
+{
+    if (fs->job_out || fs->producing || !fs->readers || fs->produced >= fs->want || fs->eof || fs->failed)
+        return 0;
+    fs->job_out = 1;
+    fs->refs++;
+    return 1;
+}
+
+// on the pool, a chunk's worth - then it's somebody else's turn
+static void fstream_run(tftp_io_job_t *job)
+{
+    tftp_fstream_t *fs = (tftp_fstream_t *)job;
+
+    pthread_mutex_lock(&fs->lock);
+    uint32_t end = (fs->produced / FSTREAM_CHUNK_BLOCKS + 1) * FSTREAM_CHUNK_BLOCKS;
+    fill(fs, fs->want < end ? fs->want : end);
+    pthread_mutex_unlock(&fs->lock);
+}
+
+// right after run on the same pool thread, the job goes back in while the readers want more
+static void fstream_job_done(tftp_io_job_t *job)
+{
+    tftp_fstream_t *fs = (tftp_fstream_t *)job;
+    int again;
+
+    pthread_mutex_lock(&fs->lock);
+    fs->job_out = 0;
+    again = fstream_kick(fs);
+    if (again)
+        fs->refs--; // it keeps the one it had
+    pthread_mutex_unlock(&fs->lock);
+
+    if (again)
+        iopool_submit(&fs->job, NULL);
+    else
+        fstream_unref(fs);
+}
+
+// on the reader's worker
+static void reader_wake(tftp_io_job_t *job)
+{
+    tftp_fstream_reader_t *r = (tftp_fstream_reader_t *)job;
+
+    pthread_mutex_lock(&r->fs->lock);
+    r->wake_out = 0;
+    pthread_mutex_unlock(&r->fs->lock);
+    r->notify(r->notify_arg);
+}
+
+ssize_t fstream_block(tftp_fstream_reader_t *r, uint32_t seq, const char **data)
+{
+    tftp_fstream_t *fs = r->fs;
+    ssize_t ret;
+    int submit = 0;
+
+    pthread_mutex_lock(&fs->lock);
+    if (!r->alone && (seq - 1) / FSTREAM_CHUNK_BLOCKS - fs->first >= fs->nring)
+    {
+        // the ones behind hold the ring, this one goes on without them - what it already got stays until its window is past it
+        r->alone = 1;
+        r->until = seq;
+        release_chunks(fs);
+        atomic_fetch_add_explicit(&st_alone, 1, memory_order_relaxed);
+    }
+    if (r->alone)
+    {
+        pthread_mutex_unlock(&fs->lock);
+        return FSTREAM_ALONE;
+    }
+
+    // a chunk past what's asked for is read ahead if the ring has room, topped up once half of it is used
+    if (fs->want < seq + FSTREAM_CHUNK_BLOCKS / 2)
+    {
+        uint32_t ahead = seq + FSTREAM_CHUNK_BLOCKS;
+        if ((ahead - 1) / FSTREAM_CHUNK_BLOCKS - fs->first >= fs->nring)
+            ahead = seq;
+        if (ahead > fs->want)
+            fs->want = ahead;
+    }
+
+    if (seq > fs->produced && !fs->eof && !fs->failed)
+    {
+        if (r->ioq)
+        {
+            // the pool reads it, the worker goes on with others and hears back through the wake
+            r->waiting = seq;
+            submit = fstream_kick(fs);
+            pthread_mutex_unlock(&fs->lock);
+            if (submit)
+                iopool_submit(&fs->job, NULL);
+            return FSTREAM_WAIT;
+        }
+        // nowhere to hear back on, this thread may block: it reads itself or waits for whoever is at it
+        while (seq > fs->produced && !fs->eof && !fs->failed)
+        {
+            if (fs->producing)
+                pthread_cond_wait(&fs->cond, &fs->lock);
+            else if (fill(fs, seq) < 0)
+                break;
+        }
+        if (seq > fs->produced && !fs->eof && !fs->failed)
+        {
+            r->alone = 1;
+            r->until = seq;
+            release_chunks(fs);
+            atomic_fetch_add_explicit(&st_alone, 1, memory_order_relaxed);
+            pthread_mutex_unlock(&fs->lock);
+            return FSTREAM_ALONE;
+        }
+    }
+    submit = fstream_kick(fs);
+
+    if (fs->failed && seq > fs->produced)
+    {
+        ret = -1;
+    }
+    else if (fs->eof && seq > fs->eof)
+    {
+        *data = NULL;
+        ret = 0; // nobody asks past the short block
+    }
+    else
+    {
+        fstream_chunk_t *c = fs->ring[((seq - 1) / FSTREAM_CHUNK_BLOCKS) % fs->nring];
+        int i = (seq - 1) % FSTREAM_CHUNK_BLOCKS;
+        *data = c->mem + (size_t)i * fs->blksize;
+        ret = c->len[i];
+        if (seq <= fs->handed)
+            atomic_fetch_add_explicit(&st_shared, 1, memory_order_relaxed);
+        else
+            fs->handed = seq;
+    }
+    pthread_mutex_unlock(&fs->lock);
+    if (submit)
+        iopool_submit(&fs->job, NULL);
+    return ret;
+}
+
+void fstream_advance(tftp_fstream_reader_t *r, uint32_t base)
+{
+    tftp_fstream_t *fs = r->fs;
+
+    pthread_mutex_lock(&fs->lock);
+    r->base = base;
+    // on its own, it lets go once its window is past what it got from the stream
+    if (r->alone && base >= r->until)
+        reader_unlist(fs, r);
+    release_chunks(fs);
+    pthread_mutex_unlock(&fs->lock);
+}
+
+void fstream_bind(tftp_fstream_reader_t *r, tftp_io_done_t *ioq, void (*notify)(void *arg), void *arg)
+{
+    pthread_mutex_lock(&r->fs->lock);
+    r->ioq = ioq;
+    r->notify = notify;
+    r->notify_arg = arg;
+    pthread_mutex_unlock(&r->fs->lock);
+}
+
+int fstream_pending(tftp_fstream_reader_t *r)
+{
+    int out;
+
+    pthread_mutex_lock(&r->fs->lock);
+    out = r->wake_out;
+    pthread_mutex_unlock(&r->fs->lock);
+    return out;
+}
+
+void fstream_detach(tftp_fstream_reader_t *r)
+{
+    tftp_fstream_t *fs = r->fs;
+
+    pthread_mutex_lock(&fs->lock);
+    reader_unlist(fs, r);
+    pthread_mutex_unlock(&fs->lock);
+    fstream_unref(fs);
+    free(r);
+}
+
+void fstream_stats(tftp_fstream_stats_t *out)
+{
+    out->streams = atomic_load(&st_streams);
+    out->readers = atomic_load(&st_readers);
+    out->produced = atomic_load(&st_produced);
+    out->shared = atomic_load(&st_shared);
+    out->alone = atomic_load(&st_alone);
+}
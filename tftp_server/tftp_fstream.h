@@ -0,0 +1,74 @@
+#ifndef TFTP_FSTREAM_H
+#define TFTP_FSTREAM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "tftp_iopool.h"
+
+/*
+    shared file streams - RRQs that read the same file (same inode and
+    mtime, same mode and blksize) at about the same time attach to one
+    stream and its blocks are read, and netascii encoded, once for all
+    of them. this is for what the cache doesn't hold and can't be
+    mapped: netascii conversions of files over the cache budget, and
+    octet files read with pread. (mapped files already share the page
+    cache, their blocks are just offsets.)
+    blocks are read by a job on the I/O pool, a chunk past the furthest
+    block a reader asked for, into chunks of FSTREAM_CHUNK_BLOCKS that
+    are freed once every reader's base has moved past them - a session's
+    window never points at a chunk that is gone. the stream's lock is
+    only held to look blocks up and hand chunks out, never while
+    reading. a reader that asks for a block that isn't read yet is told
+    to wait, and its worker gets a wake once it's there. a reader that
+    isn't bound to a worker yet (session_begin on a pool thread) reads
+    itself, or waits for whoever is reading.
+    a stream takes new readers while its first chunk is still there.
+    when the first and the last reader get more than FSTREAM_MAX_BYTES
+    apart, the one in front leaves the stream and reads on by itself
+*/
+
+#define FSTREAM_CHUNK_BLOCKS 64
+#define FSTREAM_MAX_BYTES (16 << 20)
+
+// fstream_block: the reader was cut loose, it reads block seq and the ones after it itself
+#define FSTREAM_ALONE (-2)
+// fstream_block: the block isn't read yet, the reader's notify comes once it is
+#define FSTREAM_WAIT (-3)
+
+typedef struct tftp_fstream_reader tftp_fstream_reader_t;
+
+typedef struct
+{
+    uint64_t streams;  // streams started
+    uint64_t readers;  // sessions that attached, the first of each stream too
+    uint64_t produced; // blocks read (and encoded) for the streams
+    uint64_t shared;   // blocks a reader got that another one had produced
+    uint64_t alone;    // readers that got too far ahead and went on by themselves
+} tftp_fstream_stats_t;
+
+/*
+    a reader from block 1 of the file at path (open on fd), on the
+    stream others read it with if there is one - NULL: read it alone
+*/
+tftp_fstream_reader_t *fstream_attach(const char *path, int fd, int netascii, int blksize);
+
+//on the worker that owns the reader, a block it waits for is announced with notify(arg) there
+void fstream_bind(tftp_fstream_reader_t *r, tftp_io_done_t *ioq, void (*notify)(void *arg), void *arg);
+//a wake is on its way to the worker, the reader can't be detached yet
+int fstream_pending(tftp_fstream_reader_t *r);
+
+/*
+    block seq, its length with *data pointing at it, valid until the
+    reader's base moves past seq - -1 on a read error, FSTREAM_ALONE
+    once the reader is on its own, FSTREAM_WAIT when it's bound and the
+    block isn't read yet
+*/
+ssize_t fstream_block(tftp_fstream_reader_t *r, uint32_t seq, const char **data);
+
+//blocks below base were ACKed, chunks nobody needs anymore are freed
+void fstream_advance(tftp_fstream_reader_t *r, uint32_t base);
+void fstream_detach(tftp_fstream_reader_t *r);
+
+void fstream_stats(tftp_fstream_stats_t *out);
+
+#endif
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "tftp_iopool.h"
+#include "../utils/tftp_utils.h"
+
+static tftp_io_ring_t queue;
+static int wake_fd = -1; // semaphore eventfd, one count per queued job (or stop)
+static pthread_t *threads;
+static int nthreads;
+static atomic_int running;
+
+static _Atomic uint64_t st_jobs, st_inline, st_depth_max, st_wait, st_wait_max, st_run, st_run_max;
+
+static int ring_init(tftp_io_ring_t *r, size_t size)
+{
+    r->cells = calloc(size, sizeof(*r->cells));
+    if (!r->cells)
+        return -1;
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&r->cells[i].seq, i);
+    r->mask = size - 1;
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->head, 0);
+    return 0;
+}
+
+/*
+    seq == pos: free for the producer that claims pos
+    seq == pos + 1: filled, for the consumer that claims pos
+    the consumer hands it back as pos + size for the next lap
+*/
+static int ring_push(tftp_io_ring_t *r, void *ptr)
+{
+    size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    tftp_io_cell_t *c;
+
+    for (;;)
+    {
+        c = &r->cells[pos & r->mask];
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return -1; // full
+        else
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    }
+    c->ptr = ptr;
+    atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+static void *ring_pop(tftp_io_ring_t *r)
+{
+    size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    tftp_io_cell_t *c;
+
+    for (;;)
+    {
+        c = &r->cells[pos & r->mask];
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return NULL; // empty
+        else
+            pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    }
+    void *ptr = c->ptr;
+    atomic_store_explicit(&c->seq, pos + r->mask + 1, memory_order_release);
+    return ptr;
+}
+
+static void stat_max(_Atomic uint64_t *max, uint64_t v)
+{
+    uint64_t cur = atomic_load_explicit(max, memory_order_relaxed);
+    while (v > cur && !atomic_compare_exchange_weak_explicit(max, &cur, v, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static void job_finish(tftp_io_job_t *job)
+{
+    tftp_io_done_t *d = job->reply;
+    uint64_t one = 1;
+
+    if (!d)
+    {
+        if (job->done)
+            job->done(job);
+        return;
+    }
+    // the worker bounds what it has in flight below IOPOOL_DONE_SIZE, this only waits out a burst
+    while (ring_push(&d->ring, job) < 0)
+        sched_yield();
+    if (write(d->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("write io eventfd");
+}
+
+void io_done_post(tftp_io_done_t *d, tftp_io_job_t *job)
+{
+    job->reply = d;
+    job_finish(job);
+}
+
+static void job_run(tftp_io_job_t *job)
+{
+    uint64_t start = tftp_now_us();
+    uint64_t wait = start - job->queued_us;
+
+    job->run(job);
+
+    uint64_t ran = tftp_now_us() - start;
+    atomic_fetch_add_explicit(&st_wait, wait, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st_run, ran, memory_order_relaxed);
+    stat_max(&st_wait_max, wait);
+    stat_max(&st_run_max, ran);
+    job_finish(job);
+}
+
+static void *iopool_run(void *arg)
+{
+    uint64_t count;
+
+    (void)arg;
+    for (;;)
+    {
+        // one count per job, so after a read there is one to take - or we're stopping
+        if (read(wake_fd, &count, sizeof(count)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("read io eventfd");
+            break;
+        }
+        /*
+            the count is for a job that's published, but the head slot can
+            still be one a slower producer claimed and hasn't filled - going
+            back to read() would spend the count and leave the published job
+            waiting for the next submit. only a stop's count has no job
+        */
+        tftp_io_job_t *job;
+        while (!(job = ring_pop(&queue)) && atomic_load(&running))
+            sched_yield();
+        if (job)
+            job_run(job);
+        else
+            break;
+    }
+    return NULL;
+}
+
+int iopool_start(int n)
+{
+    sigset_t all, old;
+
+    if (n <= 0)
+        return 0; // everything runs inline
+
+    if (ring_init(&queue, IOPOOL_QUEUE_SIZE) < 0)
+        return -1;
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE);
+    threads = calloc(n, sizeof(*threads));
+    if (wake_fd < 0 || !threads)
+    {
+        perror("iopool");
+        return -1;
+    }
+
+    atomic_store(&running, 1);
+    // signals stay with the main thread, like the workers
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (nthreads = 0; nthreads < n; nthreads++)
+    {
+        int err = pthread_create(&threads[nthreads], NULL, iopool_run, NULL);
+        if (err != 0)
+        {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (nthreads == 0)
+    {
+        atomic_store(&running, 0);
+        return -1;
+    }
+    return 0;
+}
+
+void iopool_stop(void)
+{
+    uint64_t n;
+
+    if (!atomic_load(&running))
+        return;
+    atomic_store(&running, 0);
+
+    // a count per thread on top of the jobs, each of them finds the ring empty once
+    n = nthreads;
+    if (write(wake_fd, &n, sizeof(n)) < 0)
+        perror("write io eventfd");
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    free(queue.cells);
+    close(wake_fd);
+    threads = NULL;
+    queue.cells = NULL;
+    wake_fd = -1;
+}
+
+int io_done_init(tftp_io_done_t *d)
+{
+    if (ring_init(&d->ring, IOPOOL_DONE_SIZE) < 0)
+        return -1;
+    d->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (d->efd < 0)
+    {
+        free(d->ring.cells);
+        d->ring.cells = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void io_done_destroy(tftp_io_done_t *d)
+{
+    if (d->efd >= 0)
+        close(d->efd);
+    free(d->ring.cells);
+    d->efd = -1;
+    d->ring.cells = NULL;
+}
+
+void iopool_submit(tftp_io_job_t *job, tftp_io_done_t *reply)
+{
+    uint64_t one = 1;
+
+    job->reply = reply;
+    job->queued_us = tftp_now_us();
+
+    if (atomic_load_explicit(&running, memory_order_acquire) && ring_push(&queue, job) == 0)
+    {
+        atomic_fetch_add_explicit(&st_jobs, 1, memory_order_relaxed);
+        stat_max(&st_depth_max, iopool_depth());
+        if (write(wake_fd, &one, sizeof(one)) < 0)
+            perror("write io eventfd");
+        return;
+    }
+
+    // no pool to take it, the caller blocks like it always did
+    atomic_fetch_add_explicit(&st_inline, 1, memory_order_relaxed);
+    job->run(job);
+    job_finish(job);
+}
+
+int io_done_drain(tftp_io_done_t *d)
+{
+    uint64_t count;
+    tftp_io_job_t *job;
+    int n = 0;
+
+    // reset first, a completion pushed after this read kicks it again
+    if (read(d->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("read io eventfd");
+    while ((job = ring_pop(&d->ring)) != NULL)
+    {
+        if (job->done)
+            job->done(job);
+        n++;
+    }
+    return n;
+}
+
+size_t iopool_depth(void)
+{
+    if (!queue.cells)
+        return 0;
+    size_t tail = atomic_load_explicit(&queue.tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue.head, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+void iopool_stats(tftp_iopool_stats_t *out)
+{
+    out->jobs = atomic_load(&st_jobs);
+    out->inline_jobs = atomic_load(&st_inline);
+    out->depth_max = atomic_load(&st_depth_max);
+    out->wait_us = atomic_load(&st_wait);
+    out->wait_max_us = atomic_load(&st_wait_max);
+    out->run_us = atomic_load(&st_run);
+    out->run_max_us = atomic_load(&st_run_max);
+}
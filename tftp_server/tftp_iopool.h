@@ -0,0 +1,96 @@
+#ifndef TFTP_IOPOOL_H
+#define TFTP_IOPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+    disk I/O pool - anything that can block on storage (opening and
+    checking files, loading the cache, pwrite, fsync, rename, unlink)
+    runs on these threads instead of a worker's event loop, so one
+    slow disk never holds up the packets of other transfers.
+    workers push jobs into one shared bounded ring (lock-free, many
+    producers and consumers) and the pool thread that took a job pushes
+    it back into the submitting worker's completion ring (many
+    producers, one consumer) and kicks that worker's eventfd, which
+    sits in its epoll set. the worker then calls the job's done()
+*/
+
+#define IOPOOL_THREADS 4        // default, -i on the command line
+#define IOPOOL_QUEUE_SIZE 4096  // jobs waiting for a pool thread, power of two
+#define IOPOOL_DONE_SIZE 4096   // completions per worker, power of two
+
+typedef struct
+{
+    _Atomic size_t seq;
+    void *ptr;
+} tftp_io_cell_t;
+
+// bounded ring of pointers, every cell carries its lap like the logger's
+typedef struct
+{
+    tftp_io_cell_t *cells;
+    size_t mask;
+    _Atomic size_t tail; // next position a producer claims
+    _Atomic size_t head; // next position a consumer claims
+} tftp_io_ring_t;
+
+// a worker's completion queue
+typedef struct
+{
+    tftp_io_ring_t ring;
+    int efd; // readable while completions are waiting
+} tftp_io_done_t;
+
+typedef struct tftp_io_job tftp_io_job_t;
+
+/*
+    embedded at the start of whatever the job needs, run() is called
+    on a pool thread, done() on the worker that submitted it (or right
+    after run() on the pool thread if there was no queue to answer to)
+*/
+struct tftp_io_job
+{
+    void (*run)(tftp_io_job_t *job);
+    void (*done)(tftp_io_job_t *job);
+    tftp_io_done_t *reply;
+    uint64_t queued_us;
+};
+
+typedef struct
+{
+    uint64_t jobs;        // went through the pool
+    uint64_t inline_jobs; // ran on the submitting thread, the pool was off or full
+    uint64_t depth_max;   // most jobs waiting at once
+    uint64_t wait_us;     // queued -> picked up, total
+    uint64_t wait_max_us;
+    uint64_t run_us;      // time in run(), total
+    uint64_t run_max_us;
+} tftp_iopool_stats_t;
+
+int iopool_start(int threads);
+//runs what's still queued, then stops the threads
+void iopool_stop(void);
+
+int io_done_init(tftp_io_done_t *d);
+void io_done_destroy(tftp_io_done_t *d);
+
+/*
+    queues job, its done() goes through reply (NULL: nobody waits for it).
+    never fails - with the pool stopped or its queue full the job runs
+    right here, and its done() still comes through reply
+*/
+void iopool_submit(tftp_io_job_t *job, tftp_io_done_t *reply);
+
+//no pool thread involved, job's done() runs on the worker d belongs to - one worker handing work to another
+void io_done_post(tftp_io_done_t *d, tftp_io_job_t *job);
+
+//on the worker, when efd is readable - calls done() of every finished job, returns how many
+int io_done_drain(tftp_io_done_t *d);
+
+//jobs queued and not picked up yet
+size_t iopool_depth(void);
+void iopool_stats(tftp_iopool_stats_t *out);
+
+#endif
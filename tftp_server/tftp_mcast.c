@@ -0,0 +1,541 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "../utils/tftp_logger.h"
+#include "tftp_mcast.h"
+#include "tftp_session.h"
+#include "tftp_server.h"
+
+static int enabled;
+static struct in_addr group_addr;
+static struct in_addr if_addr; // INADDR_ANY: the kernel's choice of interface
+static uint16_t base_port = MCAST_PORT;
+
+// the registry - the workers look groups up by file, the owner changes them
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static tftp_mcast_t *groups;
+static char slots[MCAST_GROUPS];
+
+static _Atomic uint64_t st_groups, st_clients, st_done, st_packets, st_bytes;
+
+int mcast_configure(const char *spec)
+{
+    char buf[64];
+    char *at, *colon;
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    if ((at = strchr(buf, '@')) != NULL)
+    {
+        *at++ = '\0';
+        if (inet_pton(AF_INET, at, &if_addr) != 1)
+            return -1;
+    }
+    if ((colon = strchr(buf, ':')) != NULL)
+    {
+        *colon++ = '\0';
+        int port = atoi(colon);
+        if (port <= 0 || port + MCAST_GROUPS > 65536)
+            return -1;
+        base_port = port;
+    }
+    if (inet_pton(AF_INET, buf, &group_addr) != 1 || !IN_MULTICAST(ntohl(group_addr.s_addr)))
+        return -1;
+    enabled = 1;
+    return 0;
+}
+
+int mcast_enabled(void)
+{
+    return enabled;
+}
+
+// under the lock, nobody finds it anymore and its port is free for the next group
+static void group_unlink(tftp_mcast_t *g)
+{
+    if (!g->linked)
+        return;
+    for (tftp_mcast_t **p = &groups; *p; p = &(*p)->next)
+    {
+        if (*p == g)
+        {
+            *p = g->next;
+            break;
+        }
+    }
+    g->linked = 0;
+    slots[g->slot] = 0;
+    g->slot = -1;
+}
+
+// under the lock, frees it once the registry, the session and the joins all let go
+static void group_put(tftp_mcast_t *g)
+{
+    if (g->linked || g->s || g->joins > 0)
+        return;
+    free(g->members);
+    free(g->parked);
+    free(g);
+}
+
+int mcast_join(const char *filename, int blksize, tftp_io_done_t *ioq, tftp_io_job_t *job, tftp_mcast_t **group)
+{
+    tftp_mcast_t *g;
+    int slot;
+
+    pthread_mutex_lock(&lock);
+    for (g = groups; g; g = g->next)
+    {
+        if (g->blksize == blksize && strcmp(g->filename, filename) == 0)
+        {
+            // posted under the lock, the group can't be released before the owner has the job
+            g->joins++;
+            *group = g;
+            io_done_post(g->ioq, job);
+            pthread_mutex_unlock(&lock);
+            return 1;
+        }
+    }
+
+    for (slot = 0; slot < MCAST_GROUPS && slots[slot]; slot++)
+        ;
+    g = slot < MCAST_GROUPS ? calloc(1, sizeof(*g)) : NULL;
+    if (!g)
+    {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    snprintf(g->filename, sizeof(g->filename), "%s", filename);
+    g->blksize = blksize;
+    g->ioq = ioq;
+    g->slot = slot;
+    g->master = -1;
+    g->linked = 1;
+    g->next = groups;
+    groups = g;
+    slots[slot] = 1;
+    *group = g;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+int mcast_attach(tftp_mcast_t *g, tftp_session_t *s)
+{
+    struct sockaddr_in local;
+    unsigned char ttl = MCAST_TTL, loop = 1;
+    int fd;
+
+    // netascii streams only go front to back, a group reads blocks in any order
+    if (s->src.kind == SOURCE_STREAM)
+        return -1;
+
+    g->cap = 8;
+    g->members = calloc(g->cap, sizeof(*g->members));
+    if (!g->members)
+        return -1;
+
+    /*
+        a socket of its own that isn't connected - DATA goes to the
+        group and the OACKs to each member. bound to a port of its
+        own before anything is sent, it stays the group's TID
+    */
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &if_addr, sizeof(if_addr)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0)
+    {
+        perror("Error setting up multicast socket");
+        close(fd);
+        return -1;
+    }
+    close(s->sockfd);
+    s->sockfd = fd;
+
+    g->group.sin_family = AF_INET;
+    g->group.sin_addr = group_addr;
+    g->group.sin_port = htons(base_port + g->slot);
+    g->size = s->src.kind == SOURCE_CACHE ? s->src.len : s->src.size;
+    g->nblocks = g->size / g->blksize + 1;
+
+    g->members[0].addr = s->peer;
+    g->members[0].opts = s->opts;
+    g->members[0].state = MCAST_WAITING;
+    g->nmembers = 1;
+    atomic_fetch_add_explicit(&st_clients, 1, memory_order_relaxed);
+
+    // lockstep, the master ACKs every block (RFC 2090)
+    s->windowsize = 1;
+    s->mc = g;
+    return 0;
+}
+
+void mcast_publish(tftp_mcast_t *g, tftp_session_t *s)
+{
+    tftp_io_job_t **parked = g->parked;
+    int nparked = g->nparked;
+
+    g->parked = NULL;
+    g->nparked = g->parked_cap = 0;
+
+    pthread_mutex_lock(&lock);
+    if (s)
+        g->s = s;
+    else
+        group_unlink(g); // the parked joins find it over and start their own
+    group_put(g);
+    pthread_mutex_unlock(&lock);
+    if (s)
+        atomic_fetch_add_explicit(&st_groups, 1, memory_order_relaxed);
+
+    // g may be gone by the last one
+    for (int i = 0; i < nparked; i++)
+    {
+        parked[i]->done(parked[i]);
+    }
+    free(parked);
+}
+
+int mcast_pending(const tftp_mcast_t *g)
+{
+    int joins;
+
+    pthread_mutex_lock(&lock);
+    joins = g->joins;
+    pthread_mutex_unlock(&lock);
+    return joins > 0;
+}
+
+void mcast_release(tftp_mcast_t *g)
+{
+    pthread_mutex_lock(&lock);
+    group_unlink(g);
+    g->s = NULL;
+    group_put(g);
+    pthread_mutex_unlock(&lock);
+}
+
+static void arm_timer(tftp_session_t *s, uint64_t now)
+{
+    s->deadline_us = now + rtt_timeout_us(&s->rtt);
+}
+
+// one member's OACK, its own options answered plus where the group is and whether it's the master
+static void send_oack(tftp_session_t *s, const tftp_mcast_member_t *m, int mc)
+{
+    tftp_mcast_t *g = s->mc;
+    tftp_options_t opts = m->opts;
+    char addr[INET_ADDRSTRLEN];
+    char pkt[TFTP_BUF_SIZE];
+
+    if (opts.present & TFTP_OPT_TSIZE)
+        opts.tsize = g->size;
+    if (opts.present & TFTP_OPT_WINDOWSIZE)
+        opts.windowsize = 1;
+    opts.present &= ~TFTP_OPT_ROLLOVER; // a group's blocks wrap to 0, all members have to agree
+    opts.present &= ~(TFTP_OPT_OFFSET | TFTP_OPT_TAILSUM); // and start at the file's first byte
+    opts.present &= ~TFTP_OPT_COMPRESS;                    // as it is
+    inet_ntop(AF_INET, &g->group.sin_addr, addr, sizeof(addr));
+    snprintf(opts.multicast, sizeof(opts.multicast), "%s,%u,%d", addr, ntohs(g->group.sin_port), mc);
+    opts.present |= TFTP_OPT_MULTICAST;
+
+    size_t len = tftp_build_oack(pkt, sizeof(pkt), &opts);
+    if (sendto(s->sockfd, pkt, len, 0, (const struct sockaddr *)&m->addr, sizeof(m->addr)) < 0 &&
+        errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        perror("Error sending multicast OACK");
+    }
+}
+
+// block seq to the whole group - not through the ring, the socket isn't connected
+static void send_block(tftp_session_t *s, uint32_t seq, int fresh)
+{
+    tftp_mcast_t *g = s->mc;
+    const char *data;
+    uint64_t now = tftp_now_us();
+    ssize_t n = source_block(&s->src, seq, s->blksize, s->win + 4, &data);
+
+    if (n < 0)
+    {
+        logger("ERROR", "Transfer of %s aborted: read error\n", s->filename);
+        s->failed = 1;
+        s->state = SESSION_DONE;
+        return;
+    }
+
+    s->win[0] = 0;
+    s->win[1] = TFTP_OPCODE_DATA;
+    s->win[2] = (seq >> 8) & 0xFF;
+    s->win[3] = seq & 0xFF;
+
+    struct iovec iov[2] = {{s->win, 4}, {(void *)data, n}};
+    struct msghdr msg = {0};
+    msg.msg_name = &g->group;
+    msg.msg_namelen = sizeof(g->group);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if (sendmsg(s->sockfd, &msg, 0) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        perror("Error sending multicast DATA");
+    }
+
+    g->cur = seq;
+    g->cur_len = n;
+    s->block_n = seq;
+    s->tx.calls++;
+    s->tx.packets++;
+    atomic_fetch_add_explicit(&st_packets, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st_bytes, n, memory_order_relaxed);
+    s->pkt_sent_us = fresh ? now : 0;
+    arm_timer(s, now);
+}
+
+// under the lock - no member left to serve and nothing on its way, the group ends
+static int group_close(tftp_mcast_t *g)
+{
+    int r = -1;
+
+    pthread_mutex_lock(&lock);
+    if (g->joins == 0)
+    {
+        group_unlink(g);
+        r = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return r;
+}
+
+// hands the group to the first client still waiting, or ends it
+static void next_master(tftp_session_t *s, uint64_t now)
+{
+    tftp_mcast_t *g = s->mc;
+
+    s->retries = 0;
+    s->last_progress_us = now;
+    rtt_progress(&s->rtt);
+
+    for (int i = 0; i < g->nmembers; i++)
+    {
+        if (g->members[i].state == MCAST_WAITING)
+        {
+            g->master = i;
+            g->master_oack = 1;
+            g->members[i].state = MCAST_MASTER;
+            send_oack(s, &g->members[i], 1);
+            s->pkt_sent_us = now;
+            arm_timer(s, now);
+            return;
+        }
+    }
+
+    g->master = -1;
+    if (group_close(g) == 0)
+    {
+        logger("INFO", "File sent successfully: %s (multicast, %d clients)\n", s->filename, g->nmembers);
+        s->state = SESSION_DONE;
+        return;
+    }
+    // a join is still on its way, it becomes the master when it gets here
+    s->deadline_us = now + (uint64_t)TIMEOUT_MS * 1000;
+}
+
+int mcast_begin(tftp_session_t *s)
+{
+    next_master(s, tftp_now_us());
+    return 0;
+}
+
+static int member_find(const tftp_mcast_t *g, const struct sockaddr_in *addr)
+{
+    for (int i = 0; i < g->nmembers; i++)
+    {
+        if (g->members[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            g->members[i].addr.sin_port == addr->sin_port)
+            return i;
+    }
+    return -1;
+}
+
+int mcast_add(tftp_mcast_t *g, const struct sockaddr_in *addr, const tftp_options_t *opts, tftp_io_job_t *job)
+{
+    tftp_session_t *s = g->s;
+
+    if (!s && g->linked)
+    {
+        // the request that makes the session is still in the pool
+        if (g->nparked == g->parked_cap)
+        {
+            int cap = g->parked_cap ? 2 * g->parked_cap : 16;
+            tftp_io_job_t **p = realloc(g->parked, cap * sizeof(*p));
+            if (!p)
+                goto over;
+            g->parked = p;
+            g->parked_cap = cap;
+        }
+        g->parked[g->nparked++] = job;
+        return 1;
+    }
+
+over:
+    pthread_mutex_lock(&lock);
+    g->joins--;
+    if (!s || s->state == SESSION_DONE)
+    {
+        // ended, or failed and nobody noticed yet - the next request for the file gets a new group
+        group_unlink(g);
+        group_put(g);
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&lock);
+
+    int i = member_find(g, addr);
+    if (i >= 0)
+    {
+        // its RRQ again, the OACK got lost - or it's back for another copy
+        if (g->members[i].state == MCAST_DONE)
+            g->members[i].state = MCAST_WAITING;
+    }
+    else
+    {
+        if (g->nmembers == g->cap)
+        {
+            tftp_mcast_member_t *m = realloc(g->members, 2 * g->cap * sizeof(*m));
+            if (!m)
+                return 0; // dropped, it asks again
+            g->members = m;
+            g->cap *= 2;
+        }
+        i = g->nmembers++;
+        g->members[i].addr = *addr;
+        g->members[i].opts = *opts;
+        g->members[i].state = MCAST_WAITING;
+        atomic_fetch_add_explicit(&st_clients, 1, memory_order_relaxed);
+    }
+
+    if (g->master < 0)
+        next_master(s, tftp_now_us());
+    else
+        send_oack(s, &g->members[i], g->members[i].state == MCAST_MASTER);
+    return 0;
+}
+
+void mcast_on_packet(tftp_session_t *s, const unsigned char *buf, ssize_t len, const struct sockaddr_in *from)
+{
+    tftp_mcast_t *g = s->mc;
+    uint64_t now = tftp_now_us();
+    int i;
+
+    if (!from || len < 4 || buf[0] != 0 || (i = member_find(g, from)) < 0)
+    {
+        return;
+    }
+
+    if (buf[1] == TFTP_OPCODE_ERROR)
+    {
+        // only that client is out, the group goes on without it
+        logger("ERROR", "Multicast client left %s with an error\n", s->filename);
+        g->members[i].state = MCAST_DONE;
+        if (i == g->master)
+            next_master(s, now);
+        return;
+    }
+
+    // the others listen, only the master's ACKs count
+    if (buf[1] != TFTP_OPCODE_ACK || i != g->master)
+    {
+        return;
+    }
+
+    // ACK n asks for n + 1 - right after its OACK that can be any block, later only cur or past it
+    uint32_t acked = tftp_block_seq(g->cur, (buf[2] << 8) | buf[3], 0);
+    if (g->master_oack)
+    {
+        g->master_oack = 0;
+    }
+    else if (acked < g->cur)
+    {
+        return; // a stale duplicate, answering it is the sorcerer's apprentice bug
+    }
+    else if (acked == g->cur)
+    {
+        s->bytes_sent += g->cur_len;
+    }
+
+    if (s->pkt_sent_us)
+        rtt_sample(&s->rtt, now - s->pkt_sent_us);
+    else
+        rtt_spurious(&s->rtt, now);
+    s->retries = 0;
+    s->last_progress_us = now;
+    rtt_progress(&s->rtt);
+
+    if (acked >= g->nblocks)
+    {
+        g->members[i].state = MCAST_DONE;
+        atomic_fetch_add_explicit(&st_done, 1, memory_order_relaxed);
+        next_master(s, now);
+        return;
+    }
+    send_block(s, acked + 1, 1);
+}
+
+void mcast_on_timeout(tftp_session_t *s, uint64_t now_us)
+{
+    tftp_mcast_t *g = s->mc;
+
+    if (g->master < 0)
+    {
+        next_master(s, now_us); // the join it waited for came to nothing
+        return;
+    }
+
+    int waiting = 0;
+    for (int i = 0; i < g->nmembers && !waiting; i++)
+        waiting = g->members[i].state == MCAST_WAITING;
+
+    // gone before it got the file, or never there - the others shouldn't sit out the whole give up time
+    if (now_us - s->last_progress_us >= rtt_give_up_us(&s->rtt, MAX_RETRIES) ||
+        (g->master_oack && waiting && s->retries >= MCAST_OACK_RETRIES))
+    {
+        fprintf(stderr, "Multicast master of %s stopped answering, passing the group on\n", s->filename);
+        logger("ERROR", "Multicast master of %s stopped answering\n", s->filename);
+        g->members[g->master].state = MCAST_DONE;
+        next_master(s, now_us);
+        return;
+    }
+
+    s->retries++;
+    rtt_backoff(&s->rtt, now_us);
+    if (g->master_oack)
+    {
+        send_oack(s, &g->members[g->master], 1);
+        s->pkt_sent_us = 0;
+        arm_timer(s, now_us);
+    }
+    else
+    {
+        send_block(s, g->cur, 0);
+    }
+}
+
+void mcast_stats(tftp_mcast_stats_t *out)
+{
+    out->groups = atomic_load(&st_groups);
+    out->clients = atomic_load(&st_clients);
+    out->done = atomic_load(&st_done);
+    out->packets = atomic_load(&st_packets);
+    out->bytes = atomic_load(&st_bytes);
+}
@@ -0,0 +1,125 @@
+#ifndef TFTP_MCAST_H
+#define TFTP_MCAST_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "../utils/tftp_utils.h"
+#include "../utils/tftp_options.h"
+#include "tftp_iopool.h"
+
+struct tftp_session;
+
+/*
+    RFC 2090 multicast RRQs, -m on the command line - clients that ask
+    for the same file with the same blksize share one group session and
+    every DATA block goes out once, to a multicast group they all joined.
+    one of them at a time is the master: it ACKs in lockstep and the
+    server sends the block after the one it ACKed. the others just
+    listen, they got an OACK with mc=0. when the master has everything
+    it ACKs the last block and the next client that's still waiting is
+    made master with an OACK mc=1 - it ACKs the block before the first
+    one it's missing, and the group goes back to fill its holes.
+    the group lives on the worker whose request created it, requests for
+    it that land on other workers (SO_REUSEPORT) are posted to that
+    worker's completion queue, see mcast_join. a group for which no
+    multicast port is left, netascii and files that can't be read by
+    block are plain unicast transfers - the OACK just leaves the
+    option out, which RFC 2090 clients take as a no
+*/
+
+#define MCAST_PORT 1758   // first group port when -m doesn't say
+#define MCAST_GROUPS 64   // groups at once, each on port + its slot
+#define MCAST_TTL 1       // the boot LAN, not beyond the first router
+#define MCAST_OACK_RETRIES 2 // a master that never answered its OACK is passed over after these, if others wait
+
+typedef enum
+{
+    MCAST_WAITING, // got its OACK mc=0, listening
+    MCAST_MASTER,  // got (or is getting) its OACK mc=1, ACKs drive the group
+    MCAST_DONE     // ACKed the last block, or was given up on
+} tftp_mcast_state_t;
+
+typedef struct
+{
+    struct sockaddr_in addr;
+    tftp_options_t opts; // what it asked for, its OACK answers these
+    tftp_mcast_state_t state;
+} tftp_mcast_member_t;
+
+typedef struct tftp_mcast
+{
+    // registry, under the module's lock
+    char filename[PATH_LENGTH];
+    int blksize;
+    tftp_io_done_t *ioq;        // the owning worker's, joins go there
+    struct tftp_session *s;     // NULL until mcast_publish
+    int linked;                 // findable by mcast_join
+    int joins;                  // posted to the owner or parked, not handled yet
+    int slot;                   // port offset, -1 once given back
+    struct tftp_mcast *next;
+
+    // the rest is only touched by the owner
+    tftp_io_job_t **parked;     // joins that came before the session
+    int nparked, parked_cap;
+    struct sockaddr_in group;
+    tftp_mcast_member_t *members;
+    int nmembers, cap;
+    int master;                 // index into members, -1 when nobody is
+    int master_oack;            // the master hasn't answered its OACK mc=1 yet
+    uint64_t size;              // bytes on the wire, what tsize answers
+    uint32_t nblocks;           // the last block, the short one
+    uint32_t cur;               // block last sent, 0 before the first
+    size_t cur_len;             // its payload
+} tftp_mcast_t;
+
+typedef struct
+{
+    uint64_t groups;  // sessions that multicast
+    uint64_t clients; // members they took
+    uint64_t done;    // members that got the whole file
+    uint64_t packets; // DATA sent to a group, resends included
+    uint64_t bytes;   // their payload
+} tftp_mcast_stats_t;
+
+//"group[:port][@ifaddr]", -1 if that's not a multicast address - until then the option is ignored
+int mcast_configure(const char *spec);
+int mcast_enabled(void);
+
+/*
+    on the worker that got a multicast RRQ: if a group is sending
+    filename in blksize blocks, *group is set to it and job is posted
+    to its owner (job->reply), whose done() calls mcast_add - returns 1.
+    otherwise a new group is registered with ioq as its owner and the
+    request is the one to start it, *group is set and 0 returned.
+    -1: no port left, it's a plain transfer
+*/
+int mcast_join(const char *filename, int blksize, tftp_io_done_t *ioq, tftp_io_job_t *job, tftp_mcast_t **group);
+
+/*
+    on the owner, for a posted join - 0 the client is in (its OACK is
+    out), 1 it's parked until the session is published and done() runs
+    again then, -1 the group is over and the request needs a new one
+*/
+int mcast_add(tftp_mcast_t *g, const struct sockaddr_in *addr, const tftp_options_t *opts, tftp_io_job_t *job);
+
+//on the I/O pool, the session the new group's request created becomes the group - -1 it stays unicast
+int mcast_attach(tftp_mcast_t *g, struct tftp_session *s);
+
+//on the owner once the request is back, s NULL if it didn't become the group - parked joins run then
+void mcast_publish(tftp_mcast_t *g, struct tftp_session *s);
+
+//the OACK mc=1 to the first client, from session_begin
+int mcast_begin(struct tftp_session *s);
+//an ACK or ERROR from one of the members
+void mcast_on_packet(struct tftp_session *s, const unsigned char *buf, ssize_t len, const struct sockaddr_in *from);
+//the master went quiet, resend to it or give up on it
+void mcast_on_timeout(struct tftp_session *s, uint64_t now_us);
+//joins are still on their way to the session, it can't go yet
+int mcast_pending(const tftp_mcast_t *g);
+//from session_destroy
+void mcast_release(tftp_mcast_t *g);
+
+void mcast_stats(tftp_mcast_stats_t *out);
+
+#endif
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include "tftp_prefetch.h"
+
+struct tftp_prefetch
+{
+    tftp_io_job_t job; // first, the job is the prefetch
+    int fd;
+    const char *map; // set: touch pages, no ring
+    uint64_t start;  // file offset of block 1, past 0 for a resumed transfer
+    uint64_t len;
+    int blksize;
+    prefetch_fill_t fill; // set: a stream, blocks only come in order
+    void *ctx;
+    uint32_t skip; // stream: blocks still to read and drop before the first one, the job's
+
+    int slots; // K
+    int batch; // blocks a job fills before the file goes back to the queue
+    char *ring;
+    size_t *ring_len;
+
+    atomic_uint last;  // last block, a stream's is known once its short block was read
+    atomic_uint ready; // every block below this is filled, written by the job
+    atomic_uint limit; // the job stops before this, base + K - written by the worker
+    atomic_int failed; // a read error, the transfer fails once it gets there
+
+    // the worker's, a job's done() comes back to it
+    tftp_io_done_t *ioq; // NULL until bound, the caller reads what it needs itself
+    void (*notify)(void *arg);
+    void *notify_arg;
+    int busy;          // the job is out
+    uint32_t waiting;  // the sender asked for this block and wasn't given it, 0 = nobody waits
+};
+
+static atomic_uint_fast64_t served, stalls;
+
+static int has_work(tftp_prefetch_t *p)
+{
+    unsigned ready = atomic_load_explicit(&p->ready, memory_order_relaxed);
+    return !atomic_load_explicit(&p->failed, memory_order_relaxed) &&
+           ready <= atomic_load_explicit(&p->last, memory_order_relaxed) &&
+           ready < atomic_load_explicit(&p->limit, memory_order_acquire);
+}
+
+// the stream's next block into slot, its length or -1
+static ssize_t fill_stream(tftp_prefetch_t *p, char *slot)
+{
+    size_t got = 0;
+
+    // a fill function may come back short before the end, only 0 means there's no more
+    while (got < (size_t)p->blksize)
+    {
+        ssize_t n = p->fill(p->ctx, slot + got, p->blksize - got);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+// brings block seq in, returns -1 on a read error
+static int fill_block(tftp_prefetch_t *p, uint32_t seq)
+{
+    uint64_t off = p->start + (uint64_t)(seq - 1) * p->blksize;
+    size_t want = off >= p->len ? 0 : (p->len - off < (uint64_t)p->blksize ? p->len - off : (size_t)p->blksize);
+    char *slot = p->map ? NULL : p->ring + (size_t)(seq % p->slots) * p->blksize;
+
+    if (p->fill)
+    {
+        ssize_t n = fill_stream(p, slot);
+        if (n < 0)
+            return -1;
+        p->ring_len[seq % p->slots] = n;
+        if (n < p->blksize)
+            atomic_store_explicit(&p->last, seq, memory_order_relaxed);
+        return 0;
+    }
+
+    if (p->map)
+    {
+        // fault the pages in here so the worker's sendmmsg doesn't
+        volatile char sink = 0;
+        for (size_t i = 0; i < want; i += 4096)
+            sink += p->map[off + i];
+        if (want)
+            sink += p->map[off + want - 1];
+        (void)sink;
+        return 0;
+    }
+
+    size_t got = 0;
+    while (got < want)
+    {
+        ssize_t n = pread(p->fd, slot + got, want - got, off + got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        got += n;
+    }
+    p->ring_len[seq % p->slots] = got;
+    return 0;
+}
+
+// on a pool thread, the next blocks up to the limit - a batch of them, then it's another file's turn
+static void prefetch_run(tftp_io_job_t *io)
+{
+    tftp_prefetch_t *p = (tftp_prefetch_t *)io;
+    uint32_t seq = atomic_load_explicit(&p->ready, memory_order_relaxed);
+
+    // a stream that starts late converts its way up to the first block, nobody reads what's in the slot
+    for (; p->skip > 0; p->skip--)
+    {
+        if (fill_stream(p, p->ring) < 0)
+        {
+            atomic_store_explicit(&p->failed, 1, memory_order_relaxed);
+            return;
+        }
+    }
+
+    for (int n = 0; n < p->batch && has_work(p); n++)
+    {
+        if (fill_block(p, seq) < 0)
+        {
+            atomic_store_explicit(&p->failed, 1, memory_order_relaxed);
+            break;
+        }
+        atomic_store_explicit(&p->ready, ++seq, memory_order_release);
+    }
+}
+
+static void prefetch_kick(tftp_prefetch_t *p)
+{
+    if (p->ioq && !p->busy && has_work(p))
+    {
+        p->busy = 1;
+        iopool_submit(&p->job, p->ioq);
+    }
+}
+
+// back on the worker, the limit may have moved meanwhile
+static void prefetch_done(tftp_io_job_t *io)
+{
+    tftp_prefetch_t *p = (tftp_prefetch_t *)io;
+
+    p->busy = 0;
+    prefetch_kick(p);
+    // the sender goes on once what it waits for is there, or won't ever be
+    if (p->waiting && (p->waiting < atomic_load_explicit(&p->ready, memory_order_acquire) ||
+                       atomic_load_explicit(&p->failed, memory_order_relaxed) || !p->busy))
+    {
+        p->waiting = 0;
+        p->notify(p->notify_arg);
+    }
+}
+
+static tftp_prefetch_t *prefetch_new(int blksize, int windowsize, uint32_t first, int ring)
+{
+    tftp_prefetch_t *p = calloc(1, sizeof(*p));
+
+    if (!p)
+        return NULL;
+    p->job.run = prefetch_run;
+    p->job.done = prefetch_done;
+    p->blksize = blksize;
+
+    // the window itself plus the readahead, a window's slots stay put until they're ACKed
+    int ahead = PREFETCH_AHEAD_BYTES / blksize;
+    p->slots = windowsize + (ahead > 8 ? ahead : 8);
+    p->batch = windowsize > 8 ? windowsize : 8;
+    if (ring)
+    {
+        p->ring = malloc((size_t)p->slots * blksize);
+        p->ring_len = calloc(p->slots, sizeof(*p->ring_len));
+        if (!p->ring || !p->ring_len)
+        {
+            free(p->ring);
+            free(p->ring_len);
+            free(p);
+            return NULL;
+        }
+    }
+    atomic_init(&p->last, UINT32_MAX);
+    atomic_init(&p->ready, first);
+    atomic_init(&p->limit, first + p->slots);
+    atomic_init(&p->failed, 0);
+    return p;
+}
+
+tftp_prefetch_t *prefetch_attach(int fd, const char *map, uint64_t start, uint64_t len, int blksize, int windowsize,
+                                 uint32_t first)
+{
+    tftp_prefetch_t *p = prefetch_new(blksize, windowsize, first, map == NULL);
+
+    if (!p)
+        return NULL;
+    p->fd = fd;
+    p->map = map;
+    p->start = start;
+    p->len = len;
+    atomic_init(&p->last, (len - start) / blksize + 1);
+    return p;
+}
+
+tftp_prefetch_t *prefetch_attach_stream(prefetch_fill_t fill, void *ctx, int blksize, int windowsize, uint32_t first)
+{
+    tftp_prefetch_t *p = prefetch_new(blksize, windowsize, first, 1);
+
+    if (!p)
+        return NULL;
+    p->fill = fill;
+    p->ctx = ctx;
+    p->skip = first - 1;
+    return p;
+}
+
+void prefetch_bind(tftp_prefetch_t *p, tftp_io_done_t *ioq, void (*notify)(void *arg), void *arg)
+{
+    p->ioq = ioq;
+    p->notify = notify;
+    p->notify_arg = arg;
+    prefetch_kick(p);
+}
+
+int prefetch_busy(const tftp_prefetch_t *p)
+{
+    return p->busy;
+}
+
+void prefetch_detach(tftp_prefetch_t *p)
+{
+    free(p->ring);
+    free(p->ring_len);
+    free(p);
+}
+
+ssize_t prefetch_get(tftp_prefetch_t *p, uint32_t seq, const char **data)
+{
+    uint64_t off = p->start + (uint64_t)(seq - 1) * p->blksize;
+
+    // no worker to go back to, this is a thread that may block - read up to it here
+    while (!p->ioq && seq >= atomic_load_explicit(&p->ready, memory_order_acquire) && has_work(p))
+        prefetch_run(&p->job);
+
+    if (seq >= atomic_load_explicit(&p->ready, memory_order_acquire))
+    {
+        if (atomic_load_explicit(&p->failed, memory_order_relaxed) || !p->ioq)
+            return -1;
+        if (p->waiting != seq)
+            atomic_fetch_add_explicit(&stalls, 1, memory_order_relaxed);
+        p->waiting = seq;
+        prefetch_kick(p);
+        return PREFETCH_WAIT;
+    }
+    atomic_fetch_add_explicit(&served, 1, memory_order_relaxed);
+
+    if (p->map)
+    {
+        *data = p->map + (off < p->len ? off : p->len);
+        return off >= p->len ? 0 : (p->len - off < (uint64_t)p->blksize ? p->len - off : (uint64_t)p->blksize);
+    }
+    *data = p->ring + (size_t)(seq % p->slots) * p->blksize;
+    return p->ring_len[seq % p->slots];
+}
+
+void prefetch_advance(tftp_prefetch_t *p, uint32_t base)
+{
+    unsigned limit = base + p->slots;
+
+    if (limit <= atomic_load_explicit(&p->limit, memory_order_relaxed))
+        return;
+    // a job that's out sees the new limit on its next block, one that isn't gets queued
+    atomic_store_explicit(&p->limit, limit, memory_order_release);
+    prefetch_kick(p);
+}
+
+void prefetch_stats(uint64_t *ready, uint64_t *stall)
+{
+    *ready = atomic_load(&served);
+    *stall = atomic_load(&stalls);
+}
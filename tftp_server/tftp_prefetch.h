@@ -0,0 +1,61 @@
+#ifndef TFTP_PREFETCH_H
+#define TFTP_PREFETCH_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "tftp_iopool.h"
+
+/*
+    disk readahead for RRQs that aren't in the cache - every attached
+    file keeps its next K blocks ready while the window is in flight.
+    they're read by jobs on the I/O pool, at most one per file and a
+    window's worth of blocks per job, so a slow file ties up one pool
+    thread and the others go on with theirs. nothing is shared between
+    files and the worker only touches its own transfers': an ACK moves
+    the limit with an atomic store and queues a job if none is out.
+    a pread file gets a ring of K block buffers, a mapped file just gets
+    its pages faulted in ahead, and a stream that only goes front to
+    back (netascii conversion, deflate) is read into the ring by its
+    fill function. a job never fills past base + K, so a ring slot isn't
+    reused before the client ACKed the block that was in it.
+    a block no job has got to yet is a stall: the worker is told to
+    wait and hears back through notify once the job is done - before
+    prefetch_bind there's no worker, the caller reads it right there
+*/
+
+#define PREFETCH_AHEAD_BYTES (1 << 20) // read ahead of the window, at least 8 blocks
+
+// prefetch_get: not read yet, notify comes once it might be
+#define PREFETCH_WAIT (-2)
+
+typedef struct tftp_prefetch tftp_prefetch_t;
+
+//the next len bytes of a stream, fewer only at its end - -1 on a read error
+typedef ssize_t (*prefetch_fill_t)(void *ctx, char *buf, size_t len);
+
+/*
+    a file of len bytes whose block 1 is at start, read with pread from
+    fd or faulted in from map if it's mapped, from block first on (the
+    ones before are somebody else's) - NULL without the memory
+*/
+tftp_prefetch_t *prefetch_attach(int fd, const char *map, uint64_t start, uint64_t len, int blksize, int windowsize,
+                                 uint32_t first);
+//a stream read with fill(ctx) - the blocks before first are read and dropped, on the pool too
+tftp_prefetch_t *prefetch_attach_stream(prefetch_fill_t fill, void *ctx, int blksize, int windowsize, uint32_t first);
+
+//jobs go to the pool from here on and come back through ioq, on the worker that owns the transfer
+void prefetch_bind(tftp_prefetch_t *p, tftp_io_done_t *ioq, void (*notify)(void *arg), void *arg);
+//a job is out, the file and the prefetch can't go away yet
+int prefetch_busy(const tftp_prefetch_t *p);
+void prefetch_detach(tftp_prefetch_t *p);
+
+//block seq if it's ready, its length and *data - -1 on a read error, PREFETCH_WAIT when it isn't ready
+ssize_t prefetch_get(tftp_prefetch_t *p, uint32_t seq, const char **data);
+
+//everything below base was ACKed, the jobs may go on to base + K
+void prefetch_advance(tftp_prefetch_t *p, uint32_t base);
+
+//blocks that were ready in time and the ones the sender had to wait for
+void prefetch_stats(uint64_t *ready, uint64_t *stalls);
+
+#endif
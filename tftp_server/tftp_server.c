@@ -6,10 +6,20 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <sys/eventfd.h>
 #define _POSIX_C_SOURCE 200809L
 #include <signal.h>
 
 #include "tftp_server.h"
+#include "tftp_worker.h"
+#include "tftp_cache.h"
+#include "tftp_prefetch.h"
+#include "tftp_sink.h"
+#include "tftp_iopool.h"
+#include "tftp_uring.h"
+#include "tftp_mcast.h"
+#include "tftp_fstream.h"
+#include "tftp_compress.h"
 
 volatile sig_atomic_t server_running = 1; // calling the control+c handler
 
@@ -34,99 +44,246 @@ void setup_signal_handler(void)
     }
 }
 
-int main()
+static void usage(const char *prog)
 {
-    int sockfd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    char buffer[TFTP_BUF_SIZE];
-    ssize_t recv_len;
+    fprintf(stderr, "Usage: %s [-w workers] [-c cache_mb] [-s none|close|group] [-i io_threads] [-u] [-m group[:port][@ifaddr]] [-z level] [-p port]\n", prog);
+    fprintf(stderr, "  -w N   worker threads, each pinned to a CPU with its own socket (default 1, 0 = one per CPU)\n");
+    fprintf(stderr, "  -c MB  memory for the hot file cache shared by all RRQs (default %d, 0 = off)\n", CACHE_BUDGET_MB);
+    fprintf(stderr, "  -s     when uploads are fsynced: none, close (each one before its last ACK) or\n"
+                    "         group (batched by a commit thread), default none\n");
+    fprintf(stderr, "  -i N   threads doing the disk I/O off the network loops (default %d, 0 = none, workers block)\n", IOPOOL_THREADS);
+    fprintf(stderr, "  -u     run the workers on io_uring instead of epoll + sockets, if the kernel can\n");
+    fprintf(stderr, "  -m     answer the RFC 2090 multicast option (off by default) - groups go to this address,\n"
+                    "         one port each from port up (default %d), out of the interface with ifaddr\n", MCAST_PORT);
+    fprintf(stderr, "  -z N   deflate level for the compress option, 1-9 (default %d, 0 = don't take it)\n", COMPRESS_LEVEL);
+    fprintf(stderr, "  -p     port requests come in on (default %d)\n", TFTP_PORT);
+}
+
+int main(int argc, char *argv[])
+{
+    int workers = 1;
+    long cache_mb = CACHE_BUDGET_MB;
+    int sync_policy = SINK_SYNC_NONE;
+    int io_threads = IOPOOL_THREADS;
+    int use_uring = 0;
+    int port = TFTP_PORT;
+    int opt;
 
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    while ((opt = getopt(argc, argv, "w:c:s:i:um:z:p:h")) != -1)
     {
-        perror("Error creating socket\n");
-        exit(EXIT_FAILURE);
+        switch (opt)
+        {
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'c':
+            cache_mb = atol(optarg);
+            if (cache_mb < 0)
+                cache_mb = 0;
+            break;
+        case 'i':
+            io_threads = atoi(optarg);
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'z':
+            compress_set_level(atoi(optarg));
+            break;
+        case 'p':
+            port = atoi(optarg);
+            if (port <= 0 || port > 65535)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            if (mcast_configure(optarg) < 0)
+            {
+                fprintf(stderr, "Not a multicast group: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            sync_policy = sink_parse_policy(optarg);
+            if (sync_policy < 0)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
     }
 
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1)
+        ncpu = 1;
+    if (workers <= 0)
+        workers = ncpu;
+    if (workers > MAX_WORKERS)
+        workers = MAX_WORKERS;
+
     if (!dir_exist(TFTP_ROOT_DIR))
     {
         fprintf(stderr, "Failed to ensure client directory exists. Exiting.\n");
         exit(EXIT_FAILURE);
     }
 
-    // Set up server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY); // listening to all interfaces
-    server_addr.sin_port = htons(TFTP_PORT);
+    // transfers only drop records into a ring, a thread writes server.log
+    if (logger_start(LOG_FILE) < 0)
+    {
+        fprintf(stderr, "Failed to start the logger, logging synchronously\n");
+    }
+    atexit(logger_stop); // the exit() paths below still get their records out
+
+    cache_init((uint64_t)cache_mb << 20);
 
-    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    sink_set_policy(sync_policy);
+    if (sink_start() < 0)
     {
-        perror("Error binding socket");
-        close(sockfd);
-        exit(EXIT_FAILURE);
+        fprintf(stderr, "Failed to start the group commit thread, uploads are synced one by one\n");
+    }
+
+    // opening files and writing uploads happen there, never on a worker
+    if (iopool_start(io_threads) < 0)
+    {
+        fprintf(stderr, "Failed to start the I/O pool, workers do their own disk I/O\n");
     }
 
-    printf("TFTP server has started listening to requests\n");
-    logger("INFO", "Server has started\n");
+    // decided once for all workers, a kernel that can't run the whole path gets the socket one
+    if (use_uring && uring_probe() < 0)
+    {
+        fprintf(stderr, "io_uring is not usable here (%s), falling back to epoll and sockets\n", strerror(errno));
+        use_uring = 0;
+    }
 
-    if (signal(SIGINT, sigint_server) == SIG_ERR)
+    int stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stop_fd < 0)
     {
-        perror("Error setting signal handler");
+        perror("eventfd");
         exit(EXIT_FAILURE);
     }
 
+    tftp_worker_t *pool = calloc(workers, sizeof(*pool));
+    if (!pool)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < workers; i++)
+    {
+        if (worker_init(&pool[i], i, workers > 1 ? (int)(i % ncpu) : -1, port, stop_fd) < 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        pool[i].use_uring = use_uring;
+    }
+
     setup_signal_handler(); // for signal handler
 
-    while (server_running)
+    for (int i = 0; i < workers; i++)
     {
-        recv_len = recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&client_addr, &client_len);
-        if (recv_len < 0)
+        if (worker_start(&pool[i]) < 0)
         {
-            if (!server_running)
-            {
-                break; // exit loop
-            }
-            printf("Waiting for requests from the client...\n");
-            continue;
+            exit(EXIT_FAILURE);
         }
+    }
 
-        printf("Received packet from client\n");
+    printf("TFTP server has started listening to requests (%d worker%s, %s)\n", workers, workers > 1 ? "s" : "",
+           use_uring ? "io_uring" : "epoll");
+    logger("INFO", "Server has started with %d workers\n", workers);
 
-        // Extract the opcode (first 2 bytes)
-        uint16_t opcode = (buffer[0] << 8) | buffer[1];
+    // the workers block every signal, so control+c always lands here
+    while (server_running)
+    {
+        pause();
+    }
 
-        // Extract the filename and mode (assuming they are after the opcode)
-        const char *filename = (const char *)(buffer + 2);
+    uint64_t one = 1;
+    if (write(stop_fd, &one, sizeof(one)) < 0)
+    {
+        perror("write stop_fd");
+    }
 
-        // Find where the filename ends and the mode starts
-        const char *mode_start = strchr(filename, 0) + 1; // Find null byte marking the end of filename
-        const char *mode = mode_start;
+    for (int i = 0; i < workers; i++)
+    {
+        tftp_worker_t *w = &pool[i];
 
-        // Handle the different opcodes
-        switch (opcode)
+        worker_join(w);
+        printf("Worker %d: %llu requests, %llu transfers ok, %llu failed, %llu bytes sent, %llu bytes received\n",
+               w->id, (unsigned long long)w->requests, (unsigned long long)w->transfers_ok,
+               (unsigned long long)w->transfers_failed, (unsigned long long)w->bytes_sent,
+               (unsigned long long)w->bytes_received);
+        printf("Worker %d: batch sizes - requests %.2f/recvmmsg, session rx %.2f/recvmmsg, session tx %.2f/sendmmsg\n",
+               w->id, batch_stats_avg(&w->listen_rx), batch_stats_avg(&w->rx), batch_stats_avg(&w->tx));
+        if (w->uring.enters)
         {
-        case TFTP_OPCODE_RRQ: // Read Request
-            printf("Received RRQ (Read Request) from client\n");
-            rrq_handler(sockfd, &client_addr, client_len, filename, mode);
-            break;
+            printf("Worker %d: io_uring - %llu enters, %.2f SQEs and %.2f CQEs per enter, %llu recvs rearmed out of buffers\n",
+                   w->id, (unsigned long long)w->uring.enters, (double)w->uring.sqes / w->uring.enters,
+                   (double)w->uring.cqes / w->uring.enters, (unsigned long long)w->uring.nobufs);
+        }
+        worker_destroy(w);
+    }
 
-        case TFTP_OPCODE_WRQ: // Write Request
-            printf("Received WRQ (Write Request) from client\n");
-            wrq_handler(sockfd, &client_addr, client_len, filename, mode);
-            break;
+    // the workers waited for their own jobs, what's left are temp file cleanups
+    iopool_stop();
+    tftp_iopool_stats_t ios;
+    iopool_stats(&ios);
+    printf("I/O pool: %llu jobs (%llu inline), queue depth max %llu, wait avg %.1f us max %llu us, run avg %.1f us max %llu us\n",
+           (unsigned long long)ios.jobs, (unsigned long long)ios.inline_jobs, (unsigned long long)ios.depth_max,
+           ios.jobs ? (double)ios.wait_us / ios.jobs : 0.0, (unsigned long long)ios.wait_max_us,
+           ios.jobs ? (double)ios.run_us / ios.jobs : 0.0, (unsigned long long)ios.run_max_us);
 
-        case TFTP_OPCODE_DEL: // Delete Request
-            printf("Received DEL (Delete Request) from client\n");
-            del_handler(sockfd, &client_addr, client_len, filename);
-            break;
+    tftp_cache_stats_t cs;
+    cache_stats(&cs);
+    printf("Cache: %llu hits, %llu misses, %llu evictions, %llu files / %llu bytes held\n",
+           (unsigned long long)cs.hits, (unsigned long long)cs.misses, (unsigned long long)cs.evictions,
+           (unsigned long long)cs.entries, (unsigned long long)cs.bytes);
+    cache_destroy();
 
-        default:
-            logger("ERROR", "Unknown opcode received: %d\n", opcode);
-            break;
-        }
+    uint64_t pf_ready, pf_stalls;
+    prefetch_stats(&pf_ready, &pf_stalls);
+    printf("Prefetch: %llu blocks ready in time, %llu stalls waiting on disk\n",
+           (unsigned long long)pf_ready, (unsigned long long)pf_stalls);
+    sink_stop(); // uploads still waiting for a group commit go in place now
+
+    tftp_fstream_stats_t fss;
+    fstream_stats(&fss);
+    printf("Shared streams: %llu readers on %llu streams, %llu blocks read, %llu served from another reader's read, %llu readers went on alone\n",
+           (unsigned long long)fss.readers, (unsigned long long)fss.streams, (unsigned long long)fss.produced,
+           (unsigned long long)fss.shared, (unsigned long long)fss.alone);
+
+    tftp_compress_stats_t zs;
+    compress_stats(&zs);
+    if (zs.deflated || zs.reused || zs.inflated)
+        printf("Compression: %llu RRQs deflated (%llu kept), %llu sent from a kept one, %llu WRQs inflated, "
+               "%llu bytes <-> %llu compressed, %.1f ms in zlib\n",
+               (unsigned long long)zs.deflated, (unsigned long long)zs.kept, (unsigned long long)zs.reused,
+               (unsigned long long)zs.inflated, (unsigned long long)zs.raw_bytes, (unsigned long long)zs.zip_bytes,
+               zs.cpu_us / 1000.0);
+
+    if (mcast_enabled())
+    {
+        tftp_mcast_stats_t ms;
+        mcast_stats(&ms);
+        printf("Multicast: %llu groups, %llu clients (%llu got the whole file), %llu DATA sent, %llu bytes\n",
+               (unsigned long long)ms.groups, (unsigned long long)ms.clients, (unsigned long long)ms.done,
+               (unsigned long long)ms.packets, (unsigned long long)ms.bytes);
     }
 
-    close(sockfd);
+    free(pool);
+    close(stop_fd);
     logger("INFO", "Server has shut down\n");
-}
\ No newline at end of file
+    if (logger_dropped())
+    {
+        printf("%llu log records were dropped\n", (unsigned long long)logger_dropped());
+    }
+    logger_stop();
+    return 0;
+}
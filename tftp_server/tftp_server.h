@@ -2,16 +2,23 @@
 #define TFTP_SERVER_H
 
 #include <stdint.h>
-#include "tftp_server_handlers.h"
-#include "../utils/tftp_logger.h"
-
-
 
 #define MAX_RETRIES 5
+#define TIMEOUT_MS 5000 // 5 seconds timeout
 #define TFTP_ROOT_DIR "./tftp_root"
 
+//concurrent transfers served by each worker's event loop
+#define MAX_SESSIONS 1024
+#define MAX_WORKERS 256
+
+//memory a WRQ session may spend on its recvmmsg batch of DATA
+#define TFTP_BATCH_RX_BYTES (256 * 1024)
+
+#include "tftp_server_handlers.h"
+#include "../utils/tftp_logger.h"
+
 void sigint_server(int sig);
 void setup_signal_handler(void);
 void start_tftp_server();
 
-#endif
\ No newline at end of file
+#endif
@@ -4,7 +4,6 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
-#include <stdarg.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -18,38 +17,6 @@
 #include "tftp_server_handlers.h"
 #include "tftp_server.h"
 
-#define TIMEOUT_MS 5000 // 5 seconds timeout
-
-// logger
-void logger(const char *level, const char *format, ...)
-{
-    // Open the log file in append mode
-    FILE *file = fopen(LOG_FILE, "a");
-    if (!file)
-    {
-        perror("Error opening log file");
-        return;
-    }
-
-    time_t time_r;
-    struct tm *timeinfo;
-    char time_buf[50];
-
-    time(&time_r);
-    timeinfo = localtime(&time_r);
-    strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", timeinfo); // Format date
-
-    fprintf(file, "[%s [%s]] ", time_buf, level); // Write the timestamp and level
-
-    // Handle the variable arguments
-    va_list args;
-    va_start(args, format);
-    vfprintf(file, format, args); // Write the formatted string
-    va_end(args);
-
-    fclose(file); // Don't forget to close the file!
-}
-
 // sender ack
 void send_ack(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, tftp_packet_t *packet)
 {
@@ -71,6 +38,22 @@ void send_ack(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len,
     }
 }
 
+// error packet with a message, for refusals that don't have their own helper
+void send_error(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, uint16_t code, const char *msg)
+{
+    char error_packet[TFTP_BUF_SIZE];
+    size_t msg_len = strnlen(msg, sizeof(error_packet) - 5);
+
+    error_packet[0] = 0;
+    error_packet[1] = TFTP_OPCODE_ERROR;
+    error_packet[2] = (code >> 8) & 0xFF;
+    error_packet[3] = code & 0xFF;
+    memcpy(error_packet + 4, msg, msg_len);
+    error_packet[4 + msg_len] = '\0';
+
+    sendto(sockfd, error_packet, 4 + msg_len + 1, 0, (struct sockaddr *)client_addr, client_len);
+}
+
 // function for file already exists
 int f_exists(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, const char *filename)
 {
@@ -129,298 +112,124 @@ int f_acc(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, con
     return 1; // success
 }
 
-/*
-    writes data by the file mode
- */
-ssize_t write_file_data(FILE *file, const char *buffer, size_t size, const char *mode)
-{
-    if (!file || !buffer || !mode)
-    {
-        return -1; // Invalid input
-    }
-
-    ssize_t bytes_written = 0;
-
-    if (str_casecmp(mode, "netascii") == 0)
-    {
-        bytes_written = write_netascii(file, buffer, size);
-    }
-    else if (str_casecmp(mode, "octet") == 0)
-    {
-        bytes_written = write_octet(file, buffer, size);
-    }
-    else
-    {
-        return -1; // Unsupported mode
-    }
-
-    if (bytes_written != size)
-    {
-        return -1; // Writing error: not all bytes were written
-    }
-
-    return bytes_written; // Successfully written
-}
-
-// WRQ
-void wrq_handler(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *mode)
+// WRQ - validates the request and hands the transfer over to a new session
+tftp_session_t *wrq_handler(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *mode, const tftp_options_t *opts)
 {
-    char filepath[PATH_LENGTH];
-    FILE *file;
-    tftp_packet_t packet;
-    uint16_t block_n = 0;
-    ssize_t recv_len;
-    char buffer[TFTP_BUF_SIZE];
-    int retries = 0;
-
-    snprintf(filepath, sizeof(filepath), "%s/%s", TFTP_ROOT_DIR, filename);
-
-    // Set socket receive timeout (5 seconds)
-    struct timeval tv = {5, 0};
-    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
-    {
-        perror("setsockopt failed");
-        // continue anyways, not fatal
-    }
+    tftp_session_t *s;
 
-    // Check if the file exists, and if it does, exit (or send error to client, if desired)
+    // Check if the file exists, and if it does, send error to client
     if (!f_exists(sockfd, client_addr, client_len, filename))
     {
         printf("The file already exists, %s\n", filename);
         logger("ERROR", "File %s exists already\n", filename);
-        return;
+        return NULL;
     }
 
-    // Open file for writing based on mode
-    if (str_casecmp(mode, "netascii") == 0 || str_casecmp(mode, "octet") == 0)
+    if (str_casecmp(mode, "netascii") != 0 && str_casecmp(mode, "octet") != 0)
     {
-        file = fopen(filepath, "wb");
-        if (!file)
-        {
-            logger("ERROR", "Failed to open file for writing\n");
-            return;
-        }
+        printf("Unsupported mode\n");
+        logger("ERROR", "Unsupported mode for file %s\n", filename);
+        return NULL;
     }
 
-    else
+    s = session_create(TFTP_OPCODE_WRQ, client_addr, filename, mode, opts);
+    if (!s)
     {
-        printf("Unsupported mode\n");
-        logger("ERROR", "Unsupported mode for file %s\n", filename);
-        return;
+        return NULL;
     }
 
     /*
-        lets the client know it's
-        ready to receive data
+        written to a temp file that's renamed into place by the last block,
+        see tftp_sink.h. one that can be resumed reserves tsize in
+        session_resume, past what an earlier upload left
     */
-
-    packet.ack_pkt.block_n = 0;
-    send_ack(sockfd, client_addr, client_len, &packet);
-
-    // Now start receiving data packets
-    while (retries < MAX_RETRIES)
+    int resume = (opts->present & TFTP_OPT_OFFSET) && str_casecmp(mode, "octet") == 0;
+    if (sink_open(&s->sink, s->filepath, str_casecmp(mode, "netascii") == 0,
+                  (opts->present & TFTP_OPT_TSIZE) && !resume ? opts->tsize : 0) < 0 ||
+        session_resume(s) < 0)
     {
-        // Wait for WRQ packet
-        recv_len = recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)client_addr, &client_len);
-
-        printf("Received %zd bytes.\n", (ssize_t)recv_len);
-
-        printf("Raw buffer: %02x %02x %02x %02x ...\n", buffer[0], buffer[1], buffer[2], buffer[3]);
-
-        if (recv_len < 0)
-        {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-            {
-                // Timeout — retry sending the same data
-                retries++;
-                fprintf(stderr, "Timeout waiting for ACK for block %d. Retrying (%d/%d)...\n",
-                        block_n, retries, MAX_RETRIES);
-
-                packet.ack_pkt.block_n = block_n; 
-                send_ack(sockfd, client_addr, client_len, &packet);
-                
-                continue;
-            }
-            else
-            {
-                perror("recvfrom failed");
-                return;
-            }
-            break;
-        }
-
-        // Validate the opcode is DATA (TFTP_OPCODE_DATA)
-        if (buffer[1] != TFTP_OPCODE_DATA)
-        {
-            printf("Unexpected opcode: %d\n", buffer[1]);
-            retries++; // Increment retries for unexpected packets
-            continue;  // Skip this packet
-        }
-
-        uint16_t recv_block_n = ((uint16_t)(uint8_t)buffer[2] << 8) | (uint16_t)(uint8_t)buffer[3];
-
-        if (recv_block_n == block_n + 1) //valid data block
+        if (errno == ENOSPC)
         {
-            ssize_t data_len = recv_len - 4; // exclude header (4 bytes)
-            ssize_t written = write_file_data(file, buffer + 4, data_len, mode);
-
-            if (written < data_len)
-            {
-                logger("ERROR", "Failed to write full block to file\n");
-                break;
-            }
-
-            block_n = recv_block_n;           // Update expected block number
-            packet.ack_pkt.block_n = block_n; // start incrementing block_n to send ack for each data block
-            send_ack(sockfd, client_addr, client_len, &packet);
-            
-            retries = 0; // Reset retries after successful write
-
-            if (data_len < TFTP_DATA_SIZE) //EOF
-            {
-                printf("Last block received. Transfer complete.\n");
-                break;
-            }
+            logger("ERROR", "No room for %s (%llu bytes)\n", filename, (unsigned long long)opts->tsize);
+            send_error(sockfd, client_addr, client_len, TFTP_OPCODE_F, "Disk full or allocation exceeded");
         }
-        else if (recv_block_n == block_n) //
+        else
         {
-            // duplicate data block retransmit ack for expected data block
-            printf("Received out-of-order block %d, retransmitting ACK for block %d\n", recv_block_n, block_n);
-            packet.ack_pkt.block_n = block_n;
-            send_ack(sockfd, client_addr, client_len, &packet);
+            logger("ERROR", "Failed to open file for writing\n");
         }
+        session_destroy(s);
+        return NULL;
     }
+    session_compress(s);
 
-    fclose(file); // Close the file once done
-    printf("File transfer completed: %s\n", filename);
-    logger("INFO", "File has been created: %s\n", filename);
+    session_begin(s);
+    return s;
 }
 
-// RRQ
-void rrq_handler(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *mode)
+// RRQ - validates the request and hands the transfer over to a new session
+tftp_session_t *rrq_handler(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *mode, const tftp_options_t *opts, tftp_mcast_t *mc)
 {
     char filepath[PATH_LENGTH];
-    FILE *file;
-    uint16_t block_n = 1;
-    char buffer[TFTP_BUF_SIZE];
-    unsigned char ack_buf[4]; // Separate buffer for ACKs
-    ssize_t bytes_read = 0;
+    tftp_session_t *s;
+    tftp_source_t src;
+    int netascii;
 
     snprintf(filepath, sizeof(filepath), "%s/%s", TFTP_ROOT_DIR, filename);
 
     /* checking for permissions and access validation */
     if (!f_acc(sockfd, client_addr, client_len, filename))
     {
-        return;
+        return NULL;
     }
 
     if (str_casecmp(mode, "netascii") == 0)
-        file = fopen(filepath, "r");
+        netascii = 1;
     else if (str_casecmp(mode, "octet") == 0)
-        file = fopen(filepath, "rb");
+        netascii = 0;
     else
-        return;
+        return NULL;
 
-    if (!file)
-        return;
-
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    // octet blocks come straight out of the mapped file, see tftp_source.h
+    if (source_open(&src, filepath, netascii) < 0)
+        return NULL;
 
-    logger("INFO", "File opened successfully: %s (%ld bytes)\n", filename, file_size);
+    logger("INFO", "File opened successfully: %s (%llu bytes)\n", filename, (unsigned long long)src.size);
 
-    // Set socket receive timeout (5 seconds)
-    struct timeval tv = {5, 0};
-    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+    s = session_create(TFTP_OPCODE_RRQ, client_addr, filename, mode, opts);
+    if (!s)
     {
-        perror("setsockopt failed");
+        source_close(&src);
+        return NULL;
     }
+    s->src = src;
 
-    do
+    // tsize (RFC 2349) is answered with the size that goes on the wire, unknown for a netascii stream
+    if (s->opts.present & TFTP_OPT_TSIZE)
     {
-        // Read the next block of data
-        if (str_casecmp(mode, "netascii") == 0)
-            bytes_read = read_netascii(file, buffer + 4, TFTP_DATA_SIZE);
+        if (src.kind == SOURCE_STREAM)
+            s->opts.present &= ~TFTP_OPT_TSIZE;
         else
-            bytes_read = read_octet(file, buffer + 4, TFTP_DATA_SIZE);
-
-        // Build the DATA packet
-        buffer[0] = 0;
-        buffer[1] = TFTP_OPCODE_DATA;
-        buffer[2] = (block_n >> 8) & 0xFF;
-        buffer[3] = block_n & 0xFF;
-
-        int retries = 0;
-
-        while (retries < MAX_RETRIES)
-        {
-            // Send the DATA packet
-            ssize_t sent_len = sendto(sockfd, buffer, bytes_read + 4, 0,
-                                      (struct sockaddr *)client_addr, client_len);
-            if (sent_len < 0)
-            {
-                perror("sendto failed");
-                fclose(file);
-                return;
-            }
-
-            // Wait for ACK
-            ssize_t recv_len = recvfrom(sockfd, ack_buf, sizeof(ack_buf), 0,
-                                        (struct sockaddr *)client_addr, &client_len);
-
-            if (recv_len < 0)
-            {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                {
-                    // Timeout — retry sending the same data
-                    retries++;
-                    fprintf(stderr, "Timeout waiting for ACK for block %d. Retrying (%d/%d)...\n",
-                            block_n, retries, MAX_RETRIES);
-                    continue;
-                }
-                else
-                {
-                    perror("recvfrom failed");
-                    fclose(file);
-                    return;
-                }
-            }
-
-            // Check if it's a valid ACK
-            if (recv_len == 4 && ack_buf[0] == 0 && ack_buf[1] == TFTP_OPCODE_ACK)
-            {
-                uint16_t ack_block = (ack_buf[2] << 8) | ack_buf[3];
-                if (ack_block == block_n)
-                {
-                    // Valid ACK received
-                    break;
-                }
-                else
-                {
-                    fprintf(stderr, "Received ACK for unexpected block %d (expected %d). Ignoring...\n", ack_block, block_n);
-                }
-            }
-
-            // If we get here, either bad ACK or wrong block number
-            retries++;
-        }
-
-        if (retries >= MAX_RETRIES)
-        {
-            fprintf(stderr, "Max retries reached for block %d. Aborting transfer.\n", block_n);
-            fclose(file);
-            return;
-        }
+            s->opts.tsize = src.kind == SOURCE_CACHE ? src.len : src.size;
+    }
 
-        // Proceed to next block
-        block_n++;
+    // RFC 2090, octet only - anything else just gets no multicast in its OACK
+    if (mc && !netascii && mcast_attach(mc, s) < 0)
+    {
+        logger("ERROR", "Multicast not possible for %s, sending it unicast\n", filename);
+    }
 
-    } while (bytes_read == TFTP_DATA_SIZE); // Stop when last block is less than 512 bytes
+    // a resumed download starts where the client's copy ends, a compressed one is the file's zlib stream
+    session_resume(s);
+    session_compress(s);
 
-    fclose(file);
-    logger("INFO", "File sent successfully: %s (%ld bytes)\n", filename, file_size);
+    if (session_begin(s) < 0)
+    {
+        logger("ERROR", "Failed to read first block of %s\n", filename);
+        s->mc = NULL; // the worker gives the group back, see mcast_publish
+        session_destroy(s);
+        return NULL;
+    }
+    return s;
 }
 
 // DEL
@@ -451,6 +260,11 @@ void del_handler(int sockfd, struct sockaddr_in *client_addr, socklen_t client_l
         return;
     }
 
+    // its compressed copy goes with it
+    char artifact[2 * PATH_LENGTH + 16];
+    compress_artifact_name(artifact, sizeof(artifact), filepath);
+    unlink(artifact);
+
     logger("INFO", "File deleted successfully: %s\n", filename);
 
     // Send success response (ACK with block number 0)
@@ -5,11 +5,12 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "../common/tftp_common.h"
+#include "tftp_session.h"
+#include "tftp_mcast.h"
 
 
-//File writing based on transfer mode
-ssize_t write_file_data(FILE *file, const char *buffer, size_t size, const char *mode);
-
+//error packet helper function
+void send_error(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, uint16_t code, const char *msg);
 //file exists helper function
 int f_exists(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, const char *filename);
 //file access helper function
@@ -17,8 +18,14 @@ int f_acc(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, con
 
 //ACK,WRQ,PARSE_WRQ,RRQ,DEL handlers
 void send_ack(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, tftp_packet_t *packet);
-void wrq_handler(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *mode);
-void rrq_handler(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *mode);
+/*
+    WRQ/RRQ validate the request on the well-known socket and return
+    a started session (own TID) for the event loop, NULL if refused.
+    an RRQ given a new multicast group (mcast_join) becomes that group
+    if the file can be sent that way, else it stays a unicast transfer
+*/
+tftp_session_t *wrq_handler(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *mode, const tftp_options_t *opts);
+tftp_session_t *rrq_handler(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, const char *filename, const char *mode, const tftp_options_t *opts, tftp_mcast_t *mc);
 void del_handler(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, const char *filename);
 
 
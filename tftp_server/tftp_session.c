@@ -0,0 +1,816 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "../utils/tftp_logger.h"
+#include "tftp_session.h"
+#include "tftp_server.h"
+#include "tftp_uring.h"
+#include "tftp_mcast.h"
+
+static void session_free_buffers(tftp_session_t *s)
+{
+    free(s->pkt);
+    free(s->rxbuf);
+    free(s->win);
+    free(s->win_data);
+    free(s->win_len);
+    free(s->win_sent_us);
+}
+
+// the session and its buffers, no socket yet
+static tftp_session_t *session_alloc(int type, const struct sockaddr_in *client_addr, const char *filename, const char *mode, const tftp_options_t *opts)
+{
+    tftp_session_t *s = calloc(1, sizeof(*s));
+    if (!s)
+    {
+        logger("ERROR", "Memory allocation failed\n");
+        return NULL;
+    }
+
+    s->opts = *opts;
+    s->opts.present &= ~TFTP_OPT_MULTICAST; // only a group answers it, see mcast_begin
+    s->blksize = (opts->present & TFTP_OPT_BLKSIZE) ? opts->blksize : TFTP_DATA_SIZE;
+    s->windowsize = (opts->present & TFTP_OPT_WINDOWSIZE) ? opts->windowsize : 1;
+    s->rollover = (opts->present & TFTP_OPT_ROLLOVER) ? opts->rollover : 0;
+    // a negotiated timeout (RFC 2349) is the retransmit timeout, else it adapts
+    rtt_init(&s->rtt, (opts->present & TFTP_OPT_TIMEOUT) ? (uint32_t)opts->timeout * 1000000 : 0);
+    s->last_progress_us = tftp_now_us();
+
+    // the OACK has to fit too, it's never bigger than a default sized packet
+    s->buf_size = TFTP_HDR_SIZE + (s->blksize > TFTP_DATA_SIZE ? s->blksize : TFTP_DATA_SIZE);
+    s->pkt = malloc(s->buf_size);
+
+    /*
+        a whole window is drained per recvmmsg - ACKs are small, a WRQ
+        receives DATA, so its batch is capped by TFTP_BATCH_RX_BYTES
+    */
+    if (type == TFTP_OPCODE_RRQ)
+    {
+        s->rx_slot_size = TFTP_BUF_SIZE;
+        s->rx_slots = s->windowsize;
+    }
+    else
+    {
+        s->rx_slot_size = s->buf_size;
+        s->rx_slots = TFTP_BATCH_RX_BYTES / s->buf_size;
+        if (s->rx_slots > s->windowsize)
+            s->rx_slots = s->windowsize;
+        if (s->rx_slots < 1)
+            s->rx_slots = 1;
+    }
+    if (s->rx_slots > TFTP_BATCH_MAX)
+        s->rx_slots = TFTP_BATCH_MAX;
+    s->rxbuf = malloc(s->rx_slots * s->rx_slot_size);
+
+    if (type == TFTP_OPCODE_RRQ)
+    {
+        s->win = malloc((size_t)s->windowsize * s->buf_size);
+        s->win_data = calloc(s->windowsize, sizeof(*s->win_data));
+        s->win_len = calloc(s->windowsize, sizeof(*s->win_len));
+        s->win_sent_us = calloc(s->windowsize, sizeof(*s->win_sent_us));
+    }
+    if (!s->pkt || !s->rxbuf || (type == TFTP_OPCODE_RRQ && (!s->win || !s->win_data || !s->win_len || !s->win_sent_us)))
+    {
+        logger("ERROR", "Memory allocation failed\n");
+        session_free_buffers(s);
+        free(s);
+        return NULL;
+    }
+
+    s->src.fd = -1;
+    s->sink.fd = -1;
+    s->sockfd = -1;
+    s->peer = *client_addr;
+    s->type = type;
+    snprintf(s->filename, sizeof(s->filename), "%s", filename);
+    snprintf(s->filepath, sizeof(s->filepath), "%s/%s", TFTP_ROOT_DIR, filename);
+    snprintf(s->mode, sizeof(s->mode), "%s", mode);
+    return s;
+}
+
+tftp_session_t *session_create(int type, const struct sockaddr_in *client_addr, const char *filename, const char *mode, const tftp_options_t *opts)
+{
+    tftp_session_t *s = session_alloc(type, client_addr, filename, mode, opts);
+    if (!s)
+    {
+        return NULL;
+    }
+
+    // port 0 - the kernel picks the ephemeral port that becomes our TID
+    s->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->sockfd < 0)
+    {
+        perror("Error creating session socket");
+        session_destroy(s);
+        return NULL;
+    }
+
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = 0;
+
+    if (bind(s->sockfd, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+        connect(s->sockfd, (const struct sockaddr *)client_addr, sizeof(*client_addr)) < 0)
+    {
+        perror("Error setting up session socket");
+        session_destroy(s);
+        return NULL;
+    }
+    return s;
+}
+
+tftp_session_t *session_create_detached(int type, const struct sockaddr_in *client_addr, const char *filename, const char *mode, const tftp_options_t *opts,
+                                        void (*xmit)(tftp_session_t *s, const struct iovec *iov, int iov_per_pkt, int n), void *ctx)
+{
+    tftp_session_t *s = session_alloc(type, client_addr, filename, mode, opts);
+    if (s)
+    {
+        s->xmit = xmit;
+        s->xmit_ctx = ctx;
+    }
+    return s;
+}
+
+void session_destroy(tftp_session_t *s)
+{
+    if (!s)
+        return;
+    if (s->mc)
+        mcast_release(s->mc);
+    sink_abort(&s->sink); // drops the temp file of an unfinished WRQ, a no-op once it was committed
+    source_close(&s->src);
+    if (s->sockfd >= 0)
+        close(s->sockfd);
+    session_free_buffers(s);
+    free(s);
+}
+
+static void session_arm_timer(tftp_session_t *s, uint64_t now)
+{
+    s->deadline_us = now + rtt_timeout_us(&s->rtt);
+}
+
+// the peer moved the transfer forward
+static void session_progress(tftp_session_t *s, uint64_t now)
+{
+    s->retries = 0;
+    s->last_progress_us = now;
+    rtt_progress(&s->rtt);
+}
+
+// sends pkt and arms the retransmit timer, only a first send can be timed
+static void session_send(tftp_session_t *s, int fresh)
+{
+    uint64_t now = tftp_now_us();
+
+    if (s->ring)
+    {
+        s->ring_refs += uring_send_copy(s->ring, s->sockfd, s->pkt, s->pkt_len, s);
+    }
+    else if (s->xmit)
+    {
+        struct iovec iov = {s->pkt, s->pkt_len};
+        s->xmit(s, &iov, 1, 1);
+    }
+    else if (send(s->sockfd, s->pkt, s->pkt_len, 0) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        perror("Error sending session packet");
+    }
+    s->pkt_sent_us = fresh ? now : 0;
+    session_arm_timer(s, now);
+}
+
+static void session_fail(tftp_session_t *s, const char *why)
+{
+    fprintf(stderr, "Transfer of %s aborted: %s\n", s->filename, why);
+    logger("ERROR", "Transfer of %s aborted: %s\n", s->filename, why);
+
+    // a WRQ that didn't finish only ever wrote its temp file, session_destroy drops it
+    s->failed = 1;
+    s->state = SESSION_DONE;
+}
+
+static char *rrq_slot(tftp_session_t *s, uint32_t seq)
+{
+    return s->win + (size_t)(seq % s->windowsize) * s->buf_size;
+}
+
+// puts block seq in its window slot, the payload stays in the mapping when it can - 1 when it isn't read yet
+static int rrq_load_block(tftp_session_t *s, uint32_t seq)
+{
+    char *pkt = rrq_slot(s, seq);
+    ssize_t bytes_read = source_block(&s->src, seq, s->blksize, pkt + 4, &s->win_data[seq % s->windowsize]);
+
+    if (bytes_read == SOURCE_WAIT)
+    {
+        return 1;
+    }
+    if (bytes_read < 0)
+    {
+        return -1;
+    }
+
+    uint16_t wire = tftp_block_wire(seq, s->rollover);
+    pkt[0] = 0;
+    pkt[1] = TFTP_OPCODE_DATA;
+    pkt[2] = (wire >> 8) & 0xFF;
+    pkt[3] = wire & 0xFF;
+    s->win_len[seq % s->windowsize] = bytes_read + 4;
+    if (bytes_read < s->blksize)
+    {
+        s->eof = seq; // short block ends the transfer
+    }
+    return 0;
+}
+
+// queues blocks from..next_seq-1 for the next rrq_flush
+static void rrq_send_range(tftp_session_t *s, uint32_t from)
+{
+    if (!s->tx_from || from < s->tx_from)
+    {
+        s->tx_from = from;
+    }
+}
+
+// sends everything queued with one sendmmsg and arms the retransmit timer
+static void rrq_flush(tftp_session_t *s)
+{
+    struct iovec iov[2 * TFTP_BATCH_MAX]; // header, payload
+    uint64_t now = tftp_now_us();
+    int n = 0;
+
+    if (!s->tx_from || s->state == SESSION_DONE)
+    {
+        s->tx_from = 0;
+        return;
+    }
+    if (s->tx_from < s->base)
+    {
+        s->tx_from = s->base; // an ACK later in the batch took those, their slots are reused
+    }
+
+    for (uint32_t seq = s->tx_from; seq < s->next_seq; seq++)
+    {
+        int slot = seq % s->windowsize;
+        iov[2 * n].iov_base = rrq_slot(s, seq);
+        iov[2 * n].iov_len = 4;
+        iov[2 * n + 1].iov_base = (void *)s->win_data[slot];
+        iov[2 * n + 1].iov_len = s->win_len[slot] - 4;
+        // Karn's rule, only blocks sent for the first time are timed
+        s->win_sent_us[slot] = seq >= s->sent_seq ? now : 0;
+        n++;
+    }
+    s->tx_from = 0;
+
+    if (n > 0)
+    {
+        if (s->ring)
+        {
+            // one submit takes the window out with everything else the worker queued
+            int queued = uring_send(s->ring, s->sockfd, iov, 2, n, s);
+            s->ring_refs += queued;
+            s->tx.calls++;
+            s->tx.packets += queued;
+        }
+        else if (s->xmit)
+        {
+            s->xmit(s, iov, 2, n);
+            s->tx.calls++;
+            s->tx.packets += n;
+        }
+        else if (batch_send(s->sockfd, iov, 2, n, &s->tx) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            perror("Error sending session packet");
+        }
+        s->sent_seq = s->next_seq;
+        s->block_n = s->next_seq - 1;
+    }
+    session_arm_timer(s, now);
+}
+
+/*
+    reads and sends new blocks until windowsize of them are in flight -
+    or up to one the pool hasn't read yet, the rest go once session_on_io
+    says it's there
+*/
+static int rrq_fill_window(tftp_session_t *s)
+{
+    uint32_t first = s->next_seq;
+
+    s->reading = 0;
+    while (s->next_seq < s->base + s->windowsize && !s->eof)
+    {
+        int r = rrq_load_block(s, s->next_seq);
+        if (r < 0)
+        {
+            return -1;
+        }
+        if (r > 0)
+        {
+            s->reading = 1;
+            break;
+        }
+        s->next_seq++;
+    }
+    if (s->next_seq != first)
+    {
+        rrq_send_range(s, first);
+    }
+    return 0;
+}
+
+static void rrq_on_packet(tftp_session_t *s, const unsigned char *buf, ssize_t len)
+{
+    if (len < 4 || buf[0] != 0 || buf[1] != TFTP_OPCODE_ACK)
+    {
+        return;
+    }
+
+    uint16_t ack_block = (buf[2] << 8) | buf[3];
+    uint64_t now = tftp_now_us();
+
+    if (s->oack_pending)
+    {
+        if (ack_block != 0)
+            return;
+        if (s->pkt_sent_us)
+            rtt_sample(&s->rtt, now - s->pkt_sent_us);
+        else
+            rtt_spurious(&s->rtt, now);
+        s->oack_pending = 0;
+        s->base_moved_us = now;
+        session_progress(s, now);
+        if (rrq_fill_window(s) < 0)
+            session_fail(s, "read error");
+        return;
+    }
+
+    // only base-1 .. next-1 mean anything, the rest are strays
+    uint32_t acked = tftp_block_seq(s->base - 1, ack_block, s->rollover);
+    if (acked < s->base - 1 || acked >= s->next_seq)
+    {
+        return;
+    }
+
+    if (acked == s->base - 1)
+    {
+        /*
+            the client re-ACKed the last block it has in order, it lost
+            something in the window - go back to it, once per base.
+            with a window of 1 this is a plain duplicate and resending
+            on it is the sorcerer's apprentice bug.
+            one that comes sooner than half a round trip after the
+            window moved can't be about the new window, it answers
+            copies of the old one - going back on it would send every
+            window twice from then on
+        */
+        if (s->windowsize > 1 && !s->went_back && now - s->base_moved_us >= s->rtt.srtt_us / 2)
+        {
+            s->went_back = 1;
+            rrq_send_range(s, s->base);
+        }
+        return;
+    }
+
+    // the acked block times the round trip, unless it had to be resent
+    uint64_t sent_us = s->win_sent_us[acked % s->windowsize];
+    if (sent_us)
+        rtt_sample(&s->rtt, now - sent_us);
+    else
+        rtt_spurious(&s->rtt, now);
+
+    for (uint32_t seq = s->base; seq <= acked; seq++)
+    {
+        s->bytes_sent += s->win_len[seq % s->windowsize] - 4;
+    }
+    s->base = acked + 1;
+    s->went_back = 0;
+    s->base_moved_us = now;
+    source_advance(&s->src, s->base);
+    session_progress(s, now);
+
+    if (s->eof && s->base > s->eof)
+    {
+        logger("INFO", "File sent successfully: %s\n", s->filename);
+        s->state = SESSION_DONE;
+        return;
+    }
+
+    // an ACK short of the window's end is the client's last in-order block
+    if (s->base < s->next_seq)
+    {
+        rrq_send_range(s, s->base);
+    }
+
+    if (rrq_fill_window(s) < 0)
+    {
+        session_fail(s, "read error");
+    }
+}
+
+static void wrq_send_ack(tftp_session_t *s, int fresh)
+{
+    if (sink_busy(&s->sink))
+    {
+        // the disk is behind, the client waits for this ACK until session_on_io
+        s->ack_deferred = 1;
+        s->since_ack = 0;
+        return;
+    }
+    s->ack_deferred = 0;
+    s->block_n = s->expected - 1;
+    uint16_t wire = tftp_block_wire(s->block_n, s->rollover);
+    s->pkt[0] = 0;
+    s->pkt[1] = TFTP_OPCODE_ACK;
+    s->pkt[2] = (wire >> 8) & 0xFF;
+    s->pkt[3] = wire & 0xFF;
+    s->pkt_len = 4;
+    s->since_ack = 0;
+    session_send(s, fresh);
+}
+
+/*
+    the final ACK can get lost like any other, and the client then resends
+    the last DATA until it gives up - the session stays for one give-up
+    interval after the last one it heard to answer those (RFC 1350 dallying)
+*/
+static void wrq_dally(tftp_session_t *s, uint64_t now)
+{
+    s->state = SESSION_WRQ_DALLYING;
+    s->deadline_us = now + rtt_give_up_us(&s->rtt, MAX_RETRIES);
+}
+
+static void wrq_dally_on_packet(tftp_session_t *s, const unsigned char *buf, ssize_t len)
+{
+    if (len < 4 || buf[0] != 0)
+        return;
+    // the file is committed, an ERROR or the client going away only ends the wait
+    if (buf[1] == TFTP_OPCODE_ERROR)
+    {
+        s->state = SESSION_DONE;
+        return;
+    }
+    if (buf[1] == TFTP_OPCODE_DATA && tftp_block_seq(s->expected, (buf[2] << 8) | buf[3], s->rollover) == s->expected - 1)
+    {
+        session_send(s, 0); // pkt still holds the final ACK
+        wrq_dally(s, tftp_now_us());
+    }
+}
+
+// in place (and synced, by the policy) before the client hears it's done
+static void wrq_finish(tftp_session_t *s)
+{
+    if (s->sink.result == 0)
+    {
+        s->ack_deferred = 1; // the I/O pool is still at it
+        return;
+    }
+    if (s->sink.result < 0)
+    {
+        session_fail(s, s->sink.err == EEXIST ? "file was created meanwhile" : "write error");
+        return;
+    }
+    wrq_send_ack(s, 1);
+    logger("INFO", "File has been created: %s\n", s->filename);
+    wrq_dally(s, tftp_now_us());
+}
+
+static void wrq_on_packet(tftp_session_t *s, const unsigned char *buf, ssize_t len)
+{
+    if (len < 4 || buf[0] != 0 || buf[1] != TFTP_OPCODE_DATA)
+    {
+        return;
+    }
+
+    uint32_t seq = tftp_block_seq(s->expected, (buf[2] << 8) | buf[3], s->rollover);
+
+    if (seq == s->expected) // valid data block
+    {
+        size_t data_len = len - 4;
+        uint64_t now = tftp_now_us();
+
+        // ACK out, next window's first block in - one round trip
+        if (s->pkt_sent_us && s->since_ack == 0)
+            rtt_sample(&s->rtt, now - s->pkt_sent_us);
+        else
+            rtt_spurious(&s->rtt, now);
+        s->pkt_sent_us = 0;
+        if (sink_write(&s->sink, (const char *)buf + 4, data_len) < 0)
+        {
+            session_fail(s, errno == EILSEQ ? "bad compressed data" : "write error");
+            return;
+        }
+
+        s->oack_pending = 0;
+        s->expected++;
+        s->bytes_received += data_len;
+        s->gap_acked = 0;
+        session_progress(s, now);
+
+        if (data_len < (size_t)s->blksize) // EOF
+        {
+            if (sink_commit(&s->sink) < 0)
+            {
+                session_fail(s, errno == EEXIST ? "file was created meanwhile" : errno == EILSEQ ? "bad compressed data" : "write error");
+                return;
+            }
+            wrq_finish(s);
+        }
+        else if (++s->since_ack >= s->windowsize)
+        {
+            wrq_send_ack(s, 1); // only the last block of a window is ACKed
+        }
+        else
+        {
+            session_arm_timer(s, now); // the client is alive
+        }
+    }
+    else if (!s->gap_acked && (seq > s->expected || tftp_now_us() - s->last_progress_us >= s->rtt.srtt_us))
+    {
+        /*
+            a gap (or a resent window we already have) - ACK the last
+            block we have in order once, the client goes back to it.
+            before DATA 1 that means resending the OACK. old blocks
+            while new ones are still coming are copies, answering them
+            would send the client back again
+        */
+        s->gap_acked = 1;
+        if (s->oack_pending)
+            session_send(s, 0);
+        else
+            wrq_send_ack(s, 0);
+    }
+}
+
+void session_on_packet(tftp_session_t *s, const unsigned char *buf, ssize_t len, const struct sockaddr_in *from)
+{
+    if (s->state == SESSION_DONE)
+    {
+        return;
+    }
+
+    if (s->mc)
+    {
+        mcast_on_packet(s, buf, len, from); // an ERROR only drops the client that sent it
+        return;
+    }
+    if (s->state == SESSION_WRQ_DALLYING)
+    {
+        wrq_dally_on_packet(s, buf, len);
+        return;
+    }
+
+    if (len >= 4 && buf[0] == 0 && buf[1] == TFTP_OPCODE_ERROR)
+    {
+        // ERROR 8 turns down the OACK - for a WRQ that's the resume point, what was kept is no good
+        if (buf[2] == 0 && buf[3] == TFTP_OPCODE_OPT_ERR)
+            s->sink.keep = 0;
+        session_fail(s, "client sent an error");
+        return;
+    }
+
+    if (s->type == TFTP_OPCODE_RRQ)
+        rrq_on_packet(s, buf, len);
+    else
+        wrq_on_packet(s, buf, len);
+}
+
+void session_flush(tftp_session_t *s)
+{
+    // every block the ACKs released or asked for again, in one go - a group sends as it goes
+    if (s->type == TFTP_OPCODE_RRQ && !s->mc)
+    {
+        rrq_flush(s);
+    }
+}
+
+void session_on_error(tftp_session_t *s, int err)
+{
+    if (s->state == SESSION_WRQ_DALLYING)
+    {
+        s->state = SESSION_DONE; // the client has it all and went away
+    }
+    else if (s->state != SESSION_DONE)
+    {
+        session_fail(s, strerror(err));
+    }
+}
+
+void session_on_readable(tftp_session_t *s)
+{
+    struct sockaddr_in from[TFTP_BATCH_MAX]; // a group's socket isn't connected, it needs to know who
+
+    while (s->state != SESSION_DONE)
+    {
+        int n = batch_recv(s->sockfd, s->rxbuf, s->rx_slot_size, s->rx_slots, s->rx_len, s->mc ? from : NULL, &s->rx);
+        if (n < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                // e.g. ECONNREFUSED when the client went away
+                session_on_error(s, errno);
+            }
+            break;
+        }
+
+        for (int i = 0; i < n && s->state != SESSION_DONE; i++)
+        {
+            session_on_packet(s, s->rxbuf + i * s->rx_slot_size, s->rx_len[i], s->mc ? &from[i] : NULL);
+        }
+
+        if (n < s->rx_slots)
+        {
+            break; // drained
+        }
+    }
+
+    session_flush(s);
+}
+
+void session_on_timeout(tftp_session_t *s, uint64_t now_us)
+{
+    if (s->state == SESSION_DONE || now_us < s->deadline_us)
+    {
+        return;
+    }
+
+    if (s->mc)
+    {
+        mcast_on_timeout(s, now_us); // giving up on the master passes the group on
+        return;
+    }
+
+    if (s->state == SESSION_WRQ_DALLYING)
+    {
+        s->state = SESSION_DONE; // no copy of the last DATA came, the client got our ACK
+        return;
+    }
+
+    if (now_us - s->last_progress_us >= rtt_give_up_us(&s->rtt, MAX_RETRIES))
+    {
+        session_fail(s, "max retries reached");
+        return;
+    }
+
+    if ((s->type == TFTP_OPCODE_WRQ && s->ack_deferred) ||
+        (s->type == TFTP_OPCODE_RRQ && s->reading && s->base == s->next_seq))
+    {
+        // the client is waiting on our disk, not lost - no backoff, no giving up
+        s->last_progress_us = now_us;
+        session_arm_timer(s, now_us);
+        return;
+    }
+
+    s->retries++;
+    rtt_backoff(&s->rtt, now_us);
+    fprintf(stderr, "Timeout on %s block %u. Retrying (%d, next in %u us)...\n",
+            s->filename, s->block_n, s->retries, rtt_timeout_us(&s->rtt));
+
+    if (s->type == TFTP_OPCODE_RRQ && !s->oack_pending)
+    {
+        rrq_send_range(s, s->base); // go back to the oldest unACKed block
+        rrq_flush(s);
+    }
+    else if (s->type == TFTP_OPCODE_WRQ && !s->oack_pending)
+    {
+        s->gap_acked = 0;
+        wrq_send_ack(s, 0); // the last block we have in order
+    }
+    else
+    {
+        session_send(s, 0);
+    }
+}
+
+void session_on_io(void *arg)
+{
+    tftp_session_t *s = arg;
+
+    if (s->state == SESSION_DONE || s->state == SESSION_WRQ_DALLYING)
+        return; // failed meanwhile (reaped once the pool lets go of it), or finished already
+
+    if (s->type == TFTP_OPCODE_RRQ)
+    {
+        // the block the window stopped at came in, the rest of it goes out now
+        if (s->reading && !s->oack_pending)
+        {
+            if (rrq_fill_window(s) < 0)
+                session_fail(s, "read error");
+            rrq_flush(s);
+        }
+        return;
+    }
+
+    if (s->sink.err)
+        session_fail(s, s->sink.err == EEXIST ? "file was created meanwhile" : "write error");
+    else if (s->sink.committing)
+        wrq_finish(s);
+    else if (s->ack_deferred && !sink_busy(&s->sink))
+        wrq_send_ack(s, 1);
+}
+
+int session_io_pending(const tftp_session_t *s)
+{
+    if (s->ring_refs > 0 || s->ring_recv)
+        return 1;
+    if (s->mc && mcast_pending(s->mc))
+        return 1;
+    return s->type == TFTP_OPCODE_WRQ ? sink_pending(&s->sink) : source_pending(&s->src);
+}
+
+int session_resume(tftp_session_t *s)
+{
+    tftp_options_t *o = &s->opts;
+    uint32_t sum;
+
+    if (!(o->present & TFTP_OPT_OFFSET))
+        return 0;
+    // a byte offset means nothing in netascii, and a group sends the whole file
+    if (str_casecmp(s->mode, "octet") != 0 || s->mc)
+    {
+        o->present &= ~(TFTP_OPT_OFFSET | TFTP_OPT_TAILSUM);
+        return 0;
+    }
+
+    if (s->type == TFTP_OPCODE_RRQ)
+    {
+        // a different tail (or a shorter file) leaves offset out of the OACK, the client starts over
+        if ((o->present & TFTP_OPT_TAILSUM) && source_tail_sum(&s->src, o->offset, &sum) == 0 && sum == o->tailsum)
+            s->src.start = o->offset;
+        else
+            o->present &= ~TFTP_OPT_OFFSET;
+        o->present &= ~TFTP_OPT_TAILSUM;
+        return 0;
+    }
+
+    int64_t kept = sink_resume(&s->sink, (o->present & TFTP_OPT_TSIZE) ? o->tsize : 0, &sum);
+    if (kept < 0)
+        return -1;
+    o->offset = kept;
+    o->tailsum = sum;
+    if (kept)
+    {
+        o->present |= TFTP_OPT_TAILSUM;
+        logger("INFO", "Upload of %s goes on at byte %lld\n", s->filename, (long long)kept);
+    }
+    else
+    {
+        o->present &= ~TFTP_OPT_TAILSUM;
+    }
+    return 0;
+}
+
+void session_compress(tftp_session_t *s)
+{
+    tftp_options_t *o = &s->opts;
+
+    if (!(o->present & TFTP_OPT_COMPRESS))
+        return;
+    // offsets are into the file, not the stream - and a group's members could have asked for anything
+    if (str_casecmp(s->mode, "octet") != 0 || s->mc || (o->present & TFTP_OPT_OFFSET) || !compress_supported(o->compress) ||
+        (s->type == TFTP_OPCODE_RRQ ? source_compress(&s->src, s->filepath) : sink_compress(&s->sink)) < 0)
+        o->present &= ~TFTP_OPT_COMPRESS;
+}
+
+int session_begin(tftp_session_t *s)
+{
+    s->base = s->next_seq = s->sent_seq = s->expected = 1;
+    s->state = s->type == TFTP_OPCODE_RRQ ? SESSION_RRQ_SENDING : SESSION_WRQ_RECEIVING;
+    if (s->mc)
+        return mcast_begin(s); // each client gets its own OACK, blocks go out in any order - no prefetch
+    if (s->type == TFTP_OPCODE_RRQ)
+        source_begin(&s->src, s->filepath, s->blksize, s->windowsize); // the block size is settled now
+
+    if (s->opts.present)
+    {
+        /*
+            the OACK takes the place of block 0 - an RRQ waits for
+            ACK 0 before DATA 1, a WRQ gets DATA 1 in answer to it
+        */
+        s->oack_pending = 1;
+        s->pkt_len = tftp_build_oack(s->pkt, s->buf_size, &s->opts);
+        session_send(s, 1);
+    }
+    else if (s->type == TFTP_OPCODE_RRQ)
+    {
+        if (rrq_fill_window(s) < 0)
+        {
+            return -1;
+        }
+        rrq_flush(s);
+    }
+    else
+    {
+        // lets the client know it's ready to receive data
+        wrq_send_ack(s, 1);
+    }
+    return 0;
+}
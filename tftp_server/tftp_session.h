@@ -0,0 +1,165 @@
+#ifndef TFTP_SESSION_H
+#define TFTP_SESSION_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include "../utils/tftp_utils.h"
+#include "../utils/tftp_options.h"
+#include "../utils/tftp_rtt.h"
+#include "tftp_batch.h"
+#include "tftp_source.h"
+#include "tftp_sink.h"
+
+/*
+    a session is one transfer (RRQ or WRQ) with its own
+    ephemeral socket, that socket's port is the server side TID
+    and it is connected to the client's TID so the kernel drops
+    anything coming from somebody else
+*/
+
+typedef enum
+{
+    SESSION_RRQ_SENDING,   // window of DATA in flight, waiting for ACKs
+    SESSION_WRQ_RECEIVING, // ACK sent, waiting for the next window of DATA
+    SESSION_WRQ_DALLYING,  // file in place and final ACK sent, re-ACKing copies of the last DATA in case it got lost
+    SESSION_DONE           // finished or aborted, reaped by the event loop
+} tftp_session_state_t;
+
+typedef struct tftp_session
+{
+    int sockfd;              // our TID, connected to the client
+    struct sockaddr_in peer; // client TID
+    int type;                // TFTP_OPCODE_RRQ or TFTP_OPCODE_WRQ
+    tftp_session_state_t state;
+
+    tftp_sink_t sink;  // WRQ
+    tftp_source_t src; // RRQ
+    char filename[PATH_LENGTH];
+    char filepath[2 * PATH_LENGTH]; // TFTP_ROOT_DIR/filename
+    char mode[16];
+
+    tftp_options_t opts; // accepted options, answered with an OACK
+    int blksize;         // negotiated block size, TFTP_DATA_SIZE by default
+    int windowsize;      // RFC 7440, blocks per ACK (1 = stop-and-wait)
+    int oack_pending;    // the OACK is in pkt, waiting for ACK 0 / DATA 1
+    int rollover;        // what block 65535 is followed by, 0 unless the client asked for 1
+
+    /*
+        block sequence numbers are counted in 32 bits and only the
+        low 16 go on the wire, see tftp_block_wire()/tftp_block_seq()
+        RRQ: blocks base..next_seq-1 are in flight, eof is the short block
+        WRQ: everything below expected is on disk
+    */
+    uint32_t base;
+    uint32_t next_seq;
+    uint32_t eof;      // 0 until the short block has been read
+    int went_back;     // RRQ: window already resent for the current base
+    uint64_t base_moved_us; // RRQ: when base last moved, see rrq_on_packet
+    uint32_t tx_from;  // RRQ: tx_from..next_seq-1 go out on the next flush, 0 = nothing queued
+    uint32_t sent_seq; // RRQ: first block never sent, the ones below it are resends
+    uint32_t expected; // WRQ
+    int since_ack;     // WRQ: blocks taken since the last ACK
+    int gap_acked;     // WRQ: out of order seen and answered
+    int ack_deferred;  // WRQ: an ACK is held until the sink catches up
+    int reading;       // RRQ: the window stopped at a block the pool hasn't read yet
+
+    uint32_t block_n; // last block ACKed / sent, for logs
+    int retries;      // timeouts since the last progress, for logs
+    int failed;
+
+    tftp_rtt_t rtt;            // adaptive retransmission timeout
+    uint64_t deadline_us;      // when to retransmit
+    uint64_t last_progress_us; // given up after rtt_give_up_us() without progress
+    uint64_t pkt_sent_us;      // when pkt first went out, 0 once it was resent (Karn's rule)
+
+    uint64_t bytes_sent;     // RRQ: payload ACKed by the client
+    uint64_t bytes_received; // WRQ: payload written to disk
+    tftp_batch_stats_t rx;   // recvmmsg calls / packets
+    tftp_batch_stats_t tx;   // sendmmsg calls / packets
+
+    // buffers sized to blksize + header, allocated with the session
+    char *pkt; // last ACK/OACK sent, kept for retransmits
+    size_t pkt_len;
+    size_t buf_size;
+
+    // rx_slots datagrams of rx_slot_size, filled by one recvmmsg
+    unsigned char *rxbuf;
+    size_t rx_slot_size;
+    int rx_slots;
+    size_t rx_len[TFTP_BATCH_MAX];
+
+    /*
+        RRQ: the windowsize DATA packets in flight, slot = seq % windowsize.
+        a slot holds the header, the payload is at win_data - in the
+        mapped file, or in the slot right after the header when it was copied
+    */
+    char *win;
+    const char **win_data;
+    size_t *win_len; // header + payload
+    uint64_t *win_sent_us; // first transmission time, 0 once resent (Karn's rule)
+
+    // io_uring backend (tftp_uring.h), all 0 on the epoll path
+    struct tftp_uring *ring; // sends are queued on it instead of sent
+    int ring_refs;           // SENDMSGs in flight pointing at the session's buffers
+    int ring_class;          // provided buffer class its datagrams land in
+    int ring_recv;           // the multishot recvmsg on sockfd is armed
+    int ring_cancel;         // ...and asked to go away
+    int ring_rx;             // packets handled this round, flushed after it
+    struct tftp_session *ring_next; // sessions that got packets this round
+
+    struct tftp_mcast *mc; // RFC 2090 group (tftp_mcast.h), the socket isn't connected then
+
+    /*
+        set instead of a socket (session_create_detached): everything the
+        session sends goes here, n packets of iov_per_pkt iovecs each
+    */
+    void (*xmit)(struct tftp_session *s, const struct iovec *iov, int iov_per_pkt, int n);
+    void *xmit_ctx;
+
+    struct tftp_session *prev, *next; // event loop session list
+} tftp_session_t;
+
+//creates the ephemeral socket connected to the client, returns NULL on failure
+tftp_session_t *session_create(int type, const struct sockaddr_in *client_addr, const char *filename, const char *mode, const tftp_options_t *opts);
+//same without a socket, packets go to xmit and come in through session_on_packet - for a simulator
+tftp_session_t *session_create_detached(int type, const struct sockaddr_in *client_addr, const char *filename, const char *mode, const tftp_options_t *opts,
+                                        void (*xmit)(tftp_session_t *s, const struct iovec *iov, int iov_per_pkt, int n), void *ctx);
+void session_destroy(tftp_session_t *s);
+
+//drains the session socket and advances the state machine
+void session_on_readable(tftp_session_t *s);
+//one datagram that arrived some other way (io_uring), session_flush sends what a batch of them queued.
+//from is the sender, only a multicast group needs it
+void session_on_packet(tftp_session_t *s, const unsigned char *buf, ssize_t len, const struct sockaddr_in *from);
+void session_flush(tftp_session_t *s);
+//the socket reported err, e.g. ECONNREFUSED when the client went away
+void session_on_error(tftp_session_t *s, int err);
+//retransmits the window / last ACK or gives up after MAX_RETRIES
+void session_on_timeout(tftp_session_t *s, uint64_t now_us);
+
+//the I/O pool is done with a WRQ's write or an RRQ's read, notify callback of sink_attach / source_attach
+void session_on_io(void *arg);
+//the I/O pool or the ring still has work pointing at the session (or its file), it can't be destroyed yet
+int session_io_pending(const tftp_session_t *s);
+
+/*
+    the offset option, with the source / sink open and before session_begin -
+    blocking, it reads the file. an RRQ starts at offset if the client's
+    tailsum matches, a WRQ goes on from what a failed upload of the name
+    kept (sink_resume). -1 with errno set when the WRQ can't go on
+*/
+int session_resume(tftp_session_t *s);
+
+/*
+    the compress option, after session_resume (a resume wins) and before
+    session_begin - blocking, an RRQ looks for the file's artifact. what
+    can't be compressed goes as it is, the option is left out of the OACK
+*/
+void session_compress(tftp_session_t *s);
+
+//sends the OACK if options were accepted, else the first DATA block (RRQ) or ACK 0 (WRQ)
+int session_begin(tftp_session_t *s);
+
+#endif
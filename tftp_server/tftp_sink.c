@@ -0,0 +1,709 @@
+#define _GNU_SOURCE // for fallocate, syncfs and renameat2
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "tftp_sink.h"
+#include "tftp_uring.h"
+#include "../utils/tftp_logger.h"
+
+// a file waiting for the group commit, the sink handed its fd over
+typedef struct sink_pending
+{
+    int fd;
+    dev_t dev;
+    char path[2 * PATH_LENGTH];
+    char tmp[2 * PATH_LENGTH + 32];
+    struct sink_pending *next;
+} sink_pending_t;
+
+static tftp_sync_policy_t policy = SINK_SYNC_NONE;
+static atomic_uint tmp_seq;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static sink_pending_t *head, **tail = &head;
+static pthread_t committer;
+static int running;
+
+int sink_parse_policy(const char *name)
+{
+    if (strcmp(name, "none") == 0)
+        return SINK_SYNC_NONE;
+    if (strcmp(name, "close") == 0)
+        return SINK_SYNC_CLOSE;
+    if (strcmp(name, "group") == 0)
+        return SINK_SYNC_GROUP;
+    return -1;
+}
+
+void sink_set_policy(tftp_sync_policy_t p)
+{
+    policy = p;
+}
+
+static int pwrite_all(int fd, const char *buf, size_t len, uint64_t off)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static int sink_flush(tftp_sink_t *sink)
+{
+    // a buffer of zeros stays a hole, the file gets its length at the commit
+    if (tftp_is_zero(sink->buf, sink->buf_len))
+        sink->holes = 1;
+    else if (pwrite_all(sink->fd, sink->buf, sink->buf_len, sink->off) < 0)
+        return -1;
+    sink->off += sink->buf_len;
+    sink->buf_len = 0;
+    return 0;
+}
+
+static void sink_free(tftp_sink_t *sink)
+{
+    free(sink->buf);
+    free(sink->spare);
+    free(sink->scratch);
+    sink->buf = sink->spare = sink->scratch = NULL;
+    if (sink->z)
+        inflate_close(sink->z);
+    sink->z = NULL;
+}
+
+// the temp name goes next to the target, a rename across directories could cross filesystems
+static void tmp_name(char *tmp, size_t size, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? (int)(slash - path + 1) : 0;
+
+    snprintf(tmp, size, "%.*s.%s.%d.%u.part", dir_len, path, path + dir_len, (int)getpid(),
+             atomic_fetch_add(&tmp_seq, 1));
+}
+
+// where a failed upload that can be resumed waits for the next WRQ, .name.resume next to the target
+static void resume_name(char *kept, size_t size, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? (int)(slash - path + 1) : 0;
+
+    snprintf(kept, size, "%.*s.%s.resume", dir_len, path, path + dir_len);
+}
+
+// the directory entry of a rename is only durable once its directory is synced
+static void fsync_dir(const char *path)
+{
+    char dir[2 * PATH_LENGTH];
+    const char *slash = strrchr(path, '/');
+    int fd;
+
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - path) : 1, slash ? path : ".");
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/*
+    renames tmp to path unless path showed up in the meantime, the
+    WRQ's exists check was done when it started. link() does the same
+    where the filesystem has no RENAME_NOREPLACE
+*/
+static int publish(const char *tmp, const char *path)
+{
+    if (renameat2(AT_FDCWD, tmp, AT_FDCWD, path, RENAME_NOREPLACE) == 0)
+        return 0;
+    if (errno == EINVAL || errno == ENOSYS)
+    {
+        if (link(tmp, path) == 0)
+        {
+            unlink(tmp);
+            return 0;
+        }
+    }
+    int err = errno;
+    unlink(tmp);
+    errno = err;
+    return -1;
+}
+
+static void group_commit(sink_pending_t *batch)
+{
+    char synced_dir[2 * PATH_LENGTH] = "";
+
+    // one syncfs writes back the whole batch, files on another filesystem get their own fsync
+    if (syncfs(batch->fd) < 0)
+        logger("ERROR", "syncfs failed: %s\n", strerror(errno));
+    for (sink_pending_t *p = batch->next; p; p = p->next)
+    {
+        if (p->dev != batch->dev)
+            fsync(p->fd);
+    }
+
+    while (batch)
+    {
+        sink_pending_t *p = batch;
+        const char *slash = strrchr(p->path, '/');
+        int dir_len = slash ? (int)(slash - p->path) : 0;
+
+        batch = p->next;
+        close(p->fd);
+        if (publish(p->tmp, p->path) < 0)
+        {
+            logger("ERROR", "Upload to %s dropped: %s\n", p->path, strerror(errno));
+        }
+        else if (strlen(synced_dir) != (size_t)dir_len || strncmp(synced_dir, p->path, dir_len) != 0)
+        {
+            // uploads mostly land in the same directory, it's synced once for all of them
+            fsync_dir(p->path);
+            snprintf(synced_dir, sizeof(synced_dir), "%.*s", dir_len, p->path);
+        }
+        free(p);
+    }
+}
+
+static void *group_run(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    while (running || head)
+    {
+        if (!head)
+        {
+            pthread_cond_wait(&queued, &lock);
+            continue;
+        }
+        if (running)
+        {
+            // let the files that finish about now join this batch
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += SINK_GROUP_MS * 1000000L;
+            if (until.tv_nsec >= 1000000000L)
+            {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&queued, &lock, &until);
+        }
+
+        sink_pending_t *batch = head;
+        head = NULL;
+        tail = &head;
+        pthread_mutex_unlock(&lock);
+
+        group_commit(batch);
+
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int sink_start(void)
+{
+    sigset_t all, old;
+    int err;
+
+    if (policy != SINK_SYNC_GROUP)
+        return 0;
+
+    running = 1;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&committer, NULL, group_run, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0)
+    {
+        running = 0;
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+void sink_stop(void)
+{
+    pthread_mutex_lock(&lock);
+    if (!running)
+    {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    running = 0;
+    pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&lock);
+    pthread_join(committer, NULL);
+}
+
+int sink_open(tftp_sink_t *sink, const char *path, int netascii, uint64_t tsize)
+{
+    memset(sink, 0, sizeof(*sink));
+    snprintf(sink->path, sizeof(sink->path), "%s", path);
+    tmp_name(sink->tmp, sizeof(sink->tmp), path);
+    sink->netascii = netascii;
+    sink->dec = (netascii_dec_t)NETASCII_DEC_INIT;
+
+    // a small upload with a known size doesn't need the whole buffer
+    sink->buf_size = SINK_BUF_SIZE;
+    if (tsize > 0 && tsize < SINK_BUF_SIZE)
+        sink->buf_size = (tsize + SINK_ALIGN - 1) & ~(uint64_t)(SINK_ALIGN - 1);
+
+    if (posix_memalign((void **)&sink->buf, SINK_ALIGN, sink->buf_size) != 0 ||
+        (netascii && !(sink->scratch = malloc(TFTP_BLKSIZE_MAX + 1))))
+    {
+        sink_free(sink);
+        sink->fd = -1;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    sink->fd = open(sink->tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (sink->fd < 0)
+    {
+        sink_free(sink);
+        return -1;
+    }
+
+    /*
+        KEEP_SIZE only reserves the blocks, so a client whose tsize was
+        wrong still gets a file of the length it sent
+    */
+    if (tsize > 0 && fallocate(sink->fd, FALLOC_FL_KEEP_SIZE, 0, tsize) < 0 &&
+        (errno == ENOSPC || errno == EFBIG))
+    {
+        sink_abort(sink);
+        errno = ENOSPC;
+        return -1;
+    }
+    sink->reserved = tsize;
+    return 0;
+}
+
+int64_t sink_resume(tftp_sink_t *sink, uint64_t tsize, uint32_t *tailsum)
+{
+    char kept[sizeof(sink->tmp)];
+    struct stat st;
+
+    sink->keep = 1;
+    *tailsum = 0;
+    resume_name(kept, sizeof(kept), sink->path);
+
+    // renamed over our own empty temp file, of two WRQs for the name only one gets it
+    if (rename(kept, sink->tmp) == 0)
+    {
+        int fd = open(sink->tmp, O_RDWR | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) < 0 || tftp_tail_sum(fd, st.st_size, tailsum) < 0)
+        {
+            // put back for another try
+            int err = fd >= 0 ? EIO : errno;
+            if (fd >= 0)
+                close(fd);
+            rename(sink->tmp, kept);
+            errno = err;
+            return -1;
+        }
+        close(sink->fd);
+        sink->fd = fd;
+        sink->off = st.st_size;
+    }
+
+    // only the rest needs room
+    if (tsize > sink->off && fallocate(sink->fd, FALLOC_FL_KEEP_SIZE, sink->off, tsize - sink->off) < 0 &&
+        (errno == ENOSPC || errno == EFBIG))
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+    sink->reserved = tsize;
+    return sink->off;
+}
+
+// a flush, the commit or an abort on its way through the I/O pool
+typedef struct
+{
+    tftp_io_job_t io;
+    tftp_sink_t *sink; // NULL for an abort, the sink may be gone by then
+    int fd;
+    char *buf;
+    size_t len;
+    uint64_t off;
+    int err;
+    char tmp[2 * PATH_LENGTH + 32]; // abort
+    int keep;                        // abort: buf goes in and tmp becomes kept
+    char kept[2 * PATH_LENGTH + 32];
+    char path[2 * PATH_LENGTH];
+} sink_job_t;
+
+/*
+    what tsize reserved under the skipped zeros is still allocated,
+    the ranges nothing was written to (unwritten extents read as holes)
+    are given back so a sparse upload stays sparse - best effort
+*/
+static void punch_holes(int fd, off_t end)
+{
+    off_t hole = 0;
+    while ((hole = lseek(fd, hole, SEEK_HOLE)) >= 0 && hole < end)
+    {
+        off_t data = lseek(fd, hole, SEEK_DATA);
+        if (data < 0)
+            data = end;
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, hole, data - hole);
+        hole = data;
+    }
+}
+
+// the last buffer, then the fsync and the rename by the policy - blocking
+static int commit_now(tftp_sink_t *sink)
+{
+    // a file that ends in a hole is only as long as its last write until here
+    if (sink_flush(sink) < 0 || ftruncate(sink->fd, sink->off) < 0)
+        return -1;
+    if (sink->holes && sink->reserved)
+        punch_holes(sink->fd, sink->off);
+
+    if (policy == SINK_SYNC_GROUP && running)
+    {
+        sink_pending_t *p = malloc(sizeof(*p));
+        struct stat st;
+        if (p && fstat(sink->fd, &st) == 0)
+        {
+            p->fd = sink->fd;
+            p->dev = st.st_dev;
+            memcpy(p->path, sink->path, sizeof(p->path));
+            memcpy(p->tmp, sink->tmp, sizeof(p->tmp));
+            p->next = NULL;
+            sink->fd = -1;
+
+            pthread_mutex_lock(&lock);
+            *tail = p;
+            tail = &p->next;
+            pthread_cond_signal(&queued);
+            pthread_mutex_unlock(&lock);
+            return 0;
+        }
+        free(p); // no memory for the queue, commit it here
+    }
+
+    if (policy != SINK_SYNC_NONE && fsync(sink->fd) < 0)
+        return -1;
+    close(sink->fd);
+    sink->fd = -1;
+    if (publish(sink->tmp, sink->path) < 0)
+        return -1;
+    if (policy != SINK_SYNC_NONE)
+        fsync_dir(sink->path);
+    return 0;
+}
+
+static void flush_run(tftp_io_job_t *io)
+{
+    sink_job_t *job = (sink_job_t *)io;
+    job->err = pwrite_all(job->fd, job->buf, job->len, job->off) < 0 ? errno : 0;
+}
+
+static void commit_run(tftp_io_job_t *io)
+{
+    sink_job_t *job = (sink_job_t *)io;
+    tftp_sink_t *sink = job->sink;
+
+    job->err = commit_now(sink) < 0 ? errno : 0;
+    if (job->err && sink->fd >= 0)
+    {
+        close(sink->fd);
+        unlink(sink->tmp);
+        sink->fd = -1;
+    }
+}
+
+/*
+    what an upload got before it failed stays for a resume, with the buffer
+    that wasn't full yet - unless another upload of path got there first
+*/
+static void keep_now(int fd, const char *path, const char *tmp, const char *kept, const char *buf, size_t len, uint64_t off)
+{
+    if (access(path, F_OK) == 0 ||
+        (len && !tftp_is_zero(buf, len) && pwrite_all(fd, buf, len, off) < 0) ||
+        ftruncate(fd, off + len) < 0 || rename(tmp, kept) < 0)
+        unlink(tmp);
+    close(fd);
+}
+
+static void abort_run(tftp_io_job_t *io)
+{
+    sink_job_t *job = (sink_job_t *)io;
+    if (job->keep)
+    {
+        keep_now(job->fd, job->path, job->tmp, job->kept, job->buf, job->len, job->off);
+        return;
+    }
+    close(job->fd);
+    unlink(job->tmp);
+}
+
+static void job_free(tftp_io_job_t *io)
+{
+    free(((sink_job_t *)io)->buf);
+    free(io);
+}
+
+static void commit_submit(tftp_sink_t *sink);
+
+// back on the worker
+static void job_done(tftp_io_job_t *io)
+{
+    sink_job_t *job = (sink_job_t *)io;
+    tftp_sink_t *sink = job->sink;
+
+    if (job->err && !sink->err)
+        sink->err = job->err;
+
+    if (io->run == flush_run)
+    {
+        sink->inflight--;
+        // one written buffer is kept for the next flush, posix_memalign isn't free
+        if (!sink->spare)
+            sink->spare = job->buf;
+        else
+            free(job->buf);
+        if (sink->committing && !sink->commit_out && sink->inflight == 0)
+        {
+            if (sink->err)
+                sink->result = -1;
+            else
+                commit_submit(sink);
+        }
+    }
+    else
+    {
+        sink->commit_out = 0;
+        sink_free(sink);
+        sink->result = sink->err ? -1 : 1;
+    }
+    free(job);
+
+    if (sink->notify)
+        sink->notify(sink->notify_arg);
+}
+
+static void commit_submit(tftp_sink_t *sink)
+{
+    sink_job_t *job = calloc(1, sizeof(*job));
+    if (!job)
+    {
+        sink->err = ENOMEM;
+        sink->result = -1;
+        return;
+    }
+    job->io.run = commit_run;
+    job->io.done = job_done;
+    job->sink = sink;
+    sink->commit_out = 1;
+    iopool_submit(&job->io, sink->ioq);
+}
+
+// hands the full buffer to the pool and carries on in a fresh one
+static int flush_submit(tftp_sink_t *sink)
+{
+    if (tftp_is_zero(sink->buf, sink->buf_len))
+    {
+        // a hole of a disk image, nothing to write
+        sink->holes = 1;
+        sink->off += sink->buf_len;
+        sink->buf_len = 0;
+        return 0;
+    }
+
+    sink_job_t *job = calloc(1, sizeof(*job));
+    char *next = sink->spare;
+
+    if (!next && posix_memalign((void **)&next, SINK_ALIGN, sink->buf_size) != 0)
+        next = NULL;
+    if (!job || !next)
+    {
+        free(job);
+        if (next != sink->spare)
+            free(next);
+        return -1;
+    }
+    sink->spare = NULL;
+
+    job->io.run = flush_run;
+    job->io.done = job_done;
+    job->sink = sink;
+    job->fd = sink->fd;
+    job->buf = sink->buf;
+    job->len = sink->buf_len;
+    job->off = sink->off;
+
+    sink->off += sink->buf_len;
+    sink->buf = next;
+    sink->buf_len = 0;
+    sink->inflight++;
+    if (!sink->ring || uring_write(sink->ring, job->fd, job->buf, job->len, job->off, &job->io, &job->err) < 0)
+        iopool_submit(&job->io, sink->ioq);
+    return 0;
+}
+
+void sink_attach(tftp_sink_t *sink, tftp_io_done_t *ioq, void (*notify)(void *arg), void *arg)
+{
+    sink->ioq = ioq;
+    sink->notify = notify;
+    sink->notify_arg = arg;
+}
+
+void sink_use_ring(tftp_sink_t *sink, struct tftp_uring *ring)
+{
+    sink->ring = ring;
+}
+
+// into the buffer, which only goes out full - so every pwrite but the last is SINK_ALIGN aligned
+static int sink_append(void *ctx, const char *data, size_t len)
+{
+    tftp_sink_t *sink = ctx;
+
+    while (len > 0)
+    {
+        size_t n = sink->buf_size - sink->buf_len;
+        if (n > len)
+            n = len;
+        memcpy(sink->buf + sink->buf_len, data, n);
+        sink->buf_len += n;
+        data += n;
+        len -= n;
+        if (sink->buf_len == sink->buf_size &&
+            (sink->ioq ? flush_submit(sink) : sink_flush(sink)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int sink_compress(tftp_sink_t *sink)
+{
+    sink->z = inflate_open();
+    return sink->z ? 0 : -1;
+}
+
+int sink_write(tftp_sink_t *sink, const char *data, size_t len)
+{
+    if (sink->err)
+        return -1; // an earlier flush failed
+
+    if (sink->z)
+        return inflate_write(sink->z, data, len, sink_append, sink);
+    if (sink->netascii)
+    {
+        len = netascii_decode(&sink->dec, data, len, sink->scratch);
+        data = sink->scratch;
+    }
+    return sink_append(sink, data, len);
+}
+
+int sink_busy(const tftp_sink_t *sink)
+{
+    return sink->inflight >= SINK_INFLIGHT || (sink->committing && sink->result == 0);
+}
+
+int sink_pending(const tftp_sink_t *sink)
+{
+    return sink->inflight > 0 || sink->commit_out;
+}
+
+int sink_commit(tftp_sink_t *sink)
+{
+    if (sink->z && !inflate_done(sink->z))
+    {
+        errno = EILSEQ; // the last block came before the end of the stream
+        return -1;
+    }
+    if (sink->netascii)
+    {
+        size_t n = netascii_decode_end(&sink->dec, sink->scratch);
+        if (n)
+        {
+            sink->netascii = 0; // the held CR goes in as is
+            if (sink_write(sink, sink->scratch, n) < 0)
+                return -1;
+        }
+    }
+    sink->committing = 1;
+
+    if (!sink->ioq)
+    {
+        int ret = commit_now(sink);
+        sink->result = ret < 0 ? -1 : 1;
+        if (ret < 0)
+            sink_abort(sink);
+        sink_free(sink);
+        return ret;
+    }
+    // the fsync has to come after every pwrite, the last flush starts it otherwise
+    if (sink->inflight == 0)
+        commit_submit(sink);
+    return sink->result < 0 ? -1 : 0;
+}
+
+void sink_abort(tftp_sink_t *sink)
+{
+    int err = errno;
+
+    if (sink->fd >= 0)
+    {
+        // a write that failed or a commit that couldn't leaves nothing worth resuming
+        int keep = sink->keep && !sink->err && !sink->committing && sink->off + sink->buf_len > 0;
+        sink_job_t *job = sink->ioq ? calloc(1, sizeof(*job)) : NULL;
+        if (job)
+        {
+            // the unlink can block like any other metadata op, nobody waits for it
+            job->io.run = abort_run;
+            job->io.done = job_free;
+            job->fd = sink->fd;
+            memcpy(job->tmp, sink->tmp, sizeof(job->tmp));
+            job->keep = keep;
+            if (keep)
+            {
+                resume_name(job->kept, sizeof(job->kept), sink->path);
+                memcpy(job->path, sink->path, sizeof(job->path));
+                job->buf = sink->buf; // the job's now
+                job->len = sink->buf_len;
+                job->off = sink->off;
+                sink->buf = NULL;
+            }
+            iopool_submit(&job->io, NULL);
+        }
+        else if (keep)
+        {
+            char kept[sizeof(sink->tmp)];
+            resume_name(kept, sizeof(kept), sink->path);
+            keep_now(sink->fd, sink->path, sink->tmp, kept, sink->buf, sink->buf_len, sink->off);
+        }
+        else
+        {
+            close(sink->fd);
+            unlink(sink->tmp);
+        }
+        sink->fd = -1;
+    }
+    sink_free(sink);
+    errno = err;
+}
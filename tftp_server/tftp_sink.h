@@ -0,0 +1,129 @@
+#ifndef TFTP_SINK_H
+#define TFTP_SINK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "../utils/tftp_utils.h"
+#include "../utils/tftp_netascii.h"
+#include "tftp_iopool.h"
+#include "tftp_compress.h"
+
+struct tftp_uring;
+
+/*
+    where a WRQ's DATA goes - blocks are gathered into one big
+    aligned buffer that is pwritten whole, into a temp file next to
+    the target. only the last block renames it into place, so the
+    name never shows a half uploaded file and a failed transfer just
+    unlinks the temp. if the client sent tsize (RFC 2349) the space is
+    fallocated up front and a disk that can't hold it fails the WRQ
+    before any data moves.
+    a client that can resume (the offset option) gets what a failed
+    upload wrote kept as .name.resume, the next WRQ for the name picks
+    it up with sink_resume and only the rest has to come. with
+    compress=deflate the blocks are inflated before they're gathered.
+    the fsync policy is process wide:
+      none  - rename right away, the kernel writes it back whenever
+      close - fsync + rename in the session, before the last ACK
+      group - finished files are queued, a thread syncs a batch of
+              them with one syncfs and renames them together
+    once attached to a worker's I/O completion queue, full buffers and
+    the commit are written by the I/O pool and the worker hears back
+    through notify - the session holds its ACK while sink_busy(), so
+    a disk slower than the network slows the client down instead of
+    piling up buffers. a worker on the io_uring backend writes the
+    buffers with its own ring instead, only the commit goes to the pool
+*/
+
+#define SINK_BUF_SIZE (256 * 1024) // per WRQ, a multiple of SINK_ALIGN
+#define SINK_ALIGN 4096
+#define SINK_GROUP_MS 20 // how long the group commit thread gathers files
+#define SINK_INFLIGHT 2  // buffers being written before the sink counts as busy
+
+typedef enum
+{
+    SINK_SYNC_NONE,
+    SINK_SYNC_CLOSE,
+    SINK_SYNC_GROUP
+} tftp_sync_policy_t;
+
+typedef struct
+{
+    int fd; // temp file, -1 when closed
+    char path[2 * PATH_LENGTH]; // where it ends up
+    char tmp[2 * PATH_LENGTH + 32];
+    char *buf;      // SINK_ALIGN aligned, being filled
+    char *spare;    // a written buffer for the next one
+    size_t buf_len;
+    size_t buf_size;
+    uint64_t off;   // file offset buf starts at
+    uint64_t reserved; // bytes fallocated for tsize
+    int holes;      // a buffer of zeros was skipped
+    int keep;       // octet, the client can resume: an abort keeps what arrived, see sink_resume
+    int netascii;
+    netascii_dec_t dec; // a CR at the end of one block
+    char *scratch;      // netascii, one decoded block
+    tftp_inflate_t *z;  // compress=deflate, the blocks are a zlib stream of the file
+
+    tftp_io_done_t *ioq; // NULL: writes happen right in sink_write/sink_commit
+    void (*notify)(void *arg);
+    void *notify_arg;
+    struct tftp_uring *ring; // set: full buffers are WRITE SQEs on it
+    int inflight;   // flushes out in the pool
+    int committing; // sink_commit was called
+    int commit_out; // the commit job is in the pool
+    int result;     // 0 until the commit is done, 1 in place, -1 failed
+    int err;        // errno of the first failed job
+} tftp_sink_t;
+
+//"none", "close" or "group", -1 for anything else
+int sink_parse_policy(const char *name);
+void sink_set_policy(tftp_sync_policy_t policy);
+
+//the group commit thread, nothing to do for the other policies
+int sink_start(void);
+//commits what's still queued and stops it
+void sink_stop(void);
+
+/*
+    creates the temp file for path, tsize is the expected size or 0 -
+    returns -1 with errno set, ENOSPC when tsize doesn't fit
+*/
+int sink_open(tftp_sink_t *sink, const char *path, int netascii, uint64_t tsize);
+
+/*
+    claims what a failed upload of the same path kept (blocking, before
+    any write) and sets keep - returns its length and *tailsum, 0 when
+    there was nothing, -1 with errno set. it reserves tsize past that
+    itself (ENOSPC), the sink_open before it gets tsize 0
+*/
+int64_t sink_resume(tftp_sink_t *sink, uint64_t tsize, uint32_t *tailsum);
+
+//the blocks that come are a zlib stream (before any write), -1 without the memory for it
+int sink_compress(tftp_sink_t *sink);
+
+//from here on writes go through the pool, notify(arg) runs on the worker whenever one comes back
+void sink_attach(tftp_sink_t *sink, tftp_io_done_t *ioq, void (*notify)(void *arg), void *arg);
+//...and the buffers are written through the worker's ring, notify comes from its completions
+void sink_use_ring(tftp_sink_t *sink, struct tftp_uring *ring);
+
+//appends one block's payload, returns -1 on a write error (now or of an earlier flush) - EILSEQ: bad zlib stream
+int sink_write(tftp_sink_t *sink, const char *data, size_t len);
+
+//too much is still being written (or it's committing), hold the next ACK
+int sink_busy(const tftp_sink_t *sink);
+//jobs are out that point at the sink, it can't go away yet
+int sink_pending(const tftp_sink_t *sink);
+
+/*
+    the last block is in - writes the rest and puts the file in place
+    by the policy, -1 if it couldn't be (errno EEXIST: somebody else
+    uploaded the same name first). attached, this only starts it and
+    result turns 1 or -1 (err) when it's done. the sink is closed either way
+*/
+int sink_commit(tftp_sink_t *sink);
+
+//drops the temp file for transfers that didn't finish, or keeps it for a resume
+void sink_abort(tftp_sink_t *sink);
+
+#endif
@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tftp_source.h"
+#include "../utils/tftp_utils.h"
+
+int source_open(tftp_source_t *src, const char *path, int netascii)
+{
+    struct stat st;
+
+    memset(src, 0, sizeof(*src));
+    src->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (src->fd < 0)
+    {
+        return -1;
+    }
+    if (fstat(src->fd, &st) < 0)
+    {
+        close(src->fd);
+        src->fd = -1;
+        return -1;
+    }
+    src->size = st.st_size;
+    src->mtime = st.st_mtim;
+    src->ctime = st.st_ctim;
+    src->dev = st.st_dev;
+    src->ino = st.st_ino;
+
+    src->entry = cache_acquire(path, src->fd, &st, netascii);
+    if (src->entry)
+    {
+        src->kind = SOURCE_CACHE;
+        src->map = cache_data(src->entry);
+        src->len = cache_len(src->entry);
+        close(src->fd); // everything is in memory
+        src->fd = -1;
+        return 0;
+    }
+
+    // it's going to be read front to back, let the kernel start on it now
+    posix_fadvise(src->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(src->fd, 0, PREFETCH_AHEAD_BYTES, POSIX_FADV_WILLNEED);
+
+    if (netascii)
+    {
+        // the stream owns the fd from here on
+        src->kind = SOURCE_STREAM;
+        src->enc = (netascii_enc_t)NETASCII_ENC_INIT;
+        src->stream = fdopen(src->fd, "r");
+        if (!src->stream)
+        {
+            close(src->fd);
+            src->fd = -1;
+            return -1;
+        }
+        return 0;
+    }
+
+    /*
+        empty files, pipes and the like can't be mapped, pread works
+        on anything. a file truncated under a live mapping SIGBUSes,
+        the same risk every mmap based server takes
+    */
+    src->kind = SOURCE_PREAD;
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, src->fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            src->map = map;
+            src->len = st.st_size;
+            src->kind = SOURCE_MMAP;
+        }
+    }
+    return 0;
+}
+
+// the fill functions of a stream prefetch, on the pool
+static ssize_t fill_netascii(void *ctx, char *buf, size_t len)
+{
+    tftp_source_t *src = ctx;
+    size_t n = read_netascii(src->stream, &src->enc, buf, len);
+
+    return ferror(src->stream) ? -1 : (ssize_t)n;
+}
+
+static ssize_t fill_deflate(void *ctx, char *buf, size_t len)
+{
+    return deflate_read(ctx, buf, len);
+}
+
+// reads ahead from block first on, on the pool once the source is attached to its worker
+static void source_prefetch(tftp_source_t *src, uint32_t first)
+{
+    if (src->dz)
+        src->pf = prefetch_attach_stream(fill_deflate, src->dz, src->blksize, src->windowsize, first);
+    else if (src->kind == SOURCE_STREAM)
+        src->pf = prefetch_attach_stream(fill_netascii, src, src->blksize, src->windowsize, first);
+    else if (src->kind == SOURCE_MMAP || src->kind == SOURCE_PREAD)
+        src->pf = prefetch_attach(src->fd, src->kind == SOURCE_MMAP ? src->map : NULL, src->start, src->size,
+                                  src->blksize, src->windowsize, first);
+    if (src->pf && src->ioq)
+        prefetch_bind(src->pf, src->ioq, src->notify, src->notify_arg);
+}
+
+ssize_t source_block(tftp_source_t *src, uint32_t seq, int blksize, char *buf, const char **data)
+{
+    uint64_t off = src->start + (uint64_t)(seq - 1) * blksize;
+    size_t len = 0;
+
+    if (src->fs && !src->fs_alone)
+    {
+        ssize_t n = fstream_block(src->fs, seq, data);
+        if (n == FSTREAM_WAIT)
+            return SOURCE_WAIT;
+        if (n != FSTREAM_ALONE)
+            return n;
+        // too far ahead of the others, it reads on by itself - a netascii stream converts its way up to seq on the pool
+        src->fs_alone = seq;
+        source_prefetch(src, seq);
+        for (uint32_t i = 1; !src->pf && src->kind == SOURCE_STREAM && i < seq; i++)
+        {
+            read_netascii(src->stream, &src->enc, buf, blksize);
+            if (ferror(src->stream))
+                return -1;
+        }
+    }
+
+    if (src->pf)
+    {
+        ssize_t n = prefetch_get(src->pf, seq, data);
+        return n == PREFETCH_WAIT ? SOURCE_WAIT : n;
+    }
+
+    // no memory for a prefetch, or nothing to go back to - the blocks are read right here
+    if (src->dz)
+    {
+        *data = buf;
+        return deflate_read(src->dz, buf, blksize);
+    }
+
+    switch (src->kind)
+    {
+    case SOURCE_CACHE:
+    case SOURCE_MMAP:
+        *data = src->map;
+        if (off >= src->len)
+            return 0; // the length was a multiple of blksize, empty last block
+        *data = src->map + off;
+        return src->len - off < (uint64_t)blksize ? src->len - off : (uint64_t)blksize;
+
+    case SOURCE_PREAD:
+        while (len < (size_t)blksize)
+        {
+            ssize_t got = pread(src->fd, buf + len, blksize - len, off + len);
+            if (got < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (got == 0)
+                break; // EOF
+            len += got;
+        }
+        *data = buf;
+        return len;
+
+    case SOURCE_STREAM:
+        len = read_netascii(src->stream, &src->enc, buf, blksize);
+        if (ferror(src->stream))
+            return -1;
+        *data = buf;
+        return len;
+    }
+    return -1;
+}
+
+int source_tail_sum(tftp_source_t *src, uint64_t off, uint32_t *sum)
+{
+    uint64_t from = off > TFTP_TAIL_LEN ? off - TFTP_TAIL_LEN : 0;
+
+    if (src->kind == SOURCE_STREAM || off > src->size)
+        return -1;
+    if (src->map)
+    {
+        *sum = tftp_crc32(0, src->map + from, off - from);
+        return 0;
+    }
+    return tftp_tail_sum(src->fd, off, sum);
+}
+
+int source_compress(tftp_source_t *src, const char *path)
+{
+    char artifact[2 * PATH_LENGTH + 16];
+    compress_origin_t of = {src->dev, src->ino, src->size, src->mtime, src->ctime};
+    tftp_source_t art;
+    struct stat st;
+    int fd;
+
+    if (src->kind == SOURCE_STREAM)
+        return -1;
+    compress_artifact_name(artifact, sizeof(artifact), path);
+
+    // an artifact of another version of the file doesn't count, the stream is made again and replaces it
+    fd = open(artifact, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && compress_artifact_current(fd, &of) && fstat(fd, &st) == 0 && source_open(&art, artifact, 0) == 0)
+    {
+        // and it has to be the artifact that was checked, not one renamed over it since
+        if (art.dev == st.st_dev && art.ino == st.st_ino)
+        {
+            close(fd);
+            source_close(src);
+            *src = art;
+            compress_count_reused();
+            return 0;
+        }
+        source_close(&art);
+    }
+    if (fd >= 0)
+        close(fd);
+    src->dz = deflate_open(src->map, src->fd, artifact, &of);
+    return src->dz ? 0 : -1;
+}
+
+void source_begin(tftp_source_t *src, const char *path, int blksize, int windowsize)
+{
+    src->blksize = blksize;
+    src->windowsize = windowsize;
+
+    // the shared stream goes from the start of the file, a resumed transfer doesn't
+    if (!src->dz && (src->kind == SOURCE_STREAM || src->kind == SOURCE_PREAD) && src->start == 0)
+    {
+        src->fs = fstream_attach(path, src->stream ? fileno(src->stream) : src->fd, src->kind == SOURCE_STREAM, blksize);
+        if (src->fs)
+            return;
+    }
+    source_prefetch(src, 1); // a cached file is in memory already
+}
+
+void source_advance(tftp_source_t *src, uint32_t base)
+{
+    if (src->fs)
+        fstream_advance(src->fs, base);
+    if (src->pf)
+        prefetch_advance(src->pf, base);
+}
+
+void source_attach(tftp_source_t *src, tftp_io_done_t *ioq, void (*notify)(void *arg), void *arg)
+{
+    src->ioq = ioq;
+    src->notify = notify;
+    src->notify_arg = arg;
+    if (src->pf)
+        prefetch_bind(src->pf, ioq, notify, arg);
+    if (src->fs)
+        fstream_bind(src->fs, ioq, notify, arg);
+}
+
+int source_pending(const tftp_source_t *src)
+{
+    return (src->pf && prefetch_busy(src->pf)) || (src->fs && fstream_pending(src->fs));
+}
+
+void source_close(tftp_source_t *src)
+{
+    if (src->dz)
+        deflate_close(src->dz); // before what it reads from goes away
+    src->dz = NULL;
+    if (src->pf)
+        prefetch_detach(src->pf); // before the fd and the mapping go away, no job is out by now
+    src->pf = NULL;
+    if (src->fs)
+        fstream_detach(src->fs); // the stream has its own fd
+    src->fs = NULL;
+    if (src->entry)
+        cache_release(src->entry);
+    else if (src->map)
+        munmap((void *)src->map, src->len);
+    if (src->stream)
+        fclose(src->stream); // closes fd too
+    else if (src->fd >= 0)
+        close(src->fd);
+    src->map = NULL;
+    src->entry = NULL;
+    src->stream = NULL;
+    src->fd = -1;
+}
@@ -0,0 +1,113 @@
+#ifndef TFTP_SOURCE_H
+#define TFTP_SOURCE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "../utils/tftp_netascii.h"
+#include "tftp_cache.h"
+#include "tftp_prefetch.h"
+#include "tftp_fstream.h"
+#include "tftp_compress.h"
+
+/*
+    where an RRQ's DATA payloads come from - octet files are
+    addressed by block, (seq - 1) * blksize, straight out of an
+    mmap of the file (or pread if it can't be mapped), so resending
+    a block is just an offset and nothing goes through stdio. files
+    that are in (or fit in) the hot file cache are served from
+    the one shared copy there instead.
+    netascii changes the length of what it converts, so outside of
+    the cache (which keeps converted images) it stays a sequential
+    stream and its blocks only exist in the window slots.
+    whatever isn't cached gets a prefetch stage (tftp_prefetch) once
+    the transfer's blksize is known - pages faulted in, blocks read,
+    converted or deflated on the I/O pool once the session is on its
+    worker, so the worker never waits on the disk: a block that isn't
+    there yet is SOURCE_WAIT and the session hears back through notify.
+    netascii streams and pread files that are sent to several clients
+    at once read (and convert) their blocks once, on a shared file
+    stream (tftp_fstream), one that gets too far ahead of the others
+    reads on by itself through a prefetch of its own.
+    compress=deflate sends a kept .name.deflate in place of the file,
+    or deflates the file in order on the way out (tftp_compress)
+*/
+
+typedef enum
+{
+    SOURCE_CACHE,  // payloads point into a shared tftp_cache entry
+    SOURCE_MMAP,   // payloads point into the mapping, no copy
+    SOURCE_PREAD,  // payloads are pread into the caller's buffer
+    SOURCE_STREAM  // netascii, converted in order into the caller's buffer
+} tftp_source_kind_t;
+
+// source_block: the block isn't read yet, notify of source_attach comes once it might be
+#define SOURCE_WAIT (-2)
+
+typedef struct
+{
+    tftp_source_kind_t kind;
+    int fd;         // -1 when closed
+    FILE *stream;   // SOURCE_STREAM
+    uint64_t size;  // file size from fstat
+    struct timespec mtime;
+    struct timespec ctime;
+    dev_t dev;
+    ino_t ino;
+    uint64_t start; // octet: file offset of block 1, where a resumed RRQ picks up
+    uint64_t len;   // SOURCE_MMAP / SOURCE_CACHE, bytes at map - a netascii image is longer than size
+    const char *map; // SOURCE_MMAP / SOURCE_CACHE
+    tftp_cache_entry_t *entry; // SOURCE_CACHE, referenced until source_close
+    netascii_enc_t enc; // SOURCE_STREAM, a CR LF split between two blocks
+    tftp_prefetch_t *pf; // reads ahead of the window, NULL when cached, on the shared stream or out of memory
+    tftp_fstream_reader_t *fs; // SOURCE_STREAM / SOURCE_PREAD, blocks come off the shared stream
+    uint32_t fs_alone; // the stream cut it loose at this block, it reads on by itself
+    tftp_deflate_t *dz; // compressed on the way out, blocks only go front to back
+    int blksize;    // from source_begin
+    int windowsize;
+
+    // from source_attach, a prefetch started later goes to the same worker
+    tftp_io_done_t *ioq;
+    void (*notify)(void *arg);
+    void *notify_arg;
+} tftp_source_t;
+
+//opens path for an RRQ, returns -1 with errno set on failure
+int source_open(tftp_source_t *src, const char *path, int netascii);
+
+/*
+    block seq (1-based) of blksize bytes, returns its length (short = last
+    block) or -1 on a read error. *data points at the payload, either in
+    the mapping or in buf where it was read to - buf has room for blksize.
+    SOURCE_WAIT once the source is attached and the block is still on its
+    way, before that it's read right here
+*/
+ssize_t source_block(tftp_source_t *src, uint32_t seq, int blksize, char *buf, const char **data);
+
+//tftp_tail_sum of the file before off (octet), 0 or -1 when it's shorter than off
+int source_tail_sum(tftp_source_t *src, uint64_t off, uint32_t *sum);
+
+/*
+    octet: the blocks are the file's zlib stream from here on - a kept
+    artifact of it when there's a current one, else deflated as they
+    go. blocking, -1 leaves the source as it was
+*/
+int source_compress(tftp_source_t *src, const char *path);
+
+/*
+    the blksize is settled - a stream or pread file (path) joins the
+    shared stream of the file, else anything that isn't cached starts
+    prefetching ahead of the window
+*/
+void source_begin(tftp_source_t *src, const char *path, int blksize, int windowsize);
+//blocks below base were ACKed, their prefetch slots can be refilled
+void source_advance(tftp_source_t *src, uint32_t base);
+
+//on the worker that owns the transfer - reads go to the I/O pool from now on, notify(arg) when one came back
+void source_attach(tftp_source_t *src, tftp_io_done_t *ioq, void (*notify)(void *arg), void *arg);
+//jobs are out that read into the source, it can't be closed yet
+int source_pending(const tftp_source_t *src);
+
+void source_close(tftp_source_t *src);
+
+#endif
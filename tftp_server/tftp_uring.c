@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "tftp_uring.h"
+#include "../utils/tftp_utils.h"
+
+// a WRITE in flight, it goes on from where a short one stopped
+typedef struct
+{
+    tftp_io_job_t *job;
+    int *err;
+    int fd;
+    const char *buf;
+    size_t len;
+    uint64_t off;
+} uring_write_t;
+
+static const struct
+{
+    unsigned size;
+    unsigned count;
+} buf_classes[URING_BUF_CLASSES] = {
+    {1024, 512},  // ACKs, requests, DATA of the default blksize
+    {4096, 256},  // DATA of an ethernet sized blksize
+    {65536, 32},  // up to TFTP_BLKSIZE_MAX
+};
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned nr)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+static void bufs_put(tftp_uring_bufs_t *b, uint16_t bid)
+{
+    struct io_uring_buf *e = &b->br->bufs[b->tail & (b->count - 1)];
+
+    e->addr = (uint64_t)(uintptr_t)(b->mem + (size_t)bid * b->size);
+    e->len = b->size;
+    e->bid = bid;
+    b->tail++;
+    // the kernel reads the entry once it sees the tail
+    __atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+static int bufs_init(tftp_uring_t *r, int cls)
+{
+    tftp_uring_bufs_t *b = &r->bufs[cls];
+    struct io_uring_buf_reg reg;
+    size_t br_len = buf_classes[cls].count * sizeof(struct io_uring_buf);
+
+    b->size = buf_classes[cls].size;
+    b->count = buf_classes[cls].count;
+    b->br = mmap(NULL, br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->br == MAP_FAILED)
+    {
+        b->br = NULL;
+        return -1;
+    }
+    b->mem = malloc((size_t)b->size * b->count);
+    if (!b->mem)
+        return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)b->br;
+    reg.ring_entries = b->count;
+    reg.bgid = cls;
+    if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+
+    for (unsigned i = 0; i < b->count; i++)
+        bufs_put(b, i);
+    return 0;
+}
+
+int uring_init(tftp_uring_t *r)
+{
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+
+    /*
+        only the worker that made it submits, and completions are only
+        run when it enters to wait for them - no task work interrupting
+        the loop in between
+    */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = URING_ENTRIES * 4;
+    r->fd = sys_setup(URING_ENTRIES, &p);
+    if (r->fd < 0 && errno == EINVAL)
+    {
+        // older kernel, the flags are an optimization
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_ENTRIES * 4;
+        r->fd = sys_setup(URING_ENTRIES, &p);
+    }
+    if (r->fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP))
+    {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    // SQ and CQ rings share one mapping with FEAT_SINGLE_MMAP
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    r->ring_map = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->ring_map == MAP_FAILED)
+    {
+        r->ring_map = NULL;
+        goto fail;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+    {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    char *base = r->ring_map;
+    r->sq_head = (unsigned *)(base + p.sq_off.head);
+    r->sq_tail = (unsigned *)(base + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(base + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_local = *r->sq_tail;
+    r->cq_head = (unsigned *)(base + p.cq_off.head);
+    r->cq_tail = (unsigned *)(base + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(base + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+
+    // SQE i always sits in array slot i
+    unsigned *array = (unsigned *)(base + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+
+    for (int i = 0; i < URING_BUF_CLASSES; i++)
+    {
+        if (bufs_init(r, i) < 0)
+            goto fail;
+    }
+
+    r->msg_from.msg_namelen = sizeof(struct sockaddr_in);
+    return 0;
+
+fail:
+    uring_destroy(r);
+    return -1;
+}
+
+void uring_destroy(tftp_uring_t *r)
+{
+    for (int i = 0; i < URING_BUF_CLASSES; i++)
+    {
+        tftp_uring_bufs_t *b = &r->bufs[i];
+        if (b->br)
+        {
+            struct io_uring_buf_reg reg;
+            memset(&reg, 0, sizeof(reg));
+            reg.bgid = i;
+            if (r->fd >= 0)
+                sys_register(r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+            munmap(b->br, b->count * sizeof(struct io_uring_buf));
+        }
+        free(b->mem);
+        b->br = NULL;
+        b->mem = NULL;
+    }
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_len);
+    if (r->ring_map)
+        munmap(r->ring_map, r->ring_len);
+    if (r->fd >= 0)
+        close(r->fd);
+    r->sqes = NULL;
+    r->ring_map = NULL;
+    r->fd = -1;
+
+    while (r->tx_free)
+    {
+        tftp_uring_tx_t *tx = r->tx_free;
+        r->tx_free = tx->next;
+        free(tx);
+    }
+}
+
+// tells the kernel about the SQEs filled since the last time, returns how many are waiting
+static unsigned sq_publish(tftp_uring_t *r)
+{
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    return r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *uring_get_sqe(tftp_uring_t *r)
+{
+    while (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+    {
+        // full, hand this much over without waiting for anything
+        unsigned n = sq_publish(r);
+        int ret = sys_enter(r->fd, n, 0, 0, NULL, 0);
+        if (ret < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+        {
+            perror("io_uring_enter");
+            return NULL;
+        }
+        r->st.enters++;
+        if (ret > 0)
+            r->st.sqes += ret;
+    }
+
+    struct io_uring_sqe *sqe = &r->sqes[r->sq_local & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_local++;
+    return sqe;
+}
+
+int uring_enter(tftp_uring_t *r, int timeout_ms)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned n = sq_publish(r);
+
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    int ret = sys_enter(r->fd, n, timeout_ms > 0 ? 1 : 0, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                        &arg, sizeof(arg));
+    r->st.enters++;
+    if (ret < 0)
+    {
+        // ETIME: nothing came in time, EBUSY: the CQ overflowed and still needs reaping
+        if (errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN)
+            return 0;
+        perror("io_uring_enter");
+        return -1;
+    }
+    r->st.sqes += ret;
+    return 0;
+}
+
+int uring_reap(tftp_uring_t *r, struct io_uring_cqe *out, int max)
+{
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    while (head != tail && n < max)
+    {
+        out[n++] = r->cqes[head & r->cq_mask];
+        head++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    r->st.cqes += n;
+    return n;
+}
+
+int uring_buf_class(const tftp_uring_t *r, size_t len, size_t namelen)
+{
+    size_t need = sizeof(struct io_uring_recvmsg_out) + namelen + len;
+
+    for (int i = 0; i < URING_BUF_CLASSES; i++)
+    {
+        if (need <= r->bufs[i].size)
+            return i;
+    }
+    return URING_BUF_CLASSES - 1;
+}
+
+void uring_recv(tftp_uring_t *r, int fd, int cls, int from, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)(from ? &r->msg_from : &r->msg_conn);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = cls;
+    sqe->user_data = user_data;
+}
+
+ssize_t uring_recv_data(tftp_uring_t *r, int cls, const struct io_uring_cqe *cqe, int from,
+                        unsigned char **data, struct sockaddr_in *addr)
+{
+    if (!(cqe->flags & IORING_CQE_F_BUFFER) || cqe->res < 0)
+        return -1;
+
+    tftp_uring_bufs_t *b = &r->bufs[cls];
+    char *buf = b->mem + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * b->size;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    size_t namelen = from ? r->msg_from.msg_namelen : 0;
+    size_t hdr = sizeof(*out) + namelen;
+    size_t room = (size_t)cqe->res > hdr ? (size_t)cqe->res - hdr : 0;
+
+    if (from && addr)
+    {
+        memset(addr, 0, sizeof(*addr));
+        memcpy(addr, buf + sizeof(*out), out->namelen < namelen ? out->namelen : namelen);
+    }
+    *data = (unsigned char *)buf + hdr;
+    // a truncated datagram says how long it was, only what fit is there
+    return out->payloadlen < room ? out->payloadlen : room;
+}
+
+void uring_recv_done(tftp_uring_t *r, int cls, const struct io_uring_cqe *cqe)
+{
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+        bufs_put(&r->bufs[cls], cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+void uring_poll(tftp_uring_t *r, int fd, int multishot, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = user_data;
+}
+
+void uring_cancel(tftp_uring_t *r, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = URING_CANCEL;
+}
+
+static tftp_uring_tx_t *tx_get(tftp_uring_t *r)
+{
+    tftp_uring_tx_t *tx = r->tx_free;
+
+    if (tx)
+        r->tx_free = tx->next;
+    else
+        tx = malloc(sizeof(*tx));
+    return tx;
+}
+
+static int tx_queue(tftp_uring_t *r, int fd, tftp_uring_tx_t *tx, int iovlen, void *owner)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (!sqe)
+    {
+        tx->next = r->tx_free;
+        r->tx_free = tx;
+        return -1;
+    }
+
+    memset(&tx->msg, 0, sizeof(tx->msg));
+    tx->msg.msg_iov = tx->iov;
+    tx->msg.msg_iovlen = iovlen;
+    tx->owner = owner;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)&tx->msg;
+    sqe->len = 1;
+    // fails with EAGAIN instead of being parked until the socket has room, see uring_send
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->user_data = (uint64_t)(uintptr_t)tx | URING_SEND;
+    return 0;
+}
+
+int uring_send(tftp_uring_t *r, int fd, const struct iovec *iov, int iov_per_pkt, int n, void *owner)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        tftp_uring_tx_t *tx = tx_get(r);
+        if (!tx)
+            break;
+        memcpy(tx->iov, iov + i * iov_per_pkt, iov_per_pkt * sizeof(*iov));
+        if (tx_queue(r, fd, tx, iov_per_pkt, owner) < 0)
+            break;
+    }
+    return i;
+}
+
+int uring_send_copy(tftp_uring_t *r, int fd, const void *buf, size_t len, void *owner)
+{
+    tftp_uring_tx_t *tx;
+
+    if (len > URING_TX_COPY || !(tx = tx_get(r)))
+        return 0;
+    memcpy(tx->copy, buf, len);
+    tx->iov[0].iov_base = tx->copy;
+    tx->iov[0].iov_len = len;
+    return tx_queue(r, fd, tx, 1, owner) < 0 ? 0 : 1;
+}
+
+void *uring_send_done(tftp_uring_t *r, const struct io_uring_cqe *cqe)
+{
+    tftp_uring_tx_t *tx = (tftp_uring_tx_t *)(uintptr_t)(cqe->user_data & ~URING_TAG_MASK);
+    void *owner = tx->owner;
+
+    tx->next = r->tx_free;
+    r->tx_free = tx;
+    return owner;
+}
+
+static int write_queue(tftp_uring_t *r, uring_write_t *wr)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = wr->fd;
+    sqe->addr = (uint64_t)(uintptr_t)wr->buf;
+    sqe->len = wr->len;
+    sqe->off = wr->off;
+    sqe->user_data = (uint64_t)(uintptr_t)wr | URING_WRITE;
+    return 0;
+}
+
+int uring_write(tftp_uring_t *r, int fd, const char *buf, size_t len, uint64_t off, tftp_io_job_t *job, int *err)
+{
+    uring_write_t *wr = malloc(sizeof(*wr));
+
+    if (!wr)
+        return -1;
+    wr->job = job;
+    wr->err = err;
+    wr->fd = fd;
+    wr->buf = buf;
+    wr->len = len;
+    wr->off = off;
+    if (write_queue(r, wr) < 0)
+    {
+        free(wr);
+        return -1;
+    }
+    return 0;
+}
+
+void uring_write_done(tftp_uring_t *r, const struct io_uring_cqe *cqe)
+{
+    uring_write_t *wr = (uring_write_t *)(uintptr_t)(cqe->user_data & ~URING_TAG_MASK);
+
+    if (cqe->res > 0 && (size_t)cqe->res < wr->len)
+    {
+        wr->buf += cqe->res;
+        wr->len -= cqe->res;
+        wr->off += cqe->res;
+        if (write_queue(r, wr) == 0)
+            return;
+        *wr->err = EIO;
+    }
+    else if (cqe->res == -EINTR || cqe->res == -EAGAIN)
+    {
+        if (write_queue(r, wr) == 0)
+            return;
+        *wr->err = EIO;
+    }
+    else
+    {
+        // a write of 0 bytes is as good as a failed one, pwrite_all treats it the same
+        *wr->err = cqe->res < 0 ? -cqe->res : (cqe->res == 0 && wr->len ? EIO : 0);
+    }
+
+    tftp_io_job_t *job = wr->job;
+    free(wr);
+    job->done(job);
+}
+
+int uring_probe(void)
+{
+    tftp_uring_t r;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    struct io_uring_cqe cqe;
+    int fd, ok = 0;
+
+    if (uring_init(&r) < 0)
+        return -1;
+
+    // a socket connected to itself, one datagram through a multishot recvmsg
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) < 0 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto out;
+
+    uring_recv(&r, fd, 0, 0, URING_RECV);
+    if (uring_enter(&r, 0) < 0 || send(fd, "probe", 5, 0) != 5)
+        goto out;
+
+    uint64_t until = tftp_now_us() + 1000000;
+    while (!ok && tftp_now_us() < until)
+    {
+        if (uring_enter(&r, 100) < 0)
+            break;
+        if (uring_reap(&r, &cqe, 1) == 1)
+        {
+            unsigned char *data;
+            // still armed after the first datagram, or the kernel has no multishot recvmsg
+            ok = uring_recv_data(&r, 0, &cqe, 0, &data, NULL) == 5 && memcmp(data, "probe", 5) == 0 &&
+                 (cqe.flags & IORING_CQE_F_MORE);
+            uring_recv_done(&r, 0, &cqe);
+            if (!ok)
+                break;
+        }
+    }
+
+    if (ok)
+    {
+        // the recv is still armed, wait for it to go away before the buffers do
+        uring_cancel(&r, URING_RECV);
+        for (int i = 0; i < 10; i++)
+        {
+            if (uring_enter(&r, 100) < 0)
+                break;
+            if (uring_reap(&r, &cqe, 1) == 1 && cqe.user_data == URING_RECV && !(cqe.flags & IORING_CQE_F_MORE))
+                break;
+        }
+    }
+
+out:
+    if (fd >= 0)
+        close(fd);
+    uring_destroy(&r);
+    return ok ? 0 : -1;
+}
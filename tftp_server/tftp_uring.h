@@ -0,0 +1,162 @@
+#ifndef TFTP_URING_H
+#define TFTP_URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include "tftp_iopool.h"
+
+/*
+    io_uring transport, -u on the command line - a worker running on
+    it keeps one ring for all of its I/O: a multishot recvmsg per
+    socket lands datagrams in buffers the kernel takes from rings of
+    registered (provided) buffers, windows go out as SENDMSG SQEs, the
+    sink's full buffers as WRITE SQEs, and the stop and I/O completion
+    eventfds are polled. everything a loop queued goes to the kernel
+    with the one io_uring_enter that also waits for the next
+    completions. raw syscalls, there is no liburing to link against
+*/
+
+#define URING_ENTRIES 1024 // SQ size, the CQ gets four times that
+#define URING_REAP_MAX 256 // CQEs handled between two flushes of the sessions
+
+// what a CQE is about, in the low bits of its user_data - the rest is a pointer
+#define URING_TAG_MASK 7ull
+enum
+{
+    URING_LISTEN = 1, // datagram on the well-known port
+    URING_STOP,       // stop_fd turned readable
+    URING_IOQ,        // the I/O pool finished something
+    URING_RECV,       // datagram for a session, the pointer is the session
+    URING_SEND,       // a sent packet, the pointer is its tx slot
+    URING_WRITE,      // a sink buffer written, the pointer is the write
+    URING_CANCEL      // answer to a cancel, nothing to do
+};
+
+/*
+    provided buffer classes, a socket's recvmsg draws from the smallest
+    one its datagrams fit in: ACKs, requests and small DATA, DATA up to
+    a few KB, and anything up to the biggest blksize
+*/
+#define URING_BUF_CLASSES 3
+
+typedef struct
+{
+    struct io_uring_buf_ring *br; // shared with the kernel
+    char *mem;
+    unsigned size;  // bytes per buffer
+    unsigned count; // power of two
+    uint16_t tail;  // next free entry of br
+} tftp_uring_bufs_t;
+
+#define URING_TX_COPY 516 // an ACK or an OACK, copied so the session can build the next one
+
+// a SENDMSG in flight, the msghdr and iovecs have to live until its CQE
+typedef struct tftp_uring_tx
+{
+    struct msghdr msg;
+    struct iovec iov[2];
+    void *owner;
+    char copy[URING_TX_COPY];
+    struct tftp_uring_tx *next; // free list
+} tftp_uring_tx_t;
+
+typedef struct
+{
+    uint64_t enters; // io_uring_enter calls
+    uint64_t sqes;   // SQEs they submitted
+    uint64_t cqes;   // completions reaped
+    uint64_t nobufs; // recvs that ran out of provided buffers and were rearmed
+} tftp_uring_stats_t;
+
+typedef struct tftp_uring
+{
+    int fd;
+
+    unsigned *sq_head, *sq_tail, sq_mask, sq_entries;
+    unsigned sq_local; // tail including SQEs the kernel hasn't been told about
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring_map;
+    size_t ring_len;
+    size_t sqes_len;
+
+    tftp_uring_bufs_t bufs[URING_BUF_CLASSES];
+    struct msghdr msg_conn; // recvmsg of a connected socket, no address
+    struct msghdr msg_from; // recvmsg of the well-known socket, sockaddr_in
+
+    tftp_uring_tx_t *tx_free;
+    tftp_uring_stats_t st;
+} tftp_uring_t;
+
+//sets up a ring and runs one datagram through it, -1 if this kernel can't do what the backend needs
+int uring_probe(void);
+
+//one ring with its provided buffers, on the thread that is going to use it
+int uring_init(tftp_uring_t *r);
+//everything queued on it has to have completed (or been canceled)
+void uring_destroy(tftp_uring_t *r);
+
+//next free SQE, zeroed - submits what's queued to make room when the SQ is full
+struct io_uring_sqe *uring_get_sqe(tftp_uring_t *r);
+
+/*
+    submits everything queued and waits up to timeout_ms for at least
+    one completion (0: doesn't wait), -1 on an error other than a
+    timeout or a signal
+*/
+int uring_enter(tftp_uring_t *r, int timeout_ms);
+
+//copies up to max completions out of the CQ, returns how many
+int uring_reap(tftp_uring_t *r, struct io_uring_cqe *out, int max);
+
+//the smallest buffer class a datagram of len bytes (plus a name of namelen) fits in
+int uring_buf_class(const tftp_uring_t *r, size_t len, size_t namelen);
+
+//multishot recvmsg on fd into buffer class cls, from != 0 also gets the sender's address
+void uring_recv(tftp_uring_t *r, int fd, int cls, int from, uint64_t user_data);
+
+/*
+    the datagram of a recv CQE - returns its length (cut to what fit)
+    with *data in the provided buffer and the sender in *addr if asked
+    for, or -1 if the CQE carries no buffer. the buffer goes back with
+    uring_recv_done
+*/
+ssize_t uring_recv_data(tftp_uring_t *r, int cls, const struct io_uring_cqe *cqe, int from,
+                        unsigned char **data, struct sockaddr_in *addr);
+void uring_recv_done(tftp_uring_t *r, int cls, const struct io_uring_cqe *cqe);
+
+//POLL_ADD for POLLIN, multishot keeps firing until canceled
+void uring_poll(tftp_uring_t *r, int fd, int multishot, uint64_t user_data);
+
+//cancels the request queued with user_data, its last CQE comes with -ECANCELED
+void uring_cancel(tftp_uring_t *r, uint64_t user_data);
+
+/*
+    queues n packets on a connected socket, packet i gathered from
+    iov[i * iov_per_pkt] on (at most 2 each) - the memory they point
+    at must stay until the CQEs, uring_send_done hands owner back for
+    each. returns how many were queued. sends never wait for room in
+    the socket buffer, one that doesn't fit fails with EAGAIN and is
+    left to the retransmit timer like a dropped sendmmsg
+*/
+int uring_send(tftp_uring_t *r, int fd, const struct iovec *iov, int iov_per_pkt, int n, void *owner);
+//one packet of up to URING_TX_COPY bytes, copied - buf can be reused right away
+int uring_send_copy(tftp_uring_t *r, int fd, const void *buf, size_t len, void *owner);
+void *uring_send_done(tftp_uring_t *r, const struct io_uring_cqe *cqe);
+
+/*
+    writes len bytes of buf at off, a short write goes on where it
+    stopped - once it's all down (or failed), *err is set to 0 or the
+    errno and job->done(job) runs on the ring's thread
+*/
+int uring_write(tftp_uring_t *r, int fd, const char *buf, size_t len, uint64_t off, tftp_io_job_t *job, int *err);
+void uring_write_done(tftp_uring_t *r, const struct io_uring_cqe *cqe);
+
+#endif
@@ -0,0 +1,763 @@
+#define _GNU_SOURCE // for pthread_setaffinity_np
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <stddef.h>
+
+#include "tftp_worker.h"
+#include "tftp_server.h"
+#include "tftp_mcast.h"
+
+/*
+    a request on its way through the I/O pool - the handler (access
+    checks, opening the file, loading it into the cache, creating the
+    temp file, DEL) runs there and the session comes back to the worker
+*/
+typedef struct
+{
+    tftp_io_job_t io;
+    tftp_worker_t *w;
+    uint16_t opcode;
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    char filename[PATH_LENGTH];
+    char mode[16];
+    tftp_options_t opts;
+    tftp_session_t *s;
+    tftp_mcast_t *group; // RFC 2090, the group the RRQ starts (or was posted to join)
+} tftp_request_job_t;
+
+int worker_init(tftp_worker_t *w, int id, int cpu, int port, int stop_fd)
+{
+    struct sockaddr_in server_addr;
+    struct epoll_event ev;
+    int one = 1;
+
+    memset(w, 0, sizeof(*w));
+    w->id = id;
+    w->cpu = cpu;
+    w->stop_fd = stop_fd;
+    w->epfd = -1;
+    w->ioq.efd = -1;
+
+    if ((w->listen_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+    {
+        perror("Error creating socket");
+        return -1;
+    }
+
+    // every worker binds the same port, the kernel spreads clients by their address hash
+    if (setsockopt(w->listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        perror("setsockopt SO_REUSEPORT");
+        goto fail;
+    }
+
+    // Set up server address
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY); // listening to all interfaces
+    server_addr.sin_port = htons(port);
+
+    if (bind(w->listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("Error binding socket");
+        goto fail;
+    }
+
+    /*
+        one epoll set holds the well-known socket, the stop eventfd,
+        the I/O completion eventfd and every session socket - data.ptr
+        is the session, or NULL, &w->stop_fd and &w->ioq for the others
+    */
+    if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        perror("epoll_create1");
+        goto fail;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listen_fd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        goto fail;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &w->stop_fd;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->stop_fd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        goto fail;
+    }
+
+    if (io_done_init(&w->ioq) < 0)
+    {
+        perror("io_done_init");
+        goto fail;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &w->ioq;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->ioq.efd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (w->ioq.efd >= 0)
+        io_done_destroy(&w->ioq);
+    if (w->epfd >= 0)
+        close(w->epfd);
+    close(w->listen_fd);
+    w->epfd = w->listen_fd = -1;
+    return -1;
+}
+
+// puts a started session under the event loop
+static void session_register(tftp_worker_t *w, tftp_session_t *s)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+
+    if (w->ring)
+    {
+        // its datagrams land in the smallest provided buffers they fit in, a group's with the sender
+        s->ring = w->ring;
+        s->ring_class = uring_buf_class(w->ring, s->rx_slot_size, s->mc ? sizeof(struct sockaddr_in) : 0);
+        uring_recv(w->ring, s->sockfd, s->ring_class, s->mc != NULL, (uint64_t)(uintptr_t)s | URING_RECV);
+        s->ring_recv = 1;
+    }
+    else if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, s->sockfd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        session_destroy(s);
+        return;
+    }
+
+    // the WRQ's writes go through the pool from now on, or the ring - and an RRQ's reads
+    if (s->type == TFTP_OPCODE_WRQ)
+    {
+        sink_attach(&s->sink, &w->ioq, session_on_io, s);
+        if (w->ring)
+            sink_use_ring(&s->sink, w->ring);
+    }
+    else
+    {
+        source_attach(&s->src, &w->ioq, session_on_io, s);
+    }
+
+    s->prev = NULL;
+    s->next = w->sessions;
+    if (w->sessions)
+        w->sessions->prev = s;
+    w->sessions = s;
+    w->session_count++;
+}
+
+// closing the socket removes it from the epoll set too
+static void session_reap(tftp_worker_t *w, tftp_session_t *s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        w->sessions = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    w->session_count--;
+
+    // one still dallying at shutdown has its file in place
+    if (s->failed || (s->state != SESSION_DONE && s->state != SESSION_WRQ_DALLYING))
+        w->transfers_failed++;
+    else
+        w->transfers_ok++;
+    w->bytes_sent += s->bytes_sent;
+    w->bytes_received += s->bytes_received;
+    batch_stats_add(&w->rx, &s->rx);
+    batch_stats_add(&w->tx, &s->tx);
+
+    session_destroy(s);
+}
+
+// fires due retransmits, reaps finished sessions and returns the epoll timeout
+static int sessions_tick(tftp_worker_t *w)
+{
+    uint64_t now = tftp_now_us();
+    uint64_t next = now + (uint64_t)TIMEOUT_MS * 1000;
+    tftp_session_t *s = w->sessions;
+
+    while (s)
+    {
+        tftp_session_t *next_s = s->next;
+
+        session_on_timeout(s, now);
+        if (s->state == SESSION_DONE && s->ring_recv && !s->ring_cancel)
+        {
+            // the multishot recv holds on to the session until its last CQE
+            uring_cancel(w->ring, (uint64_t)(uintptr_t)s | URING_RECV);
+            s->ring_cancel = 1;
+        }
+        if (s->state == SESSION_DONE && !session_io_pending(s))
+        {
+            session_reap(w, s);
+        }
+        else if (s->deadline_us < next)
+        {
+            next = s->deadline_us;
+        }
+        s = next_s;
+    }
+    // rounded up, waking early would just spin until the deadline
+    return next > now ? (int)((next - now + 999) / 1000) : 0;
+}
+
+// on an I/O thread - the handlers block on the filesystem
+static void request_run(tftp_io_job_t *io)
+{
+    tftp_request_job_t *job = (tftp_request_job_t *)io;
+    tftp_worker_t *w = job->w;
+
+    switch (job->opcode)
+    {
+    case TFTP_OPCODE_RRQ:
+        job->s = rrq_handler(w->listen_fd, &job->addr, job->addr_len, job->filename, job->mode, &job->opts, job->group);
+        break;
+    case TFTP_OPCODE_WRQ:
+        job->s = wrq_handler(w->listen_fd, &job->addr, job->addr_len, job->filename, job->mode, &job->opts);
+        break;
+    case TFTP_OPCODE_DEL:
+        del_handler(w->listen_fd, &job->addr, job->addr_len, job->filename);
+        break;
+    }
+}
+
+// back on the worker, the session was started by the handler and is ours now
+static void request_done(tftp_io_job_t *io)
+{
+    tftp_request_job_t *job = (tftp_request_job_t *)io;
+    tftp_worker_t *w = job->w;
+
+    w->requests_pending--;
+    // the joins that came meanwhile are let in before the group's first ACK can be
+    if (job->group)
+        mcast_publish(job->group, job->s && job->s->mc == job->group ? job->s : NULL);
+    if (job->s)
+        session_register(w, job->s);
+    free(job);
+}
+
+// the worker a completion queue is embedded in
+static tftp_worker_t *ioq_worker(tftp_io_done_t *ioq)
+{
+    return (tftp_worker_t *)((char *)ioq - offsetof(tftp_worker_t, ioq));
+}
+
+static void request_submit(tftp_worker_t *w, tftp_request_job_t *job);
+
+// on the worker that owns the group the RRQ was posted to
+static void request_join(tftp_io_job_t *io)
+{
+    tftp_request_job_t *job = (tftp_request_job_t *)io;
+    int r = mcast_add(job->group, &job->addr, &job->opts, io);
+
+    if (r > 0)
+        return; // parked, comes back here once the group's session is up
+    if (r == 0)
+    {
+        free(job);
+        return;
+    }
+    // the group ended on the way, the request goes again from this worker
+    job->w = ioq_worker(io->reply);
+    job->group = NULL;
+    request_submit(job->w, job);
+}
+
+/*
+    a multicast RRQ joins the group that is sending the file, wherever
+    it lives, or starts one - everything else goes to the pool as is
+*/
+static void request_submit(tftp_worker_t *w, tftp_request_job_t *job)
+{
+    if (job->opcode == TFTP_OPCODE_RRQ && (job->opts.present & TFTP_OPT_MULTICAST) &&
+        mcast_enabled() && str_casecmp(job->mode, "octet") == 0)
+    {
+        int blksize = (job->opts.present & TFTP_OPT_BLKSIZE) ? job->opts.blksize : TFTP_DATA_SIZE;
+
+        job->io.done = request_join;
+        if (mcast_join(job->filename, blksize, &w->ioq, &job->io, &job->group) > 0)
+            return;
+    }
+
+    job->io.run = request_run;
+    job->io.done = request_done;
+    w->requests_pending++;
+    iopool_submit(&job->io, &w->ioq);
+}
+
+// handles one request that arrived on the well-known port
+static void handle_request(tftp_worker_t *w, char *buffer, ssize_t recv_len, struct sockaddr_in *client_addr, socklen_t client_len)
+{
+    if (recv_len < 4)
+    {
+        logger("ERROR", "Runt request of %zd bytes\n", recv_len);
+        return;
+    }
+    buffer[recv_len] = '\0'; // so a bad request can't run strchr off the end
+    w->requests++;
+
+    // Extract the opcode (first 2 bytes)
+    uint16_t opcode = ((uint8_t)buffer[0] << 8) | (uint8_t)buffer[1];
+
+    // a DATA/ACK that strayed here gets no answer, an ERROR would hit whoever has its port now
+    if (opcode != TFTP_OPCODE_RRQ && opcode != TFTP_OPCODE_WRQ && opcode != TFTP_OPCODE_DEL)
+    {
+        logger("ERROR", "Unknown opcode received: %d\n", opcode);
+        return;
+    }
+
+    // Extract the filename and mode (assuming they are after the opcode)
+    const char *filename = (const char *)(buffer + 2);
+
+    // Find where the filename ends and the mode starts
+    const char *mode_start = strchr(filename, 0) + 1; // Find null byte marking the end of filename
+    const char *mode = mode_start < buffer + recv_len ? mode_start : "";
+
+    // RFC 2347 options follow the mode
+    tftp_options_t opts = {0};
+    const char *opt_start = mode + strlen(mode) + 1;
+    if (opt_start < buffer + recv_len &&
+        tftp_parse_options(opt_start, buffer + recv_len - opt_start, &opts) < 0)
+    {
+        logger("ERROR", "Bad option value in request for %s\n", filename);
+        send_error(w->listen_fd, client_addr, client_len, TFTP_OPCODE_OPT_ERR, "Option negotiation failed");
+        return;
+    }
+
+    if (strstr(filename, "..") != NULL)
+    {
+        logger("ERROR", "Directory traversal attempt: %s\n", filename);
+        return;
+    }
+
+    if ((opcode == TFTP_OPCODE_RRQ || opcode == TFTP_OPCODE_WRQ) &&
+        w->session_count + w->requests_pending >= MAX_SESSIONS)
+    {
+        logger("ERROR", "Session limit reached, dropping request for %s\n", filename);
+        return; // the client will retry
+    }
+
+    // Handle the different opcodes
+    switch (opcode)
+    {
+    case TFTP_OPCODE_RRQ: // Read Request
+        printf("Received RRQ (Read Request) from client\n");
+        break;
+
+    case TFTP_OPCODE_WRQ: // Write Request
+        printf("Received WRQ (Write Request) from client\n");
+        break;
+
+    case TFTP_OPCODE_DEL: // Delete Request
+        printf("Received DEL (Delete Request) from client\n");
+        break;
+    }
+
+    // the handler runs in the I/O pool, buffer is reused by the next batch so the request is copied
+    tftp_request_job_t *job = calloc(1, sizeof(*job));
+    if (!job)
+    {
+        logger("ERROR", "Memory allocation failed\n");
+        return;
+    }
+    job->w = w;
+    job->opcode = opcode;
+    job->addr = *client_addr;
+    job->addr_len = client_len;
+    snprintf(job->filename, sizeof(job->filename), "%s", filename);
+    snprintf(job->mode, sizeof(job->mode), "%s", mode);
+    job->opts = opts;
+    request_submit(w, job);
+}
+
+// true while a request or a session still waits on the I/O pool
+static int io_pending(tftp_worker_t *w)
+{
+    if (w->requests_pending > 0)
+        return 1;
+    for (tftp_session_t *s = w->sessions; s; s = s->next)
+    {
+        if (session_io_pending(s))
+            return 1;
+    }
+    return 0;
+}
+
+// a datagram on the well-known port
+static int uring_on_request(tftp_worker_t *w, const struct io_uring_cqe *cqe)
+{
+    char buffer[TFTP_BUF_SIZE + 1];
+    struct sockaddr_in addr;
+    unsigned char *data;
+    ssize_t len = uring_recv_data(w->ring, 0, cqe, 1, &data, &addr);
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        w->ring_listen = 0; // rearmed by the loop
+    if (len < 0)
+    {
+        if (cqe->res == -ENOBUFS)
+            w->ring->st.nobufs++;
+        else if (cqe->res != -ECANCELED)
+            fprintf(stderr, "Worker %d: recvmsg: %s\n", w->id, strerror(-cqe->res));
+        return 0;
+    }
+
+    // a request never needs more than TFTP_BUF_SIZE, cut it there - handle_request writes past it
+    if (len > TFTP_BUF_SIZE)
+        len = TFTP_BUF_SIZE;
+    memcpy(buffer, data, len);
+    uring_recv_done(w->ring, 0, cqe);
+
+    printf("Received packet from client (worker %d)\n", w->id);
+    handle_request(w, buffer, len, &addr, sizeof(addr));
+    return 1;
+}
+
+// a datagram for a session, it's flushed with the others once the batch is through
+static void uring_on_datagram(tftp_worker_t *w, tftp_session_t *s, const struct io_uring_cqe *cqe, tftp_session_t **touched)
+{
+    struct sockaddr_in from;
+    unsigned char *data;
+    ssize_t len = uring_recv_data(w->ring, s->ring_class, cqe, s->mc != NULL, &data, &from);
+
+    if (len >= 0)
+    {
+        session_on_packet(s, data, len, s->mc ? &from : NULL);
+        uring_recv_done(w->ring, s->ring_class, cqe);
+        s->rx.packets++;
+        if (!s->ring_rx++)
+        {
+            s->ring_next = *touched;
+            *touched = s;
+        }
+    }
+    else if (cqe->res == -ENOBUFS)
+        w->ring->st.nobufs++;
+    else if (cqe->res != -ECANCELED)
+        session_on_error(s, -cqe->res); // e.g. ECONNREFUSED when the client went away
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        s->ring_recv = 0;
+        // out of provided buffers - they're back by now, the session still wants its datagrams
+        if (s->state != SESSION_DONE && !s->ring_cancel)
+        {
+            uring_recv(w->ring, s->sockfd, s->ring_class, s->mc != NULL, (uint64_t)(uintptr_t)s | URING_RECV);
+            s->ring_recv = 1;
+        }
+    }
+}
+
+// one reap of CQEs, then every session that got packets sends what they released in one go
+static void uring_handle(tftp_worker_t *w, const struct io_uring_cqe *cqes, int n, int *running)
+{
+    tftp_session_t *touched = NULL;
+    int requests = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        const struct io_uring_cqe *cqe = &cqes[i];
+        void *ptr = (void *)(uintptr_t)(cqe->user_data & ~URING_TAG_MASK);
+
+        switch (cqe->user_data & URING_TAG_MASK)
+        {
+        case URING_STOP:
+            *running = 0; // left readable so every worker sees it
+            break;
+
+        case URING_IOQ:
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                w->ring_ioq = 0;
+            if (cqe->res > 0)
+                io_done_drain(&w->ioq);
+            break;
+
+        case URING_LISTEN:
+            requests += uring_on_request(w, cqe);
+            break;
+
+        case URING_RECV:
+            uring_on_datagram(w, ptr, cqe, &touched);
+            break;
+
+        case URING_SEND:
+        {
+            tftp_session_t *s = uring_send_done(w->ring, cqe);
+            s->ring_refs--;
+            // EAGAIN: the socket buffer was full, the retransmit timer takes care of it
+            if (cqe->res < 0 && cqe->res != -EAGAIN)
+                fprintf(stderr, "Error sending session packet: %s\n", strerror(-cqe->res));
+            break;
+        }
+
+        case URING_WRITE:
+            uring_write_done(w->ring, cqe);
+            break;
+        }
+    }
+
+    if (requests)
+    {
+        w->listen_rx.calls++;
+        w->listen_rx.packets += requests;
+    }
+    while (touched)
+    {
+        tftp_session_t *s = touched;
+        touched = s->ring_next;
+        s->ring_next = NULL;
+        s->ring_rx = 0;
+        s->rx.calls++;
+        session_flush(s);
+    }
+}
+
+/*
+    the event loop on an io_uring - returns -1 without having done
+    anything when the ring can't be set up, the caller runs epoll then
+*/
+static int worker_run_uring(tftp_worker_t *w)
+{
+    struct io_uring_cqe cqes[URING_REAP_MAX];
+    int running = 1, listen_cancel = 0, ioq_cancel = 0;
+    tftp_uring_t *r = calloc(1, sizeof(*r));
+
+    // SINGLE_ISSUER: the ring belongs to the thread that made it, so it's made here
+    if (!r || uring_init(r) < 0)
+    {
+        fprintf(stderr, "Worker %d: io_uring setup failed (%s), using epoll\n", w->id, strerror(errno));
+        free(r);
+        return -1;
+    }
+    w->ring = r;
+    uring_poll(r, w->stop_fd, 0, URING_STOP);
+
+    while (running || w->ring_listen || w->ring_ioq || io_pending(w))
+    {
+        if (running && !w->ring_listen)
+        {
+            uring_recv(r, w->listen_fd, 0, 1, URING_LISTEN);
+            w->ring_listen = 1;
+        }
+        if (!w->ring_ioq && !ioq_cancel)
+        {
+            uring_poll(r, w->ioq.efd, 1, URING_IOQ);
+            w->ring_ioq = 1;
+        }
+
+        /*
+            shutting down - no new requests, the sessions' recvs go away,
+            and the completion poll stays until nothing waits on the pool
+        */
+        if (!running)
+        {
+            if (w->ring_listen && !listen_cancel)
+            {
+                uring_cancel(r, URING_LISTEN);
+                listen_cancel = 1;
+            }
+            for (tftp_session_t *s = w->sessions; s; s = s->next)
+            {
+                if (s->ring_recv && !s->ring_cancel)
+                {
+                    uring_cancel(r, (uint64_t)(uintptr_t)s | URING_RECV);
+                    s->ring_cancel = 1;
+                }
+            }
+            if (w->ring_ioq && !ioq_cancel && !io_pending(w))
+            {
+                uring_cancel(r, URING_IOQ);
+                ioq_cancel = 1;
+            }
+        }
+
+        int timeout = sessions_tick(w);
+        if (!running && timeout > 100)
+            timeout = 100;
+        // submits everything the last round queued and waits for the next completions
+        if (uring_enter(r, timeout) < 0)
+            break;
+
+        int n;
+        while ((n = uring_reap(r, cqes, URING_REAP_MAX)) > 0)
+        {
+            uring_handle(w, cqes, n, &running);
+            if (n < URING_REAP_MAX)
+                break;
+            // the windows just queued go out before more ACKs can move them
+            if (uring_enter(r, 0) < 0)
+                break;
+        }
+    }
+
+    while (w->sessions)
+    {
+        session_reap(w, w->sessions);
+    }
+    w->uring = r->st;
+    w->ring = NULL;
+    uring_destroy(r);
+    free(r);
+    return 0;
+}
+
+void *worker_run(void *arg)
+{
+    tftp_worker_t *w = arg;
+    struct epoll_event events[64];
+    // one recvmmsg batch of requests, each slot has room for handle_request's terminator
+    char buffers[TFTP_BATCH_MAX][TFTP_BUF_SIZE + 1];
+    struct sockaddr_in addrs[TFTP_BATCH_MAX];
+    size_t lens[TFTP_BATCH_MAX];
+    int running = 1;
+
+    if (w->use_uring && worker_run_uring(w) == 0)
+    {
+        return NULL;
+    }
+
+    while (running)
+    {
+        int timeout = sessions_tick(w);
+        int n = epoll_wait(w->epfd, events, sizeof(events) / sizeof(events[0]), timeout);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &w->stop_fd)
+            {
+                running = 0; // left readable so every worker sees it
+                continue;
+            }
+
+            if (ptr == &w->ioq)
+            {
+                io_done_drain(&w->ioq);
+                continue;
+            }
+
+            if (ptr)
+            {
+                session_on_readable(ptr);
+                continue;
+            }
+
+            // drain the well-known socket, TFTP_BATCH_MAX requests per syscall
+            for (;;)
+            {
+                int got = batch_recv(w->listen_fd, buffers, sizeof(buffers[0]), TFTP_BATCH_MAX, lens, addrs, &w->listen_rx);
+                if (got < 0)
+                {
+                    break; // EAGAIN, back to epoll
+                }
+
+                for (int j = 0; j < got; j++)
+                {
+                    // a request never needs more than TFTP_BUF_SIZE, cut it there
+                    ssize_t recv_len = lens[j] > TFTP_BUF_SIZE ? TFTP_BUF_SIZE : lens[j];
+
+                    printf("Received packet from client (worker %d)\n", w->id);
+                    handle_request(w, buffers[j], recv_len, &addrs[j], sizeof(addrs[j]));
+                }
+                if (got < TFTP_BATCH_MAX)
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    // sessions and requests the pool still works on can't be freed under it
+    while (io_pending(w))
+    {
+        struct pollfd pfd = {w->ioq.efd, POLLIN, 0};
+        if (poll(&pfd, 1, 100) > 0)
+            io_done_drain(&w->ioq);
+    }
+
+    while (w->sessions)
+    {
+        session_reap(w, w->sessions);
+    }
+    return NULL;
+}
+
+int worker_start(tftp_worker_t *w)
+{
+    sigset_t all, old;
+    int err;
+
+    // signals are left to the main thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&w->thread, NULL, worker_run, w);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err != 0)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+
+    if (w->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        err = pthread_setaffinity_np(w->thread, sizeof(set), &set);
+        if (err != 0)
+        {
+            // not fatal, e.g. restricted by a cgroup cpuset
+            fprintf(stderr, "Worker %d: could not pin to CPU %d: %s\n", w->id, w->cpu, strerror(err));
+        }
+    }
+    return 0;
+}
+
+void worker_join(tftp_worker_t *w)
+{
+    pthread_join(w->thread, NULL);
+}
+
+void worker_destroy(tftp_worker_t *w)
+{
+    io_done_destroy(&w->ioq);
+    if (w->epfd >= 0)
+        close(w->epfd);
+    if (w->listen_fd >= 0)
+        close(w->listen_fd);
+    w->epfd = w->listen_fd = -1;
+}
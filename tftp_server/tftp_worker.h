@@ -0,0 +1,61 @@
+#ifndef TFTP_WORKER_H
+#define TFTP_WORKER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "tftp_session.h"
+#include "tftp_iopool.h"
+#include "tftp_uring.h"
+
+/*
+    a worker is one thread pinned to one CPU with its own
+    SO_REUSEPORT socket on the server's port, its own epoll set and
+    the sessions it accepted - nothing on the hot path is
+    shared with the other workers. anything that touches the disk
+    is handed to the I/O pool and comes back through ioq.
+    with use_uring the loop runs on an io_uring instead of epoll,
+    see tftp_uring.h - same sessions, same handlers, other syscalls
+*/
+
+typedef struct tftp_worker
+{
+    int id;
+    int cpu; // -1 means no pinning
+    pthread_t thread;
+
+    int listen_fd; // SO_REUSEPORT share of the well-known port
+    int epfd;
+    int stop_fd; // eventfd shared by all workers, readable on shutdown
+    tftp_io_done_t ioq; // finished I/O pool jobs
+    int requests_pending; // RRQ/WRQ/DEL being opened in the pool
+
+    int use_uring;      // asked for the io_uring loop, it falls back to epoll if the ring can't be set up
+    tftp_uring_t *ring; // while the io_uring loop runs
+    int ring_listen;    // the multishot recvmsg on listen_fd is armed
+    int ring_ioq;       // the multishot poll on ioq.efd is armed
+
+    tftp_session_t *sessions; // live transfers
+    int session_count;
+
+    // stats, only touched by the worker itself
+    uint64_t requests;
+    uint64_t transfers_ok;
+    uint64_t transfers_failed;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    tftp_batch_stats_t listen_rx; // requests per recvmmsg on listen_fd
+    tftp_batch_stats_t rx;        // session packets per recvmmsg
+    tftp_batch_stats_t tx;        // session packets per sendmmsg
+    tftp_uring_stats_t uring;     // io_uring loop, all 0 on epoll
+} tftp_worker_t;
+
+//binds the worker's socket on port and its epoll set, returns -1 on failure
+int worker_init(tftp_worker_t *w, int id, int cpu, int port, int stop_fd);
+int worker_start(tftp_worker_t *w);
+void worker_join(tftp_worker_t *w);
+void worker_destroy(tftp_worker_t *w);
+
+//the event loop, runs until stop_fd turns readable
+void *worker_run(void *arg);
+
+#endif
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "tftp_logger.h"
+
+/*
+    bounded multi-producer ring, every slot carries a sequence number:
+    seq == pos means free for the producer that claims pos,
+    seq == pos + 1 means filled and ready for the flush thread,
+    which hands it back as pos + LOG_RING_SIZE for the next lap
+*/
+typedef struct
+{
+    atomic_size_t seq;
+    time_t when;
+    char level[8];
+    char msg[LOG_MSG_SIZE];
+} log_record_t;
+
+static log_record_t *ring;
+static atomic_size_t ring_tail; // next position a producer claims
+static size_t ring_head;        // next position the flush thread reads, only it touches this
+static atomic_uint_fast64_t dropped;
+static atomic_llong cached_now; // time(), refreshed by the flush thread every wakeup
+static atomic_int running;
+static pthread_t flush_thread;
+static FILE *log_file;
+
+// the old synchronous path, for anything logged before logger_start()
+static void logger_direct(const char *level, const char *format, va_list args)
+{
+    FILE *file = fopen(LOG_FILE, "a");
+    if (!file)
+    {
+        perror("Error opening log file");
+        return;
+    }
+
+    char time_buf[50];
+    time_t time_r = time(NULL);
+    strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", localtime(&time_r));
+    fprintf(file, "[%s [%s]] ", time_buf, level);
+    vfprintf(file, format, args);
+    fclose(file);
+}
+
+void logger(const char *level, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    if (!atomic_load_explicit(&running, memory_order_acquire))
+    {
+        logger_direct(level, format, args);
+        va_end(args);
+        return;
+    }
+
+    // claim a slot
+    size_t pos = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    log_record_t *rec;
+    for (;;)
+    {
+        rec = &ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ring_tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // the flush thread is a whole lap behind, don't wait for it
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            va_end(args);
+            return;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+        }
+    }
+
+    rec->when = atomic_load_explicit(&cached_now, memory_order_relaxed);
+    snprintf(rec->level, sizeof(rec->level), "%s", level);
+    vsnprintf(rec->msg, sizeof(rec->msg), format, args);
+    va_end(args);
+
+    atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+}
+
+// writes every ready record, one fflush for the lot
+static void logger_drain(void)
+{
+    static time_t stamp_sec = -1;
+    static char stamp[32];
+    int wrote = 0;
+
+    for (;;)
+    {
+        log_record_t *rec = &ring[ring_head & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&rec->seq, memory_order_acquire) != ring_head + 1)
+            break;
+
+        // localtime/strftime once per second, not per record
+        if (rec->when != stamp_sec)
+        {
+            struct tm tm;
+            stamp_sec = rec->when;
+            localtime_r(&stamp_sec, &tm);
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        }
+        fprintf(log_file, "[%s [%s]] %s", stamp, rec->level, rec->msg);
+        wrote = 1;
+
+        atomic_store_explicit(&rec->seq, ring_head + LOG_RING_SIZE, memory_order_release);
+        ring_head++;
+    }
+
+    // drops can't go through the ring, they're reported here
+    static uint64_t reported;
+    uint64_t lost = atomic_load_explicit(&dropped, memory_order_relaxed) - reported;
+    if (lost)
+    {
+        fprintf(log_file, "[%s [WARN]] %llu log records dropped, ring full\n", stamp, (unsigned long long)lost);
+        reported += lost;
+        wrote = 1;
+    }
+    if (wrote)
+        fflush(log_file);
+}
+
+static void *logger_run(void *arg)
+{
+    struct timespec tick = {0, LOG_FLUSH_MS * 1000000L};
+    (void)arg;
+
+    while (atomic_load_explicit(&running, memory_order_acquire))
+    {
+        atomic_store_explicit(&cached_now, time(NULL), memory_order_relaxed);
+        logger_drain();
+        nanosleep(&tick, NULL);
+    }
+    logger_drain(); // whatever came in during the last sleep
+    return NULL;
+}
+
+int logger_start(const char *path)
+{
+    log_file = fopen(path, "a");
+    if (!log_file)
+    {
+        perror("Error opening log file");
+        return -1;
+    }
+    setvbuf(log_file, NULL, _IOFBF, 1 << 16);
+
+    ring = calloc(LOG_RING_SIZE, sizeof(*ring));
+    if (!ring)
+    {
+        fclose(log_file);
+        log_file = NULL;
+        return -1;
+    }
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+    {
+        atomic_init(&ring[i].seq, i);
+    }
+    atomic_store(&ring_tail, 0);
+    ring_head = 0;
+    atomic_store(&cached_now, time(NULL));
+
+    // signals stay with the main thread, like the workers
+    sigset_t all, old;
+    int err;
+    sigfillset(&all);
+    atomic_store_explicit(&running, 1, memory_order_release);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&flush_thread, NULL, logger_run, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0)
+    {
+        atomic_store(&running, 0);
+        free(ring);
+        ring = NULL;
+        fclose(log_file);
+        log_file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void logger_stop(void)
+{
+    if (!atomic_exchange(&running, 0))
+        return;
+
+    pthread_join(flush_thread, NULL);
+    fclose(log_file);
+    log_file = NULL;
+    free(ring);
+    ring = NULL;
+}
+
+uint64_t logger_dropped(void)
+{
+    return atomic_load(&dropped);
+}
@@ -1,9 +1,29 @@
 #ifndef TFTP_LOGGER_H
 #define TFTP_LOGGER_H
 
+#include <stdint.h>
+
 #define LOG_FILE "server.log"
 
-//logger setup - logger included in tftp_server_handlers.c
+/*
+    asynchronous logger - logger() formats the message into a
+    fixed-size record in a preallocated lock-free ring and returns,
+    a background thread stamps the records and writes them out in
+    batches. a full ring drops the record and counts it
+*/
+
+#define LOG_RING_SIZE 8192 // records, a power of two
+#define LOG_MSG_SIZE 224   // longer messages are cut
+#define LOG_FLUSH_MS 20    // how often the thread looks at the ring
+
+//opens path and starts the flush thread, returns -1 on failure
+int logger_start(const char *path);
+//writes out what's left and stops the thread, once nothing else logs anymore
+void logger_stop(void);
+//records lost to a full ring so far
+uint64_t logger_dropped(void);
+
+//logger setup - called anywhere, before logger_start() it appends to LOG_FILE directly
 void logger(const char *level, const char *format, ...);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,165 @@
+#include <string.h>
+
+#include "tftp_netascii.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NETASCII_X86 1
+#endif
+
+// offset of the first CR or LF in p, n if there is none
+static size_t scan_scalar(const char *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (p[i] == '\n' || p[i] == '\r')
+            return i;
+    }
+    return n;
+}
+
+#ifdef NETASCII_X86
+__attribute__((target("sse2"))) static size_t scan_sse2(const char *p, size_t n)
+{
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t scan_avx2(const char *p, size_t n)
+{
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_sse2(p + i, n - i);
+}
+#endif
+
+static size_t (*scan)(const char *p, size_t n) = scan_scalar;
+
+// picks the widest scanner the CPU has, once at startup
+__attribute__((constructor)) static void netascii_init(void)
+{
+#ifdef NETASCII_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan = scan_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        scan = scan_sse2;
+#endif
+}
+
+size_t netascii_encode(netascii_enc_t *st, const char *src, size_t len, size_t *consumed, char *dst, size_t cap)
+{
+    size_t in = 0, out = 0;
+
+    if (st->pending >= 0 && out < cap)
+    {
+        dst[out++] = (char)st->pending;
+        st->pending = -1;
+    }
+
+    while (in < len && out < cap && st->pending < 0)
+    {
+        size_t run = scan(src + in, len - in);
+        size_t n = run < cap - out ? run : cap - out;
+
+        memcpy(dst + out, src + in, n);
+        in += n;
+        out += n;
+        if (n < run || in == len || out == cap)
+            break;
+
+        // src[in] is LF -> CR LF, or a bare CR -> CR NUL
+        char second = src[in] == '\n' ? '\n' : '\0';
+        in++;
+        dst[out++] = '\r';
+        if (out < cap)
+            dst[out++] = second;
+        else
+            st->pending = (unsigned char)second; // goes first in the next block
+    }
+
+    *consumed = in;
+    return out;
+}
+
+size_t netascii_decode(netascii_dec_t *st, const char *src, size_t len, char *dst)
+{
+    size_t in = 0, out = 0;
+
+    if (st->cr && len > 0)
+    {
+        // the CR that ended the last block
+        st->cr = 0;
+        if (src[0] == '\n')
+        {
+            dst[out++] = '\n';
+            in = 1;
+        }
+        else
+        {
+            dst[out++] = '\r';
+            in = src[0] == '\0' ? 1 : 0; // CR NUL, or a stray CR kept as is
+        }
+    }
+
+    while (in < len)
+    {
+        size_t run = scan(src + in, len - in);
+
+        memcpy(dst + out, src + in, run);
+        in += run;
+        out += run;
+        if (in == len)
+            break;
+
+        if (src[in] == '\n')
+        {
+            dst[out++] = '\n'; // a bare LF, not netascii but harmless
+            in++;
+        }
+        else if (in + 1 == len)
+        {
+            st->cr = 1; // CR at the end of the block, wait for the next one
+            in++;
+        }
+        else if (src[in + 1] == '\n')
+        {
+            dst[out++] = '\n';
+            in += 2;
+        }
+        else
+        {
+            dst[out++] = '\r';
+            in += src[in + 1] == '\0' ? 2 : 1;
+        }
+    }
+    return out;
+}
+
+size_t netascii_decode_end(netascii_dec_t *st, char *dst)
+{
+    if (!st->cr)
+        return 0;
+    st->cr = 0;
+    dst[0] = '\r';
+    return 1;
+}
@@ -0,0 +1,41 @@
+#ifndef TFTP_NETASCII_H
+#define TFTP_NETASCII_H
+
+#include <stddef.h>
+
+/*
+    block netascii conversion (RFC 764): on the wire every LF is
+    CR LF and a bare CR is CR NUL. runs without either byte are
+    found with SSE2/AVX2 (scalar elsewhere) and memcpy'd, and the
+    state carries a sequence split by a block boundary over to the
+    next block - a CR LF whose LF didn't fit, a CR whose LF comes
+    in the next block
+*/
+
+typedef struct
+{
+    int pending; // second byte of an expansion that didn't fit, -1 if none
+} netascii_enc_t;
+
+typedef struct
+{
+    int cr; // the last block ended with a CR, its meaning is in the next one
+} netascii_dec_t;
+
+#define NETASCII_ENC_INIT {-1}
+#define NETASCII_DEC_INIT {0}
+
+/*
+    local text -> wire, writes at most cap bytes to dst and returns how
+    many, *consumed gets how much of src that used. an expansion cut by
+    cap leaves its second byte in st, the next call writes it first
+*/
+size_t netascii_encode(netascii_enc_t *st, const char *src, size_t len, size_t *consumed, char *dst, size_t cap);
+
+//wire -> local text, consumes all of src, dst needs room for len + 1 bytes
+size_t netascii_decode(netascii_dec_t *st, const char *src, size_t len, char *dst);
+
+//end of the transfer, a CR still held from the last block is written as is, returns 0 or 1
+size_t netascii_decode_end(netascii_dec_t *st, char *dst);
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "tftp_options.h"
+#include "tftp_utils.h"
+
+// strict decimal, no sign, no junk after the digits
+static int parse_value(const char *s, unsigned long long *out)
+{
+    char *end;
+
+    if (*s < '0' || *s > '9')
+        return -1;
+    errno = 0;
+    *out = strtoull(s, &end, 10);
+    return (errno || *end != '\0') ? -1 : 0;
+}
+
+int tftp_parse_options(const char *buf, size_t len, tftp_options_t *opts)
+{
+    const char *end = buf + len;
+    const char *p = buf;
+
+    while (p < end)
+    {
+        const char *name = p;
+        const char *name_end = memchr(name, '\0', end - name);
+        if (!name_end || name_end + 1 >= end)
+            break; // no value, ignore the tail
+
+        const char *value = name_end + 1;
+        const char *value_end = memchr(value, '\0', end - value);
+        if (!value_end)
+            break;
+        p = value_end + 1;
+
+        unsigned long long v;
+        if (str_casecmp(name, "blksize") == 0)
+        {
+            if (parse_value(value, &v) < 0 || v < TFTP_BLKSIZE_MIN)
+                return -1;
+            // a bigger ask than we support is answered with our maximum
+            opts->blksize = v > TFTP_BLKSIZE_MAX ? TFTP_BLKSIZE_MAX : (int)v;
+            opts->present |= TFTP_OPT_BLKSIZE;
+        }
+        else if (str_casecmp(name, "windowsize") == 0)
+        {
+            if (parse_value(value, &v) < 0 || v < 1 || v > 65535)
+                return -1;
+            opts->windowsize = v > TFTP_WINDOWSIZE_MAX ? TFTP_WINDOWSIZE_MAX : (int)v;
+            opts->present |= TFTP_OPT_WINDOWSIZE;
+        }
+        else if (str_casecmp(name, "timeout") == 0)
+        {
+            if (parse_value(value, &v) < 0 || v < 1 || v > 255)
+                return -1;
+            opts->timeout = (int)v;
+            opts->present |= TFTP_OPT_TIMEOUT;
+        }
+        else if (str_casecmp(name, "tsize") == 0)
+        {
+            if (parse_value(value, &v) < 0)
+                return -1;
+            opts->tsize = v;
+            opts->present |= TFTP_OPT_TSIZE;
+        }
+        else if (str_casecmp(name, "rollover") == 0)
+        {
+            if (parse_value(value, &v) < 0 || v > 1)
+                return -1;
+            opts->rollover = (int)v;
+            opts->present |= TFTP_OPT_ROLLOVER;
+        }
+        else if (str_casecmp(name, "offset") == 0)
+        {
+            if (parse_value(value, &v) < 0)
+                return -1;
+            opts->offset = v;
+            opts->present |= TFTP_OPT_OFFSET;
+        }
+        else if (str_casecmp(name, "tailsum") == 0)
+        {
+            if (parse_value(value, &v) < 0 || v > 0xFFFFFFFFu)
+                return -1;
+            opts->tailsum = (uint32_t)v;
+            opts->present |= TFTP_OPT_TAILSUM;
+        }
+        else if (str_casecmp(name, "compress") == 0)
+        {
+            // a method we don't know is skipped like an unknown option, the transfer goes as it is
+            if (str_casecmp(value, "deflate") == 0)
+            {
+                opts->compress = TFTP_COMPRESS_DEFLATE;
+                opts->present |= TFTP_OPT_COMPRESS;
+            }
+        }
+        else if (str_casecmp(name, "multicast") == 0)
+        {
+            // the value only means something coming back in an OACK
+            snprintf(opts->multicast, sizeof(opts->multicast), "%s", value);
+            opts->present |= TFTP_OPT_MULTICAST;
+        }
+    }
+    return 0;
+}
+
+size_t tftp_append_option(char *buf, size_t off, size_t size, const char *name, unsigned long long value)
+{
+    char tmp[32];
+    size_t name_len = strlen(name) + 1;
+    size_t value_len = snprintf(tmp, sizeof(tmp), "%llu", value) + 1;
+
+    if (off + name_len + value_len > size)
+        return off;
+
+    memcpy(buf + off, name, name_len);
+    memcpy(buf + off + name_len, tmp, value_len);
+    return off + name_len + value_len;
+}
+
+size_t tftp_append_option_str(char *buf, size_t off, size_t size, const char *name, const char *value)
+{
+    size_t name_len = strlen(name) + 1;
+    size_t value_len = strlen(value) + 1;
+
+    if (off + name_len + value_len > size)
+        return off;
+
+    memcpy(buf + off, name, name_len);
+    memcpy(buf + off + name_len, value, value_len);
+    return off + name_len + value_len;
+}
+
+size_t tftp_append_options(char *buf, size_t off, size_t size, const tftp_options_t *opts)
+{
+    if (opts->present & TFTP_OPT_BLKSIZE)
+        off = tftp_append_option(buf, off, size, "blksize", opts->blksize);
+    if (opts->present & TFTP_OPT_WINDOWSIZE)
+        off = tftp_append_option(buf, off, size, "windowsize", opts->windowsize);
+    if (opts->present & TFTP_OPT_TIMEOUT)
+        off = tftp_append_option(buf, off, size, "timeout", opts->timeout);
+    if (opts->present & TFTP_OPT_TSIZE)
+        off = tftp_append_option(buf, off, size, "tsize", opts->tsize);
+    if (opts->present & TFTP_OPT_ROLLOVER)
+        off = tftp_append_option(buf, off, size, "rollover", opts->rollover);
+    if (opts->present & TFTP_OPT_OFFSET)
+        off = tftp_append_option(buf, off, size, "offset", opts->offset);
+    if (opts->present & TFTP_OPT_TAILSUM)
+        off = tftp_append_option(buf, off, size, "tailsum", opts->tailsum);
+    if (opts->present & TFTP_OPT_COMPRESS)
+        off = tftp_append_option_str(buf, off, size, "compress", "deflate");
+    if (opts->present & TFTP_OPT_MULTICAST)
+        off = tftp_append_option_str(buf, off, size, "multicast", opts->multicast);
+    return off;
+}
+
+size_t tftp_build_oack(char *buf, size_t size, const tftp_options_t *opts)
+{
+    buf[0] = 0;
+    buf[1] = TFTP_OPCODE_OACK;
+    return tftp_append_options(buf, 2, size, opts);
+}
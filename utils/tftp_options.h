@@ -0,0 +1,80 @@
+#ifndef TFTP_OPTIONS_H
+#define TFTP_OPTIONS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    RFC 2347 option extension - name/value pairs appended to
+    RRQ/WRQ after the mode, the server answers the ones it
+    accepts with an OACK (opcode 6)
+*/
+
+//bits of tftp_options_t.present
+#define TFTP_OPT_BLKSIZE (1u << 0)
+#define TFTP_OPT_WINDOWSIZE (1u << 1)
+#define TFTP_OPT_TIMEOUT (1u << 2)
+#define TFTP_OPT_TSIZE (1u << 3)
+#define TFTP_OPT_MULTICAST (1u << 4)
+#define TFTP_OPT_ROLLOVER (1u << 5)
+#define TFTP_OPT_OFFSET (1u << 6)
+#define TFTP_OPT_TAILSUM (1u << 7)
+#define TFTP_OPT_COMPRESS (1u << 8)
+
+//tftp_options_t.compress, "compress=deflate" is the only one so far
+#define TFTP_COMPRESS_DEFLATE 1
+
+//"addr,port,mc" of an RFC 2090 multicast OACK, longest is "255.255.255.255,65535,1"
+#define TFTP_MULTICAST_LEN 32
+
+//biggest window the server keeps in flight per session (RFC 7440 allows 65535)
+#define TFTP_WINDOWSIZE_MAX 64
+
+typedef struct
+{
+    unsigned present; // which options were sent / accepted
+    int blksize;      // RFC 2348
+    int windowsize;   // RFC 7440
+    int timeout;      // RFC 2349, seconds 1..255
+    uint64_t tsize;   // RFC 2349, transfer size in bytes - 0 in an RRQ asks for it
+    char multicast[TFTP_MULTICAST_LEN]; // RFC 2090, empty in a request, "addr,port,mc" in the OACK
+    int rollover;     // block number after 65535, 0 or 1 (no RFC, what other servers take)
+    /*
+        resuming (no RFC, octet only) - DATA 1 carries the byte at offset.
+        RRQ: the client has the first offset bytes and sends tailsum, the
+        tftp_tail_sum of its copy there. the server answers offset if its
+        file has the same bytes, else leaves it out and it starts at 0.
+        WRQ: the client sends offset 0, the server answers with how much
+        of an earlier failed upload of the name it kept and the tailsum of
+        that. a client whose file differs there sends ERROR 8 and goes again
+    */
+    uint64_t offset;
+    uint32_t tailsum;
+    /*
+        compress=deflate (no RFC, octet only) - the DATA blocks carry a zlib
+        stream (RFC 1950) of the file instead of the file, cut into blksize
+        pieces like any other payload, the short block ends it. tsize stays
+        the file's size. not together with offset, a resume wins
+    */
+    int compress;
+} tftp_options_t;
+
+/*
+    parses the name\0value\0 pairs in buf, unknown options are skipped
+    returns 0, or -1 if an option we know has an invalid value
+*/
+int tftp_parse_options(const char *buf, size_t len, tftp_options_t *opts);
+
+//appends name\0value\0 at buf + off, returns the new offset (off unchanged if it doesn't fit)
+size_t tftp_append_option(char *buf, size_t off, size_t size, const char *name, unsigned long long value);
+
+//same with a string value
+size_t tftp_append_option_str(char *buf, size_t off, size_t size, const char *name, const char *value);
+
+//appends every option in opts->present, returns the new offset
+size_t tftp_append_options(char *buf, size_t off, size_t size, const tftp_options_t *opts);
+
+//builds a whole OACK packet for the accepted options, returns its length
+size_t tftp_build_oack(char *buf, size_t size, const tftp_options_t *opts);
+
+#endif
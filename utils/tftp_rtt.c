@@ -0,0 +1,113 @@
+#include "tftp_rtt.h"
+
+static uint32_t clamp_rto(uint64_t rto)
+{
+    if (rto < TFTP_RTO_MIN_US)
+        rto = TFTP_RTO_MIN_US;
+    if (rto > TFTP_RTO_MAX_US)
+        rto = TFTP_RTO_MAX_US;
+    return (uint32_t)rto;
+}
+
+void rtt_init(tftp_rtt_t *r, uint32_t timeout_us)
+{
+    r->srtt_us = 0;
+    r->rttvar_us = 0;
+    r->min_us = 0;
+    r->backoff = 0;
+    r->rtx_us = 0;
+    r->fired_us = 0;
+    r->undo = 0;
+    r->fixed_us = timeout_us;
+    r->rto_us = clamp_rto(TFTP_RTO_INIT_US);
+}
+
+void rtt_set_timeout(tftp_rtt_t *r, uint32_t timeout_us)
+{
+    r->fixed_us = timeout_us;
+}
+
+static void rtt_update(tftp_rtt_t *r)
+{
+    // RTO = SRTT + 4 RTTVAR
+    r->rto_us = clamp_rto((uint64_t)r->srtt_us + 4 * (uint64_t)r->rttvar_us);
+}
+
+void rtt_sample(tftp_rtt_t *r, uint32_t sample_us)
+{
+    if (r->min_us == 0 || sample_us < r->min_us)
+        r->min_us = sample_us ? sample_us : 1;
+    if (r->srtt_us == 0)
+    {
+        // first sample: SRTT = R, RTTVAR = R/2
+        r->srtt_us = sample_us ? sample_us : 1;
+        r->rttvar_us = sample_us / 2;
+    }
+    else
+    {
+        // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+        uint32_t delta = r->srtt_us > sample_us ? r->srtt_us - sample_us : sample_us - r->srtt_us;
+        r->rttvar_us = r->rttvar_us - r->rttvar_us / 4 + delta / 4;
+        r->srtt_us = r->srtt_us - r->srtt_us / 8 + sample_us / 8;
+        if (r->srtt_us == 0)
+            r->srtt_us = 1;
+    }
+    rtt_update(r);
+}
+
+uint32_t rtt_timeout_us(const tftp_rtt_t *r)
+{
+    if (r->fixed_us)
+        return r->fixed_us;
+    return clamp_rto((uint64_t)r->rto_us << (r->backoff < 16 ? r->backoff : 16));
+}
+
+void rtt_backoff(tftp_rtt_t *r, uint64_t now_us)
+{
+    if (!r->rtx_us)
+        r->undo = r->backoff; // the first of a run of timeouts
+    r->fired_us = rtt_timeout_us(r);
+    r->rtx_us = now_us ? now_us : 1;
+    if (r->backoff < 16)
+        r->backoff++;
+}
+
+int rtt_spurious(tftp_rtt_t *r, uint64_t now_us)
+{
+    uint64_t since = now_us - r->rtx_us;
+
+    if (!r->rtx_us)
+        return 0;
+    r->rtx_us = 0;
+    /*
+        it may well answer the resend unless it came faster than any round
+        trip did - half the average isn't enough, on a LAN the jitter is
+        bigger than that and every real loss would push the RTT up
+    */
+    if (since >= r->min_us / 2)
+        return 0;
+
+    // the first copy got there, it just took longer than the timeout - make room for that
+    uint64_t sample = since + r->fired_us;
+    if (sample > TFTP_RTO_MAX_US)
+        sample = TFTP_RTO_MAX_US;
+    if (r->srtt_us < sample)
+        r->srtt_us = sample;
+    if (r->rttvar_us < sample / 2)
+        r->rttvar_us = sample / 2;
+    r->backoff = r->undo;
+    rtt_update(r);
+    return 1;
+}
+
+void rtt_progress(tftp_rtt_t *r)
+{
+    r->backoff = 0;
+    r->rtx_us = 0;
+}
+
+uint64_t rtt_give_up_us(const tftp_rtt_t *r, int max_retries)
+{
+    // as long as max_retries full timeouts at the ceiling, like the old fixed timer
+    return (uint64_t)(r->fixed_us ? r->fixed_us : TFTP_RTO_MAX_US) * max_retries;
+}
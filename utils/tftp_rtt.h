@@ -0,0 +1,64 @@
+#ifndef TFTP_RTT_H
+#define TFTP_RTT_H
+
+#include <stdint.h>
+
+/*
+    retransmission timer per transfer, shared by the server sessions
+    and the client handlers - smoothed RTT and RTT variance the way
+    TCP does it (RFC 6298) with exponential backoff on timeouts.
+    an answer to a resent packet that comes sooner than half the
+    shortest round trip seen after the resend answers the first copy
+    (a resend can't be answered faster than that), the timeout was
+    spurious: the backoff is undone and the RTT is taken to be as long
+    as the first copy waited (the Eifel response, RFC 4015).
+    a peer that asked for the RFC 2349 timeout gets exactly that
+*/
+
+#define TFTP_RTO_INIT_US 1000000 // before the first sample
+#define TFTP_RTO_MIN_US  20000   // LAN RTTs are far below it, a busy peer rarely answers later
+#define TFTP_RTO_MAX_US  5000000 // ceiling of the adaptive timeout
+
+typedef struct
+{
+    uint32_t srtt_us;   // smoothed RTT, 0 until the first sample
+    uint32_t rttvar_us; // RTT variance
+    uint32_t min_us;    // shortest round trip seen, what a resend can be answered in at best
+    uint32_t rto_us;    // current timeout without backoff
+    uint32_t fixed_us;  // the negotiated timeout option, the timeout itself - 0 adapts
+    int backoff;        // consecutive timeouts, doubles the timeout each
+
+    // the last timeout, until the peer answers
+    uint64_t rtx_us;   // when it resent, 0 once an answer came
+    uint32_t fired_us; // how long it had waited
+    int undo;          // the backoff before the timeouts started
+} tftp_rtt_t;
+
+//timeout_us is the RFC 2349 timeout if one was agreed, 0 adapts
+void rtt_init(tftp_rtt_t *r, uint32_t timeout_us);
+//the timeout was agreed later (the client hears it in the OACK), the samples are kept
+void rtt_set_timeout(tftp_rtt_t *r, uint32_t timeout_us);
+
+//feeds one measured round trip - only for packets sent once (Karn's rule)
+void rtt_sample(tftp_rtt_t *r, uint32_t sample_us);
+
+//timeout to arm now, backoff included
+uint32_t rtt_timeout_us(const tftp_rtt_t *r);
+
+//a timeout fired at now_us and what it waited for is resent, the next one waits twice as long
+void rtt_backoff(tftp_rtt_t *r, uint64_t now_us);
+
+/*
+    the peer answered what was resent on a timeout, at now_us - instead of
+    rtt_sample, which Karn's rule rules out. 1 if the timeout was spurious
+    and has been undone
+*/
+int rtt_spurious(tftp_rtt_t *r, uint64_t now_us);
+
+//the peer made progress, drop the backoff
+void rtt_progress(tftp_rtt_t *r);
+
+//how long without progress before a transfer is given up
+uint64_t rtt_give_up_us(const tftp_rtt_t *r, int max_retries);
+
+#endif
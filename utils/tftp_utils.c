@@ -1,10 +1,12 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "tftp_utils.h"
 #include "../tftp_server/tftp_server.h"
@@ -66,38 +68,34 @@ int dir_exist(const char *dir_path)
 
 /*
     clrf - used for windows too
-    with preventing overflow (adding 1 byte safeguarding max_size)
+    the conversion itself is in tftp_netascii.c, these read / write
+    a FILE block by block and keep st between the blocks of a transfer
 */
-size_t read_netascii(FILE *file, char *buf, size_t max_size)
+size_t read_netascii(FILE *file, netascii_enc_t *st, char *buf, size_t max_size)
 {
-    size_t bytes_read = 0;
-    int ch;
+    char raw[4096];
+    size_t consumed;
+    size_t out = netascii_encode(st, "", 0, &consumed, buf, max_size); // what's left from the last block
 
-    while ((ch = fgetc(file)) != EOF)
+    /*
+        one raw byte is at most two on the wire, so reading half of
+        the room left always fits - nothing read is ever given back,
+        an expansion cut at max_size waits in st
+    */
+    while (out < max_size)
     {
-        if (ch == '\n')
-        {
-            if (bytes_read + 2 > max_size)
-            {
-                ungetc(ch, file);
-                break;
-            }
+        size_t want = (max_size - out) / 2;
+        if (want == 0)
+            want = 1;
+        if (want > sizeof(raw))
+            want = sizeof(raw);
 
-            buf[bytes_read++] = '\r';
-            buf[bytes_read++] = '\n';
-        }
-        else
-        {
-            if (bytes_read + 1 > max_size)
-            {
-                ungetc(ch, file);
-                break;
-            }
-            buf[bytes_read++] = (char)ch;
-        }
+        size_t got = fread(raw, 1, want, file);
+        if (got == 0)
+            break;
+        out += netascii_encode(st, raw, got, &consumed, buf + out, max_size - out);
     }
-
-    return bytes_read;
+    return out;
 }
 
 // prints out the content
@@ -109,35 +107,42 @@ void print_netascii_file(FILE *file)
     // Rewind in case the file pointer is not at the beginning
     rewind(file);
 
-    while ((bytes_read = read_netascii(file, buffer, sizeof(buffer))) > 0)
+    // the file is local text already, no netascii to undo
+    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0)
     {
-        buffer[bytes_read] = '\0'; // Ensure null-termination
-        printf("%s\n", buffer);
+        fwrite(buffer, 1, bytes_read, stdout);
     }
+    printf("\n");
 }
 
-// writes netascii
-size_t write_netascii(FILE *file, const char *buf, size_t size)
+// writes netascii, returns size or how much of buf made it before a write error
+size_t write_netascii(FILE *file, netascii_dec_t *st, const char *buf, size_t size)
 {
+    char out[4096 + 1];
 
-    for (size_t i = 0; i < size; i++)
+    for (size_t off = 0; off < size;)
     {
-        // skip CR characters (0x0D)
-        if (buf[i] == '\r')
-        {
-            continue;
-        }
-
-        // write the characters including LF
+        size_t chunk = size - off < 4096 ? size - off : 4096;
+        size_t n = netascii_decode(st, buf + off, chunk, out);
 
-        if (putc(buf[i], file) == EOF)
+        if (fwrite(out, 1, n, file) != n)
         {
-            return i;
+            return off;
         }
+        off += chunk;
     }
     return size;
 }
 
+// end of a netascii transfer, writes a CR the last block ended with
+int write_netascii_end(FILE *file, netascii_dec_t *st)
+{
+    char out[1];
+    size_t n = netascii_decode_end(st, out);
+
+    return fwrite(out, 1, n, file) == n ? 0 : -1;
+}
+
 // checks if it's octet
 
 size_t read_octet(FILE *file, char *buf, size_t max_size)
@@ -183,3 +188,101 @@ int str_casecmp(const char *s1, const char *s2)
     }
     return (unsigned char)*s1 - (unsigned char)*s2;
 }
+
+// set by a simulator (bench/tftp_sim.c), before any thread reads the clock
+static uint64_t (*clock_override)(void);
+
+void tftp_set_clock(uint64_t (*now_us)(void))
+{
+    clock_override = now_us;
+}
+
+uint64_t tftp_now_ms(void)
+{
+    struct timespec ts;
+    if (clock_override)
+        return clock_override() / 1000;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t tftp_now_us(void)
+{
+    struct timespec ts;
+    if (clock_override)
+        return clock_override();
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint16_t tftp_block_wire(uint32_t seq, int rollover)
+{
+    if (!rollover || seq == 0)
+        return (uint16_t)seq;
+    return (seq - 1) % 65535 + 1; // 65535 is followed by 1
+}
+
+uint32_t tftp_block_seq(uint32_t ref, uint16_t block, int rollover)
+{
+    if (!rollover)
+    {
+        int16_t diff = (int16_t)(block - (uint16_t)ref); // -32768..32767 around ref
+        return ref + diff;
+    }
+    if (block == 0)
+        return 0;
+
+    // the wire numbers go round in 65535 steps, ref's place on that round is what counts
+    int32_t diff = (int32_t)block - tftp_block_wire(ref ? ref : 1, 1);
+    if (diff > 32767)
+        diff -= 65535;
+    else if (diff < -32767)
+        diff += 65535;
+    return (ref ? ref : 1) + diff;
+}
+
+int tftp_is_zero(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    // the first byte is 0 and every byte equals the next one
+    return len == 0 || (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0);
+}
+
+uint32_t tftp_crc32(uint32_t crc, const void *buf, size_t len)
+{
+    // a nibble at a time, it only ever runs over a resume point's tail
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+    const unsigned char *p = buf;
+
+    crc = ~crc;
+    while (len--)
+    {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ table[crc & 15];
+        crc = (crc >> 4) ^ table[crc & 15];
+    }
+    return ~crc;
+}
+
+int tftp_tail_sum(int fd, uint64_t off, uint32_t *sum)
+{
+    char buf[8192];
+    uint64_t pos = off > TFTP_TAIL_LEN ? off - TFTP_TAIL_LEN : 0;
+
+    *sum = 0;
+    while (pos < off)
+    {
+        size_t want = off - pos < sizeof(buf) ? off - pos : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        *sum = tftp_crc32(*sum, buf, n);
+        pos += n;
+    }
+    return 0;
+}
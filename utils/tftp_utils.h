@@ -3,11 +3,19 @@
 
 
 #include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "tftp_netascii.h"
 
 //not using normal tftp port because I always gotta sudo :)
 #define TFTP_PORT         6969 
 #define TFTP_BUF_SIZE  516  // 512 bytes data + 4 bytes header
-#define TFTP_DATA_SIZE    512
+#define TFTP_DATA_SIZE    512 // default block size, when blksize isn't negotiated
+#define TFTP_HDR_SIZE     4   // opcode + block number
+
+//blksize option limits (RFC 2348)
+#define TFTP_BLKSIZE_MIN  8
+#define TFTP_BLKSIZE_MAX  65464
 
 //definitions of each mode code
 #define TFTP_OPCODE_RRQ   1 //RRQ
@@ -15,11 +23,13 @@
 #define TFTP_OPCODE_DATA  3 //data
 #define TFTP_OPCODE_ACK   4 //ack
 #define TFTP_OPCODE_ERROR 5 //general error
+#define TFTP_OPCODE_OACK  6 //option acknowledgment (RFC 2347)
 #define TFTP_OPCODE_EXISTS 6 // exists
 #define TFTP_OPCODE_ACC_ERR 7 // access error
 #define TFTP_OPCODE_DEL 8 // delete
 #define TFTP_OPCODE_NE 9 //doesn't exist 
 #define TFTP_OPCODE_F 10 //disk full
+#define TFTP_OPCODE_OPT_ERR 8 //error code - option negotiation refused (RFC 2347)
 
 
 
@@ -27,9 +37,10 @@
 #define PATH_LENGTH 256
 int dir_exist();
 
-//NetAscii mode handler
-size_t read_netascii(FILE *file, char *buffer, size_t max_size);
-size_t write_netascii(FILE *file, const char *buffer, size_t size);
+//NetAscii mode handler, st lives as long as the transfer (NETASCII_ENC_INIT / NETASCII_DEC_INIT)
+size_t read_netascii(FILE *file, netascii_enc_t *st, char *buffer, size_t max_size);
+size_t write_netascii(FILE *file, netascii_dec_t *st, const char *buffer, size_t size);
+int write_netascii_end(FILE *file, netascii_dec_t *st);
 
 //octet mode handler
 size_t read_octet(FILE *file, char *buffer, size_t max_size);
@@ -48,5 +59,32 @@ int file_exists(const char *filename);
 //additional tools
 int str_casecmp(const char *s1, const char *s2);
 
+/*
+    blocks are counted in 32 bits (2 TB at 512 byte blocks) and only the
+    low 16 go on the wire. after 65535 the wire number goes on at 0, or
+    at 1 with the rollover=1 option - 0 only ever means the OACK's ACK
+*/
+//the wire number of block seq
+uint16_t tftp_block_wire(uint32_t seq, int rollover);
+//maps a 16 bit wire block number to the 32 bit sequence nearest to ref
+uint32_t tftp_block_seq(uint32_t ref, uint16_t block, int rollover);
+
+//true if the len bytes at buf are all 0, a hole in a sparse file
+int tftp_is_zero(const void *buf, size_t len);
+
+//CRC-32 (the zlib/PNG one) of len bytes, going on from crc - start with 0
+uint32_t tftp_crc32(uint32_t crc, const void *buf, size_t len);
+//bytes before a resume offset that the tailsum option covers, fewer if the offset is smaller
+#define TFTP_TAIL_LEN (64 * 1024)
+//tftp_crc32 of the TFTP_TAIL_LEN bytes of fd before off, 0 or -1 when they can't all be read
+int tftp_tail_sum(int fd, uint64_t off, uint32_t *sum);
+
+//monotonic clock in milliseconds, for retransmit timers
+uint64_t tftp_now_ms(void);
+//same clock in microseconds, for RTT samples
+uint64_t tftp_now_us(void);
+//replaces that clock (microseconds) for both, a simulator's virtual time - NULL goes back to CLOCK_MONOTONIC
+void tftp_set_clock(uint64_t (*now_us)(void));
+
 #endif
 